@@ -105,6 +105,13 @@ extern const PinDescription g_APinDescription[] ;
 #include "RawChainPlayer.h"
 #include "WavChainPlayer.h"
 #include "WavPlayer.h"
+#include "AudioFilter.h"
+#include "AudioLimiter.h"
+#include "SwingSynth.h"
+#include "AudioClipCache.h"
+#include "AudioFontIndex.h"
+#include "MemoryPlayer.h"
+#include "VoicePool.h"
 #include "PropMotion.h"
 #include "wm8523.h"
 #include "sdcard.h"
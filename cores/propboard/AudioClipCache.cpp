@@ -0,0 +1,388 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### AudioClipCache.cpp
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+#include "AudioClipCache.h"
+#include "AudioFileHelper.h"
+#include "Arduino.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+extern uint32_t getRandom(uint32_t min, uint32_t max);
+
+AudioClipCache::AudioClipCache()
+{
+	pool_alloc = pool = NULL;
+	pool_size = used_bytes = 0;
+	use_counter = 0;
+	last_random = NULL;
+	memset(clips, 0, sizeof(clips));
+	memset(&stats, 0, sizeof(stats));
+}
+
+AudioClipCache::~AudioClipCache()
+{
+	end();
+}
+
+bool AudioClipCache::begin(uint32_t budget)
+{
+	end();
+
+	budget &= ~0x03;
+	if (!budget)
+		return false;
+
+	pool_alloc = (uint8_t*) malloc(budget + 4);
+	if (!pool_alloc)
+		return false;
+
+	// Clips are word aligned inside the pool
+	pool = pool_alloc;
+	if ((uintptr_t) pool & 0x03)
+		pool += (4 - ((uintptr_t) pool & 0x03));
+
+	pool_size = budget;
+	return true;
+}
+
+void AudioClipCache::end()
+{
+	// Players still holding clips have to be stopped before this
+	clear();
+
+	if (pool_alloc)
+		free(pool_alloc);
+
+	pool_alloc = pool = NULL;
+	pool_size = 0;
+}
+
+CACHED_CLIP* AudioClipCache::find(const char* filename)
+{
+	for (uint32_t i = 0; i < MAX_CACHED_CLIPS; i++)
+	{
+		if (clips[i].data && !strcmp(clips[i].name, filename))
+			return &clips[i];
+	}
+
+	return NULL;
+}
+
+CACHED_CLIP* AudioClipCache::getFreeEntry()
+{
+	while (true)
+	{
+		for (uint32_t i = 0; i < MAX_CACHED_CLIPS; i++)
+		{
+			if (!clips[i].data)
+				return &clips[i];
+		}
+
+		if (!evict())
+			return NULL;
+	}
+}
+
+uint8_t* AudioClipCache::allocate(uint32_t size)
+{
+	CACHED_CLIP* sorted[MAX_CACHED_CLIPS];
+	uint32_t count = 0;
+	uint8_t* gap = pool;
+
+	// Clips sorted by address, then first fit between them
+	for (uint32_t i = 0; i < MAX_CACHED_CLIPS; i++)
+	{
+		if (!clips[i].data)
+			continue;
+
+		uint32_t j = count++;
+		while (j && sorted[j - 1]->data > clips[i].data)
+		{
+			sorted[j] = sorted[j - 1];
+			j--;
+		}
+
+		sorted[j] = &clips[i];
+	}
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if ((uint32_t) (sorted[i]->data - gap) >= size)
+			return gap;
+
+		gap = sorted[i]->data + sorted[i]->size;
+	}
+
+	if ((uint32_t) (pool + pool_size - gap) >= size)
+		return gap;
+
+	return NULL;
+}
+
+bool AudioClipCache::evict()
+{
+	CACHED_CLIP* oldest = NULL;
+
+	// Least recently used clip that is not playing
+	__disable_irq();
+	for (uint32_t i = 0; i < MAX_CACHED_CLIPS; i++)
+	{
+		if (clips[i].data && !clips[i].users &&
+			(!oldest || (int32_t) (clips[i].last_used - oldest->last_used) < 0))
+			oldest = &clips[i];
+	}
+
+	if (oldest)
+	{
+		remove(oldest);
+		stats.evictions++;
+	}
+	__enable_irq();
+
+	return oldest != NULL;
+}
+
+void AudioClipCache::remove(CACHED_CLIP* clip)
+{
+	if (clip == last_random)
+		last_random = NULL;
+
+	used_bytes -= clip->size;
+	clip->data = NULL;
+	clip->name[0] = '\0';
+}
+
+CACHED_CLIP* AudioClipCache::load(const char* filename)
+{
+	AudioFileHelper file;
+	CACHED_CLIP* clip;
+	uint8_t* data;
+	uint32_t samples, size;
+
+	if (!pool || strlen(filename) >= CLIP_NAME_LENGTH)
+		return NULL;
+
+	clip = find(filename);
+	if (clip)
+	{
+		touch(clip);
+		return clip;
+	}
+
+	if (!file.openWav(filename, false))
+		return NULL;
+
+	samples = file.getSamplesLeft();
+	size = (samples * file.getSampleSize() + 3) & ~0x03;
+	if (!samples || size > pool_size)
+	{
+		file.close();
+		return NULL;
+	}
+
+	// Make room
+	clip = getFreeEntry();
+	data = NULL;
+	while (clip && !(data = allocate(size)))
+	{
+		if (!evict())
+			break;
+	}
+
+	if (!clip || !data || file.fillBuffer(data, samples) != samples)
+	{
+		file.close();
+		return NULL;
+	}
+
+	file.close();
+
+	strcpy(clip->name, filename);
+	clip->size = size;
+	clip->samples = samples;
+	clip->sample_rate = file.getWavHeader()->format.sample_rate;
+	clip->bits_per_sample = file.getWavHeader()->format.bits_per_sample;
+	clip->stereo = file.getWavHeader()->format.channels == 2;
+	clip->users = 0;
+	touch(clip);
+
+	// The clip is visible from here
+	clip->data = data;
+	used_bytes += size;
+	stats.loads++;
+	return clip;
+}
+
+uint32_t AudioClipCache::loadRandom(const char* filename, uint32_t min, uint32_t max)
+{
+	char name[CLIP_NAME_LENGTH];
+	uint32_t loaded = 0;
+
+	if (min > max)
+	{
+		uint32_t tmp = min;
+		min = max;
+		max = tmp;
+	}
+
+	// Same names AudioFileHelper::openRandomWav() generates
+	for (uint32_t i = min; i <= max; i++)
+	{
+		snprintf(name, sizeof(name), "%s%lu.wav", filename, (unsigned long) i);
+		if (load(name))
+			loaded++;
+	}
+
+	return loaded;
+}
+
+bool AudioClipCache::unload(const char* filename)
+{
+	CACHED_CLIP* clip = find(filename);
+	bool ret = false;
+
+	if (!clip)
+		return false;
+
+	__disable_irq();
+	if (!clip->users)
+	{
+		remove(clip);
+		ret = true;
+	}
+	__enable_irq();
+
+	return ret;
+}
+
+void AudioClipCache::clear()
+{
+	for (uint32_t i = 0; i < MAX_CACHED_CLIPS; i++)
+	{
+		if (clips[i].data)
+			unload(clips[i].name);
+	}
+}
+
+CACHED_CLIP* AudioClipCache::get(const char* filename)
+{
+	CACHED_CLIP* clip = find(filename);
+
+	if (!clip)
+	{
+		stats.misses++;
+		return NULL;
+	}
+
+	stats.hits++;
+	touch(clip);
+	return clip;
+}
+
+CACHED_CLIP* AudioClipCache::getRandom(const char* filename, uint32_t min, uint32_t max)
+{
+	CACHED_CLIP* candidates[MAX_CACHED_CLIPS];
+	CACHED_CLIP* clip;
+	uint32_t count = 0;
+	uint32_t length = strlen(filename);
+	uint32_t num;
+	char* end;
+
+	if (min > max)
+	{
+		uint32_t tmp = min;
+		min = max;
+		max = tmp;
+	}
+
+	// Cached clips named <filename><min..max>.wav
+	for (uint32_t i = 0; i < MAX_CACHED_CLIPS; i++)
+	{
+		if (!clips[i].data || strncmp(clips[i].name, filename, length) ||
+			clips[i].name[length] < '0' || clips[i].name[length] > '9')
+			continue;
+
+		num = strtoul(clips[i].name + length, &end, 10);
+		if (num >= min && num <= max && !strcmp(end, ".wav"))
+			candidates[count++] = &clips[i];
+	}
+
+	if (!count)
+	{
+		stats.misses++;
+		return NULL;
+	}
+
+	// Don't repeat the last one, like AudioFileHelper::openRandomWav()
+	do
+	{
+		clip = candidates[count == 1 ? 0 : ::getRandom(0, count - 1)];
+	} while (count > 1 && clip == last_random);
+
+	last_random = clip;
+	stats.hits++;
+	touch(clip);
+	return clip;
+}
+
+void AudioClipCache::acquire(CACHED_CLIP* clip)
+{
+	__disable_irq();
+	clip->users++;
+	__enable_irq();
+}
+
+void AudioClipCache::release(CACHED_CLIP* clip)
+{
+	__disable_irq();
+	if (clip->users)
+		clip->users--;
+	__enable_irq();
+}
+
+uint32_t AudioClipCache::getClipCount()
+{
+	uint32_t count = 0;
+
+	for (uint32_t i = 0; i < MAX_CACHED_CLIPS; i++)
+	{
+		if (clips[i].data)
+			count++;
+	}
+
+	return count;
+}
+
+void AudioClipCache::getStats(CLIP_CACHE_STATS* dst)
+{
+	if (dst)
+		memcpy(dst, &stats, sizeof(CLIP_CACHE_STATS));
+}
+
+void AudioClipCache::resetStats()
+{
+	memset(&stats, 0, sizeof(stats));
+}
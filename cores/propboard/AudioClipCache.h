@@ -0,0 +1,105 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### AudioClipCache.h
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+#ifndef __AUDIOCLIPCACHE_H__
+#define __AUDIOCLIPCACHE_H__
+
+#include <stm32f4xx.h>
+#include "AudioSource.h"
+
+#define MAX_CACHED_CLIPS			32
+#define CLIP_NAME_LENGTH			48
+
+typedef struct _cached_clip
+{
+	char name[CLIP_NAME_LENGTH];
+	uint8_t* data;						// Inside the pool, NULL if the entry is free
+	uint32_t size;						// Bytes taken from the pool
+	uint32_t samples;
+	uint32_t sample_rate;
+	uint8_t bits_per_sample;
+	bool stereo;
+	volatile uint8_t users;				// Players holding the clip, it can't be evicted meanwhile
+	uint32_t last_used;
+} CACHED_CLIP;
+
+typedef struct _clip_cache_stats
+{
+	uint32_t loads;						// Clips read from the card
+	uint32_t evictions;
+	uint32_t hits;						// Lookups that found the clip
+	uint32_t misses;
+} CLIP_CACHE_STATS;
+
+// WAV clips preloaded in a fixed RAM pool, for sounds that have to start right away. The pool is
+// allocated once in begin() and is the byte budget of the cache: loading a clip that doesn't fit
+// evicts the least recently used ones that are not playing. Loading goes to the card and is meant
+// for setup time, lookups are done from RAM only.
+class AudioClipCache
+{
+public:
+	AudioClipCache();
+	~AudioClipCache();
+
+	bool begin(uint32_t budget);
+	void end();
+
+	CACHED_CLIP* load(const char* filename);
+	uint32_t loadRandom(const char* filename, uint32_t min, uint32_t max);
+	bool unload(const char* filename);
+	void clear();
+
+	CACHED_CLIP* get(const char* filename);
+	CACHED_CLIP* getRandom(const char* filename, uint32_t min, uint32_t max);
+
+	static void acquire(CACHED_CLIP* clip);
+	static void release(CACHED_CLIP* clip);
+
+	inline uint32_t getBudget() { return pool_size; }
+	inline uint32_t getUsedBytes() { return used_bytes; }
+	inline uint32_t getFreeBytes() { return pool_size - used_bytes; }
+	uint32_t getClipCount();
+	void getStats(CLIP_CACHE_STATS* dst);
+	void resetStats();
+
+private:
+	CACHED_CLIP* find(const char* filename);
+	CACHED_CLIP* getFreeEntry();
+	uint8_t* allocate(uint32_t size);
+	bool evict();
+	void remove(CACHED_CLIP* clip);
+	inline void touch(CACHED_CLIP* clip) { clip->last_used = ++use_counter; }
+
+	uint8_t* pool_alloc;
+	uint8_t* pool;
+	uint32_t pool_size;
+	uint32_t used_bytes;
+	uint32_t use_counter;
+	CACHED_CLIP* last_random;
+	CACHED_CLIP clips[MAX_CACHED_CLIPS];
+	CLIP_CACHE_STATS stats;
+};
+
+#endif /* __AUDIOCLIPCACHE_H__ */
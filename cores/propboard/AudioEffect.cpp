@@ -0,0 +1,100 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### AudioEffect.cpp
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+#include "AudioEffect.h"
+#include "Arduino.h"
+
+AudioEffect::AudioEffect()
+{
+	sample_rate = 0;
+	enabled = true;
+	next_in_chain = NULL;
+	budget_us = 0;
+	time_us = max_time_us = 0;
+	overruns = 0;
+	strikes = 0;
+	over_budget = false;
+}
+
+AudioEffect::~AudioEffect()
+{
+	Audio.removeEffect(this);
+}
+
+bool AudioEffect::begin(uint32_t fs)
+{
+	sample_rate = fs;
+	return true;
+}
+
+void AudioEffect::setEnabled(bool enable)
+{
+	__disable_irq();
+	if (enable)
+	{
+		strikes = 0;
+		over_budget = false;
+	}
+
+	enabled = enable;
+	__enable_irq();
+}
+
+void AudioEffect::setBudget(uint32_t us)
+{
+	__disable_irq();
+	budget_us = us;
+	strikes = 0;
+	__enable_irq();
+}
+
+void AudioEffect::resetStats()
+{
+	__disable_irq();
+	time_us = max_time_us = 0;
+	overruns = 0;
+	__enable_irq();
+}
+
+void AudioEffect::accountTime(uint32_t us)
+{
+	time_us = us;
+	if (us > max_time_us)
+		max_time_us = us;
+
+	if (!budget_us || us <= budget_us)
+	{
+		strikes = 0;
+		return;
+	}
+
+	overruns++;
+	if (++strikes >= EFFECT_BUDGET_STRIKES)
+	{
+		// Better to lose the effect than the audio
+		enabled = false;
+		over_budget = true;
+	}
+}
@@ -0,0 +1,82 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### AudioEffect.h
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+#ifndef __AUDIOEFFECT_H__
+#define __AUDIOEFFECT_H__
+
+#include <stm32f4xx.h>
+#include <stddef.h>
+
+#define EFFECT_BUDGET_STRIKES		8		// Consecutive buffers over budget before bypassing an effect
+
+class PropAudio;
+
+// Insert effect on the mix bus. Effects are added to PropAudio with addEffect() and run in
+// chain order on every mixed buffer, after the mixing function and before the analyze callback.
+// They process planar 16-bit (Q15) left and right channels; 24-bit output bypasses the chain.
+class AudioEffect
+{
+	friend class PropAudio;
+
+public:
+	AudioEffect();
+	virtual ~AudioEffect();
+
+	void setEnabled(bool enabled);
+	inline bool isEnabled() { return enabled; }
+
+	// Time allowed per output buffer, in uS (0 = no limit). An effect over its budget for
+	// EFFECT_BUDGET_STRIKES consecutive buffers is bypassed until enabled again.
+	void setBudget(uint32_t us);
+	inline uint32_t getBudget() { return budget_us; }
+	inline bool isOverBudget() { return over_budget; }
+	inline uint32_t getTime() { return time_us; }
+	inline uint32_t getMaxTime() { return max_time_us; }
+	inline uint32_t getBudgetOverruns() { return overruns; }
+	void resetStats();
+
+protected:
+	virtual bool begin(uint32_t fs);
+	virtual void process(int16_t* left, int16_t* right, uint32_t samples) = 0;
+
+	inline void setNextInChain(AudioEffect* next) { next_in_chain = next; }
+	inline AudioEffect* getNextInChain() { return next_in_chain; }
+
+	uint32_t sample_rate;
+	volatile bool enabled;
+
+private:
+	void accountTime(uint32_t us);
+
+	AudioEffect* next_in_chain;
+	uint32_t budget_us;
+	uint32_t time_us;
+	uint32_t max_time_us;
+	uint32_t overruns;
+	uint8_t strikes;
+	volatile bool over_budget;
+};
+
+#endif /* __AUDIOEFFECT_H__ */
@@ -25,7 +25,9 @@
 ***************************************************************************/
 
 #include "AudioFileHelper.h"
+#include "AudioFontIndex.h"
 #include "Arduino.h"
+#include <diskio.h>
 #include <stddef.h>
 #include <string.h>
 #include <stdio.h>
@@ -33,6 +35,69 @@
 
 extern uint32_t getRandom(uint32_t min, uint32_t max);
 
+static AUDIO_FILE_STATS file_stats;
+AudioFontIndex* AudioFileHelper::font_index = NULL;
+
+// The audio update may service the file a source opens or reads in thread mode:
+// those operations don't lend the volume to it at sector boundaries (see fs_yield()).
+class fileOpScope
+{
+public:
+	fileOpScope() { fs_lend_block(1); }
+	~fileOpScope() { fs_lend_block(0); }
+};
+
+static const int8_t adpcm_index_table[16] =
+{
+	-1, -1, -1, -1, 2, 4, 6, 8,
+	-1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static const int16_t adpcm_step_table[89] =
+{
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+	253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+	1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+	3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+	12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static inline int16_t adpcmDecode(ADPCM_STATE* state, uint8_t nibble)
+{
+	int32_t step = adpcm_step_table[state->index];
+	int32_t diff = step >> 3;
+
+	if (nibble & 4)
+		diff += step;
+	if (nibble & 2)
+		diff += step >> 1;
+	if (nibble & 1)
+		diff += step >> 2;
+
+	if (nibble & 8)
+		state->predictor = __SSAT(state->predictor - diff, 16);
+	else
+		state->predictor = __SSAT(state->predictor + diff, 16);
+
+	state->index += adpcm_index_table[nibble];
+	if (state->index < 0)
+		state->index = 0;
+	else if (state->index > 88)
+		state->index = 88;
+
+	return (int16_t) state->predictor;
+}
+
+static inline int16_t mulawDecode(uint8_t value)
+{
+	int32_t sample;
+
+	value = ~value;
+	sample = (((value & 0x0F) << 3) + 0x84) << ((value & 0x70) >> 4);
+	return (int16_t) ((value & 0x80) ? (0x84 - sample) : (sample - 0x84));
+}
+
 AudioFileHelper::AudioFileHelper()
 {
 	infinite_mode = 0;
@@ -43,12 +108,172 @@ AudioFileHelper::AudioFileHelper()
 	header_size = 0;
 	is_raw = false;
 	data_end = 0;
+	linkmap_alloc = NULL;
+	linkmap_alloc_items = 0;
+	coding = WAV_FORMAT_PCM;
+	file_sample_size = 0;
+	block = NULL;
+	block_alloc_size = 0;
+	reserved = false;
+	block_size = block_samples = block_count = block_pos = 0;
 }
 
 AudioFileHelper::~AudioFileHelper()
 {
 	if (opened)
 		f_close(&file);
+
+	if (linkmap_alloc)
+		free(linkmap_alloc);
+
+	if (block)
+		free(block);
+}
+
+// Takes the IMA-ADPCM block buffer and the cluster link map now, for the files opened later, and
+// stops opening files from allocating: ADPCM files with bigger blocks can't be opened, and files
+// with more fragments than the map holds follow the FAT. No file can be open.
+bool AudioFileHelper::reserve(uint32_t block_bytes, uint32_t linkmap_items)
+{
+	if (opened)
+		return false;
+
+	if (block_bytes > ADPCM_MAX_BLOCK_SIZE)
+		block_bytes = ADPCM_MAX_BLOCK_SIZE;
+
+	if (linkmap_items > FILE_LINKMAP_MAX_ITEMS)
+		linkmap_items = FILE_LINKMAP_MAX_ITEMS;
+
+	if (block_bytes > block_alloc_size)
+	{
+		if (block)
+			free(block);
+
+		block = (uint8_t*) malloc(block_bytes);
+		block_alloc_size = block ? block_bytes : 0;
+		if (!block)
+			return false;
+	}
+
+	// The helper holds FILE_LINKMAP_ITEMS itself
+	if (linkmap_items > FILE_LINKMAP_ITEMS && linkmap_items > linkmap_alloc_items)
+	{
+		if (linkmap_alloc)
+			free(linkmap_alloc);
+
+		linkmap_alloc = (DWORD*) malloc(linkmap_items * sizeof(DWORD));
+		linkmap_alloc_items = linkmap_alloc ? linkmap_items : 0;
+		if (!linkmap_alloc)
+			return false;
+	}
+
+	reserved = true;
+	return true;
+}
+
+bool AudioFileHelper::createLinkMap()
+{
+	FRESULT res;
+	uint32_t items;
+
+	// Map the cluster chain once, so seeking (rewinds of looping files) and crossing
+	// clusters while reading don't have to follow the FAT
+	linkmap_buffer[0] = FILE_LINKMAP_ITEMS;
+	file.cltbl = linkmap_buffer;
+	res = f_lseek(&file, CREATE_LINKMAP);
+
+	if (res == FR_NOT_ENOUGH_CORE)
+	{
+		// The first item holds the size the map needs. A bigger buffer is kept
+		// for the next files opened by this helper, unless its memory was reserved.
+		items = linkmap_buffer[0];
+		if (items <= FILE_LINKMAP_MAX_ITEMS)
+		{
+			if (items > linkmap_alloc_items && !reserved)
+			{
+				if (linkmap_alloc)
+					free(linkmap_alloc);
+
+				linkmap_alloc = (DWORD*) malloc(items * sizeof(DWORD));
+				linkmap_alloc_items = linkmap_alloc ? items : 0;
+			}
+
+			if (linkmap_alloc && items <= linkmap_alloc_items)
+			{
+				linkmap_alloc[0] = linkmap_alloc_items;
+				file.cltbl = linkmap_alloc;
+				res = f_lseek(&file, CREATE_LINKMAP);
+				if (res == FR_OK)
+					file_stats.linkmap_allocs++;
+			}
+		}
+	}
+
+	if (res == FR_OK)
+	{
+		file_stats.linkmaps++;
+		return true;
+	}
+
+	// Too fragmented: fall back to following the FAT
+	file.cltbl = NULL;
+	file_stats.linkmap_fails++;
+	return res == FR_NOT_ENOUGH_CORE;
+}
+
+bool AudioFileHelper::setCoding(uint32_t fmt_size)
+{
+	WAV_FORMAT* format = &wav_header.format;
+	uint16_t extra[2];
+	UINT read;
+
+	switch (format->fmt_type)
+	{
+		case WAV_FORMAT_IMA_ADPCM:
+			// Blocks start with a 4 bytes header per channel
+			if (format->bits_per_sample != 4 || format->block_align < 4 * format->channels ||
+				format->block_align > ADPCM_MAX_BLOCK_SIZE)
+				return false;
+
+			block_size = format->block_align;
+			block_samples = (block_size - 4 * format->channels) * 2 / format->channels + 1;
+
+			// The extension has the samples per block
+			if (fmt_size >= sizeof(WAV_FORMAT) + sizeof(extra))
+			{
+				if (f_read(&file, extra, sizeof(extra), &read) != FR_OK || read != sizeof(extra))
+					return false;
+
+				if (extra[1] && extra[1] < block_samples)
+					block_samples = extra[1];
+			}
+
+			coding = WAV_FORMAT_IMA_ADPCM;
+			file_sample_size = 0;
+			block_count = block_pos = 0;
+			break;
+
+		case WAV_FORMAT_MULAW:
+			if (format->bits_per_sample != 8)
+				return false;
+
+			coding = WAV_FORMAT_MULAW;
+			file_sample_size = format->channels;
+			break;
+
+		default:
+			// PCM, and whatever was accepted before as such (i.e. WAVE_FORMAT_EXTENSIBLE)
+			coding = WAV_FORMAT_PCM;
+			file_sample_size = (format->bits_per_sample / 8) * format->channels;
+			return true;
+	}
+
+	// Players see the decoded format
+	format->fmt_type = WAV_FORMAT_PCM;
+	format->bits_per_sample = 16;
+	format->block_align = 2 * format->channels;
+	format->byte_rate = format->sample_rate * format->block_align;
+	return true;
 }
 
 bool AudioFileHelper::parseWavHeader()
@@ -98,6 +323,9 @@ bool AudioFileHelper::parseWavHeader()
 			if (!wav_header.format.channels || wav_header.format.channels > 2)
 				return false;
 
+			if (!setCoding(chunk_size))
+				return false;
+
 			// Get sample_size; we'll be using this in the fillBuffer() function
 			sample_size = (wav_header.format.bits_per_sample / 8) * wav_header.format.channels;
 
@@ -122,22 +350,110 @@ bool AudioFileHelper::parseWavHeader()
 	return (fmt_found && data_found);
 }
 
+void AudioFileHelper::countOpen(uint32_t start, bool indexed)
+{
+	uint32_t elapsed = micros() - start;
+
+	file_stats.opens++;
+	if (indexed)
+		file_stats.indexed_opens++;
+
+	file_stats.open_time += elapsed;
+	if (elapsed > file_stats.max_open_time)
+		file_stats.max_open_time = elapsed;
+}
+
+bool AudioFileHelper::openEntry(const char* name, const FONT_ENTRY* entry)
+{
+	// The drive is taken from the name
+	if (f_openclust(&file, name, entry->cluster, entry->size, entry->stat) != FR_OK)
+		return false;
+
+	// Clusters of a volume mounted again may belong to other files by now
+	if (!font_index->isCurrent(&file) || !createLinkMap())
+	{
+		f_close(&file);
+		return false;
+	}
+
+	wav_header = entry->header;
+	header_size = entry->header_size;
+	data_end = entry->data_end;
+	sample_size = entry->sample_size;
+	file_sample_size = entry->file_sample_size;
+	coding = entry->coding;
+	block_size = entry->block_size;
+	block_samples = entry->block_samples;
+	block_count = block_pos = 0;
+
+	if (f_lseek(&file, header_size) != FR_OK)
+	{
+		f_close(&file);
+		return false;
+	}
+
+	return true;
+}
+
 bool AudioFileHelper::openWav(const char* name, bool infinite)
 {
+	const FONT_ENTRY* entry = NULL;
+	uint32_t start = micros();
+
+	// Before the scope: a stale index scans the directory again, lending the volume meanwhile
+	if (font_index)
+		entry = font_index->find(name);
+
+	fileOpScope scope;
+
 	if (opened)
 	{
 		f_close(&file);
 		opened = false;
 	}
 
-	if (f_open(&file, name, FA_READ | FA_OPEN_EXISTING) != FR_OK)
-		return false;
+	// Files not in the index, or that can't be opened through it, take the path
+	if (entry && !openEntry(name, entry))
+		entry = NULL;
 
-	// Parse WAV header
-	if (!parseWavHeader())
+	if (!entry)
 	{
-		close();
-		return false;
+		if (f_open(&file, name, FA_READ | FA_OPEN_EXISTING) != FR_OK)
+			return false;
+
+		if (!createLinkMap())
+		{
+			f_close(&file);
+			return false;
+		}
+
+		// Parse WAV header
+		if (!parseWavHeader())
+		{
+			close();
+			return false;
+		}
+	}
+
+	// Decoding buffer for IMA-ADPCM, kept for the next files if big enough
+	if (coding == WAV_FORMAT_IMA_ADPCM && block_size > block_alloc_size)
+	{
+		if (reserved)
+		{
+			f_close(&file);
+			return false;
+		}
+
+		if (block)
+			free(block);
+
+		block = (uint8_t*) malloc(block_size);
+		block_alloc_size = block ? block_size : 0;
+		if (!block)
+		{
+			f_close(&file);
+			return false;
+		}
 	}
 
 	is_raw = false;
@@ -145,6 +461,7 @@ bool AudioFileHelper::openWav(const char* name, bool infinite)
 	infinite_mode = infinite;
 	eof = false;
 	strcpy(file_name, name);
+	countOpen(start, entry != NULL);
 	return true;
 }
 
@@ -156,8 +473,14 @@ bool AudioFileHelper::openRandomWav(const char* name, uint32_t min, uint32_t max
 
 bool AudioFileHelper::openRaw(const char* name, uint32_t samplesize, uint32_t hdrsize, bool infinite)
 {
+	fileOpScope scope;
+	uint32_t start = micros();
+
 	header_size = hdrsize;
 	sample_size = samplesize;
+	file_sample_size = samplesize;
+	coding = WAV_FORMAT_PCM;
+	data_end = 0;
 
 	if (opened)
 	{
@@ -168,6 +491,12 @@ bool AudioFileHelper::openRaw(const char* name, uint32_t samplesize, uint32_t hd
 	if (f_open(&file, name, FA_READ | FA_OPEN_EXISTING) != FR_OK)
 		return false;
 
+	if (!createLinkMap())
+	{
+		f_close(&file);
+		return false;
+	}
+
 	// Skip header
 	if (f_lseek(&file, header_size) != FR_OK)
 	{
@@ -180,6 +509,7 @@ bool AudioFileHelper::openRaw(const char* name, uint32_t samplesize, uint32_t hd
 	infinite_mode = infinite;
 	eof = false;
 	strcpy(file_name, name);
+	countOpen(start, false);
 	return true;
 }
 
@@ -191,6 +521,8 @@ bool AudioFileHelper::openRandomRaw(const char* name, const char* ext, uint32_t
 
 void AudioFileHelper::close()
 {
+	fileOpScope scope;
+
 	if (opened)
 	{
 		f_close(&file);
@@ -200,41 +532,116 @@ void AudioFileHelper::close()
 
 bool AudioFileHelper::rewind()
 {
+	fileOpScope scope;
+	uint32_t start, elapsed;
+
 	if (file.fptr != header_size)
 	{
+		start = micros();
 		if (f_lseek(&file, header_size) != FR_OK)
 			return false;
+
+		elapsed = micros() - start;
+		file_stats.seeks++;
+		file_stats.seek_time += elapsed;
+		if (elapsed > file_stats.max_seek_time)
+			file_stats.max_seek_time = elapsed;
 	}
 
+	// The next ADPCM block is loaded from the start of the data
+	block_count = block_pos = 0;
 	eof = false;
 	return true;
 }
 
+uint32_t AudioFileHelper::getDataEnd()
+{
+	// data_end holds the location in the file where samples data ends
+	// If data_end == 0, then sample data ends at EOF
+	return data_end ? data_end : getFileSize();
+}
+
+uint32_t AudioFileHelper::adpcmSamples(uint32_t bytes)
+{
+	uint32_t header = 4 * wav_header.format.channels;
+	uint32_t rest = bytes % block_size;
+	uint32_t samples = (bytes / block_size) * block_samples;
+
+	// The last block can be shorter
+	if (rest >= header)
+		samples += min((uint32_t) block_samples, (rest - header) * 2 / wav_header.format.channels + 1);
+
+	return samples;
+}
+
 uint32_t AudioFileHelper::getSamplesLeft()
 {
+	uint32_t end;
 	uint32_t bytes;
 
 	if (!opened || eof)
 		return 0;
 
-	// data_end holds the location in the file where samples data ends
-	// If data_end == 0, then sample data ends at EOF
-	bytes = getFileSize() - file.fptr - data_end;
-	return (bytes / sample_size);
+	end = getDataEnd();
+	bytes = (end > file.fptr) ? end - file.fptr : 0;
+
+	if (coding == WAV_FORMAT_IMA_ADPCM)
+		return (block_count - block_pos) + adpcmSamples(bytes);
+
+	return (bytes / file_sample_size);
 }
 
-uint32_t AudioFileHelper::fillBuffer(uint8_t* buffer, uint32_t samples)
+bool AudioFileHelper::read(uint8_t* buffer, uint32_t bytes, UINT* read)
+{
+	uint32_t head = (_MAX_SS - file.fptr % _MAX_SS) % _MAX_SS;
+	uint32_t sectors = 0;
+	uint32_t start = micros();
+	uint32_t elapsed;
+
+	// FatFs copies the partial sectors at both ends from its sector buffer and reads the
+	// whole ones in between straight into ours
+	if (bytes > head)
+		sectors = ((bytes - head) / _MAX_SS) * _MAX_SS;
+
+	if (f_read(&file, buffer, bytes, read) != FR_OK)
+		return false;
+
+	elapsed = micros() - start;
+	file_stats.reads++;
+	file_stats.bytes += *read;
+	file_stats.read_time += elapsed;
+	if (elapsed > file_stats.max_read_time)
+		file_stats.max_read_time = elapsed;
+
+	if (*read == bytes)
+	{
+		file_stats.sector_bytes += sectors;
+		if (((uintptr_t) (buffer + head) & (FILE_READ_ALIGNMENT - 1)) == 0)
+			file_stats.aligned_bytes += sectors;
+	}
+
+	return true;
+}
+
+void AudioFileHelper::getStats(AUDIO_FILE_STATS* dst)
+{
+	memcpy(dst, &file_stats, sizeof(AUDIO_FILE_STATS));
+}
+
+void AudioFileHelper::resetStats()
+{
+	memset(&file_stats, 0, sizeof(AUDIO_FILE_STATS));
+}
+
+uint32_t AudioFileHelper::readSamples(uint8_t* buffer, uint32_t samples)
 {
 	uint32_t to_read;
 	UINT read;
 	uint32_t samples_read = 0;
 
-	if (!opened || eof)
-		return 0;
-
-	to_read = samples * sample_size;
+	to_read = samples * file_sample_size;
 
-	if (f_read(&file, buffer, to_read, &read) != FR_OK)
+	if (!this->read(buffer, to_read, &read))
 		return 0;
 
 	// data_end holds the location in the file where samples data ends
@@ -242,7 +649,7 @@ uint32_t AudioFileHelper::fillBuffer(uint8_t* buffer, uint32_t samples)
 	if (data_end && read && (file.fptr > data_end))
 		read -= (file.fptr - data_end);
 
-	samples_read = read / sample_size;
+	samples_read = read / file_sample_size;
 
 	if (read != to_read || (data_end && file.fptr >= data_end))
 	{
@@ -261,17 +668,137 @@ uint32_t AudioFileHelper::fillBuffer(uint8_t* buffer, uint32_t samples)
 			if (to_read)
 			{
 				buffer += read;
-				if (f_read(&file, buffer, to_read, &read) != FR_OK)
+				if (!this->read(buffer, to_read, &read))
 					return 0;
 
-				samples_read += read / sample_size;
+				samples_read += read / file_sample_size;
+			}
+		}
+	}
+
+	return samples_read;
+}
+
+bool AudioFileHelper::loadBlock()
+{
+	uint32_t channels = wav_header.format.channels;
+	uint32_t end = getDataEnd();
+	uint32_t bytes;
+	UINT read;
+
+	bytes = (end > file.fptr) ? min((uint32_t) block_size, end - file.fptr) : 0;
+	if (bytes < 4 * channels)
+	{
+		if (!infinite_mode)
+		{
+			// Signal EOF
+			eof = true;
+			return false;
+		}
+
+		// EOF, move the file pointer back to the beginning
+		if (!rewind())
+			return false;
+
+		bytes = min((uint32_t) block_size, end - header_size);
+		if (bytes < 4 * channels)
+			return false;
+	}
+
+	if (!this->read(block, bytes, &read) || read != bytes)
+		return false;
+
+	// Each channel starts with its first sample and the step index
+	for (uint32_t i = 0; i < channels; i++)
+	{
+		adpcm[i].predictor = (int16_t) (block[i * 4] | (block[i * 4 + 1] << 8));
+		adpcm[i].index = min(block[i * 4 + 2], 88);
+	}
+
+	block_count = min((uint32_t) block_samples, (bytes - 4 * channels) * 2 / channels + 1);
+	block_pos = 0;
+	return true;
+}
+
+uint32_t AudioFileHelper::decodeAdpcm(uint8_t* buffer, uint32_t samples)
+{
+	int16_t* dst = (int16_t*) buffer;
+	uint32_t channels = wav_header.format.channels;
+	uint32_t samples_read = 0;
+	uint32_t count, start, k;
+	uint8_t* ptr;
+
+	while (samples_read < samples)
+	{
+		if (block_pos == block_count && !loadBlock())
+			break;
+
+		count = min(samples - samples_read, (uint32_t) (block_count - block_pos));
+		samples_read += count;
+		start = micros();
+
+		while (count--)
+		{
+			if (!block_pos)
+			{
+				for (uint32_t i = 0; i < channels; i++)
+					*dst++ = (int16_t) adpcm[i].predictor;
+			} else {
+				// After the headers, each channel has 4 bytes (8 samples) in turn
+				k = block_pos - 1;
+				ptr = block + 4 * channels + (k >> 3) * 4 * channels + ((k & 7) >> 1);
+
+				for (uint32_t i = 0; i < channels; i++)
+					*dst++ = adpcmDecode(&adpcm[i], (k & 1) ? (ptr[i * 4] >> 4) : (ptr[i * 4] & 0x0F));
 			}
+
+			block_pos++;
 		}
+
+		file_stats.decode_time += micros() - start;
 	}
 
+	// Signal EOF with the last samples, like readSamples() does
+	if (!infinite_mode && block_pos == block_count && file.fptr >= getDataEnd())
+		eof = true;
+
 	return samples_read;
 }
 
+uint32_t AudioFileHelper::fillBuffer(uint8_t* buffer, uint32_t samples)
+{
+	fileOpScope scope;
+	uint32_t samples_read;
+	uint32_t start;
+	uint8_t* src;
+	int16_t* dst;
+
+	if (!opened || eof)
+		return 0;
+
+	switch (coding)
+	{
+		case WAV_FORMAT_IMA_ADPCM:
+			return decodeAdpcm(buffer, samples);
+
+		case WAV_FORMAT_MULAW:
+			// Read the 8-bit samples in the upper half of the buffer and expand them in place
+			src = buffer + samples * file_sample_size;
+			samples_read = readSamples(src, samples);
+
+			start = micros();
+			dst = (int16_t*) buffer;
+			for (uint32_t i = 0; i < samples_read * file_sample_size; i++)
+				*dst++ = mulawDecode(*src++);
+
+			file_stats.decode_time += micros() - start;
+			return samples_read;
+
+		default:
+			return readSamples(buffer, samples);
+	}
+}
+
 bool AudioFileHelper::generateRandomFileName(const char* name, const char* ext, uint32_t min, uint32_t max)
 {
 	uint32_t num;
@@ -298,7 +825,7 @@ bool AudioFileHelper::generateRandomFileName(const char* name, const char* ext,
 
 	last_random = num;
 
-	sprintf(file_name, "%s%lu.%s", name, num, ext);
+	sprintf(file_name, "%s%lu.%s", name, (unsigned long) num, ext);
 	return true;
 }
 
@@ -318,8 +845,9 @@ uint32_t AudioFileHelper::getDuration(uint32_t fs)
 		if (!size || !fs)
 			return 0;
 	} else {
-		size = wav_header.chunk.file_size;
+		// Compressed files have more samples than bytes
 		rate = wav_header.format.sample_rate;
+		return (uint32_t) (((uint64_t) getDataSamples() * 1000) / rate);
 	}
 
 	return ((size / sample_size) * 1000) / rate;
@@ -351,3 +879,20 @@ uint32_t AudioFileHelper::getDataSize()
 		return  wav_header.chunk.file_size;
 	}
 }
+
+uint32_t AudioFileHelper::getDataSamples()
+{
+	uint32_t end;
+
+	if (!opened || (!file_sample_size && coding != WAV_FORMAT_IMA_ADPCM))
+		return 0;
+
+	end = getDataEnd();
+	if (end <= header_size)
+		return 0;
+
+	if (coding == WAV_FORMAT_IMA_ADPCM)
+		return adpcmSamples(end - header_size);
+
+	return (end - header_size) / file_sample_size;
+}
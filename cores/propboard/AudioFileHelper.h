@@ -31,6 +31,16 @@
 #include "AudioSource.h"
 #include <ff.h>
 
+#define FILE_READ_ALIGNMENT		16			// SDIO DMA does word bursts (INC4) to 16-byte aligned memory
+#define FILE_LINKMAP_ITEMS		16			// Cluster link map kept in the helper: 7 fragments
+#define FILE_LINKMAP_MAX_ITEMS	128			// Larger maps are allocated up to this size: 63 fragments
+
+// WAV format tags. Compressed samples are decoded to 16-bit PCM by fillBuffer().
+#define WAV_FORMAT_PCM			0x0001
+#define WAV_FORMAT_MULAW		0x0007
+#define WAV_FORMAT_IMA_ADPCM	0x0011
+#define ADPCM_MAX_BLOCK_SIZE	4096
+
 typedef struct _wav_chunk
 {
 	uint8_t		riff[4];
@@ -51,9 +61,40 @@ typedef struct _wav_format
 typedef struct _wav_header
 {
 	WAV_CHUNK chunk;
-	WAV_FORMAT format;
+	WAV_FORMAT format;				// Format of the samples fillBuffer() returns
 } WAV_HEADER;
 
+typedef struct _adpcm_state
+{
+	int32_t predictor;
+	int32_t index;
+} ADPCM_STATE;
+
+class AudioFontIndex;
+struct _font_entry;
+
+// Counters shared by all the helpers, always kept
+typedef struct _audio_file_stats
+{
+	uint32_t reads;						// fillBuffer() calls
+	uint32_t bytes;
+	uint32_t sector_bytes;				// Read as whole sectors straight into the caller's buffer
+	uint32_t aligned_bytes;				// Part of sector_bytes that went to FILE_READ_ALIGNMENT aligned memory
+	uint32_t read_time;					// uS spent reading
+	uint32_t max_read_time;
+	uint32_t decode_time;				// uS spent decoding compressed samples
+	uint32_t seeks;						// rewind() calls that moved the file pointer
+	uint32_t seek_time;
+	uint32_t max_seek_time;
+	uint32_t linkmaps;					// Files opened with a cluster link map (fast seek)
+	uint32_t linkmap_allocs;			// Maps that didn't fit in the helper and were allocated
+	uint32_t linkmap_fails;				// Files too fragmented for a map, seeking follows the FAT
+	uint32_t opens;						// openWav()/openRaw() calls that succeeded
+	uint32_t indexed_opens;				// Part of opens done through the font index
+	uint32_t open_time;
+	uint32_t max_open_time;
+} AUDIO_FILE_STATS;
+
 class AudioFileHelper
 {
 public:
@@ -65,6 +106,7 @@ public:
 
 	bool openRaw(const char* name, uint32_t samplesize, uint32_t hdrsize, bool infinite);
 	bool openRandomRaw(const char* name, const char* ext, uint32_t min, uint32_t max, uint32_t samplesize, uint32_t hdrsize, bool infinite);
+	bool reserve(uint32_t block_bytes, uint32_t linkmap_items);
 
 	void close();
 	bool rewind();
@@ -72,6 +114,7 @@ public:
 	uint32_t getDuration(uint32_t fs = 0);
 	uint32_t getFileSize();
 	uint32_t getDataSize();
+	uint32_t getDataSamples();
 	uint32_t getSamplesLeft();
 
 	inline bool eofReached() { return eof; }
@@ -80,22 +123,65 @@ public:
 	inline uint32_t getHeaderSize() { return header_size; }
 	inline uint8_t getSampleSize() { return sample_size; }
 	inline char* getFileName() { return file_name; }
+	inline bool hasLinkMap() { return opened && file.cltbl != NULL; }
+	inline uint16_t getCoding() { return coding; }
+
+	// Offset from a FILE_READ_ALIGNMENT aligned address where the next fillBuffer() should write,
+	// so the whole sectors FatFs reads straight into the buffer land aligned. Samples stay word aligned.
+	inline uint32_t getAlignmentOffset()
+	{
+		return (opened && coding == WAV_FORMAT_PCM) ? (file.fptr & (FILE_READ_ALIGNMENT - 1) & ~0x03) : 0;
+	}
+
+	static void getStats(AUDIO_FILE_STATS* dst);
+	static void resetStats();
+
+	// WAV files found in the index are opened by cluster, without following the path
+	static inline void setFontIndex(AudioFontIndex* index) { font_index = index; }
+	static inline AudioFontIndex* getFontIndex() { return font_index; }
 
 private:
+	friend class AudioFontIndex;
+
+	bool openEntry(const char* name, const struct _font_entry* entry);
+	void countOpen(uint32_t start, bool indexed);
 	bool generateRandomFileName(const char* name, const char* ext, uint32_t min, uint32_t max);
 	bool parseWavHeader();
+	bool read(uint8_t* buffer, uint32_t bytes, UINT* read);
+	bool createLinkMap();
+	bool setCoding(uint32_t fmt_size);
+	uint32_t readSamples(uint8_t* buffer, uint32_t samples);
+	uint32_t decodeAdpcm(uint8_t* buffer, uint32_t samples);
+	bool loadBlock();
+	uint32_t adpcmSamples(uint32_t bytes);
+	uint32_t getDataEnd();
 
 	FIL file;
+	DWORD linkmap_buffer[FILE_LINKMAP_ITEMS];
+	DWORD* linkmap_alloc;
+	uint32_t linkmap_alloc_items;
+	uint8_t* block;						// IMA-ADPCM block being decoded
+	uint32_t block_alloc_size;
+	bool reserved;						// Opening files doesn't allocate, see reserve()
+	uint16_t block_size;
+	uint16_t block_samples;				// Frames in a whole block
+	uint16_t block_count;				// Frames in the block loaded
+	uint16_t block_pos;					// Next frame to decode
+	ADPCM_STATE adpcm[2];
 	bool opened;
 	bool infinite_mode;
 	bool is_raw;
 	volatile bool eof;
 	uint32_t last_random;
 	uint32_t data_end;
-	uint8_t sample_size;
+	uint8_t sample_size;				// Size of the samples fillBuffer() returns
+	uint8_t file_sample_size;			// Size of the samples in the file (PCM and u-law)
+	uint16_t coding;
 	uint32_t header_size;
 	WAV_HEADER wav_header;
 	char file_name[_MAX_LFN];
+
+	static AudioFontIndex* font_index;
 };
 
 #endif /* __AUDIOFILEHELPER_H__ */
@@ -0,0 +1,307 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### AudioFilter.cpp
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+#include "Arduino.h"
+#include "AudioFilter.h"
+#include <arm_math.h>
+
+// Normalized biquad coefficients b0, b1, b2, a1, a2, from the RBJ Audio EQ Cookbook
+static bool calculateBiquad(FILTER_BAND* band, uint32_t fs, float* c)
+{
+	if (band->frequency <= 0 || band->frequency >= fs / 2 || band->q <= 0)
+		return false;
+
+	float w0 = 2 * PI * band->frequency / fs;
+	float cw = cosf(w0);
+	float alpha = sinf(w0) / (2 * band->q);
+	float a = powf(10, band->gain / 40);
+	float sa = 2 * sqrtf(a) * alpha;
+	float a0;
+
+	switch (band->type)
+	{
+		case FilterPeaking:
+			a0 = 1 + alpha / a;
+			c[0] = 1 + alpha * a;
+			c[1] = -2 * cw;
+			c[2] = 1 - alpha * a;
+			c[3] = -2 * cw;
+			c[4] = 1 - alpha / a;
+			break;
+
+		case FilterLowShelf:
+			a0 = (a + 1) + (a - 1) * cw + sa;
+			c[0] = a * ((a + 1) - (a - 1) * cw + sa);
+			c[1] = 2 * a * ((a - 1) - (a + 1) * cw);
+			c[2] = a * ((a + 1) - (a - 1) * cw - sa);
+			c[3] = -2 * ((a - 1) + (a + 1) * cw);
+			c[4] = (a + 1) + (a - 1) * cw - sa;
+			break;
+
+		case FilterHighShelf:
+			a0 = (a + 1) - (a - 1) * cw + sa;
+			c[0] = a * ((a + 1) + (a - 1) * cw + sa);
+			c[1] = -2 * a * ((a - 1) + (a + 1) * cw);
+			c[2] = a * ((a + 1) + (a - 1) * cw - sa);
+			c[3] = 2 * ((a - 1) - (a + 1) * cw);
+			c[4] = (a + 1) - (a - 1) * cw - sa;
+			break;
+
+		case FilterLowPass:
+			a0 = 1 + alpha;
+			c[0] = (1 - cw) / 2;
+			c[1] = 1 - cw;
+			c[2] = (1 - cw) / 2;
+			c[3] = -2 * cw;
+			c[4] = 1 - alpha;
+			break;
+
+		case FilterHighPass:
+			a0 = 1 + alpha;
+			c[0] = (1 + cw) / 2;
+			c[1] = -(1 + cw);
+			c[2] = (1 + cw) / 2;
+			c[3] = -2 * cw;
+			c[4] = 1 - alpha;
+			break;
+
+		default:
+			return false;
+	}
+
+	for (uint8_t i = 0; i < 5; i++)
+		c[i] /= a0;
+
+	return true;
+}
+
+static q15_t toQ15(float value, float scale)
+{
+	int32_t q = (int32_t) lrintf(value * scale);
+	return (q15_t) __SSAT(q, 16);
+}
+
+AudioBiquad::AudioBiquad()
+{
+	stages = 0;
+	post_shift = 0;
+	memset(bands, 0, sizeof(bands));
+	memset(coefficients, 0, sizeof(coefficients));
+	memset(state, 0, sizeof(state));
+}
+
+AudioBiquad::~AudioBiquad()
+{
+}
+
+bool AudioBiquad::begin(uint32_t fs)
+{
+	AudioEffect::begin(fs);
+	return updateCoefficients();
+}
+
+bool AudioBiquad::updateCoefficients()
+{
+	float values[MAX_FILTER_BANDS * 5];
+	q15_t new_coefficients[MAX_FILTER_BANDS * 6];
+	float peak = 0;
+	float scale;
+	uint8_t count = 0;
+	uint8_t shift = 0;
+
+	// Calculated in begin(), once the sample rate is known
+	if (!sample_rate)
+		return true;
+
+	for (uint8_t i = 0; i < MAX_FILTER_BANDS; i++)
+	{
+		if (!bands[i].enabled)
+			continue;
+
+		if (!calculateBiquad(&bands[i], sample_rate, &values[count * 5]))
+			return false;
+
+		count++;
+	}
+
+	for (uint8_t i = 0; i < count * 5; i++)
+		peak = max(peak, fabsf(values[i]));
+
+	// All the stages share the same post-shift, big enough for the largest coefficient
+	while (shift < 15 && peak * 32768.0f / (1 << shift) > 32767.0f)
+		shift++;
+
+	scale = 32768.0f / (1 << shift);
+
+	// CMSIS layout is {b0, 0, b1, b2, a1, a2}, with the feedback coefficients negated
+	for (uint8_t i = 0; i < count; i++)
+	{
+		new_coefficients[i * 6] = toQ15(values[i * 5], scale);
+		new_coefficients[i * 6 + 1] = 0;
+		new_coefficients[i * 6 + 2] = toQ15(values[i * 5 + 1], scale);
+		new_coefficients[i * 6 + 3] = toQ15(values[i * 5 + 2], scale);
+		new_coefficients[i * 6 + 4] = toQ15(-values[i * 5 + 3], scale);
+		new_coefficients[i * 6 + 5] = toQ15(-values[i * 5 + 4], scale);
+	}
+
+	// The filter state is kept across parameter changes, unless the stages change
+	__disable_irq();
+	memcpy(coefficients, new_coefficients, count * 6 * sizeof(q15_t));
+	if (count != stages)
+		memset(state, 0, sizeof(state));
+
+	stages = count;
+	post_shift = shift;
+	__enable_irq();
+
+	return true;
+}
+
+bool AudioBiquad::setFilterBand(uint8_t band, FilterType type, float frequency, float q, float gain, bool enabled)
+{
+	if (band >= MAX_FILTER_BANDS)
+		return false;
+
+	FILTER_BAND previous = bands[band];
+
+	bands[band].type = type;
+	bands[band].frequency = frequency;
+	bands[band].q = q;
+	bands[band].gain = gain;
+	bands[band].enabled = enabled;
+
+	if (updateCoefficients())
+		return true;
+
+	bands[band] = previous;
+	return false;
+}
+
+void AudioBiquad::process(int16_t* left, int16_t* right, uint32_t samples)
+{
+	arm_biquad_casd_df1_inst_q15 filter;
+
+	if (!stages)
+		return;
+
+	// The instance only points to the coefficients and the state, which live in the object
+	filter.numStages = stages;
+	filter.pCoeffs = coefficients;
+	filter.postShift = post_shift;
+
+	filter.pState = state[0];
+	arm_biquad_cascade_df1_q15(&filter, left, left, samples);
+
+	filter.pState = state[1];
+	arm_biquad_cascade_df1_q15(&filter, right, right, samples);
+}
+
+AudioEqualizer::AudioEqualizer()
+{
+}
+
+AudioEqualizer::~AudioEqualizer()
+{
+}
+
+bool AudioEqualizer::setBand(uint8_t band, FilterType type, float frequency, float q, float gain)
+{
+	return setFilterBand(band, type, frequency, q, gain, true);
+}
+
+bool AudioEqualizer::setBandGain(uint8_t band, float gain)
+{
+	if (band >= MAX_FILTER_BANDS || !bands[band].enabled)
+		return false;
+
+	return setFilterBand(band, bands[band].type, bands[band].frequency, bands[band].q, gain, true);
+}
+
+bool AudioEqualizer::clearBand(uint8_t band)
+{
+	if (band >= MAX_FILTER_BANDS)
+		return false;
+
+	return setFilterBand(band, bands[band].type, bands[band].frequency, bands[band].q, bands[band].gain, false);
+}
+
+AudioHighPass::AudioHighPass(float frequency, uint8_t order)
+{
+	cutoff = frequency;
+	this->order = (order == 4) ? 4 : 2;
+	configure();
+}
+
+AudioHighPass::~AudioHighPass()
+{
+}
+
+bool AudioHighPass::configure()
+{
+	FILTER_BAND previous[2] = { bands[0], bands[1] };
+
+	// Butterworth Q values for one and two stages
+	bands[0].type = bands[1].type = FilterHighPass;
+	bands[0].frequency = bands[1].frequency = cutoff;
+	bands[0].gain = bands[1].gain = 0;
+	bands[0].enabled = true;
+	bands[1].enabled = (order == 4);
+	bands[0].q = (order == 4) ? 0.5412f : 0.7071f;
+	bands[1].q = 1.3066f;
+
+	if (updateCoefficients())
+		return true;
+
+	bands[0] = previous[0];
+	bands[1] = previous[1];
+	return false;
+}
+
+bool AudioHighPass::setCutoff(float frequency)
+{
+	float previous = cutoff;
+
+	cutoff = frequency;
+	if (configure())
+		return true;
+
+	cutoff = previous;
+	return false;
+}
+
+bool AudioHighPass::setOrder(uint8_t order)
+{
+	uint8_t previous = this->order;
+
+	if (order != 2 && order != 4)
+		return false;
+
+	this->order = order;
+	if (configure())
+		return true;
+
+	this->order = previous;
+	return false;
+}
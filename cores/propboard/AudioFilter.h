@@ -0,0 +1,108 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### AudioFilter.h
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+#ifndef __AUDIOFILTER_H__
+#define __AUDIOFILTER_H__
+
+#include <stm32f4xx.h>
+#include "AudioEffect.h"
+
+#define MAX_FILTER_BANDS			4
+#define HIGHPASS_DEFAULT_HZ			20.0f		// Just blocks DC
+
+enum FilterType
+{
+	FilterPeaking = 0,
+	FilterLowShelf,
+	FilterHighShelf,
+	FilterLowPass,
+	FilterHighPass
+};
+
+typedef struct _filter_band
+{
+	FilterType type;
+	float frequency;
+	float q;
+	float gain;							// dB, peaking and shelving filters only
+	bool enabled;
+} FILTER_BAND;
+
+// Cascade of biquads (one per enabled band) run with the CMSIS-DSP Q15 direct form I filter.
+// Coefficients are calculated in floating point when a band changes, outside the mixing.
+class AudioBiquad : public AudioEffect
+{
+public:
+	AudioBiquad();
+	~AudioBiquad();
+
+protected:
+	bool begin(uint32_t fs);
+	void process(int16_t* left, int16_t* right, uint32_t samples);
+	bool setFilterBand(uint8_t band, FilterType type, float frequency, float q, float gain, bool enabled);
+	bool updateCoefficients();
+
+	FILTER_BAND bands[MAX_FILTER_BANDS];
+
+private:
+	// Q15, in the layout of arm_biquad_cascade_df1_q15(). arm_math.h stays out of this header.
+	int16_t coefficients[MAX_FILTER_BANDS * 6];
+	int16_t state[2][MAX_FILTER_BANDS * 4];
+	uint8_t stages;
+	int8_t post_shift;
+};
+
+class AudioEqualizer : public AudioBiquad
+{
+public:
+	AudioEqualizer();
+	~AudioEqualizer();
+
+	bool setBand(uint8_t band, FilterType type, float frequency, float q = 0.707f, float gain = 0);
+	bool setBandGain(uint8_t band, float gain);
+	bool clearBand(uint8_t band);
+	inline FILTER_BAND* getBand(uint8_t band) { return band < MAX_FILTER_BANDS ? &bands[band] : NULL; }
+};
+
+// Butterworth high-pass, to remove DC or to keep low frequencies away from small speakers.
+// Order is 2 (12 dB/octave) or 4 (24 dB/octave).
+class AudioHighPass : public AudioBiquad
+{
+public:
+	AudioHighPass(float frequency = HIGHPASS_DEFAULT_HZ, uint8_t order = 2);
+	~AudioHighPass();
+
+	bool setCutoff(float frequency);
+	bool setOrder(uint8_t order);
+	inline float getCutoff() { return cutoff; }
+
+protected:
+	bool configure();
+
+	float cutoff;
+	uint8_t order;
+};
+
+#endif /* __AUDIOFILTER_H__ */
@@ -0,0 +1,592 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### AudioFontIndex.cpp
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+#include "AudioFontIndex.h"
+#include "Arduino.h"
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define FONT_LIST_GROWTH			32
+
+static int compareEntries(const void* a, const void* b)
+{
+	uint32_t ha = ((const FONT_ENTRY*) a)->hash;
+	uint32_t hb = ((const FONT_ENTRY*) b)->hash;
+
+	return (ha > hb) - (ha < hb);
+}
+
+static bool isWavFile(const char* name)
+{
+	uint32_t len = strlen(name);
+	return (len > 4 && strcasecmp(name + len - 4, ".wav") == 0);
+}
+
+// Names are compared in lower case, with '\' as '/'
+static uint8_t normalize(char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		c += 'a' - 'A';
+	else if (c == '\\')
+		c = '/';
+
+	return (uint8_t) c;
+}
+
+AudioFontIndex::AudioFontIndex()
+{
+	entries = NULL;
+	count = 0;
+	mount_id = 0;
+	stale = false;
+	dir[0] = 0;
+	file_name[0] = 0;
+	memset(&stats, 0, sizeof(stats));
+}
+
+AudioFontIndex::~AudioFontIndex()
+{
+	end();
+}
+
+uint32_t AudioFontIndex::hash(const char* str, uint32_t value)
+{
+	// "/font/x.wav" and "font/x.wav" are the same file
+	if (value == FONT_HASH_BASIS)
+	{
+		while (*str == '/')
+			str++;
+	}
+
+	while (*str)
+		value = (value ^ normalize(*str++)) * FONT_HASH_PRIME;
+
+	return value;
+}
+
+// Another hash of the name, unrelated to hash(), to tell apart the names that hash() mixes up
+uint32_t AudioFontIndex::check(const char* str, uint32_t value)
+{
+	if (value == FONT_CHECK_BASIS)
+	{
+		while (*str == '/')
+			str++;
+	}
+
+	while (*str)
+		value = (value * 33) ^ normalize(*str++);
+
+	return value;
+}
+
+bool AudioFontIndex::makePath(char* dst, uint32_t size, const char* name)
+{
+	int len;
+
+	if (dir[0])
+		len = snprintf(dst, size, "%s/%s", dir, name);
+	else
+		len = snprintf(dst, size, "%s", name);
+
+	return (len > 0 && (uint32_t) len < size);
+}
+
+bool AudioFontIndex::begin(const char* path, const char* index_file)
+{
+	uint32_t len;
+
+	end();
+
+	while (*path == '/')
+		path++;
+
+	len = strlen(path);
+	while (len && path[len - 1] == '/')
+		len--;
+
+	if (len >= sizeof(dir))
+		return false;
+
+	memcpy(dir, path, len);
+	dir[len] = 0;
+
+	file_name[0] = 0;
+	if (index_file && index_file[0] && !makePath(file_name, sizeof(file_name), index_file))
+		return false;
+
+	if (!refresh())
+		return false;
+
+	AudioFileHelper::setFontIndex(this);
+	return true;
+}
+
+void AudioFontIndex::end()
+{
+	FONT_ENTRY* list;
+
+	if (AudioFileHelper::getFontIndex() == this)
+		AudioFileHelper::setFontIndex(NULL);
+
+	// A refill may be opening a file through the index
+	__disable_irq();
+	list = entries;
+	entries = NULL;
+	count = 0;
+	__enable_irq();
+
+	if (list)
+		free(list);
+}
+
+bool AudioFontIndex::parse(AudioFileHelper* helper, const char* name, FONT_ENTRY* entry)
+{
+	bool ok;
+
+	// Read the header the way openWav() does, without the index
+	if (f_open(&helper->file, name, FA_READ | FA_OPEN_EXISTING) != FR_OK)
+		return false;
+
+	ok = helper->parseWavHeader();
+	f_close(&helper->file);
+
+	if (!ok)
+		return false;
+
+	entry->sample_size = helper->sample_size;
+	entry->file_sample_size = helper->file_sample_size;
+	entry->reserved = 0;
+	entry->coding = helper->coding;
+	entry->block_size = helper->block_size;
+	entry->block_samples = helper->block_samples;
+	entry->header_size = helper->header_size;
+	entry->data_end = helper->data_end;
+	entry->header = helper->wav_header;
+	return true;
+}
+
+const FONT_ENTRY* AudioFontIndex::search(const FONT_ENTRY* list, uint32_t items, uint32_t value)
+{
+	uint32_t low = 0;
+	uint32_t high = items;
+
+	while (low < high)
+	{
+		uint32_t mid = (low + high) / 2;
+
+		if (list[mid].hash == value)
+			return &list[mid];
+
+		if (list[mid].hash < value)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return NULL;
+}
+
+// Found by its hash, and with the same name
+const FONT_ENTRY* AudioFontIndex::lookup(const char* name)
+{
+	const FONT_ENTRY* entry = search(entries, count, hash(name));
+
+	if (entry && entry->check != check(name))
+		return NULL;
+
+	return entry;
+}
+
+uint32_t AudioFontIndex::removeDuplicates(FONT_ENTRY* list, uint32_t items)
+{
+	uint32_t kept = 0;
+	uint32_t i = 0;
+
+	// Names with the same hash can't be told apart, they are left to openWav() to find
+	while (i < items)
+	{
+		uint32_t j = i + 1;
+		while (j < items && list[j].hash == list[i].hash)
+			j++;
+
+		if (j == i + 1)
+			list[kept++] = list[i];
+
+		i = j;
+	}
+
+	return kept;
+}
+
+bool AudioFontIndex::scan(const FONT_ENTRY* previous, uint32_t previous_count, FONT_ENTRY** list, uint32_t* found)
+{
+	char path[FONT_PATH_LENGTH + _MAX_LFN + 2];
+	AudioFileHelper* helper = NULL;
+	FONT_ENTRY* items = NULL;
+	uint32_t allocated = 0;
+	uint32_t n = 0;
+	uint32_t base;
+	uint32_t base_check;
+	FILINFO info;
+	DIR dj;
+
+	if (f_opendir(&dj, dir) != FR_OK)
+		return false;
+
+	mount_id = dj.obj.id;
+	base = hash(dir);
+	base_check = check(dir);
+	if (dir[0])
+	{
+		base = hash("/", base);
+		base_check = check("/", base_check);
+	}
+
+	while (f_readdir(&dj, &info) == FR_OK && info.fname[0])
+	{
+		const FONT_ENTRY* known;
+		FONT_ENTRY* entry;
+
+		if ((info.fattrib & AM_DIR) || !isWavFile(info.fname))
+			continue;
+
+		if (n == FONT_INDEX_MAX_FILES)
+			break;
+
+		if (n == allocated)
+		{
+			FONT_ENTRY* grown = (FONT_ENTRY*) realloc(items, (allocated + FONT_LIST_GROWTH) * sizeof(FONT_ENTRY));
+			if (!grown)
+				break;
+
+			items = grown;
+			allocated += FONT_LIST_GROWTH;
+		}
+
+		entry = &items[n];
+		entry->hash = hash(info.fname, base);
+		entry->check = check(info.fname, base_check);
+
+		// Files that didn't change since the last scan keep what was read then
+		known = search(previous, previous_count, entry->hash);
+		if (known && known->check == entry->check && known->cluster == info.fclust && known->size == info.fsize &&
+			known->date == info.fdate && known->time == info.ftime && known->stat == info.fstat)
+		{
+			*entry = *known;
+			n++;
+			continue;
+		}
+
+		if (!helper)
+		{
+			helper = new AudioFileHelper();
+			if (!helper)
+				break;
+		}
+
+		if (!makePath(path, sizeof(path), info.fname) || !parse(helper, path, entry))
+			continue;
+
+		entry->cluster = info.fclust;
+		entry->size = info.fsize;
+		entry->date = info.fdate;
+		entry->time = info.ftime;
+		entry->stat = info.fstat;
+		stats.parsed++;
+		n++;
+	}
+
+	f_closedir(&dj);
+
+	if (helper)
+		delete helper;
+
+	qsort(items, n, sizeof(FONT_ENTRY), compareEntries);
+	*found = removeDuplicates(items, n);
+	*list = items;
+	return true;
+}
+
+uint32_t AudioFontIndex::load(FONT_ENTRY** list)
+{
+	FONT_INDEX_HEADER header;
+	FONT_ENTRY* items;
+	UINT read;
+	FIL file;
+	uint32_t size;
+
+	*list = NULL;
+
+	if (f_open(&file, file_name, FA_READ | FA_OPEN_EXISTING) != FR_OK)
+		return 0;
+
+	if (f_read(&file, &header, sizeof(header), &read) != FR_OK || read != sizeof(header) ||
+		header.magic != FONT_INDEX_MAGIC || header.version != FONT_INDEX_VERSION ||
+		header.entry_size != sizeof(FONT_ENTRY) || !header.count || header.count > FONT_INDEX_MAX_FILES)
+	{
+		f_close(&file);
+		return 0;
+	}
+
+	size = header.count * sizeof(FONT_ENTRY);
+	items = (FONT_ENTRY*) malloc(size);
+	if (!items)
+	{
+		f_close(&file);
+		return 0;
+	}
+
+	if (f_read(&file, items, size, &read) != FR_OK || read != size)
+	{
+		f_close(&file);
+		free(items);
+		return 0;
+	}
+
+	f_close(&file);
+	*list = items;
+	return header.count;
+}
+
+bool AudioFontIndex::save()
+{
+	FONT_INDEX_HEADER header;
+	uint32_t size = count * sizeof(FONT_ENTRY);
+	UINT written;
+	FIL file;
+	bool ok;
+
+	if (f_open(&file, file_name, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+		return false;
+
+	header.magic = FONT_INDEX_MAGIC;
+	header.version = FONT_INDEX_VERSION;
+	header.entry_size = sizeof(FONT_ENTRY);
+	header.count = count;
+
+	ok = (f_write(&file, &header, sizeof(header), &written) == FR_OK && written == sizeof(header));
+	ok = ok && (!size || (f_write(&file, entries, size, &written) == FR_OK && written == size));
+	ok = (f_close(&file) == FR_OK) && ok;
+
+	if (ok)
+		stats.saves++;
+
+	return ok;
+}
+
+bool AudioFontIndex::refresh()
+{
+	FONT_ENTRY* previous = entries;
+	uint32_t previous_count = count;
+	FONT_ENTRY* loaded = NULL;
+	FONT_ENTRY* list = NULL;
+	uint32_t found = 0;
+	uint32_t start = micros();
+
+	// Nothing scanned yet, what was found the last time is in the index file
+	if (!previous && file_name[0])
+	{
+		previous_count = load(&loaded);
+		previous = loaded;
+	}
+
+	stats.parsed = 0;
+	if (!scan(previous, previous_count, &list, &found))
+	{
+		if (loaded)
+			free(loaded);
+
+		return false;
+	}
+
+	if (loaded)
+		free(loaded);
+
+	// A refill may be opening a file through the index
+	__disable_irq();
+	previous = entries;
+	entries = list;
+	count = found;
+	stale = false;
+	__enable_irq();
+
+	if (previous)
+		free(previous);
+
+	stats.files = count;
+	stats.scan_time = micros() - start;
+
+	// Written again when files were added, modified or removed
+	if (file_name[0] && (stats.parsed || count != previous_count))
+		save();
+
+	return true;
+}
+
+// The directory is scanned again after it changed, in thread mode only: interrupt handlers
+// can't wait for it, they open the files by path until then
+bool AudioFontIndex::update()
+{
+	if (!stale)
+		return true;
+
+	if (__get_IPSR() || !refresh())
+	{
+		stats.stale++;
+		return false;
+	}
+
+	stats.refreshes++;
+	return true;
+}
+
+const FONT_ENTRY* AudioFontIndex::find(const char* name)
+{
+	const FONT_ENTRY* entry;
+
+	if (!update() || !count)
+		return NULL;
+
+	entry = lookup(name);
+	if (entry)
+		stats.hits++;
+	else
+		stats.misses++;
+
+	return entry;
+}
+
+uint32_t AudioFontIndex::getGroupSize(const char* name)
+{
+	char path[FONT_PATH_LENGTH + _MAX_LFN + 2];
+	uint32_t size = 0;
+
+	if (!update())
+		return 0;
+
+	// Files named like openRandomWav() does, from 1 until one is missing
+	while (true)
+	{
+		snprintf(path, sizeof(path), "%s%lu.wav", name, (unsigned long) (size + 1));
+		if (!lookup(path))
+			break;
+
+		size++;
+	}
+
+	return size;
+}
+
+bool AudioFontIndex::isCurrent(FIL* file)
+{
+	if (file->obj.id == mount_id)
+		return true;
+
+	// Another volume, or the same one mounted again: read the directory on the next lookup
+	stale = true;
+	return false;
+}
+
+// A file in the directory, the directory itself or one it is in. Not the index file, save() writes it.
+bool AudioFontIndex::contains(const char* path)
+{
+	uint32_t i = 0;
+
+	// Drive number
+	if (path[0] && path[1] == ':')
+		path += 2;
+
+	while (*path == '/' || *path == '\\')
+		path++;
+
+	if (file_name[0] && hash(path) == hash(file_name) && check(path) == check(file_name))
+		return false;
+
+	while (dir[i] && normalize(path[i]) == normalize(dir[i]))
+		i++;
+
+	// Renaming or removing a directory the font is in
+	if (dir[i])
+		return (!path[i] && normalize(dir[i]) == '/');
+
+	if (i)
+	{
+		if (!path[i])
+			return true;
+
+		if (normalize(path[i]) != '/')
+			return false;
+
+		i++;
+	}
+
+	// Not in a subdirectory
+	for (; path[i]; i++)
+	{
+		if (normalize(path[i]) == '/')
+			return false;
+	}
+
+	return true;
+}
+
+// Called by FatFs before a file changes, with its path or the start cluster of an open file (see ff_notify())
+void AudioFontIndex::invalidate(const char* path, uint32_t cluster)
+{
+	if (path)
+	{
+		if (contains(path))
+			stale = true;
+
+		return;
+	}
+
+	if (!cluster)
+		return;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (entries[i].cluster == cluster)
+		{
+			stale = true;
+			return;
+		}
+	}
+}
+
+void AudioFontIndex::getStats(FONT_INDEX_STATS* dst)
+{
+	memcpy(dst, &stats, sizeof(FONT_INDEX_STATS));
+}
+
+void AudioFontIndex::resetStats()
+{
+	uint32_t files = stats.files;
+
+	memset(&stats, 0, sizeof(FONT_INDEX_STATS));
+	stats.files = files;
+}
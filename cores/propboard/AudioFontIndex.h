@@ -0,0 +1,134 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### AudioFontIndex.h
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+#ifndef __AUDIOFONTINDEX_H__
+#define __AUDIOFONTINDEX_H__
+
+#include <stm32f4xx.h>
+#include "AudioFileHelper.h"
+
+#define FONT_INDEX_FILE				"font.idx"
+#define FONT_INDEX_MAGIC			0x58444946		// "FIDX"
+#define FONT_INDEX_VERSION			2
+#define FONT_INDEX_MAX_FILES		512
+#define FONT_PATH_LENGTH			64
+#define FONT_HASH_BASIS				2166136261UL	// FNV-1a
+#define FONT_HASH_PRIME				16777619UL
+#define FONT_CHECK_BASIS			5381UL			// djb2, to verify a name found by its hash
+
+// A WAV file of the font: where it is on the volume and what parseWavHeader() found in it
+typedef struct _font_entry
+{
+	uint32_t hash;						// Path in lower case, see AudioFontIndex::hash()
+	uint32_t check;						// Same path, see AudioFontIndex::check()
+	uint32_t cluster;					// Start cluster
+	uint32_t size;
+	uint16_t date;						// Modification date and time, to tell a changed file
+	uint16_t time;
+	uint8_t stat;						// Chain status (exFAT)
+	uint8_t sample_size;
+	uint8_t file_sample_size;
+	uint8_t reserved;
+	uint16_t coding;
+	uint16_t block_size;
+	uint16_t block_samples;
+	uint32_t header_size;
+	uint32_t data_end;
+	WAV_HEADER header;					// Format of the decoded samples
+} FONT_ENTRY;
+
+typedef struct _font_index_header
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t entry_size;
+	uint32_t count;
+} FONT_INDEX_HEADER;
+
+typedef struct _font_index_stats
+{
+	uint32_t files;						// WAV files in the index
+	uint32_t parsed;					// Headers read in the last scan, the rest came from the index file
+	uint32_t scan_time;					// uS taken by the last scan
+	uint32_t saves;						// Times the index file was written
+	uint32_t hits;						// Lookups that found the file
+	uint32_t misses;
+	uint32_t stale;						// Lookups refused because the directory or the volume changed
+	uint32_t refreshes;					// Scans done by lookups after a change
+} FONT_INDEX_STATS;
+
+// The WAV files of a font directory, indexed by name once so AudioFileHelper::openWav() and
+// openRandomWav() can open them by start cluster, without walking the directory nor parsing the
+// header on every trigger. The index is kept in a file in the directory; begin() checks it
+// against the directory and only reads the headers of new or modified files. Names are looked up
+// as they are passed to openWav(), with the directory ("font1/clash3.wav"), case insensitive.
+// Files of the directory created, written, renamed or removed through FatFs (see ff_notify()) and
+// mounting the volume again make the index stale: the next lookup in thread mode scans it again,
+// the ones in interrupt handlers open the files by path until then.
+class AudioFontIndex
+{
+public:
+	AudioFontIndex();
+	~AudioFontIndex();
+
+	bool begin(const char* path, const char* index_file = FONT_INDEX_FILE);
+	void end();
+	bool refresh();
+
+	const FONT_ENTRY* find(const char* name);
+	uint32_t getGroupSize(const char* name);
+	bool isCurrent(FIL* file);
+	void invalidate(const char* path, uint32_t cluster);
+
+	inline uint32_t getFileCount() { return count; }
+	inline bool isStale() { return stale; }
+	void getStats(FONT_INDEX_STATS* dst);
+	void resetStats();
+
+	static uint32_t hash(const char* str, uint32_t value = FONT_HASH_BASIS);
+	static uint32_t check(const char* str, uint32_t value = FONT_CHECK_BASIS);
+
+private:
+	bool scan(const FONT_ENTRY* previous, uint32_t previous_count, FONT_ENTRY** list, uint32_t* found);
+	bool parse(AudioFileHelper* helper, const char* name, FONT_ENTRY* entry);
+	uint32_t removeDuplicates(FONT_ENTRY* list, uint32_t items);
+	const FONT_ENTRY* search(const FONT_ENTRY* list, uint32_t items, uint32_t value);
+	const FONT_ENTRY* lookup(const char* name);
+	bool update();
+	bool contains(const char* path);
+	uint32_t load(FONT_ENTRY** list);
+	bool save();
+	bool makePath(char* dst, uint32_t size, const char* name);
+
+	FONT_ENTRY* entries;				// Sorted by hash
+	uint32_t count;
+	WORD mount_id;
+	volatile bool stale;
+	char dir[FONT_PATH_LENGTH];
+	char file_name[FONT_PATH_LENGTH];
+	FONT_INDEX_STATS stats;
+};
+
+#endif /* __AUDIOFONTINDEX_H__ */
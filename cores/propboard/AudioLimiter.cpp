@@ -0,0 +1,176 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### AudioLimiter.cpp
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+#include "AudioLimiter.h"
+#include "Arduino.h"
+
+AudioLimiter::AudioLimiter(float threshold, uint32_t lookahead_us, uint32_t release_ms)
+{
+	threshold_db = threshold;
+	this->lookahead_us = lookahead_us;
+	this->release_ms = release_ms;
+	lookahead = 0;
+	delay_index = 0;
+	this->threshold = 32767;
+	release = 0;
+	gain = LIMITER_UNITY_GAIN;
+	configure();
+}
+
+AudioLimiter::~AudioLimiter()
+{
+}
+
+bool AudioLimiter::begin(uint32_t fs)
+{
+	AudioEffect::begin(fs);
+	configure();
+	return true;
+}
+
+void AudioLimiter::configure()
+{
+	uint32_t frames = 1;
+	int32_t rel = 0;
+
+	if (sample_rate)
+	{
+		frames = (lookahead_us * sample_rate) / 1000000;
+		frames = constrain(frames, 1, LIMITER_MAX_LOOKAHEAD);
+
+		// One-pole release with a time constant of release_ms
+		if (release_ms)
+			rel = (int32_t) ((1.0f - expf(-1000.0f / (release_ms * sample_rate))) * LIMITER_UNITY_GAIN);
+		else
+			rel = LIMITER_UNITY_GAIN;
+	}
+
+	__disable_irq();
+	threshold = (int32_t) (32767.0f * powf(10, threshold_db / 20));
+	threshold = constrain(threshold, 1, 32767);
+	release = rel;
+
+	// A new delay line starts over
+	if (frames != lookahead)
+	{
+		lookahead = frames;
+		delay_index = 0;
+		gain = LIMITER_UNITY_GAIN;
+		memset(delay_left, 0, sizeof(delay_left));
+		memset(delay_right, 0, sizeof(delay_right));
+	}
+
+	// Peaks are looked at again with the new settings
+	target = gain;
+	step = 0;
+	hold = 0;
+	__enable_irq();
+}
+
+bool AudioLimiter::setThreshold(float decibels)
+{
+	if (decibels > 0)
+		return false;
+
+	threshold_db = decibels;
+	configure();
+	return true;
+}
+
+bool AudioLimiter::setLookahead(uint32_t us)
+{
+	if (sample_rate && (us * sample_rate) / 1000000 > LIMITER_MAX_LOOKAHEAD)
+		return false;
+
+	lookahead_us = us;
+	configure();
+	return true;
+}
+
+bool AudioLimiter::setRelease(uint32_t ms)
+{
+	release_ms = ms;
+	configure();
+	return true;
+}
+
+void AudioLimiter::process(int16_t* left, int16_t* right, uint32_t samples)
+{
+	int32_t peak;
+	int32_t required;
+	int32_t attack;
+	int16_t out_left, out_right;
+
+	while (samples--)
+	{
+		peak = max(abs(*left), abs(*right));
+
+		if (peak > threshold)
+		{
+			// Reach the gain this frame needs by the time it leaves the delay line. A steeper
+			// attack already running is kept, so earlier peaks still get theirs in time.
+			required = (threshold << 16) / peak;
+			if (required < target)
+			{
+				target = required;
+				attack = (required - gain - (int32_t) lookahead + 1) / (int32_t) lookahead;
+				if (attack < step)
+					step = attack;
+			}
+
+			hold = lookahead;
+		}
+
+		if (step)
+		{
+			gain += step;
+			if (gain <= target)
+			{
+				gain = target;
+				step = 0;
+			}
+		} else if (hold)
+		{
+			hold--;
+		} else if (gain < LIMITER_UNITY_GAIN)
+		{
+			gain += (int32_t) (((int64_t) (LIMITER_UNITY_GAIN - gain) * release) >> 16) + 1;
+			if (gain > LIMITER_UNITY_GAIN)
+				gain = LIMITER_UNITY_GAIN;
+
+			target = gain;
+		}
+
+		out_left = delay_left[delay_index];
+		out_right = delay_right[delay_index];
+		delay_left[delay_index] = *left;
+		delay_right[delay_index] = *right;
+		if (++delay_index == lookahead)
+			delay_index = 0;
+
+		*left++ = __SSAT((out_left * gain) >> 16, 16);
+		*right++ = __SSAT((out_right * gain) >> 16, 16);
+	}
+}
@@ -0,0 +1,70 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### AudioLimiter.h
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+#ifndef __AUDIOLIMITER_H__
+#define __AUDIOLIMITER_H__
+
+#include <stm32f4xx.h>
+#include "AudioEffect.h"
+
+#define LIMITER_MAX_LOOKAHEAD		128			// Frames
+#define LIMITER_UNITY_GAIN			65536		// Q16
+
+// Look-ahead peak limiter. The output is delayed by the look-ahead time, so the gain reaches
+// what a peak needs before the peak is played. Both channels share the same gain.
+class AudioLimiter : public AudioEffect
+{
+public:
+	AudioLimiter(float threshold = -1.0f, uint32_t lookahead_us = 1000, uint32_t release_ms = 50);
+	~AudioLimiter();
+
+	bool setThreshold(float decibels);
+	bool setLookahead(uint32_t us);
+	bool setRelease(uint32_t ms);
+	inline float getGain() { return (float) gain / LIMITER_UNITY_GAIN; }
+
+protected:
+	bool begin(uint32_t fs);
+	void process(int16_t* left, int16_t* right, uint32_t samples);
+	void configure();
+
+	float threshold_db;
+	uint32_t lookahead_us;
+	uint32_t release_ms;
+
+private:
+	int16_t delay_left[LIMITER_MAX_LOOKAHEAD];
+	int16_t delay_right[LIMITER_MAX_LOOKAHEAD];
+	uint32_t delay_index;
+	uint32_t lookahead;					// Frames
+	int32_t threshold;					// Q15 amplitude
+	int32_t release;					// Per-frame fraction of the distance to unity, Q16
+	int32_t gain;						// Q16
+	int32_t target;						// Lowest gain the frames in the delay line need
+	int32_t step;						// Per-frame attack step, negative while attacking
+	uint32_t hold;						// Frames until the last peak leaves the delay line
+};
+
+#endif /* __AUDIOLIMITER_H__ */
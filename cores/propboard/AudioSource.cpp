@@ -34,10 +34,18 @@ AudioSource::AudioSource()
 	stereo = false;
 	bits_per_sample = sample_rate = sample_size = 0;
 	next_to_mix = next_in_list = NULL;
-	current_volume = 1.0f;
-	target_volume = current_volume;
-	target_volume_samples = 0;
-	target_volume_step = 0;
+	mixing_samples = 0;
+	current_gain = target_gain = block_gain_end = VOLUME_UNITY_GAIN;
+	block_gain_step = ramp_ratio = 0;
+	ramp_step = 0;
+	ramp_samples = block_samples = 0;
+	volume_ramp_length = VOLUME_CHANGE_SAMPLES;
+	volume_ramp = VolumeRampDecibel;
+	refill_request_time = 0;
+	refill_deadline = REFILL_NO_DEADLINE;
+	refill_pending = false;
+	refilled = false;
+	memset(&stats, 0, sizeof(stats));
 }
 
 AudioSource::~AudioSource()
@@ -110,84 +118,214 @@ bool AudioSource::resume()
 	return false;
 }
 
-void AudioSource::changeVolume(uint8_t* samples_ptr, uint32_t samples)
+// Applies a Q16 gain to 16 or 24-bit frames, adding 'step' to the gain after every frame.
+// Returns a pointer past the last frame.
+static uint8_t* applyGain(uint8_t* ptr, uint32_t samples, int32_t gain, int32_t step, bool stereo, uint8_t bps)
 {
-	// Only 16-bit audio is supported right now
-	if ((target_volume == current_volume && current_volume == 1) || bitsPerSample() != 16)
-		return;
-
-	int16_t* ptr = (int16_t*) samples_ptr;
-
-	if (isStereo())
-		samples *= 2;
-
-	if (current_volume != target_volume && target_volume_samples)
+	if (bps == 16)
 	{
-		while (true)
+		if (stereo)
 		{
-			if (!samples)
-				return;
+			uint32_t* ptr32 = (uint32_t*) ptr;
+			int32_t left, right;
 
-			if (!target_volume_samples)
+			while (samples--)
 			{
-				current_volume = target_volume;
-				break;
+				left = __SSAT(__SMULWB(gain, *ptr32), 16);
+				right = __SSAT(__SMULWT(gain, *ptr32), 16);
+				*ptr32++ = __PKHBT(left, right, 16);
+				gain += step;
 			}
 
-			// Linear? that's bad.
-			// TODO: use logarithmic volume
-			*ptr = (int16_t)((float) *ptr * current_volume);
-			ptr++;
-			samples--;
+			return (uint8_t*) ptr32;
+		}
 
-			if (isStereo())
-			{
-				*ptr = (int16_t)((float) *ptr * current_volume);
-				ptr++;
-				samples--;
-			}
+		int16_t* ptr16 = (int16_t*) ptr;
 
-			current_volume -= target_volume_step;
-			target_volume_samples--;
+		while (samples--)
+		{
+			*ptr16 = __SSAT(__SMULWB(gain, *ptr16), 16);
+			ptr16++;
+			gain += step;
 		}
+
+		return (uint8_t*) ptr16;
 	}
 
-	if (current_volume == 0)
+	uint8_t channels = stereo ? 2 : 1;
+
+	while (samples--)
 	{
-		memset(ptr, 0, samples * sizeof(int16_t));
-		return;
+		for (uint8_t i = 0; i < channels; i++)
+		{
+			writePCM24(ptr, __SSAT((int32_t) (((int64_t) readPCM24(ptr) * gain) >> 16), 24));
+			ptr += 3;
+		}
+
+		gain += step;
 	}
 
-	if (current_volume != 1)
+	return ptr;
+}
+
+void AudioSource::changeVolume(uint8_t* samples_ptr, uint32_t samples)
+{
+	// Only 16 and 24-bit audio are supported right now
+	if ((!ramp_samples && current_gain == VOLUME_UNITY_GAIN) ||
+		(bitsPerSample() != 16 && bitsPerSample() != 24))
+		return;
+
+	uint8_t* ptr = samples_ptr;
+	uint32_t count;
+
+	// Ramps advance in blocks of VOLUME_RAMP_BLOCK frames. The gain at the end of each block
+	// is calculated once, with a linear or a decibel (constant ratio) step, and interpolated
+	// linearly inside the block. The last block lands exactly on the target.
+	while (samples && ramp_samples)
 	{
-		while (samples)
+		if (!block_samples)
 		{
-			*ptr = (int16_t)((float) *ptr * current_volume);
-			ptr++;
-			samples--;
+			block_samples = min(ramp_samples, VOLUME_RAMP_BLOCK);
+
+			if (block_samples == ramp_samples)
+				block_gain_end = target_gain;
+			else if (volume_ramp == VolumeRampDecibel)
+				block_gain_end = (int32_t) (((int64_t) max(current_gain, VOLUME_DB_FLOOR_GAIN) * ramp_ratio) >> 28);
+			else
+				block_gain_end = current_gain + (int32_t) ((ramp_step * block_samples) >> 16);
+
+			block_gain_step = (block_gain_end - current_gain) / (int32_t) block_samples;
 		}
+
+		count = min(samples, block_samples);
+		ptr = applyGain(ptr, count, current_gain, block_gain_step, isStereo(), bitsPerSample());
+		current_gain += block_gain_step * (int32_t) count;
+		samples -= count;
+		block_samples -= count;
+		ramp_samples -= count;
+
+		if (!block_samples)
+			current_gain = block_gain_end;
+	}
+
+	if (!samples)
+		return;
+
+	if (current_gain == 0)
+	{
+		memset(ptr, 0, samples * sample_size);
+		return;
 	}
+
+	if (current_gain != VOLUME_UNITY_GAIN)
+		applyGain(ptr, samples, current_gain, 0, isStereo(), bitsPerSample());
 }
 
 void AudioSource::setVolume(float value)
 {
-	if (value == current_volume)
+	int32_t gain;
+	int32_t start = current_gain;
+	int32_t ratio = 0;
+	int64_t step = 0;
+	float blocks;
+
+	if (value < 0)
+		value = 0;
+
+	if (value > VOLUME_MAX)
+		value = VOLUME_MAX;
+
+	gain = (int32_t) (value * VOLUME_UNITY_GAIN);
+
+	// Ramp parameters are calculated here, so the mixing path only deals with integers
+	if (volume_ramp_length)
 	{
-		target_volume = value;
-		target_volume_samples = 0;
-		target_volume_step = 0;
-	} else {
-		__disable_irq();
-		if (playing())
+		if (volume_ramp == VolumeRampDecibel)
 		{
-			target_volume = value;
-			target_volume_samples = VOLUME_CHANGE_SAMPLES;
-			target_volume_step = (current_volume - value) / VOLUME_CHANGE_SAMPLES;
+			blocks = (float) ((volume_ramp_length + VOLUME_RAMP_BLOCK - 1) / VOLUME_RAMP_BLOCK);
+			float r = powf((float) max(gain, VOLUME_DB_FLOOR_GAIN) / (float) max(start, VOLUME_DB_FLOOR_GAIN), 1.0f / blocks);
+
+			// Q28 can't go past 8x per block. The last block snaps to the target anyway.
+			if (r > 7.99f)
+				r = 7.99f;
+
+			ratio = (int32_t) (r * (1 << 28));
 		} else {
-			target_volume = current_volume = value;
+			step = ((int64_t) (gain - start) << 16) / (int64_t) volume_ramp_length;
 		}
-		__enable_irq();
 	}
+
+	__disable_irq();
+	if (!playing() || !volume_ramp_length || gain == current_gain)
+	{
+		current_gain = target_gain = gain;
+		ramp_samples = block_samples = 0;
+	} else {
+		target_gain = gain;
+		ramp_ratio = ratio;
+		ramp_step = step;
+		ramp_samples = volume_ramp_length;
+		block_samples = 0;
+	}
+	__enable_irq();
+}
+
+void AudioSource::setVolumeRamp(uint32_t samples, VolumeRamp type)
+{
+	__disable_irq();
+	volume_ramp_length = samples;
+	volume_ramp = type;
+	__enable_irq();
+}
+
+void AudioSource::getStats(AUDIO_SOURCE_STATS* dst)
+{
+	__disable_irq();
+	memcpy(dst, &stats, sizeof(stats));
+	__enable_irq();
+}
+
+void AudioSource::resetStats()
+{
+	__disable_irq();
+	memset(&stats, 0, sizeof(stats));
+	__enable_irq();
+}
+
+void AudioSource::refillRequested()
+{
+	// A refill requested again before completing keeps the first request time
+	if (refill_pending)
+		return;
+
+	refill_request_time = micros();
+	refill_deadline = getRefillDeadline();
+	refill_pending = true;
+}
+
+bool AudioSource::refillCompleted()
+{
+	if (!refill_pending)
+		return false;
+
+	refill_pending = false;
+	stats.refill_time = micros() - refill_request_time;
+	stats.total_refill_time += stats.refill_time;
+	stats.refills++;
+
+	if (stats.refill_time > stats.max_refill_time)
+		stats.max_refill_time = stats.refill_time;
+
+	if (stats.refill_time > refill_deadline)
+		stats.deadline_misses++;
+
+	return true;
+}
+
+void AudioSource::samplesUnderrun(uint32_t samples)
+{
+	stats.underruns++;
+	stats.underrun_samples += samples;
 }
 
 UpdateResult AudioSource::update()
@@ -199,3 +337,27 @@ uint32_t AudioSource::getSamplesLeft()
 {
 	return 0;
 }
+
+uint32_t AudioSource::getRefillDeadline()
+{
+	// Time left, in uS, before a requested refill is too late. Sources that don't read
+	// from files don't need one.
+	return REFILL_NO_DEADLINE;
+}
+
+uint32_t AudioSource::samplesToUs(uint32_t samples)
+{
+	if (!sample_rate)
+		return 0;
+
+	return (uint32_t) (((uint64_t) samples * 1000000) / sample_rate);
+}
+
+uint8_t AudioSource::getNextSampleSpans(SAMPLE_SPAN* spans, uint32_t samples)
+{
+	// Sources that don't implement spans are mixed one sample at a time
+	// through getNextSamplePtr().
+	UNUSED(spans);
+	UNUSED(samples);
+	return 0;
+}
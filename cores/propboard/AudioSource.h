@@ -37,6 +37,13 @@
 #define MAX_UPDATE_BUFFER_SIZE		4096
 #define INVALID_VOLUME_VALUE		0xFF
 #define VOLUME_CHANGE_SAMPLES		512
+#define VOLUME_RAMP_BLOCK			32
+#define VOLUME_UNITY_GAIN			65536		// Q16
+#define VOLUME_MAX					32767.0f
+#define VOLUME_DB_FLOOR_GAIN		2			// ~ -90 dB, where decibel ramps start from/end to silence
+#define MAX_SAMPLE_SPANS			2
+#define REFILL_CHUNK_BYTES			2048		// Largest read done for a refill before checking other deadlines
+#define REFILL_NO_DEADLINE			0xFFFFFFFF
 
 enum AudioSourceStatus
 {
@@ -45,14 +52,39 @@ enum AudioSourceStatus
 	AudioSourcePaused
 };
 
+enum VolumeRamp
+{
+	VolumeRampLinear = 0,
+	VolumeRampDecibel
+};
+
 enum UpdateResult
 {
 	SourceIdling,
 	SourceUpdated,
+	SourceRefilling,				// Refill in progress, update() has to be called again
 	SourceRemove,
 	UpdateError
 };
 
+typedef struct _sample_span
+{
+	uint8_t* ptr;
+	uint32_t samples;
+} SAMPLE_SPAN;
+
+// Per-source counters, always kept. Times are in uS.
+typedef struct _audio_source_stats
+{
+	uint32_t refills;					// Refills completed after being requested by the mixing
+	uint32_t refill_time;				// Time from the last refill request to its completion
+	uint32_t max_refill_time;
+	uint32_t total_refill_time;
+	uint32_t underruns;					// Mixing periods the source had no samples for
+	uint32_t underrun_samples;
+	uint32_t deadline_misses;			// Refills completed after the samples left at the request ran out
+} AUDIO_SOURCE_STATS;
+
 class AudioSource;
 class PropAudio;
 
@@ -73,19 +105,29 @@ public:
 	virtual bool resume();
 	virtual UpdateResult update();
 	virtual uint32_t getSamplesLeft();
+	virtual uint32_t getRefillDeadline();
 	virtual inline void* getNextSamplePtr()			{ return NULL; }
+	virtual uint8_t getNextSampleSpans(SAMPLE_SPAN* spans, uint32_t samples);
 	virtual inline bool isStereo() 					{ return stereo; }
 	virtual inline uint32_t sampleRate() 			{ return sample_rate; }
 	virtual inline uint8_t bitsPerSample() 			{ return bits_per_sample; }
 	virtual inline AudioSourceStatus getStatus() 	{ return status; }
 	virtual inline bool playing() 					{ return status == AudioSourcePlaying; }
 	virtual inline uint32_t getSampleSize() 		{ return sample_size; }
-	virtual inline float getVolume() 				{ return current_volume; }
+	virtual inline float getVolume() 				{ return (float) current_gain / VOLUME_UNITY_GAIN; }
 	virtual void setVolume(float value);
+	void setVolumeRamp(uint32_t samples, VolumeRamp type = VolumeRampDecibel);
+	void getStats(AUDIO_SOURCE_STATS* dst);
+	void resetStats();
 
 protected:
 	
 	void changeVolume(uint8_t* samples_ptr, uint32_t samples);
+	void refillRequested();
+	bool refillCompleted();
+	inline void refillCancelled() { refill_pending = false; }
+	void samplesUnderrun(uint32_t samples);
+	uint32_t samplesToUs(uint32_t samples);
 	
 	virtual uint32_t mixingStarts(uint32_t samples) = 0;
 	virtual void mixingEnded(uint32_t samples) = 0;
@@ -99,15 +141,27 @@ protected:
 	uint8_t bits_per_sample;
 	uint32_t sample_rate;
 	uint8_t sample_size;
-	float current_volume;
-	float target_volume;
-	float target_volume_step;
-	uint32_t target_volume_samples;
+	int32_t current_gain;				// Q16
+	int32_t target_gain;				// Q16
+	int32_t block_gain_step;			// Per-sample step inside the current ramp block
+	int32_t block_gain_end;				// Gain at the end of the current ramp block
+	int64_t ramp_step;					// Per-sample step, Q16 of a Q16 gain (linear ramps)
+	int32_t ramp_ratio;					// Per-block ratio, Q28 (decibel ramps)
+	uint32_t ramp_samples;				// Samples left in the ramp
+	uint32_t block_samples;				// Samples left in the current ramp block
+	uint32_t volume_ramp_length;
+	VolumeRamp volume_ramp;
 	volatile AudioSourceStatus status;
+	AUDIO_SOURCE_STATS stats;
 
 private:
 	AudioSource* next_to_mix;
 	AudioSource* next_in_list;
+	uint32_t mixing_samples;
+	bool refilled;						// Serviced by the refill scheduler in the current update()
+	uint32_t refill_request_time;
+	uint32_t refill_deadline;
+	volatile bool refill_pending;
 };
 
 #endif /* __AUDIOSOURCE_H__ */
@@ -29,7 +29,48 @@
 
 #include <stm32f4xx.h>
 
+// Signed 32 x 16-bit multiply, returning the upper 32 bits of the 48-bit product.
+// Not part of CMSIS. Used to apply Q16 gains to 16-bit samples.
+#if defined(__arm__)
+static inline int32_t __SMULWB(int32_t op1, uint32_t op2)
+{
+	int32_t result;
+	__ASM volatile ("smulwb %0, %1, %2" : "=r" (result) : "r" (op1), "r" (op2));
+	return result;
+}
+
+static inline int32_t __SMULWT(int32_t op1, uint32_t op2)
+{
+	int32_t result;
+	__ASM volatile ("smulwt %0, %1, %2" : "=r" (result) : "r" (op1), "r" (op2));
+	return result;
+}
+#else
+static inline int32_t __SMULWB(int32_t op1, uint32_t op2)
+{
+	return (int32_t) (((int64_t) op1 * (int16_t) op2) >> 16);
+}
+
+static inline int32_t __SMULWT(int32_t op1, uint32_t op2)
+{
+	return (int32_t) (((int64_t) op1 * (int16_t) (op2 >> 16)) >> 16);
+}
+#endif
+
 void PCM16ToFloat(int16_t* src, float* dst, uint32_t samples);
 void floatToPCM16(float* src, int16_t* dst, uint32_t samples);
 
+// Packed 3-byte little-endian samples, as found in 24-bit WAV files
+static inline int32_t readPCM24(uint8_t* ptr)
+{
+	return (int32_t) ((ptr[0] << 8) | (ptr[1] << 16) | (ptr[2] << 24)) >> 8;
+}
+
+static inline void writePCM24(uint8_t* ptr, int32_t value)
+{
+	ptr[0] = (uint8_t) value;
+	ptr[1] = (uint8_t) (value >> 8);
+	ptr[2] = (uint8_t) (value >> 16);
+}
+
 #endif /* __AUDIOUTIL_H__ */
@@ -0,0 +1,305 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### MemoryPlayer.cpp
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+#include "PropAudio.h"
+#include "MemoryPlayer.h"
+#include "Arduino.h"
+#include <string.h>
+#include <stdlib.h>
+
+MemoryPlayer::MemoryPlayer()
+{
+	clip = NULL;
+	data = NULL;
+	total_samples = position = cursor = 0;
+	play_mode = PlayModeNormal;
+	finished = true;
+	scratch_alloc = scratch = block_ptr = NULL;
+	scratch_samples = block_samples = 0;
+}
+
+MemoryPlayer::~MemoryPlayer()
+{
+	end();
+}
+
+bool MemoryPlayer::begin()
+{
+	uint32_t samples = Audio.getOutputSamples();
+
+	if (!samples)
+		return false;
+
+	if (scratch_alloc && samples == scratch_samples)
+		return true;
+
+	if (status != AudioSourceStopped)
+		return false;
+
+	if (scratch_alloc)
+		free(scratch_alloc);
+
+	// Room for one output buffer of the largest sample size
+	scratch_alloc = (uint8_t*) malloc(samples * MAX_BYTES_PER_SAMPLE * MAX_SOURCE_CHANNELS + 4);
+	if (!scratch_alloc)
+	{
+		scratch = NULL;
+		scratch_samples = 0;
+		return false;
+	}
+
+	scratch = scratch_alloc;
+	if ((uintptr_t) scratch & 0x03)
+		scratch += (4 - ((uintptr_t) scratch & 0x03));
+
+	scratch_samples = samples;
+	return true;
+}
+
+void MemoryPlayer::end()
+{
+	stop();
+
+	if (scratch_alloc)
+		free(scratch_alloc);
+
+	scratch_alloc = scratch = NULL;
+	scratch_samples = 0;
+}
+
+bool MemoryPlayer::play(AudioClipCache* cache, const char* filename, PlayMode mode)
+{
+	return play(cache->get(filename), mode);
+}
+
+bool MemoryPlayer::playRandom(AudioClipCache* cache, const char* filename, uint32_t min, uint32_t max, PlayMode mode)
+{
+	return play(cache->getRandom(filename, min, max), mode);
+}
+
+bool MemoryPlayer::play(CACHED_CLIP* clip, PlayMode mode)
+{
+	if (status != AudioSourceStopped)
+		stop();
+
+	if (!clip || !begin())
+		return false;
+
+	// Keep the clip in the cache while it plays
+	AudioClipCache::acquire(clip);
+	this->clip = clip;
+
+	if (!doPlay(clip->data, clip->samples, clip->sample_rate, clip->bits_per_sample, !clip->stereo, mode))
+	{
+		stop();
+		return false;
+	}
+
+	return true;
+}
+
+bool MemoryPlayer::play(const void* data, uint32_t samples, uint32_t fs, uint8_t bps, bool mono, PlayMode mode)
+{
+	if (status != AudioSourceStopped)
+		stop();
+
+	return doPlay(data, samples, fs, bps, mono, mode);
+}
+
+bool MemoryPlayer::doPlay(const void* data, uint32_t samples, uint32_t fs, uint8_t bps, bool mono, PlayMode mode)
+{
+	if (!data || !samples || !begin())
+		return false;
+
+	AudioSource::begin(fs, bps, mono);
+
+	this->data = (const uint8_t*) data;
+	total_samples = samples;
+	position = 0;
+	play_mode = mode;
+	finished = false;
+	block_ptr = NULL;
+	block_samples = 0;
+
+	if (!AudioSource::play())
+		return false;
+
+	if (play_mode == PlayModeBlocking)
+		while (playing());
+
+	return true;
+}
+
+bool MemoryPlayer::replay()
+{
+	if (status == AudioSourceStopped)
+		return false;
+
+	__disable_irq();
+	position = 0;
+	finished = false;
+	__enable_irq();
+
+	return true;
+}
+
+bool MemoryPlayer::stop()
+{
+	AudioSource::stop();
+
+	if (clip)
+	{
+		AudioClipCache::release(clip);
+		clip = NULL;
+	}
+
+	return true;
+}
+
+UpdateResult MemoryPlayer::update()
+{
+	// Nothing to refill, only remove ourselves when the clip is over
+	return finished ? SourceRemove : SourceUpdated;
+}
+
+const char* MemoryPlayer::getFileName()
+{
+	return clip ? clip->name : NULL;
+}
+
+uint32_t MemoryPlayer::getSamplesLeft()
+{
+	return block_samples;
+}
+
+void* MemoryPlayer::getNextSamplePtr()
+{
+	void* ret;
+
+	if (block_ptr)
+	{
+		ret = block_ptr;
+		block_ptr += sample_size;
+		return ret;
+	}
+
+	ret = (void*) (data + cursor * sample_size);
+	if (++cursor == total_samples)
+		cursor = 0;
+
+	return ret;
+}
+
+uint8_t MemoryPlayer::getNextSampleSpans(SAMPLE_SPAN* spans, uint32_t samples)
+{
+	uint32_t first;
+
+	if (block_ptr)
+	{
+		spans->ptr = block_ptr;
+		spans->samples = samples;
+		block_ptr += samples * sample_size;
+		return 1;
+	}
+
+	// Straight from memory, in two pieces when a loop wraps
+	first = min(samples, total_samples - cursor);
+	spans[0].ptr = (uint8_t*) (data + cursor * sample_size);
+	spans[0].samples = first;
+	cursor += first;
+	if (cursor == total_samples)
+		cursor = 0;
+
+	if (first == samples)
+		return 1;
+
+	spans[1].ptr = (uint8_t*) data;
+	spans[1].samples = samples - first;
+	cursor = samples - first;
+	return 2;
+}
+
+uint32_t MemoryPlayer::mixingStarts(uint32_t samples)
+{
+	uint32_t count, left;
+	uint8_t* dst;
+
+	block_ptr = NULL;
+	block_samples = 0;
+
+	if (finished)
+		return 0;
+
+	cursor = position;
+
+	if (play_mode != PlayModeLoop)
+		samples = min(samples, total_samples - position);
+
+	// Memory is shared and read-only, so the volume is applied on a copy
+	if (ramp_samples || current_gain != VOLUME_UNITY_GAIN)
+	{
+		samples = min(samples, scratch_samples);
+		dst = scratch;
+		left = samples;
+
+		while (left)
+		{
+			count = min(left, total_samples - cursor);
+			memcpy(dst, data + cursor * sample_size, count * sample_size);
+			dst += count * sample_size;
+			left -= count;
+			cursor += count;
+			if (cursor == total_samples)
+				cursor = 0;
+		}
+
+		changeVolume(scratch, samples);
+		block_ptr = scratch;
+	}
+
+	block_samples = samples;
+	return samples;
+}
+
+void MemoryPlayer::mixingEnded(uint32_t samples)
+{
+	uint32_t new_position = position + samples;
+
+	block_samples = 0;
+
+	if (new_position >= total_samples)
+	{
+		if (play_mode == PlayModeLoop)
+		{
+			new_position %= total_samples;
+		} else {
+			new_position = total_samples;
+			finished = true;
+			Audio.triggerUpdate();
+		}
+	}
+
+	position = new_position;
+}
@@ -0,0 +1,79 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### MemoryPlayer.h
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+#ifndef __MEMORYPLAYER_H__
+#define __MEMORYPLAYER_H__
+
+#include <stm32f4xx.h>
+#include "AudioSource.h"
+#include "AudioClipCache.h"
+#include "RawPlayer.h"
+
+// Plays samples already in memory: clips from an AudioClipCache or any buffer in RAM/flash.
+// There's no file access and no allocation after begin(), so a sound starts in the next
+// mixing period. Samples are mixed straight from memory at unity gain, and copied to a
+// scratch buffer to apply the volume otherwise.
+class MemoryPlayer : public AudioSource
+{
+public:
+	MemoryPlayer();
+	~MemoryPlayer();
+
+	bool begin();
+	void end();
+	bool play(AudioClipCache* cache, const char* filename, PlayMode mode = PlayModeNormal);
+	bool playRandom(AudioClipCache* cache, const char* filename, uint32_t min, uint32_t max, PlayMode mode = PlayModeNormal);
+	bool play(CACHED_CLIP* clip, PlayMode mode = PlayModeNormal);
+	bool play(const void* data, uint32_t samples, uint32_t fs, uint8_t bps, bool mono, PlayMode mode = PlayModeNormal);
+	bool replay();
+	bool stop();
+	UpdateResult update();
+
+	const char* getFileName();
+	uint32_t getSamplesLeft();
+	void* getNextSamplePtr();
+	uint8_t getNextSampleSpans(SAMPLE_SPAN* spans, uint32_t samples);
+
+protected:
+	uint32_t mixingStarts(uint32_t samples);
+	void mixingEnded(uint32_t samples);
+	bool doPlay(const void* data, uint32_t samples, uint32_t fs, uint8_t bps, bool mono, PlayMode mode);
+
+	CACHED_CLIP* clip;
+	const uint8_t* data;
+	uint32_t total_samples;
+	volatile uint32_t position;
+	uint32_t cursor;					// getNextSamplePtr() position inside the clip
+	PlayMode play_mode;
+	volatile bool finished;
+
+	uint8_t* scratch_alloc;
+	uint8_t* scratch;
+	uint32_t scratch_samples;
+	uint8_t* block_ptr;					// Volume scaled samples, NULL when mixing from memory
+	uint32_t block_samples;
+};
+
+#endif /* __MEMORYPLAYER_H__ */
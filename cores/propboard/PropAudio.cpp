@@ -26,8 +26,8 @@
 
 #include "Arduino.h"
 #include <string.h>
-
-extern uint8_t fs_busy(void);
+#include "AudioUtil.h"
+#include <diskio.h>
 
 #define MIN(a,b) ((a) < (b) ? a : b)
 #define MAX(a,b) ((a) > (b) ? a : b)
@@ -40,15 +40,30 @@ PropAudio::PropAudio()
 	analyze_callback = NULL;
 	mix_callback = NULL;
 	sources_list = NULL;
+	effects_list = NULL;
+	effect_buffer = NULL;
 	initialized = false;
 	playing = false;
 	sending_mclk = false;
-	play_buffer = update_buffer = NULL;
+	play_buffer = NULL;
+	buffer_count = min_buffers = active_buffers = 0;
+	play_index = ready_count = dma_queued = 0;
+	output_mode = OutputModeNormal;
+	silence_buffer = NULL;
+	adaptive = false;
+	deferred_mixing = true;
+	mix_priority = VARIANT_PRIO_AUDIO_MIX;
+	period_us = 0;
+	mix_budget_us = 0;
+	period_start = 0;
+	clean_periods = 0;
 	bits_per_sample = 0;
 	sample_rate = 0;
 	update_pending = false;
 	idling = false;
 	source_count = 0;
+	memset(&perf_stats, 0, sizeof(perf_stats));
+	perf_stats.min_mix_slack = INT32_MAX;
 
 #if AUDIO_STATS
 	miss_count = 0;
@@ -62,7 +77,7 @@ PropAudio::PropAudio()
 	update_tick = 0;
 #endif // AUDIO_STATS
 
-	buffer1 = buffer2 = NULL;;
+	buffer_memory = NULL;
 	buffer_size = 0;
 }
 
@@ -70,38 +85,61 @@ PropAudio::~PropAudio()
 {
 }
 
-bool PropAudio::begin(uint32_t fs, uint8_t bps, bool async)
+bool PropAudio::begin(uint32_t fs, uint8_t bps, bool async, uint32_t latency_us, uint8_t buffers,
+					  uint8_t max_buffers)
 {
 	if (initialized)
 		return true;
 
-	sample_rate = fs;
-	bits_per_sample = bps;
+	// In double-buffer mode the DMA holds two buffers, so deferred mixing needs a third one
+	if (output_mode == OutputModeDoubleBuffer && deferred_mixing && buffers < 3)
+		buffers = 3;
 
-	if (!allocateOutputBuffers())
+	if (buffers < MIN_OUTPUT_BUFFERS || buffers > MAX_OUTPUT_BUFFERS || max_buffers > MAX_OUTPUT_BUFFERS)
 		return false;
 
-	output_buffers[0].buffer = (uint32_t*) buffer1;
-
-	if ((uint32_t) buffer1 & 0x03)
-		output_buffers[0].buffer = (uint32_t*) ((uint8_t*) output_buffers[0].buffer + (4 - ((uint32_t) buffer1 & 0x03)));
+	sample_rate = fs;
+	bits_per_sample = bps;
 
-	output_buffers[1].buffer = (uint32_t*) buffer2;
+	// A max_buffers greater than buffers enables the adaptive ring, that grows up to max_buffers
+	// when buffers are not ready in time and shrinks back when playback stays clean
+	adaptive = (max_buffers > buffers);
+	min_buffers = active_buffers = buffers;
 
-	if ((uint32_t) buffer2 & 0x03)
-		output_buffers[1].buffer = (uint32_t*) ((uint8_t*) output_buffers[1].buffer + (4 - ((uint32_t) buffer2 & 0x03)));
+	if (!allocateOutputBuffers(latency_us, adaptive ? max_buffers : buffers))
+		return false;
 
+	play_index = 0;
+	ready_count = 0;
+	dma_queued = 0;
+	clean_periods = 0;
 	play_buffer = &output_buffers[0];
-	update_buffer = &output_buffers[1];
+	play_buffer->ready = false;
+	period_us = (output_samples * 1000000) / sample_rate;
+
+	// Effects added before begin() get the sample rate now. One that can't work at this
+	// rate stays in the chain, disabled.
+	for (AudioEffect* effect = effects_list; effect; effect = effect->getNextInChain())
+	{
+		if (!effect->begin(fs))
+			effect->setEnabled(false);
+	}
 
 	// Configure PendSV to the lowest priority
 	NVIC_SetPriority(PendSV_IRQn, VARIANT_PRIO_PENDSV);
 	NVIC_EnableIRQ(PendSV_IRQn);
 
+	// Configure the mixing interrupt
+	NVIC_SetPriority(AUDIO_MIX_IRQn, mix_priority);
+	NVIC_EnableIRQ(AUDIO_MIX_IRQn);
+
 	if (!initI2S(fs, bps))
 		return false;
 
-	onI2STxFinished();
+	if (output_mode == OutputModeDoubleBuffer)
+		startDoubleBufferDMA();
+	else
+		onI2STxFinished();
 
 	if (!initCodec())
 		return false;
@@ -130,7 +168,11 @@ void PropAudio::end()
 		// Disable DMA1 Stream4 Transmission Complete interrupt
 		DMA_ITConfig(DMA1_Stream4, DMA_IT_TC, DISABLE);
 
+		// Stop the stream, it may be running in circular (double-buffer) mode
+		DMA1_Stream4->CR &= ~DMA_SxCR_EN;
+
 		NVIC_DisableIRQ(DMA1_Stream4_IRQn);
+		NVIC_DisableIRQ(AUDIO_MIX_IRQn);
 
 		SPI_I2S_DMACmd(SPI2, SPI_I2S_DMAReq_Tx, DISABLE);
 
@@ -154,45 +196,73 @@ void PropAudio::end()
 	}
 }
 
-bool PropAudio::allocateOutputBuffers()
+bool PropAudio::allocateOutputBuffers(uint32_t latency_us, uint8_t count)
 {
+	uint8_t* ptr;
+
 	// Calculate output samples according to the target latency
-	output_samples = (TARGET_LATENCY_US * sample_rate) / 1000000;
+	output_samples = (latency_us * sample_rate) / 1000000;
+
+	// The DMA transfers up to 65535 half-words
+	if (!output_samples || output_samples * (getOutputFrameSize() / 2) > 0xFFFF)
+		return false;
 
-	// Allocate two stereo buffers (and padding)
-	uint32_t needed = output_samples * 2 * (bits_per_sample / 8) + 16;
+	// Allocate all the stereo buffers in one block (and padding). Double-buffer mode
+	// takes an extra one, to play silence from.
+	uint32_t buffer_bytes = output_samples * getOutputFrameSize();
+	uint8_t extra = (output_mode == OutputModeDoubleBuffer) ? 1 : 0;
+	uint32_t effect_bytes = (bits_per_sample <= 16) ? output_samples * 2 * sizeof(int16_t) : 0;
+	uint32_t needed = buffer_bytes * (count + extra) + effect_bytes + 16;
 
-	if (buffer_size == needed)
-		return true;
+	if (buffer_size != needed)
+	{
+		deallocateOutputBuffers();
 
-	deallocateOutputBuffers();
+		buffer_memory = (uint8_t*) malloc(needed);
+		if (!buffer_memory)
+			return false;
 
-	buffer1 = (uint8_t*) malloc(needed);
-	if (!buffer1)
-		return false;
+		buffer_size = needed;
+	}
+
+	ptr = buffer_memory;
+	if ((uintptr_t) ptr & 0x03)
+		ptr += 4 - ((uintptr_t) ptr & 0x03);
 
-	buffer2 = (uint8_t*) malloc(needed);
-	if (!buffer2)
+	for (uint8_t i = 0; i < count; i++)
 	{
-		free(buffer1);
-		return false;
+		output_buffers[i].buffer = (uint32_t*) (ptr + buffer_bytes * i);
+		output_buffers[i].buffer_samples = output_samples;
+		output_buffers[i].mixed_samples = 0;
+		output_buffers[i].ready = false;
 	}
 
-	buffer_size = needed;
+	silence_buffer = NULL;
+	if (extra)
+	{
+		silence_buffer = (uint32_t*) (ptr + buffer_bytes * count);
+		memset(silence_buffer, 0, buffer_bytes);
+	}
+
+	// Effects work on the left and right channels apart
+	effect_buffer = NULL;
+	if (effect_bytes)
+		effect_buffer = (int16_t*) (ptr + buffer_bytes * (count + extra));
+
+	buffer_count = count;
 	return true;
 }
 
 void PropAudio::deallocateOutputBuffers()
 {
-	if (buffer1)
-		free(buffer1);
-
-	if (buffer2)
-		free(buffer2);
+	if (buffer_memory)
+		free(buffer_memory);
 
 	buffer_size = 0;
-	buffer1 = NULL;
-	buffer2 = NULL;
+	buffer_count = 0;
+	buffer_memory = NULL;
+	silence_buffer = NULL;
+	effect_buffer = NULL;
 }
 
 bool PropAudio::initCodec()
@@ -286,7 +356,7 @@ bool PropAudio::initI2S(uint32_t fs, uint8_t bps)
 		case 8:
 		case 16:
 			I2S_InitStruct.I2S_DataFormat = I2S_DataFormat_16bextended;
-			mix_callback = mix16Multipass;
+			mix_callback = mix16SinglePass;
 			break;
 			
 		case 24:
@@ -302,7 +372,7 @@ bool PropAudio::initI2S(uint32_t fs, uint8_t bps)
 
 	// DMA
 	DMA_InitStruct.DMA_Channel = DMA_Channel_0;
-	DMA_InitStruct.DMA_PeripheralBaseAddr = (uint32_t) &SPI2->DR;
+	DMA_InitStruct.DMA_PeripheralBaseAddr = (uint32_t) (uintptr_t) &SPI2->DR;
 	DMA_InitStruct.DMA_Memory0BaseAddr = (uint32_t) 0; 		// to be filled in PropAudio::startDMA()
 	DMA_InitStruct.DMA_DIR = DMA_DIR_MemoryToPeripheral;
 	DMA_InitStruct.DMA_BufferSize = (uint32_t) 0;			// to be filled in PropAudio::startDMA()
@@ -339,37 +409,133 @@ void PropAudio::triggerUpdate()
 	__enable_irq();
 }
 
+static inline void histogramAdd(AUDIO_HISTOGRAM* histogram, uint32_t us)
+{
+	uint32_t bin = 32 - __CLZ(us / AUDIO_HISTOGRAM_BASE_US);
+
+	if (bin >= AUDIO_HISTOGRAM_BINS)
+		bin = AUDIO_HISTOGRAM_BINS - 1;
+
+	histogram->bins[bin]++;
+	if (us > histogram->max)
+		histogram->max = us;
+}
+
+void PropAudio::updateSource(AudioSource* source)
+{
+	uint32_t misses = source->stats.deadline_misses;
+	UpdateResult result = source->update();
+
+	perf_stats.deadline_misses += source->stats.deadline_misses - misses;
+	if (source->stats.max_refill_time > perf_stats.max_refill_gap)
+		perf_stats.max_refill_gap = source->stats.max_refill_time;
+
+	if (result == SourceRemove || result == UpdateError)
+		source->stop();
+}
+
 void PropAudio::update()
 {
-	AudioSource* ptr = sources_list;
+	AudioSource* ptr;
 	AudioSource* next;
-	UpdateResult result;
+	AudioSource* urgent;
+	uint32_t deadline;
+	uint32_t urgent_deadline;
+	uint32_t chunks = 0;
+	uint32_t start = micros();
 
-	AUDIO_STAT(update_tick = micros());
+	AUDIO_STAT(update_tick = start);
 
-	while (ptr)
+	for (ptr = sources_list; ptr; ptr = ptr->getNextInList())
+		ptr->refilled = false;
+
+	// Pending refills first, earliest deadline first. Sources read at most REFILL_CHUNK_BYTES
+	// per update() call and the deadlines are checked again after each read, so a refill
+	// requested by the mixing meanwhile doesn't wait behind a long one.
+	while (true)
 	{
-		next = ptr->getNextInList();
+		urgent = NULL;
+		urgent_deadline = REFILL_NO_DEADLINE;
+
+		for (ptr = sources_list; ptr; ptr = ptr->getNextInList())
+		{
+			if (!ptr->playing())
+				continue;
+
+			deadline = ptr->getRefillDeadline();
+			if (deadline < urgent_deadline)
+			{
+				urgent = ptr;
+				urgent_deadline = deadline;
+			}
+		}
+
+		if (!urgent)
+			break;
 
-		if (ptr->playing())
+		if (chunks == MAX_REFILL_CHUNKS)
 		{
-			result = ptr->update();
-			if (result == SourceRemove || result == UpdateError)
-				ptr->stop();
+			// Let the thread code run, we'll be back
+			triggerUpdate();
+			break;
 		}
 
+		urgent->refilled = true;
+		updateSource(urgent);
+		chunks++;
+	}
+
+	perf_stats.refill_chunks += chunks;
+
+	// Then the ones that weren't refilled, once
+	ptr = sources_list;
+	while (ptr)
+	{
+		next = ptr->getNextInList();
+
+		if (ptr->playing() && !ptr->refilled && ptr->getRefillDeadline() == REFILL_NO_DEADLINE)
+			updateSource(ptr);
+
 		ptr = next;
 	}
 
+	histogramAdd(&perf_stats.update_time, micros() - start);
 	AUDIO_STAT(update_time = micros() - update_tick);
 }
 
+void PropAudio::getStats(AUDIO_PERF_STATS* dst)
+{
+	__disable_irq();
+	memcpy(dst, &perf_stats, sizeof(perf_stats));
+	__enable_irq();
+}
+
+void PropAudio::resetStats()
+{
+	AudioSource* ptr;
+
+	__disable_irq();
+	memset(&perf_stats, 0, sizeof(perf_stats));
+	perf_stats.min_mix_slack = INT32_MAX;
+	perf_stats.reset_time = millis();
+
+	for (ptr = sources_list; ptr; ptr = ptr->getNextInList())
+		memset(&ptr->stats, 0, sizeof(ptr->stats));
+	__enable_irq();
+}
+
+OUTPUT_BUFFER* PropAudio::getQueuedBuffer(uint8_t position)
+{
+	return &output_buffers[(play_index + position) % buffer_count];
+}
+
 void PropAudio::mix()
 {
 	AudioSource* ptr = sources_list;
 	AudioSource* mix_list = NULL;
-
-	update_buffer->ready = false;
+	OUTPUT_BUFFER* buffer;
+	uint32_t start;
+	bool mixed;
 
 	while (ptr)
 	{
@@ -382,20 +548,96 @@ void PropAudio::mix()
 		ptr = ptr->getNextInList();
 	}
 
-	if (mix_list)
+	if (!mix_list)
+		return;
+
+	// Mix ahead until the ring is full. Stop early if the sources couldn't fill a buffer,
+	// so they get refilled before going on.
+	while (dma_queued + ready_count < active_buffers - 1)
 	{
-		update_buffer->buffer_samples = output_samples;
-		update_buffer->mixed_samples = 0;
-		if ((mix_callback)(update_buffer, mix_list))
+		buffer = getQueuedBuffer(dma_queued + ready_count + 1);
+		buffer->ready = false;
+		buffer->buffer_samples = output_samples;
+		buffer->mixed_samples = 0;
+
+		start = micros();
+		mixed = (mix_callback)(buffer, mix_list);
+		histogramAdd(&perf_stats.mix_time, micros() - start);
+
+		if (!mixed || !buffer->mixed_samples)
+			break;
+
+		if (effects_list)
+			applyEffects(buffer);
+
+		if (analyze_callback)
+			(analyze_callback)(buffer);
+
+		// The DMA interrupt may move through the ring while mixing. Positions shift along
+		// with it, so the buffer is still the next one after the ready ones.
+		buffer->ready = true;
+		__disable_irq();
+		ready_count++;
+		__enable_irq();
+
+		if (buffer->mixed_samples < buffer->buffer_samples)
+			break;
+	}
+}
+
+void PropAudio::applyEffects(OUTPUT_BUFFER* buffer)
+{
+	AudioEffect* effect;
+	int16_t* left = effect_buffer;
+	int16_t* right = effect_buffer + output_samples;
+	uint32_t samples = buffer->mixed_samples;
+	uint32_t start;
+	bool split = false;
+
+	if (!effect_buffer)
+		return;
+
+	for (effect = effects_list; effect; effect = effect->getNextInChain())
+	{
+		if (!effect->enabled)
+			continue;
+
+		// Frames are L in the lower half-word and R in the upper one
+		if (!split)
 		{
-			if (analyze_callback)
-				(analyze_callback)(update_buffer);
+			for (uint32_t i = 0; i < samples; i++)
+			{
+				left[i] = (int16_t) buffer->buffer[i];
+				right[i] = (int16_t) (buffer->buffer[i] >> 16);
+			}
 
-			if (update_buffer->mixed_samples)
-				update_buffer->ready = true;
-			else
-				update_buffer->ready = false;
+			split = true;
 		}
+
+		start = micros();
+		effect->process(left, right, samples);
+		effect->accountTime(micros() - start);
+	}
+
+	if (split)
+	{
+		for (uint32_t i = 0; i < samples; i++)
+			buffer->buffer[i] = __PKHBT(left[i], right[i], 16);
+	}
+}
+
+void PropAudio::adaptBuffers(bool missed)
+{
+	if (missed)
+	{
+		clean_periods = 0;
+		if (active_buffers < buffer_count)
+			active_buffers++;
+	} else if (active_buffers > min_buffers && ++clean_periods >= ADAPTIVE_SHRINK_PERIODS)
+	{
+		// Queued buffers past the new size are played normally, the ring just mixes less ahead
+		clean_periods = 0;
+		active_buffers--;
 	}
 }
 
@@ -405,38 +647,78 @@ void PropAudio::onI2STxFinished()
 	AUDIO_STAT(irq_interval_time = micros());
 	AUDIO_STAT(if (irq_interval >= max_irq_interval) max_irq_interval = irq_interval);
 
-	if (update_buffer->ready)
+	period_start = micros();
+
+	if (output_mode == OutputModeDoubleBuffer)
+	{
+		onDoubleBufferTxFinished();
+		return;
+	}
+
+	if (ready_count)
 	{
-		// Switch buffers
-		switchBuffers();
+		// Advance to the next buffer in the ring
+		play_buffer->ready = false;
+		play_index = (play_index + 1) % buffer_count;
+		play_buffer = &output_buffers[play_index];
+		ready_count--;
 
 		AUDIO_STAT(if (idling && source_count && miss_start) miss_time = GetTickCount() - miss_start);
 		idling = false;
+
+		if (adaptive && source_count)
+			adaptBuffers(false);
 	} else {
 		if (!idling)
 		{
+			if (source_count)
+				perf_stats.underruns++;
+
 			AUDIO_STAT(if (source_count) miss_count++);
 			AUDIO_STAT(if (source_count) miss_start = GetTickCount());
-			memset(play_buffer->buffer, 0, (sample_rate / 1000) * (bits_per_sample / 8) * 2);
-			play_buffer->mixed_samples = sample_rate / 1000;
+			memset(play_buffer->buffer, 0, output_samples * getOutputFrameSize());
+			play_buffer->mixed_samples = output_samples;
 			idling = true;
+
+			if (adaptive && source_count)
+				adaptBuffers(true);
 		}
 	}
 
 	// Send current playing buffer
 	startDMA(play_buffer);
 
-	// Mix the updating buffer
-	mix();
+	// Mix the free buffers
+	if (deferred_mixing)
+		requestMix();
+	else
+		mix();
 }
 
-void PropAudio::switchBuffers()
+void PropAudio::requestMix()
 {
-	OUTPUT_BUFFER* ptr;
-	
-	ptr = play_buffer;
-	play_buffer = update_buffer;
-	update_buffer = ptr;
+	NVIC_SetPendingIRQ(AUDIO_MIX_IRQn);
+}
+
+void PropAudio::runDeferredMix()
+{
+	uint32_t start = micros();
+
+	mix();
+
+	// Time left until the next DMA transfer completes, and time taken compared to the budget
+	uint32_t end = micros();
+	int32_t slack = (int32_t) period_us - (int32_t) (end - period_start);
+	uint32_t budget = mix_budget_us ? mix_budget_us : (period_us * MIX_BUDGET_PERCENT) / 100;
+
+	if (slack < perf_stats.min_mix_slack)
+		perf_stats.min_mix_slack = slack;
+
+	if (slack < 0)
+		perf_stats.mix_deadline_misses++;
+
+	if (end - start > budget)
+		perf_stats.mix_budget_warnings++;
 }
 
 void PropAudio::startDMA(OUTPUT_BUFFER* output_buffer)
@@ -447,9 +729,9 @@ void PropAudio::startDMA(OUTPUT_BUFFER* output_buffer)
 
 	// Configure source, destination and size
 	DMA1->HIFCR = 0x3D;
-	DMA1_Stream4->M0AR = (uint32_t) output_buffer->buffer;
-	DMA1_Stream4->PAR = (uint32_t) &SPI2->DR;
-	DMA1_Stream4->NDTR = output_buffer->mixed_samples * 2;
+	DMA1_Stream4->M0AR = (uint32_t) (uintptr_t) output_buffer->buffer;
+	DMA1_Stream4->PAR = (uint32_t) (uintptr_t) &SPI2->DR;
+	DMA1_Stream4->NDTR = output_buffer->mixed_samples * (getOutputFrameSize() / 2);
 
 	// Enable DMA
 	DMA1_Stream4->FCR = 0;
@@ -460,6 +742,147 @@ void PropAudio::startDMA(OUTPUT_BUFFER* output_buffer)
 	AUDIO_STAT(samples_played += output_buffer->mixed_samples);
 }
 
+void PropAudio::startDoubleBufferDMA()
+{
+	// Both DMA targets start with silence. The stream then runs on its own, switching
+	// between M0AR and M1AR. Each interrupt re-points the idle one to the next buffer.
+	play_index = 0;
+	play_buffer = &output_buffers[0];
+	dma_queued = 0;
+	ready_count = 0;
+	idling = true;
+
+	// Disable DMA
+	DMA1_Stream4->CR = 0;
+	SPI2->CR2 &= (uint16_t)~SPI_I2S_DMAReq_Tx;
+
+	// Configure both targets, destination and size
+	DMA1->HIFCR = 0x3D;
+	DMA1_Stream4->M0AR = (uint32_t) (uintptr_t) silence_buffer;
+	DMA1_Stream4->M1AR = (uint32_t) (uintptr_t) silence_buffer;
+	DMA1_Stream4->PAR = (uint32_t) (uintptr_t) &SPI2->DR;
+	DMA1_Stream4->NDTR = output_samples * (getOutputFrameSize() / 2);
+
+	// Enable DMA in circular double-buffer mode, starting with M0AR
+	DMA1_Stream4->FCR = 0;
+	DMA1_Stream4->CR |= DMA_SxCR_EN | DMA_SxCR_MSIZE_0 | DMA_SxCR_DIR_0 | DMA_SxCR_PSIZE_0 | DMA_SxCR_MINC |
+						DMA_SxCR_TCIE | DMA_SxCR_DBM | DMA_SxCR_CIRC;
+
+	SPI2->CR2 |= SPI_I2S_DMAReq_Tx;
+}
+
+void PropAudio::armDMA(OUTPUT_BUFFER* output_buffer)
+{
+	uint32_t* buffer = silence_buffer;
+
+	if (output_buffer)
+	{
+		// The transfer size is fixed in this mode, pad short buffers with silence
+		if (output_buffer->mixed_samples < output_samples)
+		{
+			memset((uint8_t*) output_buffer->buffer + output_buffer->mixed_samples * getOutputFrameSize(), 0,
+				   (output_samples - output_buffer->mixed_samples) * getOutputFrameSize());
+			output_buffer->mixed_samples = output_samples;
+		}
+
+		buffer = output_buffer->buffer;
+	}
+
+	// Only the target the DMA is not using can be written
+	if (DMA1_Stream4->CR & DMA_SxCR_CT)
+		DMA1_Stream4->M0AR = (uint32_t) (uintptr_t) buffer;
+	else
+		DMA1_Stream4->M1AR = (uint32_t) (uintptr_t) buffer;
+
+	dma_queued = output_buffer ? 1 : 0;
+}
+
+void PropAudio::onDoubleBufferTxFinished()
+{
+	DMA1->HIFCR = 0x3D;
+
+	// The DMA already moved to the target armed in the previous interrupt. If it was a ring
+	// buffer (and not the silence one), it's the playing buffer now.
+	if (dma_queued)
+	{
+		play_buffer->ready = false;
+		play_index = (play_index + 1) % buffer_count;
+		play_buffer = &output_buffers[play_index];
+		dma_queued = 0;
+	}
+
+	AUDIO_STAT(samples_played += output_samples);
+
+	if (!deferred_mixing)
+		mix();
+
+	// Arm the idle target with the next buffer. There's a whole period to do it.
+	if (ready_count)
+	{
+		ready_count--;
+		armDMA(getQueuedBuffer(1));
+
+		AUDIO_STAT(if (idling && source_count && miss_start) miss_time = GetTickCount() - miss_start);
+		idling = false;
+
+		if (adaptive && source_count)
+			adaptBuffers(false);
+	} else {
+		// Play silence. The free ring buffers can't be used, the mixer may be working on them.
+		armDMA(NULL);
+
+		if (!idling)
+		{
+			if (source_count)
+				perf_stats.underruns++;
+
+			AUDIO_STAT(if (source_count) miss_count++);
+			AUDIO_STAT(if (source_count) miss_start = GetTickCount());
+			idling = true;
+
+			if (adaptive && source_count)
+				adaptBuffers(true);
+		}
+	}
+
+	if (deferred_mixing)
+		requestMix();
+}
+
+bool PropAudio::setOutputMode(AudioOutputMode mode)
+{
+	// To be called before begin()
+	if (initialized)
+		return false;
+
+	output_mode = mode;
+	return true;
+}
+
+bool PropAudio::setDeferredMixing(bool deferred)
+{
+	// To be called before begin()
+	if (initialized)
+		return false;
+
+	deferred_mixing = deferred;
+	return true;
+}
+
+void PropAudio::setMixingPriority(uint8_t priority)
+{
+	mix_priority = priority;
+
+	if (initialized)
+		NVIC_SetPriority(AUDIO_MIX_IRQn, mix_priority);
+}
+
+void PropAudio::setMixingBudget(uint32_t us)
+{
+	// 0 selects the default, MIX_BUDGET_PERCENT of the period
+	mix_budget_us = us;
+}
+
 void PropAudio::setAnalyzeCallback(audioAnalyzeCallback* analyze)
 {
 	__disable_irq();
@@ -474,12 +897,132 @@ void PropAudio::setMixingFunction(audioMixCallback* mix)
 	__enable_irq();
 }
 
+// Copies a span of 16-bit frames into the output buffer. Mono samples are read two at a time
+// and expanded to both channels.
+static inline void copySpan16(uint32_t* dst, uint8_t* src, uint32_t samples, bool stereo)
+{
+	uint16_t* ptr = (uint16_t*) src;
+	uint32_t* words;
+	uint32_t word;
+
+	if (stereo)
+	{
+		memcpy(dst, src, samples * sizeof(uint32_t));
+		return;
+	}
+
+	if (samples && ((uintptr_t) ptr & 0x02))
+	{
+		*dst++ = __PKHBT(*ptr, *ptr, 16);
+		ptr++;
+		samples--;
+	}
+
+	words = (uint32_t*) ptr;
+	for (; samples >= 2; samples -= 2)
+	{
+		word = *words++;
+		*dst++ = __PKHBT(word, word, 16);
+		*dst++ = __PKHTB(word, word, 16);
+	}
+
+	ptr = (uint16_t*) words;
+	if (samples)
+		*dst = __PKHBT(*ptr, *ptr, 16);
+}
+
+// Same as copySpan16(), but adds (with saturation) to what's already in the output buffer
+static inline void addSpan16(uint32_t* dst, uint8_t* src, uint32_t samples, bool stereo)
+{
+	uint16_t* ptr = (uint16_t*) src;
+	uint32_t* words;
+	uint32_t word;
+
+	if (stereo)
+	{
+		words = (uint32_t*) src;
+		while (samples--)
+		{
+			*dst = __QADD16(*dst, *words++);
+			dst++;
+		}
+		return;
+	}
+
+	if (samples && ((uintptr_t) ptr & 0x02))
+	{
+		*dst = __QADD16(*dst, __PKHBT(*ptr, *ptr, 16));
+		dst++;
+		ptr++;
+		samples--;
+	}
+
+	words = (uint32_t*) ptr;
+	for (; samples >= 2; samples -= 2)
+	{
+		word = *words++;
+		dst[0] = __QADD16(dst[0], __PKHBT(word, word, 16));
+		dst[1] = __QADD16(dst[1], __PKHTB(word, word, 16));
+		dst += 2;
+	}
+
+	ptr = (uint16_t*) words;
+	if (samples)
+		*dst = __QADD16(*dst, __PKHBT(*ptr, *ptr, 16));
+}
+
+// Adds a span of packed 24-bit frames to a 32-bit stereo accumulator
+static inline void accumulateSpan24(int32_t* acc, uint8_t* src, uint32_t samples, bool stereo)
+{
+	int32_t value;
+
+	if (stereo)
+	{
+		samples *= 2;
+		while (samples--)
+		{
+			*acc++ += readPCM24(src);
+			src += 3;
+		}
+	} else {
+		while (samples--)
+		{
+			value = readPCM24(src);
+			*acc++ += value;
+			*acc++ += value;
+			src += 3;
+		}
+	}
+}
+
+// Adds a span of 16-bit frames to a 32-bit stereo accumulator
+static inline void accumulateSpan16(int32_t* acc, uint8_t* src, uint32_t samples, bool stereo)
+{
+	int16_t* ptr = (int16_t*) src;
+
+	if (stereo)
+	{
+		samples *= 2;
+		while (samples--)
+			*acc++ += *ptr++;
+	} else {
+		while (samples--)
+		{
+			*acc++ += *ptr;
+			*acc++ += *ptr++;
+		}
+	}
+}
+
 bool PropAudio::mix16Multipass(OUTPUT_BUFFER* buf, AudioSource* sources)
 {
 	AudioSource* source = sources;
 	uint32_t count;
 	uint32_t samples;
+	uint32_t add;
 	uint8_t* ptr;
+	uint8_t spans;
+	SAMPLE_SPAN span[MAX_SAMPLE_SPANS];
 	bool first_pass = true;
 
 	AUDIO_STAT(mix_ticks = micros());
@@ -497,7 +1040,27 @@ bool PropAudio::mix16Multipass(OUTPUT_BUFFER* buf, AudioSource* sources)
 			continue;
 		}
 
-		if (source->isStereo())
+		spans = source->getNextSampleSpans(span, samples);
+
+		if (spans)
+		{
+			// Whole spans at once: saturate-add the part that overlaps what's already mixed
+			// and copy the rest
+			for (uint8_t i = 0; i < spans; i++)
+			{
+				add = first_pass ? 0 : MIN(span[i].samples, buf->mixed_samples > count ? buf->mixed_samples - count : 0);
+
+				if (add)
+					addSpan16(buf->buffer + count, span[i].ptr, add, source->isStereo());
+
+				if (span[i].samples > add)
+					copySpan16(buf->buffer + count + add, span[i].ptr + add * source->getSampleSize(), span[i].samples - add, source->isStereo());
+
+				count += span[i].samples;
+			}
+
+			first_pass = false;
+		} else if (source->isStereo())
 		{
 			if (first_pass)
 			{
@@ -552,12 +1115,150 @@ bool PropAudio::mix16Multipass(OUTPUT_BUFFER* buf, AudioSource* sources)
 	return true;
 }
 
-bool PropAudio::mix24(OUTPUT_BUFFER* buf, AudioSource* pb)
+bool PropAudio::mix16SinglePass(OUTPUT_BUFFER* buf, AudioSource* sources)
+{
+	static int32_t acc[MIX_BLOCK_SAMPLES * 2];
+	AudioSource* source;
+	uint32_t samples = 0;
+	uint32_t block;
+	uint32_t count;
+	int32_t* acc_ptr;
+	int16_t* ptr;
+	uint8_t spans;
+	SAMPLE_SPAN span[MAX_SAMPLE_SPANS];
+
+	AUDIO_STAT(mix_ticks = micros());
+
+	// Gather how many samples every source can give in this period
+	for (source = sources; source; source = source->getNextToMix())
+	{
+		source->mixingStarts(Audio.getOutputSamples());
+		source->mixing_samples = MIN(source->getSamplesLeft(), buf->buffer_samples);
+		if (source->mixing_samples > samples)
+			samples = source->mixing_samples;
+	}
+
+	// Accumulate every frame of a block from all sources into 32-bit, then saturate it once
+	for (uint32_t start = 0; start < samples; start += block)
+	{
+		block = MIN(samples - start, MIX_BLOCK_SAMPLES);
+		memset(acc, 0, block * 2 * sizeof(int32_t));
+
+		for (source = sources; source; source = source->getNextToMix())
+		{
+			if (source->mixing_samples <= start)
+				continue;
+
+			count = MIN(source->mixing_samples - start, block);
+			acc_ptr = acc;
+			spans = source->getNextSampleSpans(span, count);
+
+			if (spans)
+			{
+				for (uint8_t i = 0; i < spans; i++)
+				{
+					accumulateSpan16(acc_ptr, span[i].ptr, span[i].samples, source->isStereo());
+					acc_ptr += span[i].samples * 2;
+				}
+			} else if (source->isStereo())
+			{
+				while (count--)
+				{
+					ptr = (int16_t*) source->getNextSamplePtr();
+					*acc_ptr++ += ptr[0];
+					*acc_ptr++ += ptr[1];
+				}
+			} else {
+				while (count--)
+				{
+					ptr = (int16_t*) source->getNextSamplePtr();
+					*acc_ptr++ += *ptr;
+					*acc_ptr++ += *ptr;
+				}
+			}
+		}
+
+		acc_ptr = acc;
+		for (count = 0; count < block; count++, acc_ptr += 2)
+			buf->buffer[start + count] = __PKHBT(__SSAT(acc_ptr[0], 16), __SSAT(acc_ptr[1], 16), 16);
+	}
+
+	for (source = sources; source; source = source->getNextToMix())
+		source->mixingEnded(source->mixing_samples);
+
+	buf->mixed_samples = samples;
+
+	AUDIO_STAT(mix_time = micros() - mix_ticks);
+	return true;
+}
+
+bool PropAudio::mix24(OUTPUT_BUFFER* buf, AudioSource* sources)
 {
-	/* TBD */
-	UNUSED(buf);
-	UNUSED(pb);
-	return false;
+	// 24-bit samples in a 32-bit accumulator leave 8 bits of headroom, so up to 256 full
+	// scale sources can be summed before saturating once, on output.
+	static int32_t acc[MIX_BLOCK_SAMPLES * 2];
+	AudioSource* source;
+	uint32_t samples = 0;
+	uint32_t block;
+	uint32_t count;
+	int32_t* acc_ptr;
+	uint8_t* ptr;
+	uint8_t spans;
+	SAMPLE_SPAN span[MAX_SAMPLE_SPANS];
+
+	AUDIO_STAT(mix_ticks = micros());
+
+	for (source = sources; source; source = source->getNextToMix())
+	{
+		source->mixingStarts(Audio.getOutputSamples());
+		source->mixing_samples = MIN(source->getSamplesLeft(), buf->buffer_samples);
+		if (source->mixing_samples > samples)
+			samples = source->mixing_samples;
+	}
+
+	for (uint32_t start = 0; start < samples; start += block)
+	{
+		block = MIN(samples - start, MIX_BLOCK_SAMPLES);
+		memset(acc, 0, block * 2 * sizeof(int32_t));
+
+		for (source = sources; source; source = source->getNextToMix())
+		{
+			if (source->mixing_samples <= start)
+				continue;
+
+			count = MIN(source->mixing_samples - start, block);
+			acc_ptr = acc;
+			spans = source->getNextSampleSpans(span, count);
+
+			if (spans)
+			{
+				for (uint8_t i = 0; i < spans; i++)
+				{
+					accumulateSpan24(acc_ptr, span[i].ptr, span[i].samples, source->isStereo());
+					acc_ptr += span[i].samples * 2;
+				}
+			} else {
+				while (count--)
+				{
+					ptr = (uint8_t*) source->getNextSamplePtr();
+					accumulateSpan24(acc_ptr, ptr, 1, source->isStereo());
+					acc_ptr += 2;
+				}
+			}
+		}
+
+		acc_ptr = acc;
+		for (count = (start * 2); count < (start + block) * 2; count++)
+			buf->buffer[count] = PACK_I2S24(__SSAT(*acc_ptr++, 24));
+	}
+
+	for (source = sources; source; source = source->getNextToMix())
+		source->mixingEnded(source->mixing_samples);
+
+	buf->mixed_samples = samples;
+
+	AUDIO_STAT(mix_time = micros() - mix_ticks);
+	return true;
 }
 
 bool PropAudio::checkSourceFormat(AudioSource* source)
@@ -640,6 +1341,70 @@ bool PropAudio::removeSource(AudioSource* source)
 	return true;
 }
 
+bool PropAudio::addEffect(AudioEffect* effect)
+{
+	AudioEffect* ptr;
+
+	if (!effect)
+		return false;
+
+	// Already in the chain?
+	for (ptr = effects_list; ptr; ptr = ptr->getNextInChain())
+	{
+		if (ptr == effect)
+			return true;
+	}
+
+	if (sample_rate && !effect->begin(sample_rate))
+		return false;
+
+	effect->setNextInChain(NULL);
+
+	// Append, effects run in the order they were added
+	__disable_irq();
+	if (!effects_list)
+	{
+		effects_list = effect;
+	} else {
+		for (ptr = effects_list; ptr->getNextInChain(); ptr = ptr->getNextInChain());
+		ptr->setNextInChain(effect);
+	}
+	__enable_irq();
+
+	return true;
+}
+
+bool PropAudio::removeEffect(AudioEffect* effect)
+{
+	AudioEffect* ptr;
+	AudioEffect* prev = NULL;
+	bool found = false;
+
+	__disable_irq();
+	for (ptr = effects_list; ptr; prev = ptr, ptr = ptr->getNextInChain())
+	{
+		if (ptr == effect)
+		{
+			if (prev)
+				prev->setNextInChain(ptr->getNextInChain());
+			else
+				effects_list = ptr->getNextInChain();
+
+			ptr->setNextInChain(NULL);
+			found = true;
+			break;
+		}
+	}
+	__enable_irq();
+
+	return found;
+}
+
+bool PropAudio::isPlaying()
+{
+	return initialized && source_count;
+}
+
 bool PropAudio::mute()
 {
 	digitalWrite(AUDIO_MUTE, 0);
@@ -665,6 +1430,14 @@ void PropAudio::printDebug(UARTClass* uart)
 	uart->println("\r\nAudio statistics");
 	uart->println("----------------\r\n");
 
+	uart->print("Output buffers: ");
+	uart->print(active_buffers);
+	uart->print(" of ");
+	uart->print(buffer_count);
+	uart->print(", ");
+	uart->print(getLatency());
+	uart->print(" uS latency");
+	uart->println(output_mode == OutputModeDoubleBuffer ? ", double-buffer DMA" : "");
 	uart->print("Samples played: ");
 	uart->println(samples_played);
 	uart->print("Buffers not ready: ");
@@ -678,9 +1451,21 @@ void PropAudio::printDebug(UARTClass* uart)
 	uart->print("Max. DMA IRQ interval: ");
 	uart->print(max_irq_interval);
 	uart->println(" uS");
+	uart->print("Mixing: ");
+	uart->println(deferred_mixing ? "deferred" : "in DMA IRQ");
+	if (deferred_mixing)
+	{
+		uart->print("Mix deadline misses: ");
+		uart->println(perf_stats.mix_deadline_misses);
+		uart->print("Mix budget warnings: ");
+		uart->println(perf_stats.mix_budget_warnings);
+		uart->print("Min. time left after mixing: ");
+		uart->print(perf_stats.min_mix_slack);
+		uart->println(" uS");
+	}
 	uart->print("Update() time: ");
 	uart->print(update_time);
-	uart->println(" ms");
+	uart->println(" uS");
 }
 #endif // AUDIO_STATS
 
@@ -689,17 +1474,41 @@ void DMA1_Stream4_IRQHandler(void)
 	Audio.onI2STxFinished();
 }
 
+void AUDIO_MIX_IRQHandler(void)
+{
+	Audio.runDeferredMix();
+}
+
+void PropAudio::deferUpdate()
+{
+	if (!update_pending)
+		update_deferred_time = micros();
+
+	update_pending = true;
+}
+
 void PendSV_Handler(void)
 {
 	// For now, this guards AudioSources that depend on the file system to update.
-	// TBD: move this calls to each type of AudioSource and return a coherent value indicating that
-	// the update is still pending.
-	if (fs_busy() || sdIsBusy())
+	// The update runs again when the volume is released, or lent by a user operation
+	// at a sector boundary (see fs_yield()).
+	if (fs_busy())
 	{
-		Audio.update_pending = true;
+		Audio.perf_stats.updates_deferred_fs++;
+		Audio.deferUpdate();
 		return;
 	}
 
+	if (sdIsBusy())
+	{
+		Audio.perf_stats.updates_deferred_sd++;
+		Audio.deferUpdate();
+		return;
+	}
+
+	if (Audio.update_pending)
+		histogramAdd(&Audio.perf_stats.update_wait, micros() - Audio.update_deferred_time);
+
 	Audio.update_pending = false;
 	Audio.update();
 }
@@ -30,6 +30,7 @@
 #include <stm32f4xx.h>
 #include "ff.h"
 #include "AudioSource.h"
+#include "AudioEffect.h"
 #include "UARTClass.h"
 
 #define Activate_PendSV() SCB->ICSR = SCB->ICSR | SCB_ICSR_PENDSVSET_Msk
@@ -44,8 +45,28 @@
 #define AUDIO_STAT(x)
 #endif // AUDIO_STATS
 
-#define TARGET_LATENCY_US		1000
-#define MAX_OUTPUT_BUFFERS		2
+#define TARGET_LATENCY_US		1000		// Default length of an output buffer
+#define MIN_OUTPUT_BUFFERS		2
+#define MAX_OUTPUT_BUFFERS		8
+#define ADAPTIVE_SHRINK_PERIODS	5000		// Clean periods before the adaptive ring shrinks
+#define MIX_BUDGET_PERCENT		50			// Default mixing budget, in percent of the period
+
+// Unused vector (SPI4), pended by software to run the mixing
+#define AUDIO_MIX_IRQn			SPI4_IRQn
+#define AUDIO_MIX_IRQHandler	SPI4_IRQHandler
+#define MIX_BLOCK_SAMPLES		32
+#define MAX_REFILL_CHUNKS		16			// Refill chunks per update() before yielding to thread code
+
+// 8 and 16-bit output is one 32-bit word per frame (L in the lower half-word, R in the upper).
+// 24-bit output is one 32-bit word per channel, in the order the 16-bit I2S data register
+// takes it: bits 23-8 first, then bits 7-0 left aligned. See PACK_I2S24().
+#define PACK_I2S24(x)			__ROR((uint32_t) (x) << 8, 16)
+
+enum AudioOutputMode
+{
+	OutputModeNormal = 0,		// The DMA stream is reprogrammed on every transfer
+	OutputModeDoubleBuffer		// Circular double-buffer DMA (M0AR/M1AR)
+};
 
 typedef struct _output_buffer
 {
@@ -56,6 +77,35 @@ typedef struct _output_buffer
 
 } OUTPUT_BUFFER;
 
+// Histogram of times in uS. Bin n counts times below (AUDIO_HISTOGRAM_BASE_US << n),
+// the last bin everything above.
+#define AUDIO_HISTOGRAM_BINS	8
+#define AUDIO_HISTOGRAM_BASE_US	16
+
+typedef struct _audio_histogram
+{
+	uint32_t bins[AUDIO_HISTOGRAM_BINS];
+	uint32_t max;
+} AUDIO_HISTOGRAM;
+
+// Counters kept regardless of AUDIO_STATS. Read them with getStats().
+typedef struct _audio_perf_stats
+{
+	AUDIO_HISTOGRAM mix_time;			// Per output buffer
+	AUDIO_HISTOGRAM update_time;		// Per update() call
+	AUDIO_HISTOGRAM update_wait;		// From a deferred PendSV update to the update running
+	uint32_t updates_deferred_fs;		// PendSV updates skipped because the file system was busy
+	uint32_t updates_deferred_sd;		// PendSV updates skipped because the SD card was busy
+	uint32_t max_refill_gap;			// Longest time from a refill request to its completion, in uS
+	uint32_t refill_chunks;				// Reads done by the refill scheduler
+	uint32_t deadline_misses;			// Refills completed after the source ran out of samples
+	uint32_t underruns;					// Times the output ran out of mixed buffers
+	uint32_t mix_deadline_misses;		// Deferred mixes that ended after the next DMA interrupt was due
+	uint32_t mix_budget_warnings;		// Deferred mixes that took longer than the mixing budget
+	int32_t min_mix_slack;				// Least time left after a deferred mix, in uS (INT32_MAX if none ran)
+	uint32_t reset_time;				// millis() at the last resetStats()
+} AUDIO_PERF_STATS;
+
 typedef struct _i2s_buffer
 {
 	uint8_t* buffer;
@@ -67,19 +117,25 @@ typedef void (audioAnalyzeCallback)(OUTPUT_BUFFER*);
 
 extern "C" void DMA1_Stream4_IRQHandler(void);
 extern "C" void PendSV_Handler(void);
+extern "C" void AUDIO_MIX_IRQHandler(void);
 
 class PropAudio
 {
 	friend void DMA1_Stream4_IRQHandler(void);
 	friend void PendSV_Handler(void);
+	friend void AUDIO_MIX_IRQHandler(void);
 
 public:
 	~PropAudio();
 
-	bool begin(uint32_t fs = 22050, uint8_t bps = 16, bool async = false);
+	bool begin(uint32_t fs = 22050, uint8_t bps = 16, bool async = false,
+			   uint32_t latency_us = TARGET_LATENCY_US, uint8_t buffers = MIN_OUTPUT_BUFFERS,
+			   uint8_t max_buffers = 0);
 	void end();
 	bool addSource(AudioSource* source);
 	bool removeSource(AudioSource* source);
+	bool addEffect(AudioEffect* effect);
+	bool removeEffect(AudioEffect* effect);
 	bool mute();
 	bool unmute();
 	bool isPlaying();
@@ -88,8 +144,23 @@ public:
 	void triggerUpdate();
 	void setAnalyzeCallback(audioAnalyzeCallback* analyze);
 	void setMixingFunction(audioMixCallback* mix);
+	bool setOutputMode(AudioOutputMode mode);
+	inline AudioOutputMode getOutputMode() { return output_mode; }
+	bool setDeferredMixing(bool deferred);
+	void setMixingPriority(uint8_t priority);
+	void setMixingBudget(uint32_t us);
+	inline uint32_t getPeriod() { return period_us; }
 	inline uint32_t getOutputSamples() { return output_samples; }
 	inline uint32_t getSampleRate() { return sample_rate; }
+	inline uint8_t getBitsPerSample() { return bits_per_sample; }
+	inline uint8_t getOutputFrameSize() { return bits_per_sample > 16 ? 8 : 4; }
+	inline uint8_t getOutputBuffers() { return active_buffers; }
+	inline uint32_t getLatency() { return (output_samples * (active_buffers - 1) * 1000000) / sample_rate; }
+	void getStats(AUDIO_PERF_STATS* dst);
+	void resetStats();
+	inline uint32_t getMixDeadlineMisses() { return perf_stats.mix_deadline_misses; }
+	inline uint32_t getMixBudgetWarnings() { return perf_stats.mix_budget_warnings; }
+	inline int32_t getMinMixSlack() { return perf_stats.min_mix_slack; }
 
 	static PropAudio& instance()
 	{
@@ -97,33 +168,68 @@ public:
 		return singleton;
 	}
 
+	// Built-in mixing functions, to be used with setMixingFunction()
+	static bool mix16Multipass(OUTPUT_BUFFER* buf, AudioSource* sources) __attribute__ ((optimize(3)));
+	static bool mix16SinglePass(OUTPUT_BUFFER* buf, AudioSource* sources) __attribute__ ((optimize(3)));
+	static bool mix24(OUTPUT_BUFFER* buf, AudioSource* sources) __attribute__ ((optimize(3)));
+
 #if AUDIO_STATS
 	void printDebug(UARTClass* uart);
+	inline uint32_t getMissCount() { return miss_count; }
+	inline uint32_t getMissTime() { return miss_time; }
+	inline uint32_t getSamplesPlayed() { return samples_played; }
 #endif // AUDIO_STATS
 
 protected:
 	PropAudio();
 	void update();
+	void deferUpdate();
+	void updateSource(AudioSource* source);
 	void mix();
 	void onI2STxFinished();
 	bool initI2S(uint32_t fs, uint8_t bps);
 	bool initCodec();
 
 	bool checkSourceFormat(AudioSource* source);
-	inline void switchBuffers();
+	inline OUTPUT_BUFFER* getQueuedBuffer(uint8_t position);
 	inline void startDMA(OUTPUT_BUFFER* output_buffer);
-	static bool mix16Multipass(OUTPUT_BUFFER* buf, AudioSource* sources) __attribute__ ((optimize(3)));
-	static bool mix24(OUTPUT_BUFFER* buf, AudioSource* sources);
+	void startDoubleBufferDMA();
+	inline void armDMA(OUTPUT_BUFFER* output_buffer);
+	void onDoubleBufferTxFinished();
+	inline void requestMix();
+	void runDeferredMix();
+	void adaptBuffers(bool missed);
+	void applyEffects(OUTPUT_BUFFER* buffer);
 
-	bool allocateOutputBuffers();
+	bool allocateOutputBuffers(uint32_t latency_us, uint8_t count);
 	void deallocateOutputBuffers();
-	uint8_t* buffer1;
-	uint8_t* buffer2;
+	uint8_t* buffer_memory;
 	uint32_t buffer_size;
 
-	OUTPUT_BUFFER output_buffers[2];
+	// Output ring. Buffers are played in order, the one at play_index is being sent by the DMA,
+	// the next dma_queued are held by the DMA too (double-buffer mode) and the next ready_count
+	// buffers are already mixed. active_buffers (up to buffer_count, the allocated ones) limits
+	// how far ahead the mixing goes.
+	OUTPUT_BUFFER output_buffers[MAX_OUTPUT_BUFFERS];
 	OUTPUT_BUFFER* play_buffer;
-	OUTPUT_BUFFER* update_buffer;
+	AudioOutputMode output_mode;
+	uint32_t* silence_buffer;
+	uint8_t dma_queued;
+	uint8_t buffer_count;
+	uint8_t min_buffers;
+	uint8_t active_buffers;
+	uint8_t play_index;
+	volatile uint8_t ready_count;
+	bool adaptive;
+	uint32_t clean_periods;
+
+	// Deferred mixing. The DMA interrupt only moves through the ring and pends
+	// AUDIO_MIX_IRQn, mix() runs there at mix_priority.
+	bool deferred_mixing;
+	uint8_t mix_priority;
+	uint32_t period_us;
+	uint32_t mix_budget_us;
+	uint32_t period_start;				// micros() at the last DMA interrupt
 	uint8_t bits_per_sample;
 	uint32_t sample_rate;
 	bool initialized;
@@ -131,6 +237,8 @@ protected:
 	bool idling;
 	volatile bool playing;
 	volatile bool update_pending;
+	uint32_t update_deferred_time;		// micros() when the pending update was first deferred
+	AUDIO_PERF_STATS perf_stats;
 
 #if AUDIO_STATS
 	uint32_t miss_count;
@@ -152,6 +260,10 @@ private:
 
 	volatile uint8_t source_count;
 	AudioSource* sources_list;
+
+	// Insert effects on the mix bus, in order, and their planar working buffer (16-bit output only)
+	AudioEffect* effects_list;
+	int16_t* effect_buffer;
 };
 
 #ifdef __cplusplus
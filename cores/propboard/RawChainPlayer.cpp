@@ -29,25 +29,63 @@
 #include <stddef.h>
 #include <string.h>
 #include <Arduino.h>
+#include "AudioUtil.h"
 
 RawChainPlayer::RawChainPlayer()
 {
 	chained_status = PlayingNone;
 	status = AudioSourceStopped;
 	chained_mode = PlayModeNormal;
+	chained_left = 0;
+	loading = false;
 	header_size = 0;
+	main_name[0] = '\0';
+	crossfade_samples = 0;
+	fade_tail = NULL;
+	fade_length = fade_pos = 0;
+
+	// Tracks swap buffers, both are double buffered
+	max_buffers = 2;
+	resetTracks();
 }
 
 RawChainPlayer::~RawChainPlayer()
 {
+	if (fade_tail)
+		free(fade_tail);
+}
+
+static inline uint32_t bufferedSamples(playerBuffer* buffer)
+{
+	samplesBuffer* updating_buffer = buffer->getUpdatingBuffer();
+
+	return buffer->getPlayingBuffer()->samples + (updating_buffer->updated ? updating_buffer->samples : 0);
+}
+
+void RawChainPlayer::resetTracks()
+{
+	main_track.file = &audio_file;
+	main_track.buffer = &buffer;
+	main_track.update_requested = false;
+	chained_track.file = &chained_file;
+	chained_track.buffer = &chained_buffer;
+	chained_track.update_requested = false;
+	active_buffer = &buffer;
+}
+
+bool RawChainPlayer::openTrack(AudioFileHelper* file, const char* filename, bool loop)
+{
+	return file->openRaw(filename, sample_size, header_size, loop);
 }
 
 bool RawChainPlayer::begin(const char* filename, uint32_t fs, uint8_t bps, bool mono, uint32_t hdrsize)
 {
 	// If the main_file is already opened, it means this function was already called
-	if (audio_file.isOpened())
+	if (main_track.file->isOpened())
 		return false;
 
+	resetTracks();
+
 	// Call the base class begin function to allocate the working buffer
 	if (!RawPlayer::begin(fs, bps, mono, hdrsize))
 		return false;
@@ -58,6 +96,7 @@ bool RawChainPlayer::begin(const char* filename, uint32_t fs, uint8_t bps, bool
 
 	// Remember the header size
 	header_size = hdrsize;
+	strcpy(main_name, filename);
 
 	// Do fill buffers
 	if (refill())
@@ -70,25 +109,201 @@ bool RawChainPlayer::begin(const char* filename, uint32_t fs, uint8_t bps, bool
 	return false;
 }
 
-bool RawChainPlayer::doChain(PlayMode mode)
+bool RawChainPlayer::setCrossfade(uint32_t ms)
+{
+	uint32_t samples;
+	uint32_t block = Audio.getOutputSamples();
+
+	// Call after begin() and before play()
+	if (!main_track.file->isOpened() || status != AudioSourceStopped || ms > CHAIN_CROSSFADE_MAX_MS)
+		return false;
+
+	if (fade_tail)
+		free(fade_tail);
+
+	fade_tail = NULL;
+	fade_length = fade_pos = 0;
+	crossfade_samples = 0;
+
+	samples = (sample_rate * ms) / 1000;
+	if (!samples)
+		return true;
+
+	fade_tail = (uint8_t*) malloc(samples * sample_size);
+	if (!fade_tail)
+		return false;
+
+	// The outgoing track is faded out from what it has in RAM, so each half of the buffers
+	// has to hold a crossfade and the block being played
+	uint32_t buffer_samples = ((samples + block - 1) / block + 1) * block;
+	if (buffer_samples > main_track.buffer->getBufferSamples())
+	{
+		if (!main_track.buffer->allocate(buffer_samples * 2, sample_size) ||
+			!main_track.file->rewind() || !refill(main_track.file, main_track.buffer))
+		{
+			free(fade_tail);
+			fade_tail = NULL;
+			return false;
+		}
+	}
+
+	crossfade_samples = samples;
+	return true;
+}
+
+AudioFileHelper* RawChainPlayer::getLoadingFile()
+{
+	// When crossfading from a chained track into a new one, the new one is loaded where
+	// the main track is. The main track is loaded again afterwards.
+	if (crossfade_samples && chained_status == PlayingChained)
+		return main_track.file;
+
+	return chained_track.file;
+}
+
+bool RawChainPlayer::prefetch(chainTrack* track)
 {
+	playerBuffer* buffer = track->buffer;
+
+	// Fill both buffers. Unlike refill(), the refill the playing track may have pending is kept.
+	buffer->reset();
+	track->update_requested = false;
+
+	if (!refillBuffer(track->file, buffer->getPlayingBuffer(), buffer->getBufferSamples()))
+		return false;
+
+	if (buffer->getPlayingBuffer()->samples == buffer->getBufferSamples())
+		refillBuffer(track->file, buffer->getUpdatingBuffer(), buffer->getBufferSamples());
+
+	return true;
+}
+
+bool RawChainPlayer::loadMain(bool reopen)
+{
+	if (reopen)
+	{
+		if (!openTrack(main_track.file, main_name, true))
+			return false;
+	} else if (!main_track.file->rewind())
+		return false;
+
+	return prefetch(&main_track);
+}
+
+void RawChainPlayer::startCrossfade(chainTrack* track, uint32_t samples)
+{
+	samplesBuffer* playing_buffer = track->buffer->getPlayingBuffer();
+	samplesBuffer* updating_buffer = track->buffer->getUpdatingBuffer();
+	uint32_t count = min(playing_buffer->samples, samples);
+	uint32_t more;
+
+	// Called with interrupts disabled. Only what the outgoing track has in RAM is used:
+	// if less than a crossfade is buffered, the crossfade is shorter.
+	memcpy(fade_tail, playing_buffer->readptr, count * sample_size);
+
+	if (updating_buffer->updated && count < samples)
+	{
+		more = min(updating_buffer->samples, samples - count);
+		memcpy(fade_tail + count * sample_size, updating_buffer->readptr, more * sample_size);
+		count += more;
+	}
+
+	fade_pos = 0;
+	fade_length = count;
+}
+
+void RawChainPlayer::crossfade(uint8_t* ptr, uint32_t samples)
+{
+	uint8_t* tail = fade_tail + fade_pos * sample_size;
+	uint32_t count = min(samples, fade_length - fade_pos);
+	uint32_t values = stereo ? 2 : 1;
+	int32_t gain;
+
+	// Linear complementary gains, Q16. Only 16 and 24-bit audio, like changeVolume().
+	for (uint32_t i = 0; i < count; i++)
+	{
+		gain = (int32_t) (((fade_pos + i) << 16) / fade_length);
+
+		if (bits_per_sample == 16)
+		{
+			int16_t* in = (int16_t*) ptr;
+			int16_t* out = (int16_t*) tail;
+
+			for (uint32_t j = 0; j < values; j++)
+				in[j] = (int16_t) ((in[j] * gain + out[j] * (VOLUME_UNITY_GAIN - gain)) >> 16);
+		} else if (bits_per_sample == 24)
+		{
+			for (uint32_t j = 0; j < values; j++)
+				writePCM24(ptr + j * 3, (int32_t) (((int64_t) readPCM24(ptr + j * 3) * gain +
+										(int64_t) readPCM24(tail + j * 3) * (VOLUME_UNITY_GAIN - gain)) >> 16));
+		}
+
+		ptr += sample_size;
+		tail += sample_size;
+	}
+}
+
+bool RawChainPlayer::doChain(AudioFileHelper* file, PlayMode mode)
+{
+	chainTrack* track = (file == chained_track.file) ? &chained_track : &main_track;
+	chainTrack* other = (track == &chained_track) ? &main_track : &chained_track;
+	bool swap = (track == &main_track);
+
 	// Allocate buffer for chained track. The format must be the same of the main track.
-	if (!chained_buffer.allocate(buffer.getBufferSamples() * 2, sample_size))
+	if (!track->buffer->allocate(other->buffer->getBufferSamples() * 2, sample_size))
 		return false;
 
 	chained_mode = mode;
+	chained_left = (mode == PlayModeLoop) ? CHAIN_SAMPLES_LOOPING : file->getDataSamples();
+
+	if (crossfade_samples)
+	{
+		// Load the new track while the current one keeps playing
+		if (!prefetch(track))
+			return false;
+
+		// Let a crossfade in progress end, then fade out what's playing
+		while (crossfading() && playing());
+
+		__disable_irq();
+		if (playing())
+			startCrossfade(chained_status == PlayingChained ? &chained_track : &main_track, crossfade_samples);
+
+		if (swap)
+		{
+			chainTrack tmp = main_track;
+			main_track = chained_track;
+			chained_track = tmp;
+		}
+
+		chained_status = PlayingChained;
+		active_buffer = chained_track.buffer;
+		__enable_irq();
+		loading = false;
+
+		// The main track waits from its beginning for the chained one to end
+		if ((swap || playing()) && !loadMain(swap))
+			return false;
+
+		if (playing() && mode == PlayModeBlocking)
+			while (chained_status == PlayingChained);
+
+		return true;
+	}
+
+	loading = false;
 
 	// Fill one buffer and start playing
-	chained_buffer.reset();
-	if (!refillBuffer(&chained_file, chained_buffer.getPlayingBuffer(),
-					 chained_buffer.getBufferSamples()))
+	chained_track.buffer->reset();
+	if (!refillBuffer(chained_track.file, chained_track.buffer->getPlayingBuffer(),
+					 chained_track.buffer->getBufferSamples()))
 		return false;
 
 	setChainedStatus(PlayingChained);
 
 	// Fill the other buffer
-	if (!refillBuffer(&chained_file, chained_buffer.getUpdatingBuffer(),
-					 chained_buffer.getBufferSamples()))
+	if (!refillBuffer(chained_track.file, chained_track.buffer->getUpdatingBuffer(),
+					 chained_track.buffer->getBufferSamples()))
 	{
 		setChainedStatus(PlayingMain);
 		return false;
@@ -97,9 +312,12 @@ bool RawChainPlayer::doChain(PlayMode mode)
 	if (playing())
 	{
 		// Refill the main track buffer in case we need to suddenly stop playing the chained track
-		audio_file.rewind();
-		if (!refill())
+		main_track.file->rewind();
+		if (!refill(main_track.file, main_track.buffer))
+		{
+			main_track.file->close();
 			return false;
+		}
 
 		if (mode == PlayModeBlocking)
 			while (chained_status == PlayingChained);
@@ -108,24 +326,38 @@ bool RawChainPlayer::doChain(PlayMode mode)
 	return true;
 }
 
+void RawChainPlayer::abortChain(AudioFileHelper* file)
+{
+	file->close();
+
+	// The new track was being loaded where the main one was waiting
+	if (file == main_track.file)
+		loadMain(true);
+
+	loading = false;
+}
+
 bool RawChainPlayer::chain(const char* filename, PlayMode mode)
 {
+	AudioFileHelper* file;
+
 	// This function can be called only after calling begin. main_file determines
 	// the chained track format
-	if (!audio_file.isOpened())
+	if (!main_track.file->isOpened())
 		return false;
 
 	// If already playing a chained track, go back to PlayingMain
-	if (chained_status == PlayingChained)
+	if (!crossfade_samples && chained_status == PlayingChained)
 		setChainedStatus(PlayingMain);
 
 	// Open the chained file as raw. It has to have the same format as main_file
-	if (!chained_file.openRaw(filename, sample_size, header_size, mode == PlayModeLoop))
-		return false;
+	file = getLoadingFile();
+	loading = true;
 
-	if (!doChain(mode))
+	if (!file->openRaw(filename, sample_size, header_size, mode == PlayModeLoop) ||
+		!doChain(file, mode))
 	{
-		chained_file.close();
+		abortChain(file);
 		return false;
 	}
 
@@ -134,22 +366,25 @@ bool RawChainPlayer::chain(const char* filename, PlayMode mode)
 
 bool RawChainPlayer::chainRandom(const char* filename, const char* ext, uint32_t min, uint32_t max, PlayMode mode)
 {
+	AudioFileHelper* file;
+
 	// This function can be called only after calling begin. main_file determines
 	// the chained track format
-	if (!audio_file.isOpened())
+	if (!main_track.file->isOpened())
 		return false;
 
 	// If already playing a chained track, go back to PlayingMain
-	if (chained_status == PlayingChained)
+	if (!crossfade_samples && chained_status == PlayingChained)
 		setChainedStatus(PlayingMain);
 
 	// Open a random chained file as raw. It has to have the same format as main_file
-	if (!chained_file.openRandomRaw(filename, ext, min, max, sample_size, header_size, mode == PlayModeLoop))
-		return false;
+	file = getLoadingFile();
+	loading = true;
 
-	if (!doChain(mode))
+	if (!file->openRandomRaw(filename, ext, min, max, sample_size, header_size, mode == PlayModeLoop) ||
+		!doChain(file, mode))
 	{
-		chained_file.close();
+		abortChain(file);
 		return false;
 	}
 
@@ -159,13 +394,14 @@ bool RawChainPlayer::chainRandom(const char* filename, const char* ext, uint32_t
 bool RawChainPlayer::play()
 {
 	// This function can be called only after calling begin()
-	if (!audio_file.isOpened())
+	if (!main_track.file->isOpened())
 		return false;
 
 	if (status != AudioSourceStopped)
 		return false;
 
-	update_requested = false;
+	main_track.update_requested = false;
+	fade_length = fade_pos = 0;
 
 	if (!Audio.addSource(this))
 		return false;
@@ -180,17 +416,18 @@ bool RawChainPlayer::play()
 
 bool RawChainPlayer::stop()
 {
-	if (!audio_file.isOpened())
+	if (!main_track.file->isOpened())
 		return false;
 
 	status = AudioSourceStopped;
 
 	Audio.removeSource(this);
-	audio_file.close();
+	main_track.file->close();
 
-	if (chained_file.isOpened())
-		chained_file.close();
+	if (chained_track.file->isOpened())
+		chained_track.file->close();
 
+	fade_length = fade_pos = 0;
 	return true;
 }
 
@@ -207,12 +444,12 @@ void RawChainPlayer::setChainedStatus(ChainPlayStatus status)
 
 		case PlayingMain:
 			new_status = status;
-			new_active_buffer = &buffer;
+			new_active_buffer = main_track.buffer;
 			break;
 
 		case PlayingChained:
 			new_status = status;
-			new_active_buffer = &chained_buffer;
+			new_active_buffer = chained_track.buffer;
 			break;
 
 		case PlayingTransition:
@@ -227,6 +464,40 @@ void RawChainPlayer::setChainedStatus(ChainPlayStatus status)
 	__enable_irq();
 }
 
+UpdateResult RawChainPlayer::updateTrack(chainTrack* track)
+{
+	// Same as RawPlayer::update(), for whichever file and buffer the track uses
+	if (track->file->eofReached())
+		return SourceRemove;
+
+	if (!track->update_requested && !track->buffer->refillInProgress())
+		return SourceUpdated;
+
+	track->update_requested = false;
+
+	UpdateResult result = RawPlayer::update(track->file, track->buffer);
+
+	if (result == SourceUpdated)
+	{
+		// Check the condition on which there is a very, very loaded system, and the playing_buffer
+		// ran out of samples while (from the mixingEnded function point of view) the
+		// updating_buffer is still to be updated.
+		samplesBuffer* playing_buffer = track->buffer->getPlayingBuffer();
+		if (!playing_buffer->samples && !playing_buffer->updated)
+		{
+			// Do the buffer switching here
+			track->buffer->switchBuffers();
+
+			// Request another update
+			track->update_requested = true;
+			refillRequested();
+			Audio.triggerUpdate();
+		}
+	}
+
+	return result;
+}
+
 UpdateResult RawChainPlayer::update()
 {
 	uint32_t samples_read;
@@ -235,7 +506,7 @@ UpdateResult RawChainPlayer::update()
 	switch (chained_status)
 	{
 		case PlayingMain:
-			result = RawPlayer::update();
+			result = updateTrack(&main_track);
 			break;
 
 		case PlayingTransition:
@@ -244,34 +515,47 @@ UpdateResult RawChainPlayer::update()
 			break;
 
 		case PlayingChained:
-			if (!chained_update_requested)
+			if (!chained_track.update_requested && !chained_track.buffer->refillInProgress())
 				return SourceUpdated;
 
-			chained_update_requested = false;
+			if (crossfade_samples)
+			{
+				// The end of the chained track is crossfaded into the main one by mixingStarts()
+				if (chained_track.file->eofReached())
+				{
+					chained_track.update_requested = false;
+					return SourceUpdated;
+				}
+
+				result = updateTrack(&chained_track);
+				break;
+			}
 
-			if (chained_file.eofReached())
+			chained_track.update_requested = false;
+
+			if (chained_track.file->eofReached())
 			{
 				setChainedStatus(PlayingTransition);
 				result = SourceUpdated;
 				break;
 			}
 
-			result = RawPlayer::update(&chained_file, &chained_buffer);
+			result = RawPlayer::update(chained_track.file, chained_track.buffer);
 
 			if (result == SourceUpdated)
 			{
-				samplesBuffer* updating_buffer = chained_buffer.getUpdatingBuffer();
+				samplesBuffer* updating_buffer = chained_track.buffer->getUpdatingBuffer();
 
 				// Check if the buffer was filled completely
-				if (updating_buffer->samples == chained_buffer.getBufferSamples())
+				if (updating_buffer->samples == chained_track.buffer->getBufferSamples())
 					break;
 
 				// Otherwise fill the remaining with audio from the main track
 				uint8_t* ptr = updating_buffer->buffer + updating_buffer->samples * sample_size;
-				uint32_t samples = chained_buffer.getBufferSamples() - updating_buffer->samples;
+				uint32_t samples = chained_track.buffer->getBufferSamples() - updating_buffer->samples;
 
-				audio_file.rewind();
-				samples_read = audio_file.fillBuffer(ptr, samples);
+				main_track.file->rewind();
+				samples_read = main_track.file->fillBuffer(ptr, samples);
 
 				if (samples_read == samples)
 				{
@@ -279,8 +563,9 @@ UpdateResult RawChainPlayer::update()
 					result = SourceUpdated;
 
 					// Refill main track buffer
-					if (!refill())
+					if (!refill(main_track.file, main_track.buffer))
 					{
+						main_track.file->close();
 						result = UpdateError;
 						break;
 					}
@@ -288,14 +573,15 @@ UpdateResult RawChainPlayer::update()
 					// Check the condition on which there is a very, very loaded system, and the
 					// playing_buffer ran out of samples while (from the mixingEnded function point
 					// of view) the updating_buffer is still to be updated.
-					samplesBuffer* playing_buffer = chained_buffer.getPlayingBuffer();
+					samplesBuffer* playing_buffer = chained_track.buffer->getPlayingBuffer();
 					if (!playing_buffer->samples && !playing_buffer->updated)
 					{
 						// Do the buffer switching here
-						chained_buffer.switchBuffers();
+						chained_track.buffer->switchBuffers();
 
 						// Request another update
-						chained_update_requested = true;
+						chained_track.update_requested = true;
+						refillRequested();
 						Audio.triggerUpdate();
 					}
 				} else {
@@ -314,8 +600,9 @@ UpdateResult RawChainPlayer::update()
 bool RawChainPlayer::restart()
 {
 	bool was_playing = false;
+	bool swap;
 
-	if (!audio_file.isOpened())
+	if (!main_track.file->isOpened())
 		return false;
 
 	if (status == AudioSourceStopped)
@@ -323,11 +610,44 @@ bool RawChainPlayer::restart()
 
 	was_playing = playing();
 
+	if (crossfade_samples && was_playing && chained_status != PlayingTransition)
+	{
+		// A chained track fades into the main one, that is waiting from its beginning.
+		// The main track is loaded again in the idle buffer to fade into itself.
+		swap = (chained_status == PlayingMain);
+		if (swap && (!openTrack(chained_track.file, main_name, true) || !prefetch(&chained_track)))
+		{
+			chained_track.file->close();
+			return false;
+		}
+
+		while (crossfading() && playing());
+
+		__disable_irq();
+		startCrossfade(swap ? &main_track : &chained_track, crossfade_samples);
+
+		if (swap)
+		{
+			chainTrack tmp = main_track;
+			main_track = chained_track;
+			chained_track = tmp;
+		}
+
+		chained_status = PlayingMain;
+		active_buffer = main_track.buffer;
+		__enable_irq();
+
+		if (swap)
+			chained_track.file->close();
+
+		return true;
+	}
+
 	if (chained_status == PlayingMain)
 	{
 		status = AudioSourcePaused;
-		audio_file.rewind();
-		if (!refill())
+		main_track.file->rewind();
+		if (!refill(main_track.file, main_track.buffer))
 		{
 			stop();
 			return false;
@@ -342,30 +662,44 @@ bool RawChainPlayer::restart()
 	return true;
 }
 
+void RawChainPlayer::trackMixed(chainTrack* track, uint32_t samples)
+{
+	samplesBuffer* playing_buffer = track->buffer->getPlayingBuffer();
+
+	playing_buffer->samples -= samples;
+	if (!playing_buffer->samples)
+	{
+		playing_buffer->updated = false;
+
+		// Don't switch buffers if updating_buffer is not updated,
+		// since it may be still updating right now.
+		if (track->buffer->getUpdatingBuffer()->updated)
+			track->buffer->switchBuffers();
+
+		track->update_requested = true;
+		refillRequested();
+		Audio.triggerUpdate();
+	}
+}
+
 void RawChainPlayer::mixingEnded(uint32_t samples)
 {
-	samplesBuffer* playing_buffer = chained_buffer.getPlayingBuffer();
+	samplesBuffer* playing_buffer = chained_track.buffer->getPlayingBuffer();
+
+	if (crossfading())
+		fade_pos += min(samples, fade_length - fade_pos);
 
 	switch (chained_status)
 	{
 		case PlayingMain:
-			RawPlayer::mixingEnded(samples);
+			trackMixed(&main_track, samples);
 			break;
 
 		case PlayingChained:
-			playing_buffer->samples -= samples;
-			if (!playing_buffer->samples)
-			{
-				playing_buffer->updated = false;
-
-				// Don't switch buffers if updating_buffer is not updated,
-				// since it may be still updating right now.
-				if (chained_buffer.getUpdatingBuffer()->updated)
-					chained_buffer.switchBuffers();
+			if (chained_left != CHAIN_SAMPLES_LOOPING)
+				chained_left -= min(samples, chained_left);
 
-				chained_update_requested = true;
-				Audio.triggerUpdate();
-			}
+			trackMixed(&chained_track, samples);
 			break;
 
 		case PlayingTransition:
@@ -382,6 +716,21 @@ void RawChainPlayer::mixingEnded(uint32_t samples)
 	}
 }
 
+uint32_t RawChainPlayer::getRefillDeadline()
+{
+	switch (chained_status)
+	{
+		case PlayingMain:
+			return RawPlayer::getRefillDeadline(main_track.buffer, main_track.update_requested);
+
+		case PlayingChained:
+			return RawPlayer::getRefillDeadline(chained_track.buffer, chained_track.update_requested);
+
+		default:
+			return REFILL_NO_DEADLINE;
+	}
+}
+
 uint32_t RawChainPlayer::getSamplesLeft()
 {
 	return active_buffer->getPlayingBuffer()->samples;
@@ -394,21 +743,55 @@ void* RawChainPlayer::getNextSamplePtr()
 	return ret;
 }
 
+uint8_t RawChainPlayer::getNextSampleSpans(SAMPLE_SPAN* spans, uint32_t samples)
+{
+	samplesBuffer* playing_buffer = active_buffer->getPlayingBuffer();
+	spans->ptr = playing_buffer->readptr;
+	spans->samples = samples;
+	playing_buffer->readptr += samples * sample_size;
+	return 1;
+}
+
 uint32_t RawChainPlayer::mixingStarts(uint32_t samples)
 {
-	changeVolume(active_buffer->getPlayingBuffer()->readptr, samples);
-	return active_buffer->getPlayingBuffer()->samples;
+	samplesBuffer* playing_buffer;
+
+	// The end of a chained track fades into the main one once the samples left fit in
+	// a crossfade and are all in RAM
+	if (crossfade_samples && chained_status == PlayingChained && !loading && !crossfading() &&
+		chained_left <= crossfade_samples && chained_left <= bufferedSamples(chained_track.buffer))
+	{
+		startCrossfade(&chained_track, chained_left);
+		chained_status = PlayingMain;
+		active_buffer = main_track.buffer;
+	}
+
+	playing_buffer = active_buffer->getPlayingBuffer();
+
+	// The refill didn't make it in time. The main track loops, a chained one ends.
+	if (!playing_buffer->samples && (chained_status == PlayingMain ||
+		(chained_status == PlayingChained && !chained_track.file->eofReached())))
+		samplesUnderrun(samples);
+
+	// Only the samples left in the buffer are scaled, the rest of the block comes from the next one
+	samples = min(samples, playing_buffer->samples);
+
+	if (crossfading())
+		crossfade(playing_buffer->readptr, samples);
+
+	changeVolume(playing_buffer->readptr, samples);
+	return playing_buffer->samples;
 }
 
 uint32_t RawChainPlayer::getChainedDuration()
 {
-	if (chained_file.isOpened())
-		return chained_file.getDuration();
+	if (chained_track.file->isOpened())
+		return chained_track.file->getDuration();
 
 	return 0;
 }
 
 char* RawChainPlayer::getChainedFileName()
 {
-	return chained_file.getFileName();
+	return chained_track.file->getFileName();
 }
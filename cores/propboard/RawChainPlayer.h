@@ -30,6 +30,9 @@
 #include "WavPlayer.h"
 #include "RawPlayer.h"
 
+#define CHAIN_CROSSFADE_MAX_MS		250
+#define CHAIN_SAMPLES_LOOPING		0xFFFFFFFF
+
 enum ChainPlayStatus
 {
 	PlayingNone = 0,
@@ -38,6 +41,15 @@ enum ChainPlayStatus
 	PlayingTransition,
 };
 
+// A file and the buffer it plays from. With crossfades enabled the two pairs of the
+// player can swap roles, since the incoming track has to be loaded in the idle one.
+typedef struct
+{
+	AudioFileHelper* file;
+	playerBuffer* buffer;
+	bool update_requested;
+} chainTrack;
+
 class RawChained : public RawPlayer
 {
 	uint32_t fillThisBuffer(uint8_t* buffer, uint32_t samples)
@@ -59,28 +71,55 @@ public:
 	bool stop();
 	UpdateResult update();
 	bool restart();
+	bool setCrossfade(uint32_t ms);
 
+	inline uint32_t getCrossfade() { return crossfade_samples ? crossfade_samples * 1000 / sample_rate : 0; }
+	inline bool crossfading() { return fade_pos < fade_length; }
 	uint32_t getChainedDuration();
 	inline ChainPlayStatus getChainStatus() { return chained_status; }
 	inline bool playingChained() { return (chained_status == PlayingChained ||
 										   chained_status == PlayingTransition); }
 	char* getChainedFileName();
+	inline char* getFileName() { return main_name; }
+	inline uint32_t duration() { return main_track.file->getDuration(); }
 	void* getNextSamplePtr();
+	uint8_t getNextSampleSpans(SAMPLE_SPAN* spans, uint32_t samples);
 	uint32_t getSamplesLeft();
+	uint32_t getRefillDeadline();
 
 protected:
-	bool doChain(PlayMode mode);
+	virtual bool openTrack(AudioFileHelper* file, const char* filename, bool loop);
+	AudioFileHelper* getLoadingFile();
+	void resetTracks();
+	bool doChain(AudioFileHelper* file, PlayMode mode);
+	void abortChain(AudioFileHelper* file);
 	uint32_t mixingStarts(uint32_t samples);
 	void mixingEnded(uint32_t samples);
 	void setChainedStatus(ChainPlayStatus status);
 
+	UpdateResult updateTrack(chainTrack* track);
+	void trackMixed(chainTrack* track, uint32_t samples);
+	bool prefetch(chainTrack* track);
+	bool loadMain(bool reopen);
+	void startCrossfade(chainTrack* track, uint32_t samples);
+	void crossfade(uint8_t* ptr, uint32_t samples);
+
 	playerBuffer* active_buffer;
 
 	playerBuffer chained_buffer;
 	AudioFileHelper chained_file;
+	chainTrack main_track;
+	chainTrack chained_track;
 	PlayMode chained_mode;
 	volatile ChainPlayStatus chained_status;
-	bool chained_update_requested;
+	volatile uint32_t chained_left;				// Chained samples still to be mixed
+	volatile bool loading;						// A track is being loaded in the idle buffer
+	char main_name[_MAX_LFN + 1];
+
+	uint32_t crossfade_samples;
+	uint8_t* fade_tail;							// Outgoing samples, copied from its buffers
+	volatile uint32_t fade_length;
+	volatile uint32_t fade_pos;
 };
 
 #endif /* __RAWCHAINPLAYER_H__ */
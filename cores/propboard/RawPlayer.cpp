@@ -26,15 +26,22 @@
 
 #include "PropAudio.h"
 #include "RawPlayer.h"
+#include "Arduino.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+// Legacy fixed sizing unless changed with setDefaultBufferPolicy()
+BUFFER_POLICY RawPlayer::default_policy = { false, false, 5000, 50000, 999, 150 };
+REFILL_TIME_STATS RawPlayer::refill_stats;
+
 RawPlayer::RawPlayer()
 {
 	play_mode = PlayModeNormal;
 	header_size = 0;
 	update_requested = false;
+	custom_policy = false;
+	max_buffers = PLAYER_MAX_BUFFERS;
 }
 
 RawPlayer::~RawPlayer()
@@ -49,10 +56,134 @@ bool RawPlayer::begin(uint32_t fs, uint8_t bps, bool mono, uint32_t hdrsize)
 	// sample_size is calculated in here
 	AudioSource::begin(fs, bps, mono);
 
-	// TBD: get a proper buffer size
+	return allocateBuffers();
+}
+
+bool RawPlayer::allocateBuffers()
+{
 	uint32_t samples = Audio.getOutputSamples() * 10 * (stereo ? 1 : 2);
+	uint8_t count = 2;
+
+	samples = getBufferSamples(samples, &count);
+	return buffer.allocate(samples, sample_size, count);
+}
+
+uint32_t RawPlayer::getBufferSamples(uint32_t samples, uint8_t* count)
+{
+	const BUFFER_POLICY* p = getPolicy();
+	uint32_t previous = buffer.getBufferSamples();
+	uint32_t us;
+
+	if (!p->adaptive || refill_stats.count < REFILL_HISTOGRAM_MIN_COUNT)
+		return samples;
+
+	// The samples ready when a refill is requested have to last for the refill time.
+	// That is one buffer, or two when triple buffering.
+	us = (uint32_t) (((uint64_t) getRefillTimeQuantile(p->target) * p->headroom) / 100);
+	if (p->triple && max_buffers > 2)
+	{
+		us /= 2;
+		*count = 3;
+	}
+
+	us = constrain(us, p->min_us, p->max_us);
+
+	// Plus the block the mixing may be in the middle of when the refill is requested
+	samples = (uint32_t) (((uint64_t) us * sample_rate) / 1000000) + Audio.getOutputSamples();
+
+	// Refills update the histogram from PendSV
+	__disable_irq();
+	if (previous && samples > previous)
+		refill_stats.grows++;
+	else if (previous && samples < previous)
+		refill_stats.shrinks++;
+	__enable_irq();
+
+	return samples * 2;
+}
+
+void RawPlayer::setBufferPolicy(const BUFFER_POLICY* policy)
+{
+	if (policy)
+		this->policy = *policy;
+
+	custom_policy = (policy != NULL);
+}
+
+void RawPlayer::setDefaultBufferPolicy(const BUFFER_POLICY* policy)
+{
+	default_policy = *policy;
+}
+
+void RawPlayer::getDefaultBufferPolicy(BUFFER_POLICY* policy)
+{
+	*policy = default_policy;
+}
+
+void RawPlayer::recordRefillTime(uint32_t us)
+{
+	uint32_t bin = us / REFILL_HISTOGRAM_STEP_US;
+
+	if (bin >= REFILL_HISTOGRAM_BINS)
+		bin = REFILL_HISTOGRAM_BINS - 1;
+
+	refill_stats.refills++;
+	if (us > refill_stats.max_refill_time)
+		refill_stats.max_refill_time = us;
 
-	return buffer.allocate(samples, sample_size);
+	if (refill_stats.count == REFILL_HISTOGRAM_MAX_COUNT)
+	{
+		refill_stats.count = 0;
+		for (uint32_t i = 0; i < REFILL_HISTOGRAM_BINS; i++)
+		{
+			refill_stats.bins[i] /= 2;
+			refill_stats.count += refill_stats.bins[i];
+		}
+	}
+
+	refill_stats.bins[bin]++;
+	refill_stats.count++;
+}
+
+uint32_t RawPlayer::getRefillTimeQuantile(uint16_t target)
+{
+	uint32_t result = 0;
+	uint32_t sum = 0;
+	uint32_t threshold;
+
+	__disable_irq();
+	threshold = ((uint64_t) refill_stats.count * target + 999) / 1000;
+
+	for (uint32_t i = 0; i < REFILL_HISTOGRAM_BINS; i++)
+	{
+		sum += refill_stats.bins[i];
+		if (sum >= threshold)
+		{
+			// The last bin has no upper bound
+			if (i == REFILL_HISTOGRAM_BINS - 1)
+				result = refill_stats.max_refill_time;
+			else
+				result = (i + 1) * REFILL_HISTOGRAM_STEP_US;
+			break;
+		}
+	}
+	__enable_irq();
+
+	return result;
+}
+
+void RawPlayer::getRefillTimeStats(REFILL_TIME_STATS* dst)
+{
+	__disable_irq();
+	*dst = refill_stats;
+	__enable_irq();
+}
+
+void RawPlayer::resetRefillTimeStats()
+{
+	__disable_irq();
+	memset(&refill_stats, 0, sizeof(refill_stats));
+	__enable_irq();
 }
 
 void RawPlayer::end()
@@ -71,24 +202,47 @@ uint32_t RawPlayer::getSamplesLeft()
 	return samples;
 }
 
+uint32_t RawPlayer::getRefillDeadline(playerBuffer* buffer, bool requested)
+{
+	if (!requested && !buffer->refillInProgress())
+		return REFILL_NO_DEADLINE;
+
+	return samplesToUs(buffer->getReadySamples());
+}
+
+uint32_t RawPlayer::getRefillDeadline()
+{
+	return getRefillDeadline(&buffer, update_requested);
+}
+
 UpdateResult RawPlayer::update(AudioFileHelper* file, playerBuffer* buffer)
 {
 	uint32_t samples_read = 0;
+	uint32_t samples;
 	samplesBuffer* updating_buffer = buffer->getUpdatingBuffer();
 
 	if (updating_buffer->updated)
 		return SourceUpdated;
 
-	// Read from file
-	samples_read = file->fillBuffer(updating_buffer->buffer, buffer->getBufferSamples());
+	if (!updating_buffer->samples)
+		updating_buffer->buffer = updating_buffer->base + file->getAlignmentOffset();
+
+	// Read from file, at most REFILL_CHUNK_BYTES at a time
+	samples = min(buffer->getBufferSamples() - updating_buffer->samples, (uint32_t) (REFILL_CHUNK_BYTES / sample_size));
+	samples_read = file->fillBuffer(updating_buffer->buffer + updating_buffer->samples * sample_size, samples);
 
-	if ((!samples_read || samples_read != buffer->getBufferSamples()) && !file->eofReached())
+	if ((!samples_read || samples_read != samples) && !file->eofReached())
 		// Something is wrong
 		return UpdateError;
 
-	updating_buffer->samples = samples_read;
+	updating_buffer->samples += samples_read;
+	if (updating_buffer->samples != buffer->getBufferSamples() && !file->eofReached())
+		return SourceRefilling;
+
 	updating_buffer->readptr = updating_buffer->buffer;
 	updating_buffer->updated = true;
+	if (refillCompleted())
+		recordRefillTime(stats.refill_time);
 
 	return SourceUpdated;
 }
@@ -100,7 +254,7 @@ UpdateResult RawPlayer::update()
 		// Return SourceRemove so Audio can remove this AudioSource from the list.
 		return SourceRemove;
 
-	if (!update_requested)
+	if (!update_requested && !buffer.refillInProgress())
 		return SourceUpdated;
 
 	update_requested = false;
@@ -120,6 +274,12 @@ UpdateResult RawPlayer::update()
 
 			// Request another update
 			update_requested = true;
+			refillRequested();
+			Audio.triggerUpdate();
+		} else if (!buffer.getUpdatingBuffer()->updated)
+		{
+			// With three buffers, go on with the next one
+			update_requested = true;
 			Audio.triggerUpdate();
 		}
 	}
@@ -129,7 +289,11 @@ UpdateResult RawPlayer::update()
 
 bool RawPlayer::refillBuffer(AudioFileHelper* file, samplesBuffer* buffer, uint32_t samples)
 {
-	uint32_t read_samples = file->fillBuffer(buffer->buffer, samples);
+	uint32_t read_samples;
+
+	buffer->buffer = buffer->base + file->getAlignmentOffset();
+	buffer->readptr = buffer->buffer;
+	read_samples = file->fillBuffer(buffer->buffer, samples);
 
 	if (!read_samples)
 		return false;
@@ -141,18 +305,20 @@ bool RawPlayer::refillBuffer(AudioFileHelper* file, samplesBuffer* buffer, uint3
 
 bool RawPlayer::refill(AudioFileHelper* file, playerBuffer* buffer)
 {
-	// Reset buffers
+	// Reset buffers. A refill still pending from the mixing is not needed anymore.
 	buffer->reset();
+	refillCancelled();
 
-	samplesBuffer* playing_buffer = buffer->getPlayingBuffer();
-	samplesBuffer* updating_buffer = buffer->getUpdatingBuffer();
-
-	// Fill both buffers
-	if (!refillBuffer(file, playing_buffer, buffer->getBufferSamples()))
+	// Fill all the buffers
+	if (!refillBuffer(file, buffer->getPlayingBuffer(), buffer->getBufferSamples()))
 		return false;
 
-	if (playing_buffer->samples == buffer->getBufferSamples())
-		refillBuffer(file, updating_buffer, buffer->getBufferSamples());
+	for (uint8_t i = 1; i < buffer->getBufferCount(); i++)
+	{
+		if (buffer->getBuffer(i - 1)->samples != buffer->getBufferSamples() ||
+			!refillBuffer(file, buffer->getBuffer(i), buffer->getBufferSamples()))
+			break;
+	}
 
 	return true;
 }
@@ -192,6 +358,10 @@ bool RawPlayer::play(const char* filename, PlayMode mode)
 	if (status != AudioSourceStopped)
 		stop();
 
+	// Sized again for the refill times measured so far, in the format given to begin()
+	if (getPolicy()->adaptive && !allocateBuffers())
+		return false;
+
 	if (!audio_file.openRaw(filename, sample_size, header_size, mode == PlayModeLoop))
 		return false;
 
@@ -204,6 +374,9 @@ bool RawPlayer::playRandom(const char* filename, const char* ext,
 	if (status != AudioSourceStopped)
 		stop();
 
+	if (getPolicy()->adaptive && !allocateBuffers())
+		return false;
+
 	if (!audio_file.openRandomRaw(filename, ext, min, max, sample_size, header_size,
 								  mode == PlayModeLoop))
 		return false;
@@ -253,13 +426,21 @@ char* RawPlayer::getFileName()
 
 uint32_t RawPlayer::mixingStarts(uint32_t samples)
 {
-	if (buffer.getPlayingBuffer()->updated)
+	samplesBuffer* playing_buffer = buffer.getPlayingBuffer();
+
+	if (playing_buffer->updated)
 	{
-		changeVolume(buffer.getPlayingBuffer()->readptr, samples);
-		samples = buffer.getPlayingBuffer()->samples;
-	}
-	else
+		// The block can be longer than what is left in the buffer, whose size is not
+		// a multiple of it with adaptive sizing. Don't scale past the buffer end.
+		changeVolume(playing_buffer->readptr, min(samples, playing_buffer->samples));
+		samples = playing_buffer->samples;
+	} else {
+		// The refill didn't make it in time
+		if (!audio_file.eofReached())
+			samplesUnderrun(samples);
+
 		samples = 0;
+	}
 
 	return samples;
 }
@@ -273,12 +454,13 @@ void RawPlayer::mixingEnded(uint32_t samples)
 	{
 		playing_buffer->updated = false;
 
-		// Don't switch buffers if updating_buffer is not updated,
+		// Don't switch buffers if the next buffer is not updated,
 		// since it may be still updating right now.
-		if (buffer.getUpdatingBuffer()->updated)
+		if (buffer.getNextBuffer()->updated)
 			buffer.switchBuffers();
 
 		update_requested = true;
+		refillRequested();
 		Audio.triggerUpdate();
 	}
 }
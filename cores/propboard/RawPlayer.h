@@ -32,6 +32,12 @@
 #include "AudioSource.h"
 #include "AudioFileHelper.h"
 
+#define PLAYER_MAX_BUFFERS			3
+#define REFILL_HISTOGRAM_BINS		64			// Last bin counts everything above
+#define REFILL_HISTOGRAM_STEP_US	100
+#define REFILL_HISTOGRAM_MAX_COUNT	4096		// Counts are halved when reached, so old refills weigh less
+#define REFILL_HISTOGRAM_MIN_COUNT	32			// Refills measured before buffers are sized from them
+
 enum PlayMode
 {
 	PlayModeNormal = 0,
@@ -42,11 +48,37 @@ enum PlayMode
 typedef struct
 {
 	volatile bool updated;
-	uint8_t* buffer;
+	uint8_t* base;						// FILE_READ_ALIGNMENT aligned
+	uint8_t* buffer;					// Samples start, set for each refill (see AudioFileHelper::getAlignmentOffset())
 	uint8_t* readptr;
 	uint32_t samples;
 } samplesBuffer;
 
+// Buffer sizing policy. With adaptive sizing, the time held by the buffers covers the 'target'
+// quantile of the refill times measured for all the players, plus some headroom. Buffers are
+// sized by begin(), that WavPlayer calls for every file it plays, and again by RawPlayer::play()
+// and playRandom() when the sizing is adaptive.
+typedef struct _buffer_policy
+{
+	bool adaptive;
+	bool triple;						// Three buffers, so a refill can run while two are ready
+	uint32_t min_us;					// Time limits for a single buffer
+	uint32_t max_us;
+	uint16_t target;					// Per thousand
+	uint16_t headroom;					// Percent of the target refill time
+} BUFFER_POLICY;
+
+// Refill times of all the players. Times are in uS.
+typedef struct _refill_time_stats
+{
+	uint32_t refills;
+	uint32_t max_refill_time;
+	uint32_t count;						// Refills in the histogram
+	uint32_t bins[REFILL_HISTOGRAM_BINS];
+	uint32_t grows;						// Buffers sized up/down from the previous file played
+	uint32_t shrinks;
+} REFILL_TIME_STATS;
+
 class playerBuffer
 {
 public:
@@ -54,40 +86,72 @@ public:
 	{
 		buffer_alloc = NULL;
 		alloc_size = 0;
-		playing_buffer = updating_buffer = NULL;
+		memory = NULL;
+		memory_size = 0;
+		playing_buffer = NULL;
+		buffers_count = 2;
 		buffers_samples = 0;
 	}
 
-	bool allocate(uint32_t samples, uint32_t sample_size)
+	// Buffers are taken from memory reserved by the owner (i.e. VoicePool), nothing is allocated.
+	// The memory has to be FILE_READ_ALIGNMENT aligned.
+	void assign(uint8_t* ptr, uint32_t size)
 	{
-		uint32_t size = sample_size * samples;
+		deallocate();
+		memory = ptr;
+		memory_size = size & ~(2 * FILE_READ_ALIGNMENT - 1);
+	}
+
+	// samples is the size of two buffers, count can be 2 or 3 (triple buffering)
+	bool allocate(uint32_t samples, uint32_t sample_size, uint8_t count = 2)
+	{
+		// Each buffer is aligned and has room to move its start by up to FILE_READ_ALIGNMENT bytes
+		uint32_t buffer_size = (sample_size * (samples / 2) + 2 * FILE_READ_ALIGNMENT - 1) & ~(FILE_READ_ALIGNMENT - 1);
+		uint32_t size = buffer_size * count;
+		uint8_t* buffer_ptr;
+
+		if (count < 2 || count > PLAYER_MAX_BUFFERS)
+			return false;
 
-		// Do not reallocate if we already have a buffer with the requested size
-		if (buffer_alloc && size == alloc_size)
+		if (memory)
 		{
-			// We may have changed sample_size (stereo/mono), so recalculate buffer_samples
-			buffers_samples = samples / 2;
-			return true;
-		}
+			// Formats that need more than the memory assigned get shorter buffers
+			if (size > memory_size)
+			{
+				buffer_size = (memory_size / count) & ~(FILE_READ_ALIGNMENT - 1);
+				samples = ((buffer_size - FILE_READ_ALIGNMENT) / sample_size) * 2;
+				if (!samples || buffer_size <= FILE_READ_ALIGNMENT)
+					return false;
+			}
 
-		alloc_size = size;
+			buffer_ptr = memory;
+		} else {
+			// Do not reallocate if we already have a buffer with the requested size
+			if (!buffer_alloc || size != alloc_size)
+			{
+				deallocate();
+				alloc_size = size;
 
-		// Allocate and check
-		buffer_alloc = (uint8_t*) malloc(alloc_size + 4);
-		if (!buffer_alloc)
-			return false;
+				// Allocate and check
+				buffer_alloc = (uint8_t*) malloc(alloc_size + FILE_READ_ALIGNMENT);
+				if (!buffer_alloc)
+					return false;
+			}
 
-		// Check alignment
-		uint8_t* buffer_ptr = buffer_alloc;
-		if ((uint32_t) buffer_ptr & 0x03)
-			buffer_ptr += (4 - ((uint32_t) buffer_alloc & 0x03));
+			// Check alignment
+			buffer_ptr = buffer_alloc;
+			if ((uintptr_t) buffer_ptr & (FILE_READ_ALIGNMENT - 1))
+				buffer_ptr += (FILE_READ_ALIGNMENT - ((uintptr_t) buffer_alloc & (FILE_READ_ALIGNMENT - 1)));
+		}
 
-		// Both buffers can hold the same quantity of samples
+		// All the buffers can hold the same quantity of samples. We may have
+		// changed sample_size (stereo/mono), so this is always recalculated.
 		buffers_samples = samples / 2;
+		buffers_count = count;
+
+		for (uint8_t i = 0; i < count; i++)
+			buffers[i].base = buffers[i].buffer = buffer_ptr + i * buffer_size;
 
-		// Assign double buffer pointers
-		buffers[0].buffer = buffer_ptr;
-		buffers[1].buffer = buffer_ptr + alloc_size / 2;
 		return true;
 	}
 
@@ -97,37 +161,73 @@ public:
 			free(buffer_alloc);
 
 		buffer_alloc = NULL;
+		alloc_size = 0;
 	}
 
 	void reset()
 	{
-		buffers[0].samples = buffers[1].samples = 0;
-		buffers[0].updated = buffers[1].updated = false;
-		buffers[0].readptr = buffers[0].buffer;
-		buffers[1].readptr = buffers[1].buffer;
+		for (uint8_t i = 0; i < buffers_count; i++)
+		{
+			buffers[i].samples = 0;
+			buffers[i].updated = false;
+			buffers[i].readptr = buffers[i].buffer;
+		}
+
 		playing_buffer = &buffers[0];
-		updating_buffer = &buffers[1];
 	}
 
+	// Buffers after the playing one, in the order they are played
+	inline samplesBuffer* getBuffer(uint8_t offset)
+	{
+		return &buffers[(playing_buffer - buffers + offset) % buffers_count];
+	}
+
+	// The updating buffer is the first one after the playing buffer that is not ready. It counts its
+	// samples while it's being filled in chunks. With all of them ready, it's the next one.
+	inline samplesBuffer* getUpdatingBuffer()
+	{
+		for (uint8_t i = 1; i < buffers_count - 1; i++)
+		{
+			if (!getBuffer(i)->updated)
+				return getBuffer(i);
+		}
+
+		return getBuffer(buffers_count - 1);
+	}
+
+	// Samples ready to be played, before the mixing runs out of them
+	inline uint32_t getReadySamples()
+	{
+		uint32_t samples = 0;
+
+		for (uint8_t i = 0; i < buffers_count && getBuffer(i)->updated; i++)
+			samples += getBuffer(i)->samples;
+
+		return samples;
+	}
+
+	inline bool refillInProgress() { return !getUpdatingBuffer()->updated && getUpdatingBuffer()->samples; }
+
 	inline samplesBuffer* getPlayingBuffer() { return playing_buffer; }
-	inline samplesBuffer* getUpdatingBuffer() { return updating_buffer; }
+	inline samplesBuffer* getNextBuffer() { return getBuffer(1); }
 	inline uint32_t getBufferSamples() { return buffers_samples; }
+	inline uint8_t getBufferCount() { return buffers_count; }
 
 	inline void switchBuffers()
 	{
 		__disable_irq();
-		samplesBuffer* tmp = playing_buffer;
-		playing_buffer = updating_buffer;
-		updating_buffer = tmp;
+		playing_buffer = getNextBuffer();
 		__enable_irq();
 	}
 
 private:
 	uint8_t* buffer_alloc;
 	uint32_t alloc_size;
-	samplesBuffer buffers[2];
+	uint8_t* memory;
+	uint32_t memory_size;
+	samplesBuffer buffers[PLAYER_MAX_BUFFERS];
 	samplesBuffer* playing_buffer;
-	samplesBuffer* updating_buffer;
+	uint8_t buffers_count;
 	uint32_t buffers_samples;
 };
 
@@ -139,6 +239,16 @@ public:
 
 	bool begin(uint32_t fs, uint8_t bps, bool mono, uint32_t hdrsize);
 	void end();
+	inline void setBufferMemory(uint8_t* memory, uint32_t size) { buffer.assign(memory, size); }
+	inline bool reserveFileMemory(uint32_t block_bytes, uint32_t linkmap_items) { return audio_file.reserve(block_bytes, linkmap_items); }
+	void setBufferPolicy(const BUFFER_POLICY* policy);
+	inline uint8_t getBufferCount() { return buffer.getBufferCount(); }
+	inline uint32_t getBufferTime() { return samplesToUs(buffer.getBufferSamples()); }
+	static void setDefaultBufferPolicy(const BUFFER_POLICY* policy);
+	static void getDefaultBufferPolicy(BUFFER_POLICY* policy);
+	static void getRefillTimeStats(REFILL_TIME_STATS* dst);
+	static void resetRefillTimeStats();
+	static uint32_t getRefillTimeQuantile(uint16_t target);
 	bool play(const char* filename, PlayMode mode = PlayModeNormal);
 	bool playRandom(const char* filename, const char* ext, uint32_t min, uint32_t max, PlayMode mode = PlayModeNormal);
 	bool replay();
@@ -146,6 +256,7 @@ public:
 	char* getFileName();
 	UpdateResult update();
 	uint32_t getSamplesLeft();
+	uint32_t getRefillDeadline();
 	uint32_t duration() { return audio_file.getDuration(); }
 	inline void* getNextSamplePtr()
 	{
@@ -157,6 +268,17 @@ public:
 		return ret;
 	}
 
+	inline uint8_t getNextSampleSpans(SAMPLE_SPAN* spans, uint32_t samples)
+	{
+		// Same contract as getNextSamplePtr(). Buffers are switched only in mixingEnded(),
+		// so the samples declared by getSamplesLeft() are always contiguous.
+		samplesBuffer* playing_buffer = buffer.getPlayingBuffer();
+		spans->ptr = playing_buffer->readptr;
+		spans->samples = samples;
+		playing_buffer->readptr += samples * sample_size;
+		return 1;
+	}
+
 protected:
 
 	bool doPlay(PlayMode mode);
@@ -166,13 +288,24 @@ protected:
 	bool refill(AudioFileHelper* file, playerBuffer* buffer);
 	bool refillBuffer(AudioFileHelper* file, samplesBuffer* buffer, uint32_t samples);
 	UpdateResult update(AudioFileHelper* file, playerBuffer* buffer);
+	uint32_t getRefillDeadline(playerBuffer* buffer, bool requested);
+	uint32_t getBufferSamples(uint32_t samples, uint8_t* count);
+	bool allocateBuffers();
+	inline const BUFFER_POLICY* getPolicy() { return custom_policy ? &policy : &default_policy; }
+	static void recordRefillTime(uint32_t us);
 
 	AudioFileHelper audio_file;
 	PlayMode play_mode;
 	uint32_t header_size;
 	bool update_requested;
+	BUFFER_POLICY policy;
+	bool custom_policy;
+	uint8_t max_buffers;
 
 	playerBuffer buffer;
+
+	static BUFFER_POLICY default_policy;
+	static REFILL_TIME_STATS refill_stats;
 };
 
 #endif /* __RAWPLAYER_H__ */
@@ -0,0 +1,341 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### SwingSynth.cpp
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+#include "SwingSynth.h"
+#include "AudioFileHelper.h"
+#include "Arduino.h"
+
+// Loads a whole 16-bit mono WAV file in RAM
+static int16_t* loadLoop(const char* name, uint32_t* samples, uint32_t* fs)
+{
+	AudioFileHelper file;
+	int16_t* data;
+
+	if (!file.openWav(name, false))
+		return NULL;
+
+	if (file.getWavHeader()->format.bits_per_sample != 16 || file.getWavHeader()->format.channels != 1)
+	{
+		file.close();
+		return NULL;
+	}
+
+	*fs = file.getWavHeader()->format.sample_rate;
+	*samples = file.getSamplesLeft();
+
+	data = (int16_t*) malloc(*samples * sizeof(int16_t));
+	if (data && (!*samples || file.fillBuffer((uint8_t*) data, *samples) != *samples))
+	{
+		free(data);
+		data = NULL;
+	}
+
+	file.close();
+	return data;
+}
+
+// Next sample of a loop, linearly interpolated, advancing 'step' (Q16)
+static inline int32_t nextLoopSample(const int16_t* data, uint32_t samples, uint32_t* index, uint32_t* fraction, uint32_t step)
+{
+	uint32_t next = *index + 1;
+	if (next == samples)
+		next = 0;
+
+	int32_t a = data[*index];
+	int32_t value = a + (((data[next] - a) * (int32_t) *fraction) >> 16);
+
+	*fraction += step;
+	*index += *fraction >> 16;
+	*fraction &= 0xFFFF;
+	while (*index >= samples)
+		*index -= samples;
+
+	return value;
+}
+
+SwingSynth::SwingSynth()
+{
+	memset(&hum_loop, 0, sizeof(hum_loop));
+	memset(&swing_loop, 0, sizeof(swing_loop));
+	owns_loops = false;
+	render_buffer = read_ptr = NULL;
+	render_size = render_samples = 0;
+	target_intensity = intensity = 0;
+	min_g = SWING_DEFAULT_MIN_G;
+	max_g = SWING_DEFAULT_MAX_G;
+	attack_ms = SWING_DEFAULT_ATTACK_MS;
+	release_ms = SWING_DEFAULT_RELEASE_MS;
+	attack_coef = release_coef = 1;
+	hum_pitch = SWING_DEFAULT_HUM_PITCH;
+	swing_pitch = SWING_DEFAULT_SWING_PITCH;
+	hum_level = SWING_DEFAULT_HUM_LEVEL;
+}
+
+SwingSynth::~SwingSynth()
+{
+	end();
+}
+
+bool SwingSynth::begin(const char* hum_file, const char* swing_file)
+{
+	int16_t* hum;
+	int16_t* swing;
+	uint32_t hum_samples, swing_samples;
+	uint32_t hum_fs, swing_fs;
+
+	end();
+
+	hum = loadLoop(hum_file, &hum_samples, &hum_fs);
+	if (!hum)
+		return false;
+
+	swing = loadLoop(swing_file, &swing_samples, &swing_fs);
+	if (!swing || swing_fs != hum_fs ||
+		!begin(hum, hum_samples, swing, swing_samples, hum_fs))
+	{
+		free(hum);
+		if (swing)
+			free(swing);
+		return false;
+	}
+
+	owns_loops = true;
+	return true;
+}
+
+bool SwingSynth::begin(const int16_t* hum, uint32_t hum_samples, const int16_t* swing, uint32_t swing_samples, uint32_t fs)
+{
+	if (!hum || !swing || !hum_samples || !swing_samples)
+		return false;
+
+	end();
+
+	AudioSource::begin(fs, 16, true);
+
+	hum_loop.data = hum;
+	hum_loop.samples = hum_samples;
+	swing_loop.data = swing;
+	swing_loop.samples = swing_samples;
+	hum_loop.index = hum_loop.fraction = 0;
+	swing_loop.index = swing_loop.fraction = 0;
+	owns_loops = false;
+	return true;
+}
+
+void SwingSynth::freeLoops()
+{
+	if (owns_loops)
+	{
+		free((void*) hum_loop.data);
+		free((void*) swing_loop.data);
+	}
+
+	memset(&hum_loop, 0, sizeof(hum_loop));
+	memset(&swing_loop, 0, sizeof(swing_loop));
+	owns_loops = false;
+}
+
+void SwingSynth::end()
+{
+	stop();
+	freeLoops();
+
+	if (render_buffer)
+		free(render_buffer);
+
+	render_buffer = read_ptr = NULL;
+	render_size = render_samples = 0;
+}
+
+bool SwingSynth::play()
+{
+	uint32_t size = Audio.getOutputSamples();
+
+	if (!hum_loop.data || !size)
+		return false;
+
+	// Blocks are rendered when the mixing asks for them, one output buffer at most
+	if (render_size != size)
+	{
+		if (render_buffer)
+			free(render_buffer);
+
+		render_buffer = (int16_t*) malloc(size * sizeof(int16_t));
+		if (!render_buffer)
+		{
+			render_size = 0;
+			return false;
+		}
+
+		render_size = size;
+	}
+
+	render_samples = 0;
+	read_ptr = render_buffer;
+	intensity = target_intensity;
+	calculateResponse();
+
+	return AudioSource::play();
+}
+
+UpdateResult SwingSynth::update()
+{
+	// Nothing to refill
+	return SourceUpdated;
+}
+
+bool SwingSynth::updateMotion()
+{
+	float x, y, z;
+
+	if (!Motion.read(&x, &y, &z))
+		return false;
+
+	// Whatever isn't gravity
+	setMotion(fabsf(sqrtf(x * x + y * y + z * z) - 1.0f));
+	return true;
+}
+
+void SwingSynth::setMotion(float g)
+{
+	setIntensity((g - min_g) / (max_g - min_g));
+}
+
+void SwingSynth::setIntensity(float value)
+{
+	target_intensity = constrain(value, 0.0f, 1.0f);
+}
+
+void SwingSynth::setSensitivity(float min_g, float max_g)
+{
+	if (max_g <= min_g)
+		return;
+
+	this->min_g = min_g;
+	this->max_g = max_g;
+}
+
+void SwingSynth::setResponse(uint32_t attack_ms, uint32_t release_ms)
+{
+	this->attack_ms = attack_ms;
+	this->release_ms = release_ms;
+	calculateResponse();
+}
+
+void SwingSynth::calculateResponse()
+{
+	float block_ms;
+	float attack = 1, release = 1;
+
+	if (sample_rate && Audio.getOutputSamples())
+	{
+		// One-pole smoothing, applied once per output buffer
+		block_ms = (Audio.getOutputSamples() * 1000.0f) / sample_rate;
+		if (attack_ms)
+			attack = 1.0f - expf(-block_ms / attack_ms);
+		if (release_ms)
+			release = 1.0f - expf(-block_ms / release_ms);
+	}
+
+	__disable_irq();
+	attack_coef = attack;
+	release_coef = release;
+	__enable_irq();
+}
+
+void SwingSynth::setPitchRange(float hum, float swing)
+{
+	hum_pitch = max(hum, 0.0f);
+	swing_pitch = max(swing, 0.0f);
+}
+
+void SwingSynth::setHumLevel(float level)
+{
+	hum_level = constrain(level, 0.0f, 1.0f);
+}
+
+void SwingSynth::render(uint32_t samples)
+{
+	float target = target_intensity;
+	int32_t hum_gain, swing_gain;
+	uint32_t hum_step, swing_step;
+	int32_t hum, swing;
+	int16_t* ptr = render_buffer;
+
+	// Gains and pitch are calculated once per block
+	intensity += (target - intensity) * (target > intensity ? attack_coef : release_coef);
+
+	// Equal power crossfade, the hum doesn't go below hum_level
+	swing_gain = (int32_t) (sqrtf(intensity) * 32767);
+	hum_gain = (int32_t) ((hum_level + (1.0f - hum_level) * sqrtf(1.0f - intensity)) * 32767);
+	hum_step = (uint32_t) ((1.0f + intensity * hum_pitch) * 65536);
+	swing_step = (uint32_t) ((1.0f + intensity * swing_pitch) * 65536);
+
+	for (uint32_t i = 0; i < samples; i++)
+	{
+		hum = nextLoopSample(hum_loop.data, hum_loop.samples, &hum_loop.index, &hum_loop.fraction, hum_step);
+		swing = nextLoopSample(swing_loop.data, swing_loop.samples, &swing_loop.index, &swing_loop.fraction, swing_step);
+		*ptr++ = __SSAT((hum * hum_gain + swing * swing_gain) >> 15, 16);
+	}
+
+	render_samples = samples;
+	read_ptr = render_buffer;
+}
+
+uint32_t SwingSynth::getSamplesLeft()
+{
+	return render_samples;
+}
+
+void* SwingSynth::getNextSamplePtr()
+{
+	void* ret = read_ptr;
+	read_ptr++;
+	return ret;
+}
+
+uint8_t SwingSynth::getNextSampleSpans(SAMPLE_SPAN* spans, uint32_t samples)
+{
+	spans->ptr = (uint8_t*) read_ptr;
+	spans->samples = samples;
+	read_ptr += samples;
+	return 1;
+}
+
+uint32_t SwingSynth::mixingStarts(uint32_t samples)
+{
+	if (!render_samples)
+	{
+		render(min(samples, render_size));
+		changeVolume((uint8_t*) render_buffer, render_samples);
+	}
+
+	return render_samples;
+}
+
+void SwingSynth::mixingEnded(uint32_t samples)
+{
+	render_samples -= min(samples, render_samples);
+}
@@ -0,0 +1,106 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### SwingSynth.h
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+#ifndef __SWINGSYNTH_H__
+#define __SWINGSYNTH_H__
+
+#include <stm32f4xx.h>
+#include "AudioSource.h"
+
+#define SWING_DEFAULT_MIN_G			0.1f		// Motion (in g, without gravity) where the swing starts
+#define SWING_DEFAULT_MAX_G			2.0f		// Motion where the swing is full
+#define SWING_DEFAULT_ATTACK_MS		20
+#define SWING_DEFAULT_RELEASE_MS	150
+#define SWING_DEFAULT_HUM_PITCH		0.05f		// Pitch increase at full swing (0.05 = +5%)
+#define SWING_DEFAULT_SWING_PITCH	0.25f
+#define SWING_DEFAULT_HUM_LEVEL		0.5f		// Hum gain left at full swing
+
+// Procedural hum/swing source. Two 16-bit mono loops held in RAM play continuously, the swing
+// intensity crossfades between them and raises their pitch. The intensity comes from the
+// accelerometer (updateMotion(), from the sketch loop) and is smoothed, turned into gains and
+// pitch once per mixing block. No file system access while playing.
+class SwingSynth : public AudioSource
+{
+public:
+	SwingSynth();
+	~SwingSynth();
+
+	bool begin(const char* hum_file, const char* swing_file);
+	bool begin(const int16_t* hum, uint32_t hum_samples, const int16_t* swing, uint32_t swing_samples, uint32_t fs);
+	void end();
+	bool play();
+	UpdateResult update();
+
+	bool updateMotion();
+	void setMotion(float g);
+	void setIntensity(float value);
+	inline float getIntensity() { return intensity; }
+	void setSensitivity(float min_g, float max_g);
+	void setResponse(uint32_t attack_ms, uint32_t release_ms);
+	void setPitchRange(float hum, float swing);
+	void setHumLevel(float level);
+
+	uint32_t getSamplesLeft();
+	void* getNextSamplePtr();
+	uint8_t getNextSampleSpans(SAMPLE_SPAN* spans, uint32_t samples);
+
+protected:
+	uint32_t mixingStarts(uint32_t samples);
+	void mixingEnded(uint32_t samples);
+	void render(uint32_t samples);
+	void calculateResponse();
+	void freeLoops();
+
+	typedef struct _swing_loop
+	{
+		const int16_t* data;
+		uint32_t samples;
+		uint32_t index;
+		uint32_t fraction;				// Q16
+	} SWING_LOOP;
+
+	SWING_LOOP hum_loop;
+	SWING_LOOP swing_loop;
+	bool owns_loops;
+
+	int16_t* render_buffer;
+	uint32_t render_size;
+	uint32_t render_samples;
+	int16_t* read_ptr;
+
+	volatile float target_intensity;
+	float intensity;
+	float min_g;
+	float max_g;
+	uint32_t attack_ms;
+	uint32_t release_ms;
+	float attack_coef;					// Smoothing per mixing block
+	float release_coef;
+	float hum_pitch;
+	float swing_pitch;
+	float hum_level;
+};
+
+#endif /* __SWINGSYNTH_H__ */
@@ -0,0 +1,292 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### VoicePool.cpp
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+#include "PropAudio.h"
+#include "VoicePool.h"
+#include <string.h>
+#include <stdlib.h>
+
+VoicePool::VoicePool()
+{
+	voices = NULL;
+	memory_alloc = NULL;
+	buffer_bytes = 0;
+	voice_count = 0;
+	play_counter = 0;
+	memset(priorities, 0, sizeof(priorities));
+	memset(groups, 0, sizeof(groups));
+	memset(started, 0, sizeof(started));
+	memset(group_limits, 0, sizeof(group_limits));
+	memset(&stats, 0, sizeof(stats));
+}
+
+VoicePool::~VoicePool()
+{
+	end();
+}
+
+bool VoicePool::begin(uint8_t count, uint32_t bytes, uint32_t block_bytes, uint32_t linkmap_items)
+{
+	uint8_t* memory;
+
+	end();
+
+	if (!count || count > VOICE_POOL_MAX_VOICES)
+		return false;
+
+	// By default, what RawPlayer::begin() allocates for 16-bit files. Bigger samples get shorter buffers.
+	if (!bytes)
+		bytes = 2 * ((Audio.getOutputSamples() * 20 + 2 * FILE_READ_ALIGNMENT - 1) & ~(FILE_READ_ALIGNMENT - 1));
+
+	bytes = (bytes + 2 * FILE_READ_ALIGNMENT - 1) & ~(2 * FILE_READ_ALIGNMENT - 1);
+	if (bytes < 4 * FILE_READ_ALIGNMENT)
+		return false;
+
+	voices = new WavPlayer[count];
+	if (!voices)
+		return false;
+
+	// One block for all the voices, taken once
+	memory_alloc = (uint8_t*) malloc(bytes * count + FILE_READ_ALIGNMENT);
+	if (!memory_alloc)
+	{
+		delete[] voices;
+		voices = NULL;
+		return false;
+	}
+
+	memory = memory_alloc;
+	if ((uintptr_t) memory & (FILE_READ_ALIGNMENT - 1))
+		memory += (FILE_READ_ALIGNMENT - ((uintptr_t) memory & (FILE_READ_ALIGNMENT - 1)));
+
+	voice_count = count;
+	buffer_bytes = bytes;
+	play_counter = 0;
+
+	for (uint8_t i = 0; i < count; i++)
+	{
+		voices[i].setBufferMemory(memory + i * bytes, bytes);
+
+		// What opening a file would allocate, taken now
+		if (!voices[i].reserveFileMemory(block_bytes, linkmap_items))
+		{
+			end();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void VoicePool::end()
+{
+	if (voices)
+	{
+		stopAll();
+		delete[] voices;
+	}
+
+	if (memory_alloc)
+		free(memory_alloc);
+
+	voices = NULL;
+	memory_alloc = NULL;
+	voice_count = 0;
+	buffer_bytes = 0;
+}
+
+bool VoicePool::setGroupLimit(uint8_t group, uint8_t count)
+{
+	if (group >= VOICE_POOL_GROUPS)
+		return false;
+
+	// 0 is no limit
+	group_limits[group] = count;
+	return true;
+}
+
+uint8_t VoicePool::getActiveVoices(uint8_t group)
+{
+	uint8_t count = 0;
+
+	for (uint8_t i = 0; i < voice_count; i++)
+	{
+		if (active(i) && (group == VOICE_ANY_GROUP || groups[i] == group))
+			count++;
+	}
+
+	return count;
+}
+
+int8_t VoicePool::getVictim(uint8_t priority, uint8_t group)
+{
+	int8_t victim = VOICE_NONE;
+	float volume = 0;
+
+	for (uint8_t i = 0; i < voice_count; i++)
+	{
+		if (!active(i) || priorities[i] > priority)
+			continue;
+
+		if (group != VOICE_ANY_GROUP && groups[i] != group)
+			continue;
+
+		float v = voices[i].getVolume();
+
+		// Lowest priority, then quietest, then oldest
+		if (victim == VOICE_NONE || priorities[i] < priorities[victim] ||
+			(priorities[i] == priorities[victim] && (v < volume ||
+			(v == volume && (int32_t) (started[i] - started[victim]) < 0))))
+		{
+			victim = i;
+			volume = v;
+		}
+	}
+
+	return victim;
+}
+
+int8_t VoicePool::pickVoice(uint8_t priority, uint8_t group)
+{
+	int8_t voice;
+
+	// A group at its limit gives up one of its own voices
+	if (group < VOICE_POOL_GROUPS && group_limits[group] && getActiveVoices(group) >= group_limits[group])
+	{
+		voice = getVictim(priority, group);
+		if (voice != VOICE_NONE)
+			stats.group_steals++;
+
+		return voice;
+	}
+
+	for (uint8_t i = 0; i < voice_count; i++)
+	{
+		if (!active(i))
+			return i;
+	}
+
+	return getVictim(priority, VOICE_ANY_GROUP);
+}
+
+int8_t VoicePool::start(int8_t voice, bool random, const char* filename, uint32_t min, uint32_t max,
+						uint8_t priority, uint8_t group, PlayMode mode, float volume)
+{
+	WavPlayer* player;
+	bool ok;
+
+	if (voice == VOICE_NONE)
+	{
+		stats.rejected++;
+		return VOICE_NONE;
+	}
+
+	player = &voices[voice];
+	if (active(voice))
+	{
+		stats.steals++;
+		player->stop();
+	}
+
+	// Stopped, so the volume is set without a ramp
+	player->setVolume(volume);
+
+	// Set before playing: PlayModeBlocking returns at the end of the sound
+	priorities[voice] = priority;
+	groups[voice] = group;
+	started[voice] = ++play_counter;
+
+	if (random)
+		ok = player->playRandom(filename, min, max, mode);
+	else
+		ok = player->play(filename, mode);
+
+	if (!ok)
+	{
+		stats.errors++;
+		return VOICE_NONE;
+	}
+
+	stats.plays++;
+	return voice;
+}
+
+int8_t VoicePool::play(const char* filename, uint8_t priority, uint8_t group, PlayMode mode, float volume)
+{
+	if (!voice_count)
+		return VOICE_NONE;
+
+	return start(pickVoice(priority, group), false, filename, 0, 0, priority, group, mode, volume);
+}
+
+int8_t VoicePool::playRandom(const char* filename, uint32_t min, uint32_t max, uint8_t priority,
+							 uint8_t group, PlayMode mode, float volume)
+{
+	if (!voice_count)
+		return VOICE_NONE;
+
+	return start(pickVoice(priority, group), true, filename, min, max, priority, group, mode, volume);
+}
+
+bool VoicePool::stop(int8_t voice)
+{
+	if (voice < 0 || voice >= voice_count)
+		return false;
+
+	return voices[voice].stop();
+}
+
+void VoicePool::stopGroup(uint8_t group)
+{
+	for (uint8_t i = 0; i < voice_count; i++)
+	{
+		if (active(i) && groups[i] == group)
+			voices[i].stop();
+	}
+}
+
+void VoicePool::stopAll()
+{
+	for (uint8_t i = 0; i < voice_count; i++)
+		voices[i].stop();
+}
+
+WavPlayer* VoicePool::getVoice(int8_t voice)
+{
+	if (voice < 0 || voice >= voice_count)
+		return NULL;
+
+	return &voices[voice];
+}
+
+void VoicePool::getStats(VOICE_POOL_STATS* dst)
+{
+	memcpy(dst, &stats, sizeof(VOICE_POOL_STATS));
+}
+
+void VoicePool::resetStats()
+{
+	memset(&stats, 0, sizeof(VOICE_POOL_STATS));
+}
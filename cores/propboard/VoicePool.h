@@ -0,0 +1,101 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### VoicePool.h
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+#ifndef __VOICEPOOL_H__
+#define __VOICEPOOL_H__
+
+#include <stm32f4xx.h>
+#include "WavPlayer.h"
+
+#define VOICE_POOL_MAX_VOICES		16
+#define VOICE_POOL_GROUPS			8
+#define VOICE_NONE					-1
+#define VOICE_ANY_GROUP				0xFF
+#define VOICE_POOL_BLOCK_BYTES		1024				// IMA-ADPCM blocks up to this size, per voice
+#define VOICE_POOL_LINKMAP_ITEMS	FILE_LINKMAP_ITEMS	// Cluster link map per voice, in the helper
+
+typedef struct _voice_pool_stats
+{
+	uint32_t plays;						// Requests that got a voice
+	uint32_t steals;					// Voices stopped to play another sound
+	uint32_t group_steals;				// Part of steals made to keep a group within its limit
+	uint32_t rejected;					// Requests that couldn't take a voice from sounds with higher priority
+	uint32_t errors;					// Files that couldn't be played
+} VOICE_POOL_STATS;
+
+// A fixed set of WavPlayers sharing a block of memory reserved in begin(), so sounds don't need a
+// player each and playing allocates nothing. begin() also reserves, per voice, the IMA-ADPCM block
+// and the cluster link map: ADPCM files with bigger blocks can't be played, and files with more
+// fragments than the map holds are read following the FAT. Requests come with a priority and a
+// group. When all the voices are busy, or the group already has as many voices as its limit, the
+// voice with the lowest priority is stopped for the new sound; among those, the quietest, then the
+// oldest one. Voices playing sounds with higher priority than the request are never taken.
+class VoicePool
+{
+public:
+	VoicePool();
+	~VoicePool();
+
+	bool begin(uint8_t count, uint32_t bytes = 0, uint32_t block_bytes = VOICE_POOL_BLOCK_BYTES,
+			   uint32_t linkmap_items = VOICE_POOL_LINKMAP_ITEMS);
+	void end();
+
+	bool setGroupLimit(uint8_t group, uint8_t count);
+	int8_t play(const char* filename, uint8_t priority = 0, uint8_t group = 0,
+				PlayMode mode = PlayModeNormal, float volume = 1.0f);
+	int8_t playRandom(const char* filename, uint32_t min, uint32_t max, uint8_t priority = 0,
+					  uint8_t group = 0, PlayMode mode = PlayModeNormal, float volume = 1.0f);
+	bool stop(int8_t voice);
+	void stopGroup(uint8_t group);
+	void stopAll();
+
+	WavPlayer* getVoice(int8_t voice);
+	uint8_t getActiveVoices(uint8_t group = VOICE_ANY_GROUP);
+	inline uint8_t getVoiceCount() { return voice_count; }
+	inline uint32_t getBufferBytes() { return buffer_bytes; }
+	inline uint32_t getMemorySize() { return buffer_bytes * voice_count; }
+	void getStats(VOICE_POOL_STATS* dst);
+	void resetStats();
+
+private:
+	int8_t pickVoice(uint8_t priority, uint8_t group);
+	int8_t getVictim(uint8_t priority, uint8_t group);
+	int8_t start(int8_t voice, bool random, const char* filename, uint32_t min, uint32_t max,
+				 uint8_t priority, uint8_t group, PlayMode mode, float volume);
+	inline bool active(uint8_t voice) { return voices[voice].getStatus() != AudioSourceStopped; }
+
+	WavPlayer* voices;
+	uint8_t* memory_alloc;
+	uint32_t buffer_bytes;				// Per voice
+	uint8_t voice_count;
+	uint8_t priorities[VOICE_POOL_MAX_VOICES];
+	uint8_t groups[VOICE_POOL_MAX_VOICES];
+	uint32_t started[VOICE_POOL_MAX_VOICES];
+	uint8_t group_limits[VOICE_POOL_GROUPS];
+	uint32_t play_counter;
+	VOICE_POOL_STATS stats;
+};
+
+#endif /* __VOICEPOOL_H__ */
@@ -42,9 +42,11 @@ WavChainPlayer::~WavChainPlayer()
 
 bool WavChainPlayer::begin(const char* filename)
 {
-	if (audio_file.isOpened())
+	if (main_track.file->isOpened())
 		return false;
 
+	resetTracks();
+
 	if (!audio_file.openWav(filename, true))
 		return false;
 
@@ -57,6 +59,8 @@ bool WavChainPlayer::begin(const char* filename)
 		return false;
 	}
 
+	strcpy(main_name, filename);
+
 	// Do fill buffers
 	if (refill())
 	{
@@ -68,31 +72,40 @@ bool WavChainPlayer::begin(const char* filename)
 	return false;
 }
 
-bool WavChainPlayer::doChain(PlayMode mode)
+bool WavChainPlayer::openTrack(AudioFileHelper* file, const char* filename, bool loop)
+{
+	return file->openWav(filename, loop);
+}
+
+bool WavChainPlayer::doChain(AudioFileHelper* file, PlayMode mode)
 {
-	// Chained track must match main track
-	if (memcmp(&audio_file.getWavHeader()->format,
-			   &chained_file.getWavHeader()->format,
+	// Chained track must match the one playing (which matches the main track)
+	AudioFileHelper* playing_file = (file == chained_track.file) ? main_track.file : chained_track.file;
+
+	if (memcmp(&playing_file->getWavHeader()->format,
+			   &file->getWavHeader()->format,
 			   sizeof(WAV_FORMAT)) != 0)
 		return false;
 
-	return RawChainPlayer::doChain(mode);
+	return RawChainPlayer::doChain(file, mode);
 }
 
 bool WavChainPlayer::chain(const char* filename, PlayMode mode)
 {
-	if (!audio_file.isOpened())
+	AudioFileHelper* file;
+
+	if (!main_track.file->isOpened())
 		return false;
 
-	if (chained_status == PlayingChained)
+	if (!crossfade_samples && chained_status == PlayingChained)
 		setChainedStatus(PlayingMain);
 
-	if (!chained_file.openWav(filename, mode == PlayModeLoop))
-		return false;
+	file = getLoadingFile();
+	loading = true;
 
-	if (!doChain(mode))
+	if (!file->openWav(filename, mode == PlayModeLoop) || !doChain(file, mode))
 	{
-		chained_file.close();
+		abortChain(file);
 		return false;
 	}
 
@@ -101,21 +114,23 @@ bool WavChainPlayer::chain(const char* filename, PlayMode mode)
 
 bool WavChainPlayer::chainRandom(const char* filename, uint32_t min, uint32_t max, PlayMode mode)
 {
-	if (!audio_file.isOpened())
+	AudioFileHelper* file;
+
+	if (!main_track.file->isOpened())
 		return false;
 
-	if (chained_status == PlayingChained)
+	if (!crossfade_samples && chained_status == PlayingChained)
 	{
 		setChainedStatus(PlayingMain);
-		chained_file.close();
+		chained_track.file->close();
 	}
 
-	if (!chained_file.openRandomWav(filename, min, max, mode == PlayModeLoop))
-		return false;
+	file = getLoadingFile();
+	loading = true;
 
-	if (!doChain(mode))
+	if (!file->openRandomWav(filename, min, max, mode == PlayModeLoop) || !doChain(file, mode))
 	{
-		chained_file.close();
+		abortChain(file);
 		return false;
 	}
 
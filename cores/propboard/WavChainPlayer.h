@@ -39,9 +39,11 @@ public:
 	bool chain(const char* filename, PlayMode mode = PlayModeNormal);
 	bool chainRandom(const char* filename, uint32_t min, uint32_t max, PlayMode mode = PlayModeNormal);
 
-private:
+protected:
+	bool openTrack(AudioFileHelper* file, const char* filename, bool loop);
 
-	bool doChain(PlayMode mode);
+private:
+	bool doChain(AudioFileHelper* file, PlayMode mode);
 };
 
 #endif /* __WAVCHAINPLAYER_H__ */
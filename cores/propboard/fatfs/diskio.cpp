@@ -9,12 +9,175 @@
 
 #include <sdcard.h>
 #include "diskio.h"		/* FatFs lower layer API */
+#include <string.h>
 
 /* Definitions of physical drive number for each drive */
 #define DEV_RAM		0	/* Example: Map Ramdisk to physical drive 0 */
 #define DEV_MMC		1	/* Example: Map MMC/SD card to physical drive 1 */
 #define DEV_USB		2	/* Example: Map USB MSD to physical drive 2 */
 
+/* Sector cache. Single sector reads (FAT, directories and the partial sectors
+   of files) are kept in DISK_CACHE_SLOTS slots, replaced by LRU. A miss on the
+   sector after the last single sector read fetches DISK_CACHE_READ_AHEAD sectors
+   with one multi-block read. Writes go through to the card. Multi-sector reads
+   are done straight into the caller's buffer. Set DISK_CACHE_SLOTS to 0 to
+   disable the cache. */
+#ifndef DISK_CACHE_SLOTS
+#define DISK_CACHE_SLOTS		8
+#endif
+
+#ifndef DISK_CACHE_READ_AHEAD
+#define DISK_CACHE_READ_AHEAD	4
+#endif
+
+#define DISK_SECTOR_SIZE		512
+#define DISK_CACHE_SECTOR_SIZE	DISK_SECTOR_SIZE
+#define DISK_CACHE_NO_SECTOR	0xFFFFFFFF
+
+#if DISK_CACHE_SLOTS
+
+#if DISK_CACHE_READ_AHEAD > DISK_CACHE_SLOTS
+#error "DISK_CACHE_READ_AHEAD can't be bigger than DISK_CACHE_SLOTS"
+#endif
+
+static BYTE cache_data[DISK_CACHE_SLOTS][DISK_CACHE_SECTOR_SIZE] __attribute__ ((aligned(16)));
+static DWORD cache_sector[DISK_CACHE_SLOTS];
+static DWORD cache_used[DISK_CACHE_SLOTS];		/* Time of last use, 0 for never */
+static DWORD cache_clock = 0;
+static DWORD cache_next_sector = DISK_CACHE_NO_SECTOR;
+#endif /* DISK_CACHE_SLOTS */
+
+static DISK_CACHE_STATS cache_stats;
+
+#if DISK_CACHE_SLOTS
+static int cacheFind (DWORD sector)
+{
+	for (int i = 0; i < DISK_CACHE_SLOTS; i++)
+	{
+		if (cache_used[i] && cache_sector[i] == sector)
+			return i;
+	}
+
+	return -1;
+}
+
+/* First of 'count' consecutive slots whose most recent use is the oldest */
+static int cacheVictim (UINT count)
+{
+	DWORD oldest = 0xFFFFFFFF;
+	int victim = 0;
+
+	for (int i = 0; i <= DISK_CACHE_SLOTS - (int) count; i++)
+	{
+		DWORD newest = 0;
+
+		for (UINT j = 0; j < count; j++)
+		{
+			if (cache_used[i + j] > newest)
+				newest = cache_used[i + j];
+		}
+
+		if (newest < oldest)
+		{
+			oldest = newest;
+			victim = i;
+		}
+	}
+
+	return victim;
+}
+
+static DRESULT cacheRead (BYTE* buff, DWORD sector)
+{
+	UINT count = 1;
+	bool sequential;
+	int slot;
+
+	/* The sector before is still cached when a stream of reads comes back to the cache in time,
+	   even with other streams in between */
+	sequential = (sector == cache_next_sector || (sector && cacheFind(sector - 1) >= 0));
+	cache_next_sector = sector + 1;
+
+	slot = cacheFind(sector);
+	if (slot >= 0)
+	{
+		cache_stats.hits++;
+		cache_used[slot] = ++cache_clock;
+		memcpy(buff, cache_data[slot], DISK_CACHE_SECTOR_SIZE);
+		return RES_OK;
+	}
+
+	cache_stats.misses++;
+
+	/* Read ahead on sequential accesses, with a single command */
+	if (sequential)
+		count = DISK_CACHE_READ_AHEAD;
+
+	slot = cacheVictim(count);
+	for (UINT i = 0; i < count; i++)
+		cache_used[slot + i] = 0;
+
+	if (count > 1 && sdReadBlocks(sector, cache_data[slot], count) != SD_NO_ERROR)
+		/* Maybe past the end of the card. Read the sector alone. */
+		count = 1;
+	else if (count > 1)
+	{
+		cache_stats.read_aheads++;
+		cache_stats.read_ahead_sectors += count - 1;
+	}
+
+	if (count == 1 && sdReadBlocks(sector, cache_data[slot], 1) != SD_NO_ERROR)
+		return RES_ERROR;
+
+	for (UINT i = 0; i < count; i++)
+	{
+		cache_sector[slot + i] = sector + i;
+		cache_used[slot + i] = ++cache_clock;
+	}
+
+	memcpy(buff, cache_data[slot], DISK_CACHE_SECTOR_SIZE);
+	return RES_OK;
+}
+
+/* Write-through: the cached copies of the sectors written are updated */
+static void cacheWrite (const BYTE* buff, DWORD sector, UINT count, bool written)
+{
+	for (int i = 0; i < DISK_CACHE_SLOTS; i++)
+	{
+		if (!cache_used[i] || cache_sector[i] < sector || cache_sector[i] >= sector + count)
+			continue;
+
+		if (written)
+		{
+			memcpy(cache_data[i], buff + (cache_sector[i] - sector) * DISK_CACHE_SECTOR_SIZE, DISK_CACHE_SECTOR_SIZE);
+			cache_stats.updated++;
+		} else {
+			/* Don't know what the card holds now */
+			cache_used[i] = 0;
+		}
+	}
+}
+#endif /* DISK_CACHE_SLOTS */
+
+void disk_cache_invalidate (void)
+{
+#if DISK_CACHE_SLOTS
+	memset(cache_used, 0, sizeof(cache_used));
+	cache_clock = 0;
+	cache_next_sector = DISK_CACHE_NO_SECTOR;
+#endif /* DISK_CACHE_SLOTS */
+}
+
+void disk_cache_stats (DISK_CACHE_STATS* stats)
+{
+	*stats = cache_stats;
+}
+
+void disk_cache_reset_stats (void)
+{
+	memset(&cache_stats, 0, sizeof(cache_stats));
+}
+
 
 /*-----------------------------------------------------------------------*/
 /* Get Drive Status                                                      */
@@ -44,6 +207,9 @@ DSTATUS disk_initialize (
 {
 	UNUSED(pdrv);
 
+	/* The card may have been changed */
+	disk_cache_invalidate();
+
 	if (sdInitialize() == SD_NO_ERROR)
 		return RES_OK;
 
@@ -63,10 +229,37 @@ DRESULT disk_read (
 	UINT count		/* Number of sectors to read */
 )
 {
+	UINT limit;
+
 	UNUSED(pdrv);
 
-	if (sdReadBlocks(sector, buff, count) != SD_NO_ERROR)
-		return RES_ERROR;
+	/* A pending audio update runs before every read of a user operation, and between
+	   chunks of the long ones */
+	fs_yield();
+
+#if DISK_CACHE_SLOTS
+	if (count == 1)
+		return cacheRead(buff, sector);
+
+	cache_stats.bypassed++;
+#endif /* DISK_CACHE_SLOTS */
+
+	limit = fs_transfer_limit();
+
+	while (count)
+	{
+		UINT chunk = (limit && count > limit) ? limit : count;
+
+		if (sdReadBlocks(sector, buff, chunk) != SD_NO_ERROR)
+			return RES_ERROR;
+
+		buff += chunk * DISK_SECTOR_SIZE;
+		sector += chunk;
+		count -= chunk;
+
+		if (count)
+			fs_yield();
+	}
 
 	return RES_OK;
 }
@@ -84,10 +277,41 @@ DRESULT disk_write (
 	UINT count			/* Number of sectors to write */
 )
 {
+	UINT limit;
+
 	UNUSED(pdrv);
 
-	if (sdWriteBlocks(sector, buff, count) != SD_NO_ERROR)
-		return RES_ERROR;
+	/* Single sector writes may come from the FatFs window, which can't change under
+	   FatFs: only the data of multi-sector writes is interleaved with audio updates */
+	limit = (count > 1) ? fs_transfer_limit() : 0;
+	if (limit)
+		fs_yield();
+
+	while (count)
+	{
+		UINT chunk = (limit && count > limit) ? limit : count;
+
+		/* Multi-sector writes pre-erase their sectors (ACMD23), so the card doesn't stay
+		   busy erasing them after the data */
+		if (sdWriteBlocks(sector, buff, chunk, chunk) != SD_NO_ERROR)
+		{
+#if DISK_CACHE_SLOTS
+			cacheWrite(buff, sector, chunk, false);
+#endif /* DISK_CACHE_SLOTS */
+			return RES_ERROR;
+		}
+
+#if DISK_CACHE_SLOTS
+		cacheWrite(buff, sector, chunk, true);
+#endif /* DISK_CACHE_SLOTS */
+
+		buff += chunk * DISK_SECTOR_SIZE;
+		sector += chunk;
+		count -= chunk;
+
+		if (count)
+			fs_yield();
+	}
 
 	return RES_OK;
 }
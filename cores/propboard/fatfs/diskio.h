@@ -25,6 +25,27 @@ typedef enum {
 } DRESULT;
 
 
+/* Sector cache counters (see diskio.cpp) */
+typedef struct {
+	DWORD	hits;			/* Single sector reads served from the cache */
+	DWORD	misses;
+	DWORD	read_aheads;	/* Multi-block reads done on sequential misses */
+	DWORD	read_ahead_sectors;
+	DWORD	bypassed;		/* Multi-sector reads, sent straight to the card */
+	DWORD	updated;		/* Cached sectors rewritten by disk_write */
+} DISK_CACHE_STATS;
+
+
+/* Volume lock counters (see option/syscall.cpp) */
+typedef struct {
+	DWORD	grants;
+	DWORD	lent;			/* Audio updates run at a sector boundary of a user operation */
+	DWORD	refused;		/* Grants refused to interrupt handlers */
+	DWORD	timeouts;		/* Grants that timed out in thread mode */
+	DWORD	max_hold;		/* Longest a user operation kept the volume without lending it, in uS */
+} FS_LOCK_STATS;
+
+
 /*---------------------------------------*/
 /* Prototypes for disk control functions */
 
@@ -34,6 +55,15 @@ DSTATUS disk_status (BYTE pdrv);
 DRESULT disk_read (BYTE pdrv, BYTE* buff, DWORD sector, UINT count);
 DRESULT disk_write (BYTE pdrv, const BYTE* buff, DWORD sector, UINT count);
 DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
+void disk_cache_invalidate (void);
+void disk_cache_stats (DISK_CACHE_STATS* stats);
+void disk_cache_reset_stats (void);
+int fs_busy (void);
+UINT fs_transfer_limit (void);
+void fs_yield (void);
+void fs_lend_block (int block);
+void fs_lock_stats (FS_LOCK_STATS* stats);
+void fs_lock_reset_stats (void);
 
 
 /* Disk Status Bits (DSTATUS) */
@@ -2423,6 +2423,10 @@ void get_fileinfo (		/* No return code */
 #if _FS_EXFAT
 	if (fs->fs_type == FS_EXFAT) {	/* At the exFAT */
 		get_xdir_info(fs->dirbuf, fno);
+#if _USE_OPENCLUST
+		fno->fclust = ld_dword(fs->dirbuf + XDIR_FstClus);
+		fno->fstat = fs->dirbuf[XDIR_GenFlags] & 2;
+#endif
 		return;
 	} else
 #endif
@@ -2492,6 +2496,10 @@ void get_fileinfo (		/* No return code */
 	fno->fsize = ld_dword(dp->dir + DIR_FileSize);	/* Size */
 	tm = ld_dword(dp->dir + DIR_ModTime);			/* Timestamp */
 	fno->ftime = (WORD)tm; fno->fdate = (WORD)(tm >> 16);
+#if _USE_OPENCLUST
+	fno->fclust = ld_clust(dp->obj.fs, dp->dir);	/* Start cluster */
+	fno->fstat = 0;
+#endif
 }
 
 #endif /* _FS_MINIMIZE <= 1 || _FS_RPATH >= 2 */
@@ -3271,6 +3279,9 @@ FRESULT f_open (
 
 	/* Get logical drive number */
 	mode &= _FS_READONLY ? FA_READ : FA_READ | FA_WRITE | FA_CREATE_ALWAYS | FA_CREATE_NEW | FA_OPEN_ALWAYS | FA_OPEN_APPEND | FA_SEEKEND;
+#if _USE_NOTIFY
+	if (mode & (FA_CREATE_ALWAYS | FA_OPEN_ALWAYS | FA_CREATE_NEW)) ff_notify(path, 0);	/* The file may be created or truncated */
+#endif
 	res = find_volume(&path, &fs, mode);
 	if (res == FR_OK) {
 		dj.obj.fs = fs;
@@ -3448,6 +3459,65 @@ FRESULT f_open (
 
 
 
+#if _USE_OPENCLUST
+/*-----------------------------------------------------------------------*/
+/* Open File by its Start Cluster (read only)                            */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_openclust (
+	FIL* fp,			/* Pointer to the blank file object */
+	const TCHAR* path,	/* Pointer to a path on the drive of the file (only the drive is used) */
+	DWORD sclust,		/* Start cluster, as in FILINFO fclust */
+	FSIZE_t size,		/* File size */
+	BYTE stat			/* Chain status, as in FILINFO fstat */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+
+
+	if (!fp) return FR_INVALID_OBJECT;
+
+	res = find_volume(&path, &fs, 0);
+	if (res == FR_OK) {
+		if ((sclust && (sclust < 2 || sclust >= fs->n_fatent)) || (!sclust && size)) {
+			res = FR_INVALID_PARAMETER;	/* The cluster is not on this volume */
+		} else {
+			fp->obj.sclust = sclust;
+			fp->obj.objsize = size;
+#if _FS_EXFAT
+			fp->obj.stat = stat;
+			fp->obj.n_cont = 0;
+			fp->obj.c_scl = 0;			/* No directory entry to update */
+#endif
+#if _USE_FASTSEEK
+			fp->cltbl = 0;
+#endif
+			fp->obj.fs = fs;
+			fp->obj.id = fs->id;
+			fp->flag = FA_READ;
+			fp->err = 0;
+			fp->sect = 0;
+			fp->fptr = 0;
+#if !_FS_READONLY
+			fp->dir_sect = 0;
+			fp->dir_ptr = 0;
+#if !_FS_TINY
+			mem_set(fp->buf, 0, _MAX_SS);
+#endif
+#endif
+		}
+	}
+
+	if (res != FR_OK) fp->obj.fs = 0;
+
+	LEAVE_FF(fs, res);
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Read File                                                             */
 /*-----------------------------------------------------------------------*/
@@ -3574,6 +3644,9 @@ FRESULT f_write (
 	res = validate(fp, &fs);
 	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);	/* Check validity */
 	if (!(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);	/* Check access mode */
+#if _USE_NOTIFY
+	if (!(fp->flag & FA_MODIFIED) && btw) ff_notify(0, fp->obj.sclust);	/* First change since the last sync */
+#endif
 
 	/* Check fptr wrap-around (file size cannot exceed the limit on each FAT specs) */
 	if ((_FS_EXFAT && fs->fs_type == FS_EXFAT && fp->fptr + btw < fp->fptr)
@@ -3744,6 +3817,9 @@ FRESULT f_sync (
 					fp->flag &= ~FA_MODIFIED;
 				}
 			}
+#if _USE_NOTIFY
+			ff_notify(0, fp->obj.sclust);	/* New size and clusters in the directory */
+#endif
 		}
 	}
 
@@ -4000,7 +4076,7 @@ FRESULT f_lseek (
 #if !_FS_TINY
 #if !_FS_READONLY
 					if (fp->flag & FA_DIRTY) {		/* Write-back dirty sector cache */
-						if (disk_write(fs->drv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fp, FR_DISK_ERR);
+						if (disk_write(fs->drv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
 						fp->flag &= ~FA_DIRTY;
 					}
 #endif
@@ -4425,6 +4501,9 @@ FRESULT f_truncate (
 	if (!(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);	/* Check access mode */
 
 	if (fp->obj.objsize > fp->fptr) {
+#if _USE_NOTIFY
+		ff_notify(0, fp->obj.sclust);
+#endif
 		if (fp->fptr == 0) {	/* When set file size to zero, remove entire cluster chain */
 			res = remove_chain(&fp->obj, fp->obj.sclust, 0);
 			fp->obj.sclust = 0;
@@ -4475,6 +4554,9 @@ FRESULT f_unlink (
 	DEF_NAMBUF
 
 
+#if _USE_NOTIFY
+	ff_notify(path, 0);
+#endif
 	/* Get logical drive number */
 	res = find_volume(&path, &fs, FA_WRITE);
 	dj.obj.fs = fs;
@@ -4662,6 +4744,10 @@ FRESULT f_rename (
 	DEF_NAMBUF
 
 
+#if _USE_NOTIFY
+	ff_notify(path_old, 0);
+	ff_notify(path_new, 0);
+#endif
 	get_ldnumber(&path_new);						/* Ignore drive number of new name */
 	res = find_volume(&path_old, &fs, FA_WRITE);	/* Get logical drive number of the old object */
 	if (res == FR_OK) {
@@ -207,6 +207,10 @@ typedef struct {
 	WORD	fdate;			/* Modified date */
 	WORD	ftime;			/* Modified time */
 	BYTE	fattrib;		/* File attribute */
+#if _USE_OPENCLUST
+	DWORD	fclust;			/* Start cluster */
+	BYTE	fstat;			/* Chain status (exFAT, 2:contiguous) */
+#endif
 #if _USE_LFN != 0
 	TCHAR	altname[13];			/* Altenative file name */
 	TCHAR	fname[_MAX_LFN + 1];	/* Primary file name */
@@ -249,6 +253,7 @@ typedef enum {
 
 FRESULT f_open (FIL* fp, const TCHAR* path, BYTE mode);				/* Open or create a file */
 FRESULT f_close (FIL* fp);											/* Close an open file object */
+FRESULT f_openclust (FIL* fp, const TCHAR* path, DWORD sclust, FSIZE_t size, BYTE stat);	/* Open a file by its start cluster */
 FRESULT f_read (FIL* fp, void* buff, UINT btr, UINT* br);			/* Read data from the file */
 FRESULT f_write (FIL* fp, const void* buff, UINT btw, UINT* bw);	/* Write data to the file */
 FRESULT f_lseek (FIL* fp, FSIZE_t ofs);								/* Move file pointer of the file object */
@@ -313,6 +318,11 @@ void ff_memfree (void* mblock);			/* Free memory block */
 #endif
 #endif
 
+/* Change notification */
+#if _USE_NOTIFY
+void ff_notify (const TCHAR* path, DWORD sclust);	/* A file is about to change, by its path or start cluster */
+#endif
+
 /* Sync functions */
 #if _FS_REENTRANT
 int ff_cre_syncobj (BYTE vol, _SYNC_t* sobj);	/* Create a sync object */
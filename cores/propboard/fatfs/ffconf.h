@@ -43,7 +43,7 @@
 /* This option switches f_mkfs() function. (0:Disable or 1:Enable) */
 
 
-#define	_USE_FASTSEEK	0
+#define	_USE_FASTSEEK	1
 /* This option switches fast seek function. (0:Disable or 1:Enable) */
 
 
@@ -51,6 +51,18 @@
 /* This option switches f_expand function. (0:Disable or 1:Enable) */
 
 
+#define	_USE_OPENCLUST	1
+/* This option switches f_openclust() function and the fclust/fstat members of
+/  FILINFO, to open a file for reading by its start cluster without following the
+/  path (PropBoard addition). (0:Disable or 1:Enable) */
+
+
+#define	_USE_NOTIFY		1
+/* This option switches the calls to ff_notify() before a file is created, written,
+/  truncated, renamed or removed, and after it is synced (PropBoard addition).
+/  (0:Disable or 1:Enable) */
+
+
 #define _USE_CHMOD		0
 /* This option switches attribute manipulation functions, f_chmod() and f_utime().
 /  (0:Disable or 1:Enable) Also _FS_READONLY needs to be 0 to enable this option. */
@@ -3,19 +3,109 @@
 /* (C)ChaN, 2014                                                          */
 /*------------------------------------------------------------------------*/
 
+#include <Arduino.h>
 #include <PropAudio.h>
 #include <stddef.h>
 #include <stm32f4xx.h>
 #include <stdlib.h>
 #include "../ff.h"
+#include "../diskio.h"
 
-volatile uint8_t fs_free;
+/* The volume lock has an owner: thread mode (the sketch, or play() opening a file) or
+/  PendSV (the audio update). PendSV can't wait on thread mode, so it skips the update
+/  while thread mode holds the volume. User operations lend the volume to a pending
+/  update at sector boundaries (fs_yield), so the wait is bounded by FS_YIELD_SECTORS
+/  sectors instead of the whole operation. Set FS_YIELD_SECTORS to 0 to never lend it.
+*/
+
+#ifndef FS_YIELD_SECTORS
+#define FS_YIELD_SECTORS	16
+#endif
+
+#define FS_FREE				0
+#define FS_HELD_USER		1
+#define FS_HELD_AUDIO		2
+
+static volatile uint8_t fs_holder = FS_FREE;
+static volatile uint8_t fs_lent;		/* The user operation is stopped at a sector boundary */
+static uint8_t fs_lend_blocked;			/* Thread mode operations that can't lend the volume */
+static uint32_t fs_hold_start;
+static FS_LOCK_STATS fs_stats;
 
 #if _FS_REENTRANT
 
-bool fs_busy(void)
+static void fsHoldEnded (void)
+{
+	uint32_t held = micros() - fs_hold_start;
+
+	if (held > fs_stats.max_hold)
+		fs_stats.max_hold = held;
+}
+
+int fs_busy (void)
+{
+	return (fs_holder != FS_FREE && !fs_lent);
+}
+
+UINT fs_transfer_limit (void)
+{
+	/* Nothing to interleave with when the audio is stopped */
+	if (__get_IPSR() || fs_holder != FS_HELD_USER || fs_lend_blocked || !Audio.isPlaying())
+		return 0;
+
+	return FS_YIELD_SECTORS;
+}
+
+void fs_yield (void)
+{
+	/* Only user operations lend the volume, and not twice */
+	if (!FS_YIELD_SECTORS || __get_IPSR() || fs_holder != FS_HELD_USER || fs_lent || fs_lend_blocked)
+		return;
+
+	fsHoldEnded();
+
+	if (Audio.updatePending())
+	{
+		__disable_irq();
+		fs_lent = 1;
+		fs_stats.lent++;
+		Activate_PendSV();
+		__enable_irq();
+
+		/* PendSV runs here */
+		__ISB();
+
+		__disable_irq();
+		fs_lent = 0;
+		__enable_irq();
+	}
+
+	fs_hold_start = micros();
+}
+
+void fs_lend_block (int block)
+{
+	if (__get_IPSR())
+		return;
+
+	if (block)
+		fs_lend_blocked++;
+	else if (fs_lend_blocked)
+		fs_lend_blocked--;
+}
+
+void fs_lock_stats (FS_LOCK_STATS* stats)
 {
-	return (fs_free == 0);
+	__disable_irq();
+	*stats = fs_stats;
+	__enable_irq();
+}
+
+void fs_lock_reset_stats (void)
+{
+	__disable_irq();
+	memset(&fs_stats, 0, sizeof(fs_stats));
+	__enable_irq();
 }
 
 /*------------------------------------------------------------------------*/
@@ -34,8 +124,9 @@ int ff_cre_syncobj (	/* 1:Function succeeded, 0:Could not create the sync object
 	(void)(vol);
 	(void)(sobj);
 
-	fs_free = 1;
-	*sobj = &fs_free;
+	fs_holder = FS_FREE;
+	fs_lent = 0;
+	*sobj = &fs_holder;
 	return 1;
 }
 
@@ -68,11 +159,48 @@ int ff_req_grant (	/* 1:Got a grant to access the volume, 0:Could not get a gran
 	_SYNC_t sobj	/* Sync object to wait */
 )
 {
+	uint32_t start;
+
 	(void)(sobj);
 
-	while (fs_free == 0);
-	fs_free = 0;
-	return 1;
+	if (__get_IPSR())
+	{
+		/* Interrupt handlers get a free volume, or one lent by a user operation */
+		__disable_irq();
+		if (fs_holder == FS_FREE || (fs_holder == FS_HELD_USER && fs_lent))
+		{
+			fs_holder = FS_HELD_AUDIO;
+			fs_stats.grants++;
+			__enable_irq();
+			return 1;
+		}
+
+		fs_stats.refused++;
+		__enable_irq();
+		return 0;
+	}
+
+	start = GetTickCount();
+
+	while (1)
+	{
+		__disable_irq();
+		if (fs_holder == FS_FREE)
+		{
+			fs_holder = FS_HELD_USER;
+			fs_hold_start = micros();
+			fs_stats.grants++;
+			__enable_irq();
+			return 1;
+		}
+		__enable_irq();
+
+		if (GetTickCount() - start >= _FS_TIMEOUT)
+		{
+			fs_stats.timeouts++;
+			return 0;
+		}
+	}
 }
 
 
@@ -91,7 +219,16 @@ void ff_rel_grant (
 
 	__disable_irq();
 
-	fs_free = 1;
+	if (fs_holder == FS_HELD_AUDIO && fs_lent)
+	{
+		/* Back to the user operation that lent it */
+		fs_holder = FS_HELD_USER;
+	} else {
+		if (fs_holder == FS_HELD_USER)
+			fsHoldEnded();
+
+		fs_holder = FS_FREE;
+	}
 
 	if (Audio.updatePending())
 	{
@@ -104,6 +241,29 @@ void ff_rel_grant (
 #endif
 
 
+#if _USE_NOTIFY
+/*------------------------------------------------------------------------*/
+/* A File Is About to Change                                              */
+/*------------------------------------------------------------------------*/
+/* This function is called before a file is created, written, truncated,
+/  renamed or removed, with its path or its start cluster, and after it is
+/  synced. The font index reads its directory again when it is there.
+*/
+
+void ff_notify (
+	const TCHAR* path,	/* Path as passed to the file function, or NULL */
+	DWORD sclust		/* Start cluster of an open file, when path is NULL */
+)
+{
+	AudioFontIndex* index = AudioFileHelper::getFontIndex();
+
+	if (index)
+		index->invalidate(path, sclust);
+}
+#endif
+
+
+
 #if _USE_LFN == 3	/* LFN with a working buffer on the heap */
 /*------------------------------------------------------------------------*/
 /* Allocate a memory block                                                */
@@ -72,6 +72,7 @@
 #define CMD_APP_SD_SET_BUSWIDTH				6
 #define CMD_SD_APP_STATUS					13
 #define CMD_SD_APP_SEND_NUM_WRITE_BLOCKS	22
+#define CMD_SD_APP_SET_WR_BLK_ERASE_COUNT	23
 #define CMD_SD_APP_OP_COND					41
 #define CMD_SD_APP_SET_CLR_CARD_DETECT		42
 #define CMD_SD_APP_SEND_SCR					51
@@ -140,6 +141,30 @@ static volatile bool sd_transfer_error = false;
 static volatile bool sd_cmd_irq_flag = false;
 static volatile SD_Status sd_transfer_error_code = SD_NO_ERROR;
 
+// Reads queued with sdReadBlocksAsync()
+typedef struct _sd_async_request
+{
+	uint32_t sector;
+	uint8_t* buffer;
+	uint32_t count;
+	sdTransferCallback* callback;
+	void* param;
+	uint8_t retries;
+	SD_STAT(uint32_t start_time;)
+} SD_ASYNC_REQUEST;
+
+// Completion of a synchronous read
+typedef struct _sd_async_wait
+{
+	volatile bool done;
+	SD_Status status;
+} SD_ASYNC_WAIT;
+
+static SD_ASYNC_REQUEST sd_async_queue[SD_ASYNC_QUEUE_SIZE];
+static volatile uint32_t sd_async_head = 0;
+static volatile uint32_t sd_async_count = 0;
+static volatile bool sd_async_active = false;		// A queued read is on the bus
+
 #if SD_STATS
 uint32_t sd_errors = 0;
 uint32_t sd_timeouts = 0;
@@ -163,11 +188,15 @@ volatile uint32_t sd_sta = 0;
 #define SDIO_CMD_MASK			0x1F
 
 #define SDIO_RETRIES			10
+#define SDIO_DATA_TIMEOUT		48000000		// SDIO_CK cycles, 1 second at 48MHz
+#define SD_IRQ_WAIT_POLLS		100000
 
 static UARTClass* uart_debug = NULL;
 static volatile bool debug_enabled = false;
 
-static SD_Status sdTransferBlocksWithDMA(uint32_t sector, const uint8_t* buffer, uint32_t count, bool write) __attribute__ ((optimize(3)));
+static SD_Status sdTransferBlocksWithDMA(uint32_t sector, const uint8_t* buffer, uint32_t count, bool write, uint32_t pre_erase) __attribute__ ((optimize(3)));
+static SD_Status sdStartTransfer(uint32_t sector, const uint8_t* buffer, uint32_t count, bool write, uint8_t retries) __attribute__ ((optimize(3)));
+static SD_Status sdEndTransfer(uint32_t sector, uint32_t count, bool write, uint8_t retries) __attribute__ ((optimize(3)));
 static SD_Status sdGetR1Response(uint8_t cmd) __attribute__ ((optimize(3)));
 
 void enableSdDebug(UARTClass* uart)
@@ -246,7 +275,8 @@ static void printError(const char* function, SD_Status code, const char* extra)
 
 static void printErrorRWOp(bool write, SD_Status code, uint32_t sector, uint32_t count, uint32_t retries, const char* msg)
 {
-	if (!debug_enabled)
+	// Not from the interrupt that ends the queued reads. Their errors are only counted.
+	if (!debug_enabled || __get_IPSR() == 16 + SD_SERVICE_IRQn)
 		return;
 
 	uart_debug->print("SdDebug: error \"");
@@ -379,6 +409,9 @@ static void sdInitializeDMA(void)
 
 	NVIC_SetPriority(SDIO_IRQn, VARIANT_PRIO_SDIO);
 	NVIC_EnableIRQ(SDIO_IRQn);
+
+	NVIC_SetPriority(SD_SERVICE_IRQn, VARIANT_PRIO_SD_SERVICE);
+	NVIC_EnableIRQ(SD_SERVICE_IRQn);
 }
 
 static void sdInitializeSDIO(uint8_t mode, bool wide)
@@ -1133,6 +1166,7 @@ void sdDeinitialize()
 	GPIO_InitTypeDef GPIO_InitStruct;
 
 	NVIC_DisableIRQ(SDIO_IRQn);
+	NVIC_DisableIRQ(SD_SERVICE_IRQn);
 
 	/* Disable clock */
 	SDIO_ClockCmd(DISABLE);
@@ -1239,6 +1273,43 @@ static SD_Status sdSendBlockTxCmd(uint32_t sector, bool multi)
 	return status;
 }
 
+// ACMD23: the card erases the blocks of the next multiple block write in advance,
+// instead of while programming them after CMD12.
+static SD_Status sdSendPreErase(uint32_t count)
+{
+	SDIO_CmdInitTypeDef sdio_cmd;
+	SD_Status status;
+
+	// CMD55
+	sdio_cmd.SDIO_Argument = (uint32_t) (card_info.rca.fields.rca << 16);
+	sdio_cmd.SDIO_CmdIndex = CMD_APP_CMD;
+	sdio_cmd.SDIO_Response = SDIO_Response_Short;
+	sdio_cmd.SDIO_Wait = SDIO_Wait_No;
+	sdio_cmd.SDIO_CPSM = SDIO_CPSM_Enable;
+	SDIO_SendCommand(&sdio_cmd);
+
+	status = sdGetR1Response(CMD_APP_CMD);
+	if (status != SD_NO_ERROR)
+	{
+		printError("sdSendPreErase", status, "sdGetR1Response(CMD_APP_CMD)");
+		return status;
+	}
+
+	// ACMD23, 23 bits of block count
+	if (count > 0x7FFFFF)
+		count = 0x7FFFFF;
+
+	sdio_cmd.SDIO_Argument = count;
+	sdio_cmd.SDIO_CmdIndex = CMD_SD_APP_SET_WR_BLK_ERASE_COUNT;
+	SDIO_SendCommand(&sdio_cmd);
+
+	status = sdGetR1Response(CMD_SD_APP_SET_WR_BLK_ERASE_COUNT);
+	if (status != SD_NO_ERROR)
+		printError("sdSendPreErase", status, "sdGetR1Response(CMD_SD_APP_SET_WR_BLK_ERASE_COUNT)");
+
+	return status;
+}
+
 static bool sdTransferDone()
 {
 	uint32_t response;
@@ -1259,9 +1330,19 @@ static bool sdTransferDone()
 	return false;
 }
 
+// SysTick doesn't preempt the SDIO interrupt, so the waits done in there count polls instead of ticks
+static bool sdWaitExpired(uint32_t ticks, uint32_t* polls)
+{
+	if (__get_IPSR())
+		return ++(*polls) >= SD_IRQ_WAIT_POLLS;
+
+	return GetTickCount() - ticks >= 1000;
+}
+
 static bool sdAbortTransmission(bool multi)
 {
 	uint32_t ticks;
+	uint32_t polls = 0;
 
 	/*
 	if (sdTransferDone())
@@ -1281,7 +1362,7 @@ static bool sdAbortTransmission(bool multi)
 		if (sdTransferDone())
 			return true;
 
-		if (GetTickCount() - ticks >= 1000)
+		if (sdWaitExpired(ticks, &polls))
 			return false;
 	}
 /*
@@ -1305,116 +1386,248 @@ static bool sdAbortTransmission(bool multi)
 	return true;
 }
 
-static SD_Status sdTransferBlocksWithDMA(uint32_t sector, const uint8_t* buffer, uint32_t count, bool write)
+// Programs the DMA and sends the read/write command. The end of the data is signaled by SDIO_IRQHandler().
+static SD_Status sdStartTransfer(uint32_t sector, const uint8_t* buffer, uint32_t count, bool write, uint8_t retries)
 {
-	uint8_t retries = SDIO_RETRIES;
-	uint32_t ticks;
-	SD_STAT(uint32_t transfer_time = micros());
+	// Reset SDIO data control and interrupts
+	SDIO->DCTRL = 0;
 
-	while (retries)
+	DMA2->LIFCR = 0x0F400000;							// Clear DMA2 Stream3 pending interrupts
+	DMA2_Stream3->CR = 0;								// Disable DMA2 Stream3
+	while (DMA2_Stream3->CR & DMA_SxCR_EN);
+	DMA2_Stream3->M0AR = (uint32_t) (uintptr_t) buffer;	// Program source address
+	DMA2_Stream3->PAR = (uint32_t) (uintptr_t) &SDIO->FIFO;	// Program destination address
+	DMA2_Stream3->NDTR = 0;								// Counter doens't care if flow control is enabled
+
+	if (((uintptr_t) buffer & 0x0F) == 0)
+	{
+		DMA2_Stream3->FCR = DMA_FIFOMode_Enable			|
+							DMA_FIFOThreshold_Full;
+
+		DMA2_Stream3->CR = 	DMA_Channel_4				|
+							DMA_MemoryInc_Enable		|
+							DMA_PeripheralDataSize_Word	|
+							DMA_MemoryDataSize_Word		|
+							DMA_PeripheralBurst_INC4	|
+							DMA_MemoryBurst_INC4		|
+							DMA_Priority_VeryHigh		|
+							DMA_SxCR_PFCTRL;
+
+	} else if (((uintptr_t) buffer & 0x07) == 0)
+	{
+		DMA2_Stream3->FCR = DMA_FIFOMode_Enable 		|
+							DMA_FIFOThreshold_Full;
+
+		DMA2_Stream3->CR = 	DMA_Channel_4 				|
+							DMA_MemoryInc_Enable 		|
+							DMA_PeripheralDataSize_Word |
+							DMA_PeripheralBurst_INC4 	|
+							DMA_MemoryDataSize_HalfWord	|
+							DMA_MemoryBurst_INC4		|
+							DMA_Priority_VeryHigh		|
+							DMA_SxCR_PFCTRL;
+
+	} else if (((uintptr_t) buffer & 0x03) == 0)
+	{
+		DMA2_Stream3->FCR = DMA_FIFOMode_Enable			|
+							DMA_FIFOThreshold_1QuarterFull;
+
+		DMA2_Stream3->CR = 	DMA_Channel_4				|
+							DMA_MemoryInc_Enable		|
+							DMA_PeripheralDataSize_Word	|
+							DMA_PeripheralBurst_INC4	|
+							DMA_MemoryDataSize_Byte		|
+							DMA_MemoryBurst_INC4		|
+							DMA_Priority_VeryHigh		|
+							DMA_SxCR_PFCTRL;
+	} else {
+
+		DMA2_Stream3->FCR = DMA_FIFOMode_Enable			|
+							DMA_FIFOThreshold_HalfFull;
+
+		DMA2_Stream3->CR = 	DMA_Channel_4				|
+							DMA_MemoryInc_Enable		|
+							DMA_PeripheralDataSize_Word	|
+							DMA_MemoryDataSize_Byte		|
+							DMA_PeripheralBurst_INC4	|
+							DMA_MemoryBurst_Single		|
+							DMA_Priority_VeryHigh		|
+							DMA_SxCR_PFCTRL;
+	}
+
+	if (write)
+		DMA2_Stream3->CR |= DMA_DIR_MemoryToPeripheral;
+	else
+		DMA2_Stream3->CR |= DMA_DIR_PeripheralToMemory;
+
+	DMA2_Stream3->CR |= DMA_SxCR_EN;
+
+	// Reset our status/error flags
+	sd_cmd_irq_flag = sd_transfer_error = sd_sdio_transfer_complete = false;
+
+	SD_STAT(sd_sta = 0);
+	SDIO->DTIMER = SDIO_DATA_TIMEOUT;
+	SDIO->DLEN = count * 512;
+	SDIO->MASK = SDIO_MASK_DATAENDIE | SDIO_MASK_DTIMEOUTIE | SDIO_MASK_TXUNDERRIE |
+				 SDIO_MASK_DCRCFAILIE | SDIO_MASK_RXOVERRIE;
+
+	if (!write)
+	{
+		SDIO->DCTRL = SDIO_DCTRL_DMAEN | SDIO_DataBlockSize_512b | SDIO_TransferMode_Block | SDIO_DPSM_Enable | SDIO_TransferDir_ToSDIO;
+		sd_transfer_error_code = sdSendBlockRxCmd(sector, (count > 1));
+	} else {
+		sd_transfer_error_code = sdSendBlockTxCmd(sector, (count > 1));
+	}
+
+	if (sd_transfer_error_code != SD_NO_ERROR)
 	{
-		// Reset SDIO data control and interrupts
+		printErrorRWOp(write, sd_transfer_error_code, sector, count, retries, "Send block cmd");
+		SD_STAT(sd_errors++);
 		SDIO->DCTRL = 0;
+		sdAbortTransmission(count > 1);
+		return sd_transfer_error_code;
+	}
+
+	if (write)
+		SDIO->DCTRL = SDIO_DCTRL_DMAEN | SDIO_DataBlockSize_512b | SDIO_TransferMode_Block | SDIO_DPSM_Enable | SDIO_TransferDir_ToCard;
+
+	return SD_NO_ERROR;
+}
+
+// Called once SDIO_IRQHandler() has signaled the end of the data or an error
+static SD_Status sdEndTransfer(uint32_t sector, uint32_t count, bool write, uint8_t retries)
+{
+	uint32_t ticks;
+	uint32_t polls = 0;
+
+	if (sd_transfer_error || sd_transfer_error_code != SD_NO_ERROR)
+	{
+		printErrorRWOp(write, sd_transfer_error_code, sector, count, retries, "While waiting for completion");
+		SD_STAT(if (sd_transfer_error_code != SD_DATA_TIMEOUT) sd_errors++);
+		sdAbortTransmission(count > 1);
+		return sd_transfer_error_code;
+	}
 
-		DMA2->LIFCR = 0x0F400000;							// Clear DMA2 Stream3 pending interrupts
-		DMA2_Stream3->CR = 0;								// Disable DMA2 Stream3
-		while (DMA2_Stream3->CR & DMA_SxCR_EN);
-		DMA2_Stream3->M0AR = (uint32_t) buffer;				// Program source address
-		DMA2_Stream3->PAR = (uint32_t) &SDIO->FIFO;			// Program destination address
-		DMA2_Stream3->NDTR = 0;								// Counter doens't care if flow control is enabled
+	// Wait while the SDIO TX/RX finishes
+	ticks = GetTickCount();
+	uint32_t sdio_status_flag = (write) ? SDIO_STA_TXACT : SDIO_STA_RXACT;
+	while (true)
+	{
+		if (!(SDIO->STA & sdio_status_flag))
+		{
+			if (SDIO->DCOUNT == 0)
+				break;
+		}
 
-		if (((uint32_t) buffer & 0x0F) == 0)
+		if (sdWaitExpired(ticks, &polls))
 		{
-			DMA2_Stream3->FCR = DMA_FIFOMode_Enable			|
-								DMA_FIFOThreshold_Full;
-
-			DMA2_Stream3->CR = 	DMA_Channel_4				|
-								DMA_MemoryInc_Enable		|
-								DMA_PeripheralDataSize_Word	|
-								DMA_MemoryDataSize_Word		|
-								DMA_PeripheralBurst_INC4	|
-								DMA_MemoryBurst_INC4		|
-								DMA_Priority_VeryHigh		|
-								DMA_SxCR_PFCTRL;
-
-		} else if (((uint32_t) buffer & 0x07) == 0)
+			// A second has passed, declare timeout
+			printErrorRWOp(write, SD_DATA_TIMEOUT, sector, count, retries, "While waiting for SDIO->STA completion");
+			SD_STAT(sd_timeouts++);
+			sd_transfer_error = true;
+			sd_transfer_error_code = SD_DATA_TIMEOUT;
+			sdAbortTransmission(count > 1);
+			return sd_transfer_error_code;
+		}
+	}
+
+	ticks = GetTickCount();
+	polls = 0;
+	while (true)
+	{
+		if (DMA2->LISR & DMA_LISR_TCIF3)
+			break;
+
+		if (DMA2->LISR & DMA_LISR_TEIF3)
 		{
-			DMA2_Stream3->FCR = DMA_FIFOMode_Enable 		|
-								DMA_FIFOThreshold_Full;
-
-			DMA2_Stream3->CR = 	DMA_Channel_4 				|
-								DMA_MemoryInc_Enable 		|
-								DMA_PeripheralDataSize_Word |
-								DMA_PeripheralBurst_INC4 	|
-								DMA_MemoryDataSize_HalfWord	|
-								DMA_MemoryBurst_INC4		|
-								DMA_Priority_VeryHigh		|
-								DMA_SxCR_PFCTRL;
-
-		} else if (((uint32_t) buffer & 0x03) == 0)
+			sd_transfer_error = true;
+			sd_transfer_error_code = SD_FIFO_ERROR;
+			break;
+		}
+
+		if (sdWaitExpired(ticks, &polls))
 		{
-			DMA2_Stream3->FCR = DMA_FIFOMode_Enable			|
-								DMA_FIFOThreshold_1QuarterFull;
-
-			DMA2_Stream3->CR = 	DMA_Channel_4				|
-								DMA_MemoryInc_Enable		|
-								DMA_PeripheralDataSize_Word	|
-								DMA_PeripheralBurst_INC4	|
-								DMA_MemoryDataSize_Byte		|
-								DMA_MemoryBurst_INC4		|
-								DMA_Priority_VeryHigh		|
-								DMA_SxCR_PFCTRL;
-		} else {
-
-			DMA2_Stream3->FCR = DMA_FIFOMode_Enable			|
-								DMA_FIFOThreshold_HalfFull;
-
-			DMA2_Stream3->CR = 	DMA_Channel_4				|
-								DMA_MemoryInc_Enable		|
-								DMA_PeripheralDataSize_Word	|
-								DMA_MemoryDataSize_Byte		|
-								DMA_PeripheralBurst_INC4	|
-								DMA_MemoryBurst_Single		|
-								DMA_Priority_VeryHigh		|
-								DMA_SxCR_PFCTRL;
+			// A second has passed, declare timeout
+			SD_STAT(sd_timeouts++);
+			sd_transfer_error = true;
+			sd_transfer_error_code = SD_DATA_TIMEOUT;
+			break;
 		}
+	}
 
-		if (write)
-			DMA2_Stream3->CR |= DMA_DIR_MemoryToPeripheral;
-		else
-			DMA2_Stream3->CR |= DMA_DIR_PeripheralToMemory;
+	DMA_ClearFlag(DMA2_Stream3, DMA_FLAG_TCIF3 | DMA_FLAG_FEIF3);
 
-		DMA2_Stream3->CR |= DMA_SxCR_EN;
+	if (sd_transfer_error || sd_transfer_error_code != SD_NO_ERROR)
+	{
+		printErrorRWOp(write, sd_transfer_error_code, sector, count, retries, "While waiting for DMA");
+		SD_STAT(sd_timeouts++);
+		sdAbortTransmission(count > 1);
+		return sd_transfer_error_code;
+	}
 
-		// Reset our status/error flags
-		sd_cmd_irq_flag = sd_transfer_error = sd_sdio_transfer_complete = false;
+	sdAbortTransmission(count > 1);
 
-		SD_STAT(sd_sta = 0);
-		SDIO->DTIMER = 0xFFFFFFFF;
-		SDIO->DLEN = count * 512;
-		SDIO->MASK = SDIO_MASK_DATAENDIE | SDIO_MASK_DTIMEOUTIE | SDIO_MASK_TXUNDERRIE |
-					 SDIO_MASK_DCRCFAILIE | SDIO_MASK_RXOVERRIE;
+	CLEAR_STATIC_IRQ();
+	return SD_NO_ERROR;
+}
 
-		if (!write)
-		{
-			SDIO->DCTRL = SDIO_DCTRL_DMAEN | SDIO_DataBlockSize_512b | SDIO_TransferMode_Block | SDIO_DPSM_Enable | SDIO_TransferDir_ToSDIO;
-			sd_transfer_error_code = sdSendBlockRxCmd(sector, (count > 1));
-		} else {
-			sd_transfer_error_code = sdSendBlockTxCmd(sector, (count > 1));
-		}
+#if SD_STATS
+static void sdTransferStats(bool write, uint32_t count, uint8_t retries, uint32_t transfer_time)
+{
+	if (retries != SDIO_RETRIES)
+	{
+		uint32_t retries_count = SDIO_RETRIES - retries;
+		if (retries_count > sd_max_retries)
+			sd_max_retries = retries_count;
+	}
+
+	if (sd_transfer_error_code != SD_NO_ERROR)
+		return;
+
+	transfer_time = micros() - transfer_time;
+
+	if (write)
+	{
+		if (transfer_time > sd_max_write_time)
+			sd_max_write_time = transfer_time;
 
-		if (sd_transfer_error_code != SD_NO_ERROR)
+		if (count)
+			sd_avg_write_time = ((sd_sectors_written * sd_avg_write_time) + transfer_time) / (sd_sectors_written + count);
+
+		sd_sectors_written += count;
+	} else {
+		if (transfer_time > sd_max_read_time)
+			sd_max_read_time = transfer_time;
+
+		if (count)
+			sd_avg_read_time = ((sd_sectors_read * sd_avg_read_time) + transfer_time) / (sd_sectors_read + count);
+
+		sd_sectors_read += count;
+	}
+}
+#endif // SD_STATS
+
+static SD_Status sdTransferBlocksWithDMA(uint32_t sector, const uint8_t* buffer, uint32_t count, bool write, uint32_t pre_erase)
+{
+	uint8_t retries = SDIO_RETRIES;
+	uint32_t ticks;
+	SD_STAT(uint32_t transfer_time = micros());
+
+	while (retries)
+	{
+		// The pre-erase count only lasts until the next write command, send it on every try
+		if (pre_erase && (sd_transfer_error_code = sdSendPreErase(pre_erase)) != SD_NO_ERROR)
 		{
-			printErrorRWOp(write, sd_transfer_error_code, sector, count, retries, "Send block cmd");
 			SD_STAT(sd_errors++);
-			SDIO->DCTRL = 0;
-			sdAbortTransmission(count > 1);
 			retries--;
 			continue;
 		}
 
-		if (write)
-			SDIO->DCTRL = SDIO_DCTRL_DMAEN | SDIO_DataBlockSize_512b | SDIO_TransferMode_Block | SDIO_DPSM_Enable | SDIO_TransferDir_ToCard;
+		if (sdStartTransfer(sector, buffer, count, write, retries) != SD_NO_ERROR)
+		{
+			retries--;
+			continue;
+		}
 
 		ticks = GetTickCount();
 		while (!sd_sdio_transfer_complete)
@@ -1432,145 +1645,175 @@ static SD_Status sdTransferBlocksWithDMA(uint32_t sector, const uint8_t* buffer,
 			}
 		}
 
-		if (sd_transfer_error || sd_transfer_error_code != SD_NO_ERROR)
+		if (sdEndTransfer(sector, count, write, retries) != SD_NO_ERROR)
 		{
-			printErrorRWOp(write, sd_transfer_error_code, sector, count, retries, "While waiting for completion");
-			SD_STAT(if (sd_transfer_error_code != SD_DATA_TIMEOUT) sd_errors++);
-			sdAbortTransmission(count > 1);
 			retries--;
 			continue;
 		}
 
-		// Wait while the SDIO TX/RX finishes
-		ticks = GetTickCount();
-		uint32_t sdio_status_flag = (write) ? SDIO_STA_TXACT : SDIO_STA_RXACT;
-		while (true)
-		{
-			if (!(SDIO->STA & sdio_status_flag))
-			{
-				if (SDIO->DCOUNT == 0)
-					break;
-			}
+		break;
+	}
 
-			if (GetTickCount() - ticks >= 1000)
-			{
-				// A second has passed, declare timeout
-				printErrorRWOp(write, SD_DATA_TIMEOUT, sector, count, retries, "While waiting for SDIO->STA completion");
-				SD_STAT(sd_timeouts++);
-				sd_transfer_error = true;
-				sd_transfer_error_code = SD_DATA_TIMEOUT;
-				sdAbortTransmission(count > 1);
-				retries--;
-				break;
-			}
-		}
+	SD_STAT(sdTransferStats(write, count, retries, transfer_time));
 
-		if (sd_transfer_error_code)
-			continue;
+	return sd_transfer_error_code;
+}
 
-		ticks = GetTickCount();
-		while (true)
-		{
-			if (DMA2->LISR & DMA_LISR_TCIF3)
-				break;
+// Starts the request at the head of the queue. Requests that can't be started are completed with an error.
+static void sdAsyncStart()
+{
+	SD_ASYNC_REQUEST* request;
+	sdTransferCallback* callback;
+	void* param;
 
-			if (DMA2->LISR & DMA_LISR_TEIF3)
-			{
-				sd_transfer_error = true;
-				sd_transfer_error_code = SD_FIFO_ERROR;
-				break;
-			}
+	while (sd_async_count)
+	{
+		request = &sd_async_queue[sd_async_head];
 
-			if (GetTickCount() - ticks >= 1000)
+		while (request->retries)
+		{
+			if (sdStartTransfer(request->sector, request->buffer, request->count, false, request->retries) == SD_NO_ERROR)
 			{
-				// A second has passed, declare timeout
-				SD_STAT(sd_timeouts++);
-				sd_transfer_error = true;
-				sd_transfer_error_code = SD_DATA_TIMEOUT;
-				retries--;
-				break;
-			}
-		}
+				sd_async_active = true;
 
-		DMA_ClearFlag(DMA2_Stream3, DMA_FLAG_TCIF3 | DMA_FLAG_FEIF3);
+				// SDIO_IRQHandler() preempts us, the data may have ended already
+				if (sd_sdio_transfer_complete || sd_transfer_error)
+					NVIC_SetPendingIRQ(SD_SERVICE_IRQn);
+				return;
+			}
 
-		if (sd_transfer_error || sd_transfer_error_code != SD_NO_ERROR)
-		{
-			printErrorRWOp(write, sd_transfer_error_code, sector, count, retries, "While waiting for DMA");
-			SD_STAT(sd_timeouts++);
-			sdAbortTransmission(count > 1);
-			retries--;
-			continue;
+			request->retries--;
 		}
 
-		sdAbortTransmission(count > 1);
+		SD_STAT(sdTransferStats(false, request->count, request->retries, request->start_time));
 
-		CLEAR_STATIC_IRQ();
-		break;
+		callback = request->callback;
+		param = request->param;
+		sd_async_head = (sd_async_head + 1) % SD_ASYNC_QUEUE_SIZE;
+		sd_async_count--;
+
+		if (callback)
+			callback(sd_transfer_error_code, param);
 	}
 
-#if SD_STATS
-	if (retries != SDIO_RETRIES)
+	sdUnlock();
+}
+
+// Called from SD_SERVICE_IRQHandler() when the data of the request in progress ended or failed
+static void sdAsyncService()
+{
+	SD_ASYNC_REQUEST* request = &sd_async_queue[sd_async_head];
+	sdTransferCallback* callback;
+	void* param;
+	SD_Status status;
+
+	sd_async_active = false;
+	status = sdEndTransfer(request->sector, request->count, false, request->retries);
+
+	if (status != SD_NO_ERROR && --request->retries)
 	{
-		uint32_t retries_count = SDIO_RETRIES - retries;
-		if (retries_count > sd_max_retries)
-			sd_max_retries = retries_count;
+		// Try again
+		sdAsyncStart();
+		return;
 	}
 
-	if (write)
-	{
-		if (sd_transfer_error_code == SD_NO_ERROR)
-		{
-			uint32_t write_time = micros() - transfer_time;
-			if (write_time > sd_max_write_time)
-				sd_max_write_time = write_time;
+	SD_STAT(sdTransferStats(false, request->count, request->retries, request->start_time));
 
-			if (count)
-				sd_avg_write_time = ((sd_sectors_written * sd_avg_write_time) + write_time) / (sd_sectors_written + count);
+	callback = request->callback;
+	param = request->param;
+	sd_async_head = (sd_async_head + 1) % SD_ASYNC_QUEUE_SIZE;
+	sd_async_count--;
 
-			sd_sectors_written += count;
-		}
+	if (callback)
+		callback(status, param);
 
-	} else {
-		if (sd_transfer_error_code == SD_NO_ERROR)
-		{
-			uint32_t read_time = micros() - transfer_time;
-			if (read_time > sd_max_read_time)
-				sd_max_read_time = read_time;
+	// Go on with the next request, or release the card
+	sdAsyncStart();
+}
 
-			if (count)
-				sd_avg_read_time = ((sd_sectors_read * sd_avg_read_time) + read_time) / (sd_sectors_read + count);
+SD_Status sdReadBlocksAsync(uint32_t sector, uint8_t* buffer, uint32_t count, sdTransferCallback* callback, void* param)
+{
+	SD_ASYNC_REQUEST* request;
+	bool start;
 
-			sd_sectors_read += count;
-		}
+	if (!count)
+		return SD_ERROR;
+
+	__disable_irq();
+
+	// The first request locks the card until the queue is empty
+	if (sd_async_count == SD_ASYNC_QUEUE_SIZE || (!sd_async_count && !sdLock()))
+	{
+		__enable_irq();
+		return SD_BUSY;
 	}
-#endif // SD_STATS
 
-	return sd_transfer_error_code;
+	request = &sd_async_queue[(sd_async_head + sd_async_count) % SD_ASYNC_QUEUE_SIZE];
+	request->sector = sector;
+	request->buffer = buffer;
+	request->count = count;
+	request->callback = callback;
+	request->param = param;
+	request->retries = SDIO_RETRIES;
+	SD_STAT(request->start_time = micros());
+
+	start = (sd_async_count++ == 0);
+	__enable_irq();
+
+	if (start)
+	{
+		// Don't let the end of the transfer be serviced before the command is done
+		NVIC_DisableIRQ(SD_SERVICE_IRQn);
+		sdAsyncStart();
+		NVIC_EnableIRQ(SD_SERVICE_IRQn);
+	}
+
+	return SD_NO_ERROR;
+}
+
+uint32_t sdGetPendingReads()
+{
+	return sd_async_count;
+}
+
+static void sdReadDone(SD_Status status, void* param)
+{
+	SD_ASYNC_WAIT* wait = (SD_ASYNC_WAIT*) param;
+
+	wait->status = status;
+	wait->done = true;
 }
 
 SD_Status sdReadBlocks(uint32_t sector, uint8_t* buffer, uint32_t count)
 {
+	SD_ASYNC_WAIT wait;
 	SD_Status ret;
 
-	if (!sdLock())
-		return SD_BUSY;
+	wait.done = false;
+	wait.status = SD_NO_ERROR;
 
-	ret = sdTransferBlocksWithDMA(sector, buffer, count, false);
+	ret = sdReadBlocksAsync(sector, buffer, count, sdReadDone, &wait);
+	if (ret != SD_NO_ERROR)
+		return ret;
 
-	sdUnlock();
+	// Retries and timeouts are handled by the queue
+	while (!wait.done);
 
-	return ret;
+	return wait.status;
 }
 
-SD_Status sdWriteBlocks(uint32_t sector, const uint8_t* buffer, uint32_t count)
+SD_Status sdWriteBlocks(uint32_t sector, const uint8_t* buffer, uint32_t count, uint32_t pre_erase)
 {
 	SD_Status ret;
 
+	// ACMD23 only applies to multiple block writes
+	if (count < 2)
+		pre_erase = 0;
+
 	if (!sdLock())
 		return SD_BUSY;
 
-	ret = sdTransferBlocksWithDMA(sector, buffer, count, true);
+	ret = sdTransferBlocksWithDMA(sector, buffer, count, true, pre_erase);
 
 	sdUnlock();
 
@@ -1614,6 +1857,16 @@ extern "C" void SDIO_IRQHandler(void)
 
 	// Disable all SDIO interrupts
 	DISABLE_STATIC_IRQ();
+
+	// Reads queued with sdReadBlocksAsync() are ended at a lower priority
+	if (sd_async_active && (sd_sdio_transfer_complete || sd_transfer_error))
+		NVIC_SetPendingIRQ(SD_SERVICE_IRQn);
+}
+
+extern "C" void SD_SERVICE_IRQHandler(void)
+{
+	if (sd_async_active && (sd_sdio_transfer_complete || sd_transfer_error))
+		sdAsyncService();
 }
 
 uint8_t sdIsBusy()
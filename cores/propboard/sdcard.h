@@ -43,6 +43,14 @@
 #define SD_STAT(x)
 #endif // SD_STATS
 
+#define SD_ASYNC_QUEUE_SIZE		8
+
+// Reads queued with sdReadBlocksAsync() are ended in this otherwise unused interrupt, pended by
+// SDIO_IRQHandler(), at VARIANT_PRIO_SD_SERVICE: below the audio interrupts. sdReadBlocks() can't
+// wait from handlers with the same or a higher priority.
+#define SD_SERVICE_IRQn			SPI3_IRQn
+#define SD_SERVICE_IRQHandler	SPI3_IRQHandler
+
 #define SD_CARD_TYPE_STD_V1_1	1
 #define SD_CARD_TYPE_STD_V2		2
 #define SD_CARD_TYPE_HC			3
@@ -294,6 +302,10 @@ typedef struct sdCardInfo
 
 } SD_CARD_INFO;
 
+// Called when a read queued with sdReadBlocksAsync() ends, from SD_SERVICE_IRQHandler()
+// (VARIANT_PRIO_SD_SERVICE, below the audio interrupts) and not from the SDIO interrupt
+typedef void (sdTransferCallback)(SD_Status status, void* param);
+
 
 #ifdef __cplusplus
 extern "C"
@@ -304,7 +316,9 @@ SD_Status sdInitialize();
 void sdDeinitialize();
 SD_Status sdGetStatus(bool lock = true);
 SD_Status sdReadBlocks(uint32_t sector, uint8_t* buffer, uint32_t count);
-SD_Status sdWriteBlocks(uint32_t sector, const uint8_t* buffer, uint32_t count);
+SD_Status sdReadBlocksAsync(uint32_t sector, uint8_t* buffer, uint32_t count, sdTransferCallback* callback, void* param = NULL);
+uint32_t sdGetPendingReads();
+SD_Status sdWriteBlocks(uint32_t sector, const uint8_t* buffer, uint32_t count, uint32_t pre_erase = 0);
 uint8_t sdIsBusy();
 void enableSdDebug(UARTClass* uart);
 void disableSdDebug();
@@ -268,7 +268,7 @@ void PropConfig::removeWhiteSpace(char* str)
 bool PropConfig::readArray(uint32_t token, void* values, uint8_t* count, DataType value_type)
 {
 	uint8_t idx = 0;
-	char* data = (char*) token;
+	char* data = (char*) (uintptr_t) token;
 	uint8_t value_size;
 	char* end;
 
@@ -346,7 +346,7 @@ bool PropConfig::readArray(const char* section, const char* key, void* values, u
 	if (!data)
 		return false;
 
-	return readArray((uint32_t) data, values, count, value_type);
+	return readArray((uint32_t) (uintptr_t) data, values, count, value_type);
 }
 
 bool PropConfig::writeKeyToBackup(const char* key, void* values, uint32_t count, DataType type)
@@ -527,7 +527,7 @@ bool PropConfig::writeValues(const char* section, const char* key, void* values,
 
 bool PropConfig::readValue(uint32_t token, void* value, DataType value_type, uint32_t* len)
 {
-	char* data = (char*) token;
+	char* data = (char*) (uintptr_t) token;
 
 	switch (value_type)
 	{
@@ -624,7 +624,7 @@ bool PropConfig::readValue(const char* section, const char* key, void* value, Da
 	if (!data)
 		return false;
 
-	return readValue((uint32_t) data, value, value_type, len);
+	return readValue((uint32_t) (uintptr_t) data, value, value_type, len);
 }
 
 bool PropConfig::writeLineToBackup(char* line)
@@ -709,7 +709,7 @@ bool PropConfig::getNextKey(uint32_t* token, char** key, uint32_t* key_len)
 			case lineKey:
 			case lineEmptyKey:
 				if (data)
-					*token = (uint32_t) data;
+					*token = (uint32_t) (uintptr_t) data;
 
 				if (key)
 					*key = file_key;
@@ -839,10 +839,12 @@ bool PropConfig::writeValue(const char* section, const char* key, uint16_t value
 	return writeValues(section, key, &value, 1, TypeUnsigned16);
 }
 
+#if defined(__arm__)
 bool PropConfig::writeValue(const char* section, const char* key, int value)
 {
 	return writeValue(section, key, (int32_t) value);
 }
+#endif
 
 bool PropConfig::writeValue(const char* section, const char* key, int32_t value)
 {
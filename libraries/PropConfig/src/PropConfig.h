@@ -101,7 +101,10 @@ public:
 	bool writeValue(const char* section, const char* key, uint8_t value);
 	bool writeValue(const char* section, const char* key, int16_t value);
 	bool writeValue(const char* section, const char* key, uint16_t value);
+#if defined(__arm__)
+	// int32_t is a long on the target, int on the host builds
 	bool writeValue(const char* section, const char* key, int value);
+#endif
 	bool writeValue(const char* section, const char* key, int32_t value);
 	bool writeValue(const char* section, const char* key, uint32_t value);
 	bool writeValue(const char* section, const char* key, const char* value);
@@ -0,0 +1,78 @@
+/*
+  SD streaming logger
+
+ This example logs the accelerometer for a minute with SDLogger. The
+ space for the whole log is reserved when the file is created, so the
+ readings are written to the card in big, aligned chunks that don't
+ hold up the audio. At the end the file is trimmed to the data logged
+ and the longest write to the card is printed.
+
+ This example code is in the public domain.
+
+ */
+
+#include <SD.h>
+#include <SDLogger.h>
+
+#define LOG_TIME_MS 60000
+
+typedef struct {
+  uint32_t time;
+  int16_t x, y, z;
+  int16_t reserved;
+} RECORD;
+
+SDLogger logger;
+uint32_t start;
+
+void setup() {
+  Serial.begin(115200);
+
+  if (!SD.begin()) {
+    Serial.println("Card failed, or not present");
+    return;
+  }
+
+  if (!Motion.begin(8, 400)) {
+    Serial.println("Cannot start the accelerometer");
+    return;
+  }
+
+  // Reserve the space for a minute of readings, before any sound is played
+  if (!logger.begin("motion.bin", sizeof(RECORD) * 400 * (LOG_TIME_MS / 1000))) {
+    Serial.println("Cannot create motion.bin");
+    return;
+  }
+
+  start = millis();
+}
+
+void loop() {
+  RECORD record;
+  SD_LOGGER_STATS stats;
+
+  if (!logger.isOpen())
+    return;
+
+  if (Motion.dataReady() && Motion.read(&record.x, &record.y, &record.z)) {
+    record.time = millis();
+    record.reserved = 0;
+    logger.write(&record, sizeof(record));
+  }
+
+  if (millis() - start >= LOG_TIME_MS) {
+    Serial.print("Logged ");
+    Serial.print(logger.getSize());
+    Serial.println(" bytes");
+
+    logger.getStats(&stats);
+    logger.end();
+
+    Serial.print("Longest write: ");
+    Serial.print(stats.max_write_time);
+    Serial.println(" uS");
+    Serial.print("Dropped: ");
+    Serial.print(stats.dropped);
+    Serial.println(" bytes");
+  }
+}
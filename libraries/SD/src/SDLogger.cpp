@@ -0,0 +1,285 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### SDLogger.cpp
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+#include "SDLogger.h"
+#include <diskio.h>
+
+#define SD_LOGGER_SECTOR_SIZE		512
+
+SDLogger::SDLogger()
+{
+	file_open = false;
+	buffer_alloc = NULL;
+	resetStats();
+}
+
+SDLogger::~SDLogger()
+{
+	end();
+}
+
+bool SDLogger::begin(const char* path, uint32_t size, uint32_t chunk_size)
+{
+	FATFS* fs;
+
+	end();
+
+	chunk_sectors = chunk_size / SD_LOGGER_SECTOR_SIZE;
+	if (!chunk_sectors || !size)
+		return false;
+
+	// 16 bytes aligned, for the widest DMA bursts
+	buffer_alloc = (uint8_t*) malloc(chunk_sectors * SD_LOGGER_SECTOR_SIZE * 2 + 16);
+	if (!buffer_alloc)
+		return false;
+
+	buffers[0] = buffer_alloc;
+	if ((uintptr_t) buffers[0] & 0x0F)
+		buffers[0] += (16 - ((uintptr_t) buffers[0] & 0x0F));
+	buffers[1] = buffers[0] + chunk_sectors * SD_LOGGER_SECTOR_SIZE;
+
+	if (f_open(&file, path, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+	{
+		free(buffer_alloc);
+		buffer_alloc = NULL;
+		return false;
+	}
+
+	// All the space in one run of clusters, with the FAT saved now and not while logging
+	if (f_expand(&file, size, 1) != FR_OK || f_sync(&file) != FR_OK)
+	{
+		f_close(&file);
+		f_unlink(path);
+		free(buffer_alloc);
+		buffer_alloc = NULL;
+		return false;
+	}
+
+	fs = file.obj.fs;
+	start_sector = fs->database + (file.obj.sclust - 2) * fs->csize;
+	end_sector = start_sector + (size + SD_LOGGER_SECTOR_SIZE - 1) / SD_LOGGER_SECTOR_SIZE;
+
+	fill = 0;
+	fill_bytes = 0;
+	fill_sector = start_sector;
+	fill_capacity = bufferCapacity(fill_sector);
+	pending[0] = pending[1] = false;
+	file_open = true;
+
+	return true;
+}
+
+// The first buffer ends at a chunk boundary of the card, so all the writes after it are aligned
+uint32_t SDLogger::bufferCapacity(uint32_t sector)
+{
+	uint32_t sectors = chunk_sectors - (sector % chunk_sectors);
+
+	if (sectors > end_sector - sector)
+		sectors = end_sector - sector;
+
+	return sectors * SD_LOGGER_SECTOR_SIZE;
+}
+
+// Hands the full buffer over to update() and starts filling the other one
+bool SDLogger::swapBuffers()
+{
+	uint8_t next = fill ^ 1;
+
+	// The other buffer is still waiting for the card, or the file is full
+	if (pending[next] || !fill_bytes)
+		return false;
+
+	pending_sector[fill] = fill_sector;
+	pending_bytes[fill] = fill_bytes;
+	pending[fill] = true;
+
+	fill_sector += fill_bytes / SD_LOGGER_SECTOR_SIZE;
+	fill_bytes = 0;
+	fill_capacity = bufferCapacity(fill_sector);
+	fill = next;
+
+	return true;
+}
+
+size_t SDLogger::write(const void* data, size_t size)
+{
+	const uint8_t* src = (const uint8_t*) data;
+	size_t done = 0;
+	uint32_t count;
+
+	if (!file_open)
+		return 0;
+
+	while (done < size)
+	{
+		if (fill_bytes == fill_capacity && !swapBuffers())
+			break;
+
+		count = fill_capacity - fill_bytes;
+		if (count > size - done)
+			count = size - done;
+
+		memcpy(buffers[fill] + fill_bytes, src + done, count);
+		fill_bytes += count;
+		done += count;
+	}
+
+	if (fill_bytes == fill_capacity)
+		swapBuffers();
+
+	stats.bytes += done;
+	stats.dropped += size - done;
+
+	if (!__get_IPSR())
+		update();
+
+	return done;
+}
+
+bool SDLogger::writeBuffer(uint8_t index)
+{
+	uint32_t sectors = (pending_bytes[index] + SD_LOGGER_SECTOR_SIZE - 1) / SD_LOGGER_SECTOR_SIZE;
+	uint32_t start = micros();
+	uint32_t elapsed;
+	FATFS* fs = file.obj.fs;
+	DRESULT res = RES_NOTRDY;
+
+	// Straight to the file sectors. Multi-sector writes are pre-erased by disk_write().
+	// The volume is held like in any FatFs call: the audio update can't read through
+	// the sector cache while it changes, and runs between the chunks of the write.
+	if (ff_req_grant(fs->sobj))
+	{
+		res = disk_write(fs->drv, buffers[index], pending_sector[index], sectors);
+		ff_rel_grant(fs->sobj);
+	}
+
+	elapsed = micros() - start;
+	stats.chunks++;
+	stats.total_write_time += elapsed;
+	if (elapsed > stats.max_write_time)
+		stats.max_write_time = elapsed;
+
+	if (res != RES_OK)
+	{
+		stats.errors++;
+		return false;
+	}
+
+	return true;
+}
+
+bool SDLogger::update()
+{
+	bool ok = true;
+
+	if (!file_open)
+		return false;
+
+	for (uint8_t i = 0; i < 2; i++)
+	{
+		if (!pending[i])
+			continue;
+
+		// The data is lost on errors, logging goes on
+		ok = writeBuffer(i) && ok;
+		pending[i] = false;
+	}
+
+	return ok;
+}
+
+// Interrupt handlers have to stop calling write() before this
+bool SDLogger::end()
+{
+	uint32_t logged;
+	uint32_t tail;
+	bool ok;
+
+	if (!file_open)
+	{
+		if (buffer_alloc)
+			free(buffer_alloc);
+		buffer_alloc = NULL;
+		return false;
+	}
+
+	ok = update();
+
+	// The last buffer, completed to a whole sector
+	logged = getSize();
+	if (fill_bytes)
+	{
+		tail = fill_bytes % SD_LOGGER_SECTOR_SIZE;
+		if (tail)
+			memset(buffers[fill] + fill_bytes, 0, SD_LOGGER_SECTOR_SIZE - tail);
+
+		pending_sector[fill] = fill_sector;
+		pending_bytes[fill] = fill_bytes;
+		ok = writeBuffer(fill) && ok;
+	}
+
+	// Give the space not used back
+	if (f_lseek(&file, logged) != FR_OK || f_truncate(&file) != FR_OK)
+		ok = false;
+
+	if (f_close(&file) != FR_OK)
+		ok = false;
+
+	file_open = false;
+	free(buffer_alloc);
+	buffer_alloc = NULL;
+
+	return ok;
+}
+
+uint32_t SDLogger::getSize()
+{
+	if (!file_open)
+		return 0;
+
+	return (fill_sector - start_sector) * SD_LOGGER_SECTOR_SIZE + fill_bytes;
+}
+
+uint32_t SDLogger::getSpaceLeft()
+{
+	if (!file_open)
+		return 0;
+
+	return (end_sector - fill_sector) * SD_LOGGER_SECTOR_SIZE - fill_bytes;
+}
+
+void SDLogger::getStats(SD_LOGGER_STATS* dst)
+{
+	__disable_irq();
+	memcpy(dst, &stats, sizeof(stats));
+	__enable_irq();
+}
+
+void SDLogger::resetStats()
+{
+	__disable_irq();
+	memset(&stats, 0, sizeof(stats));
+	__enable_irq();
+}
@@ -0,0 +1,95 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### SDLogger.h
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+#ifndef __SDLOGGER_H__
+#define __SDLOGGER_H__
+
+#include <Arduino.h>
+#include <ff.h>
+
+#define SD_LOGGER_CHUNK_SIZE		8192		// Default size of each of the two buffers, in bytes
+
+typedef struct _sd_logger_stats
+{
+	uint32_t bytes;						// Bytes taken by write()
+	uint32_t dropped;					// Bytes refused with both buffers full, or with the file full
+	uint32_t chunks;					// Writes to the card
+	uint32_t max_write_time;			// Longest write to the card, audio updates run meanwhile included, in uS
+	uint32_t total_write_time;
+	uint32_t errors;
+} SD_LOGGER_STATS;
+
+/*
+ * Streaming logger. The file is preallocated in one contiguous run of clusters
+ * (f_expand) when it is opened, so the data is written straight to its sectors,
+ * bypassing FatFs: no FAT or directory updates while logging, and only whole,
+ * aligned multi-block writes pre-erased with ACMD23. The data is copied into
+ * one of two buffers while the other one is on its way to the card.
+ *
+ * write() can be called from an interrupt handler, as long as it is the only
+ * place calling it; the card is written by update(), that has to be called from
+ * loop(). When write() is called from thread mode it calls update() itself.
+ * The file is trimmed to the bytes logged by end().
+ */
+class SDLogger
+{
+public:
+	SDLogger();
+	~SDLogger();
+
+	bool begin(const char* path, uint32_t size, uint32_t chunk_size = SD_LOGGER_CHUNK_SIZE);
+	size_t write(const void* data, size_t size);
+	bool update();
+	bool end();
+
+	inline bool isOpen() 					{ return file_open; }
+	uint32_t getSize();
+	uint32_t getSpaceLeft();
+	void getStats(SD_LOGGER_STATS* dst);
+	void resetStats();
+
+private:
+	bool swapBuffers();
+	bool writeBuffer(uint8_t index);
+	uint32_t bufferCapacity(uint32_t sector);
+
+	FIL file;
+	bool file_open;
+	uint8_t* buffer_alloc;
+	uint8_t* buffers[2];
+	uint32_t chunk_sectors;
+	uint32_t start_sector;				// First sector of the file
+	uint32_t end_sector;				// Sector after the preallocated space
+	uint32_t fill_sector;				// Where the buffer being filled goes
+	uint32_t fill_capacity;				// Bytes up to the next chunk boundary
+	volatile uint32_t fill_bytes;
+	volatile uint8_t fill;				// Buffer being filled by write()
+	volatile bool pending[2];			// Full, waiting for update()
+	uint32_t pending_sector[2];
+	uint32_t pending_bytes[2];
+	SD_LOGGER_STATS stats;
+};
+
+#endif /* __SDLOGGER_H__ */
@@ -0,0 +1,1390 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### audiosim.cpp
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+/*
+ * PropAudio simulator
+ *
+ * Runs PropAudio, the AudioSources and FatFs on Linux against a simulated
+ * I2S DMA clock and an SD card backed by a disk image, following a scenario
+ * script. The mixed output is written to a WAV file and the time spent in
+ * the DMA interrupt (mixing) and in PendSV (updates/refills) is reported.
+ *
+ * Usage: audiosim [-o output.wav] [-d disk.img] scenario.txt
+ *
+ * Scenario directives (one per line, '#' starts a comment):
+ *
+ *   rate <hz>                          Output sample rate (default 22050)
+ *   bits <bps>                         Output bits per sample (default 16)
+ *   disk <mb>                          Size of the FAT16 image (16..128, default 64)
+ *   sd <command_us> <sector_us> [jitter_us]
+ *                                      Simulated SD latency (default 200 25), plus up to jitter_us per command
+ *   sderrors <timeout_ppm> <crc_ppm> [timeout_us]
+ *                                      Data timeouts and CRC failures injected per transfer attempt
+ *   sdwrite <busy_us> <erase_us> [unit_sectors]
+ *                                      Card programming after every write, and erase of the units it
+ *                                      begins (unless pre-erased) or breaks into (default 0 0 256)
+ *   fragment <clusters>                Files written after this are split in fragments of <clusters>
+ *   format <pcm|adpcm|ulaw>            Coding of the tones and noises generated after this (default pcm)
+ *   mixer <singlepass|multipass>       Mixing function (default: PropAudio's choice)
+ *   latency <us> <buffers> [max]       Output buffer length and count, adaptive up to max
+ *   buffers <fixed|adaptive|triple> [min_us max_us target headroom]
+ *                                      Player buffer sizing (see BUFFER_POLICY, default fixed)
+ *   output <normal|dbm>                I2S DMA mode (default normal)
+ *   mixing <deferred|inline>           Mix in AUDIO_MIX_IRQn or in the DMA interrupt (default deferred)
+ *   eq <band> <type> <hz> [q] [db]     Equalizer band, type peak|lowshelf|highshelf|lowpass|highpass
+ *   highpass <hz> [2|4]                High-pass filter, order 2 (default) or 4
+ *   limiter <db> [lookahead_us] [release_ms]
+ *                                      Look-ahead limiter
+ *   tone <name> <hz> <ms> [mono|stereo] [level]
+ *   noise <name> <ms> [mono|stereo] [level]
+ *   import <host path> <name>          Copy a WAV file into the image
+ *   mkdir <dir>                        Create a directory in the image
+ *   dummy <prefix> <count> <bytes>     Write <count> files named <prefix>NNN.bin, to grow a directory
+ *   font <dir> [index file]            Index the WAV files of <dir> ("/" for the root) for openWav()
+ *   synth <hum> <swing>                Load the SwingSynth loops (16-bit mono WAV files)
+ *   cache <bytes>                      Clip cache budget
+ *   preload <name> [min max]           Load a clip, or the clips <name><min..max>.wav, in the cache
+ *   chainer <main> [crossfade_ms]      Open a WavChainPlayer on its main track
+ *   pool <voices> [bytes]              Open a VoicePool, with <bytes> of buffers per voice
+ *   group <group> <voices>             Polyphony limit of a VoicePool group
+ *   at <ms> play <voice> <name> [loop]
+ *   at <ms> stop <voice>
+ *   at <ms> volume <voice> <value>
+ *   at <ms> ramp <voice> <samples> [linear|decibel]
+ *   at <ms> synth <play|stop>
+ *   at <ms> motion <g>                 Accelerometer reading (without gravity), sent to the synth
+ *   at <ms> clip <player> <name> [min max]
+ *                                      Play a cached clip (a random one with min/max) on a MemoryPlayer
+ *   at <ms> chain <play|stop|restart>
+ *   at <ms> chain file <name> [loop]   Chain a track to the main one of the chain player
+ *   at <ms> pool <priority> <name> [group] [loop]
+ *                                      Play a file on the VoicePool
+ *   at <ms> file read <name> [chunk]   Read a whole file from thread mode, like a sketch (default chunk 32768)
+ *   at <ms> file write <name> <bytes> [chunk]
+ *                                      Write a file from thread mode, like a data logger
+ *   at <ms> file log <name> <ms> [record]
+ *                                      Log a record (default 64 bytes) per ms with an SDLogger
+ *   at <ms> file append <name> <ms> [record]
+ *                                      Log the same records with f_write(), and f_sync() every 100 ms
+ *   end <ms>                           Length of the simulation
+ *
+ * Voices are numbered 0 to MAX_VOICES - 1, each one is a WavPlayer. Clip players are numbered
+ * 0 to MAX_CLIP_PLAYERS - 1. Effects are chained
+ * in the order they appear.
+ */
+
+#include "Arduino.h"
+#include "audiosim.h"
+#include <diskio.h>
+#include <SDLogger.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define MAX_VOICES			8
+#define MAX_CLIP_PLAYERS	4
+#define MAX_EVENTS			1024
+#define MAX_LINE			512
+#define USER_IO_MAX_CHUNK	32768
+#define LOG_RECORD_NS		1000000ULL
+#define LOG_SYNC_RECORDS	100
+
+enum EventType
+{
+	EventPlay,
+	EventStop,
+	EventVolume,
+	EventRamp,
+	EventSynthPlay,
+	EventSynthStop,
+	EventMotion,
+	EventClip,
+	EventChainPlay,
+	EventChainStop,
+	EventChainRestart,
+	EventChain,
+	EventPool,
+	EventFileRead,
+	EventFileWrite,
+	EventFileLog,
+	EventFileAppend
+};
+
+typedef struct _sim_event
+{
+	uint32_t time_ms;
+	EventType type;
+	uint8_t voice;
+	bool loop;
+	float value;
+	uint32_t range[2];
+	char name[64];
+} SIM_EVENT;
+
+typedef struct _scenario
+{
+	uint32_t sample_rate;
+	uint8_t bits_per_sample;
+	uint32_t disk_mb;
+	uint32_t end_ms;
+	audioMixCallback* mixer;
+	char mixer_name[16];
+	uint32_t latency_us;
+	uint8_t buffers;
+	uint8_t max_buffers;
+	AudioOutputMode output_mode;
+	bool deferred_mixing;
+	char chain_main[64];
+	uint32_t chain_crossfade_ms;
+	uint8_t pool_voices;
+	uint32_t pool_bytes;
+	uint32_t event_count;
+	SIM_EVENT events[MAX_EVENTS];
+} SCENARIO;
+
+static FATFS fatfs;
+static WavPlayer voices[MAX_VOICES];
+static AudioEqualizer equalizer;
+static AudioHighPass highpass;
+static AudioLimiter limiter;
+static SwingSynth synth;
+static AudioClipCache clip_cache;
+static MemoryPlayer clip_players[MAX_CLIP_PLAYERS];
+static WavChainPlayer chainer;
+static AudioFontIndex font_index;
+static VoicePool pool;
+static FILE* output_file = NULL;
+static uint32_t output_bytes = 0;
+static uint32_t fragment_clusters = 0;
+static uint32_t fragment_count = 0;
+static uint16_t file_format = WAV_FORMAT_PCM;
+static uint8_t user_io_buffer[USER_IO_MAX_CHUNK] __attribute__((aligned(4)));
+
+// Sketch file I/O done by the "file" events
+static struct
+{
+	uint32_t reads;
+	uint32_t writes;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t max_call_ns;
+} user_io;
+
+// Records logged by the "file log" and "file append" events, one per LOG_RECORD_NS
+static struct
+{
+	bool active;
+	bool stream;						// SDLogger, or f_write()
+	uint32_t record;
+	uint32_t records_left;
+	uint64_t next_ns;
+	uint32_t records;
+	uint32_t late;						// Records logged after the next one was due
+	uint64_t max_call_ns;
+	bool failed;
+} log_job;
+
+static SDLogger logger;
+static FIL log_file;
+
+#define ADPCM_BLOCK_SIZE	256			// Per channel
+
+static const int8_t adpcm_index_table[16] =
+{
+	-1, -1, -1, -1, 2, 4, 6, 8,
+	-1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static const int16_t adpcm_step_table[89] =
+{
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+	253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+	1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+	3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+	12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static uint8_t adpcmEncode(ADPCM_STATE* state, int32_t sample)
+{
+	int32_t step = adpcm_step_table[state->index];
+	int32_t diff = sample - state->predictor;
+	int32_t vpdiff = step >> 3;
+	uint8_t nibble = 0;
+
+	if (diff < 0)
+	{
+		nibble = 8;
+		diff = -diff;
+	}
+
+	if (diff >= step)
+	{
+		nibble |= 4;
+		diff -= step;
+		vpdiff += step;
+	}
+
+	if (diff >= (step >> 1))
+	{
+		nibble |= 2;
+		diff -= step >> 1;
+		vpdiff += step >> 1;
+	}
+
+	if (diff >= (step >> 2))
+	{
+		nibble |= 1;
+		vpdiff += step >> 2;
+	}
+
+	// Same steps as the decoder in AudioFileHelper
+	state->predictor = __SSAT((nibble & 8) ? state->predictor - vpdiff : state->predictor + vpdiff, 16);
+	state->index += adpcm_index_table[nibble];
+	if (state->index < 0)
+		state->index = 0;
+	else if (state->index > 88)
+		state->index = 88;
+
+	return nibble;
+}
+
+static uint8_t mulawEncode(int32_t sample)
+{
+	uint8_t sign = 0;
+	uint8_t exponent = 7;
+
+	if (sample < 0)
+	{
+		sign = 0x80;
+		sample = -sample;
+	}
+
+	sample += 0x84;
+	if (sample > 0x7FFF)
+		sample = 0x7FFF;
+
+	while (exponent && !(sample & (0x4000 >> (7 - exponent))))
+		exponent--;
+
+	return ~(sign | (exponent << 4) | ((sample >> (exponent + 3)) & 0x0F));
+}
+
+static void writeWavHeader(FILE* file, uint32_t fs, uint16_t bps, uint16_t channels, uint32_t data_size,
+						   uint16_t format = WAV_FORMAT_PCM, uint16_t block_align = 0, uint16_t block_samples = 0)
+{
+	WAV_HEADER hdr;
+	uint32_t data_hdr[2];
+	uint16_t extension[2];
+
+	memcpy(hdr.chunk.riff, "RIFF", 4);
+	memcpy(hdr.chunk.wave, "WAVE", 4);
+	hdr.chunk.file_size = data_size + 36 + (block_samples ? sizeof(extension) : 0);
+	hdr.format.fmt_type = format;
+	hdr.format.channels = channels;
+	hdr.format.sample_rate = fs;
+	hdr.format.bits_per_sample = bps;
+	hdr.format.block_align = block_align ? block_align : channels * bps / 8;
+	hdr.format.byte_rate = (uint64_t) fs * hdr.format.block_align / (block_samples ? block_samples : 1);
+
+	fwrite(&hdr.chunk, sizeof(WAV_CHUNK), 1, file);
+	fwrite("fmt ", 4, 1, file);
+	data_hdr[0] = sizeof(WAV_FORMAT) + (block_samples ? sizeof(extension) : 0);
+	fwrite(data_hdr, 4, 1, file);
+	fwrite(&hdr.format, sizeof(WAV_FORMAT), 1, file);
+
+	// IMA-ADPCM has the samples per block in the format extension
+	if (block_samples)
+	{
+		extension[0] = 2;
+		extension[1] = block_samples;
+		fwrite(extension, sizeof(extension), 1, file);
+	}
+
+	fwrite("data", 4, 1, file);
+	data_hdr[0] = data_size;
+	fwrite(data_hdr, 4, 1, file);
+}
+
+static void onOutput(const uint8_t* data, uint32_t bytes, uint8_t bytes_per_sample)
+{
+	if (!output_file)
+		return;
+
+	if (bytes_per_sample == 2)
+	{
+		fwrite(data, bytes, 1, output_file);
+		output_bytes += bytes;
+		return;
+	}
+
+	// 24-bit I2S words (see PACK_I2S24) back to packed 3-byte samples
+	for (uint32_t i = 0; i < bytes; i += 4)
+	{
+		uint32_t word;
+		uint8_t sample[3];
+
+		memcpy(&word, data + i, 4);
+		word = (word << 16) | (word >> 16);
+		sample[0] = word >> 8;
+		sample[1] = word >> 16;
+		sample[2] = word >> 24;
+		fwrite(sample, 3, 1, output_file);
+		output_bytes += 3;
+	}
+}
+
+static bool writeVolumeFile(const char* name, const uint8_t* data, uint32_t size)
+{
+	FIL file;
+	UINT written;
+
+	if (f_open(&file, name, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+		return false;
+
+	if (!fragment_clusters)
+	{
+		bool ok = (f_write(&file, data, size, &written) == FR_OK && written == size);
+		f_close(&file);
+		return ok;
+	}
+
+	// Leave a cluster used by another file after every fragment
+	uint32_t chunk = fragment_clusters * fatfs.csize * _MAX_SS;
+	bool ok = true;
+
+	while (ok && size)
+	{
+		uint32_t count = size < chunk ? size : chunk;
+		char filler[16];
+		FIL gap;
+
+		ok = (f_write(&file, data, count, &written) == FR_OK && written == count && f_sync(&file) == FR_OK);
+		data += count;
+		size -= count;
+
+		sprintf(filler, "GAP%05u.BIN", fragment_count++);
+		ok = ok && f_open(&gap, filler, FA_WRITE | FA_CREATE_ALWAYS) == FR_OK;
+		ok = ok && f_write(&gap, "", 1, &written) == FR_OK && f_close(&gap) == FR_OK;
+	}
+
+	f_close(&file);
+	return ok;
+}
+
+static bool generateWav(const char* name, float freq, uint32_t ms, bool stereo, float level,
+						uint32_t fs, uint8_t bps)
+{
+	uint16_t channels = stereo ? 2 : 1;
+	uint32_t frames = (uint64_t) fs * ms / 1000;
+	uint32_t fade = fs / 200;
+	uint32_t data_size;
+	FILE* tmp = tmpfile();
+	int32_t* pcm;
+	uint8_t* data;
+	long size;
+
+	if (!tmp || (bps != 16 && bps != 24))
+		return false;
+
+	// Compressed files decode to 16-bit
+	if (file_format != WAV_FORMAT_PCM)
+		bps = 16;
+
+	pcm = (int32_t*) malloc(frames * channels * sizeof(int32_t));
+	if (!pcm)
+		return false;
+
+	for (uint32_t i = 0; i < frames; i++)
+	{
+		float gain = level;
+		float value;
+
+		// Short fades so tones don't click on their own
+		if (i < fade)
+			gain *= (float) i / fade;
+		else if (frames - i < fade)
+			gain *= (float) (frames - i) / fade;
+
+		if (freq > 0)
+			value = sinf(2.0f * (float) M_PI * freq * i / fs);
+		else
+			value = ((float) rand() / RAND_MAX) * 2.0f - 1.0f;
+
+		int32_t sample = (int32_t) (value * gain * (bps == 24 ? 8388607.0f : 32767.0f));
+		for (uint16_t ch = 0; ch < channels; ch++)
+			pcm[i * channels + ch] = sample;
+	}
+
+	if (file_format == WAV_FORMAT_MULAW)
+	{
+		data_size = frames * channels;
+		writeWavHeader(tmp, fs, 8, channels, data_size, WAV_FORMAT_MULAW);
+
+		for (uint32_t i = 0; i < frames * channels; i++)
+			fputc(mulawEncode(pcm[i]), tmp);
+	} else if (file_format == WAV_FORMAT_IMA_ADPCM)
+	{
+		uint16_t block_align = ADPCM_BLOCK_SIZE * channels;
+		uint32_t block_samples = (ADPCM_BLOCK_SIZE - 4) * 2 + 1;
+		uint32_t blocks = (frames + block_samples - 1) / block_samples;
+		ADPCM_STATE state[2] = { { 0, 0 }, { 0, 0 } };
+
+		// Whole blocks, the last one padded with silence
+		data_size = blocks * block_align;
+		writeWavHeader(tmp, fs, 4, channels, data_size, WAV_FORMAT_IMA_ADPCM, block_align, block_samples);
+
+		for (uint32_t b = 0; b < blocks; b++)
+		{
+			uint32_t first = b * block_samples;
+
+			for (uint16_t ch = 0; ch < channels; ch++)
+			{
+				int16_t sample = first < frames ? pcm[first * channels + ch] : 0;
+
+				state[ch].predictor = sample;
+				fwrite(&sample, 2, 1, tmp);
+				fputc(state[ch].index, tmp);
+				fputc(0, tmp);
+			}
+
+			// Groups of 8 samples (4 bytes) per channel, low nibble first
+			for (uint32_t k = 1; k < block_samples; k += 8)
+			{
+				for (uint16_t ch = 0; ch < channels; ch++)
+				{
+					for (uint32_t j = 0; j < 8; j += 2)
+					{
+						uint32_t frame = first + k + j;
+						uint8_t lo = adpcmEncode(&state[ch], frame < frames ? pcm[frame * channels + ch] : 0);
+						uint8_t hi = adpcmEncode(&state[ch], frame + 1 < frames ? pcm[(frame + 1) * channels + ch] : 0);
+						fputc(lo | (hi << 4), tmp);
+					}
+				}
+			}
+		}
+	} else {
+		data_size = frames * channels * (bps / 8);
+		writeWavHeader(tmp, fs, bps, channels, data_size);
+
+		for (uint32_t i = 0; i < frames * channels; i++)
+			fwrite(&pcm[i], bps / 8, 1, tmp);
+	}
+
+	free(pcm);
+
+	size = ftell(tmp);
+	data = (uint8_t*) malloc(size);
+	rewind(tmp);
+	bool ok = data && fread(data, size, 1, tmp) == 1 && writeVolumeFile(name, data, size);
+
+	free(data);
+	fclose(tmp);
+	return ok;
+}
+
+static bool importWav(const char* path, const char* name)
+{
+	FILE* file = fopen(path, "rb");
+	uint8_t* data;
+	long size;
+
+	if (!file)
+		return false;
+
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	rewind(file);
+
+	data = (uint8_t*) malloc(size);
+	bool ok = data && fread(data, size, 1, file) == 1 && writeVolumeFile(name, data, size);
+
+	free(data);
+	fclose(file);
+	return ok;
+}
+
+static int compareEvents(const void* a, const void* b)
+{
+	const SIM_EVENT* ea = (const SIM_EVENT*) a;
+	const SIM_EVENT* eb = (const SIM_EVENT*) b;
+
+	if (ea->time_ms != eb->time_ms)
+		return ea->time_ms < eb->time_ms ? -1 : 1;
+
+	return ea < eb ? -1 : 1;
+}
+
+static bool parseScenario(const char* path, SCENARIO* sc, const char* image)
+{
+	char line[MAX_LINE];
+	char cmd[32], arg1[256], arg2[64], arg3[64];
+	uint32_t line_num = 0;
+	bool volume_ready = false;
+	FILE* file = fopen(path, "r");
+
+	if (!file)
+	{
+		fprintf(stderr, "Cannot open scenario %s\n", path);
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), file))
+	{
+		char* comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		line_num++;
+		arg1[0] = arg2[0] = arg3[0] = '\0';
+		int n = sscanf(line, "%31s %255s %63s %63s", cmd, arg1, arg2, arg3);
+		if (n <= 0)
+			continue;
+
+		// The volume is created on the first directive that needs it
+		if (!volume_ready && (!strcmp(cmd, "tone") || !strcmp(cmd, "noise") ||
+							  !strcmp(cmd, "import") || !strcmp(cmd, "synth") || !strcmp(cmd, "preload") ||
+							  !strcmp(cmd, "chainer") || !strcmp(cmd, "mkdir") || !strcmp(cmd, "dummy") ||
+							  !strcmp(cmd, "font") ||
+							  !strcmp(cmd, "at")))
+		{
+			if (!hostSdCreate(image, sc->disk_mb) || !hostSdOpen(image) ||
+				f_mount(&fatfs, "", 1) != FR_OK)
+			{
+				fprintf(stderr, "Cannot create disk image %s\n", image);
+				fclose(file);
+				return false;
+			}
+
+			volume_ready = true;
+		}
+
+		bool ok = true;
+
+		if (!strcmp(cmd, "rate"))
+		{
+			sc->sample_rate = atoi(arg1);
+		} else if (!strcmp(cmd, "bits"))
+		{
+			sc->bits_per_sample = atoi(arg1);
+		} else if (!strcmp(cmd, "disk"))
+		{
+			sc->disk_mb = atoi(arg1);
+		} else if (!strcmp(cmd, "fragment"))
+		{
+			fragment_clusters = atoi(arg1);
+		} else if (!strcmp(cmd, "format"))
+		{
+			if (!strcmp(arg1, "pcm"))
+				file_format = WAV_FORMAT_PCM;
+			else if (!strcmp(arg1, "adpcm"))
+				file_format = WAV_FORMAT_IMA_ADPCM;
+			else if (!strcmp(arg1, "ulaw"))
+				file_format = WAV_FORMAT_MULAW;
+			else
+				ok = false;
+		} else if (!strcmp(cmd, "sd"))
+		{
+			hostSdSetLatency(atoi(arg1), atoi(arg2));
+			hostSdSetJitter(atoi(arg3));
+		} else if (!strcmp(cmd, "sderrors"))
+		{
+			hostSdSetFaults(atoi(arg1), atoi(arg2), arg3[0] ? atoi(arg3) : 1000000, 1);
+		} else if (!strcmp(cmd, "sdwrite"))
+		{
+			hostSdSetWriteCost(atoi(arg1), atoi(arg2), arg3[0] ? atoi(arg3) : 256);
+		} else if (!strcmp(cmd, "mixer"))
+		{
+			if (!strcmp(arg1, "singlepass"))
+				sc->mixer = PropAudio::mix16SinglePass;
+			else if (!strcmp(arg1, "multipass"))
+				sc->mixer = PropAudio::mix16Multipass;
+			else
+				ok = false;
+
+			snprintf(sc->mixer_name, sizeof(sc->mixer_name), "%s", arg1);
+		} else if (!strcmp(cmd, "latency"))
+		{
+			sc->latency_us = atoi(arg1);
+			sc->buffers = atoi(arg2);
+			sc->max_buffers = atoi(arg3);
+		} else if (!strcmp(cmd, "buffers"))
+		{
+			BUFFER_POLICY policy;
+			RawPlayer::getDefaultBufferPolicy(&policy);
+			sscanf(line, "%*s %*s %u %u %hu %hu", &policy.min_us, &policy.max_us, &policy.target, &policy.headroom);
+
+			ok = !strcmp(arg1, "fixed") || !strcmp(arg1, "adaptive") || !strcmp(arg1, "triple");
+			policy.adaptive = strcmp(arg1, "fixed") != 0;
+			policy.triple = !strcmp(arg1, "triple");
+			RawPlayer::setDefaultBufferPolicy(&policy);
+		} else if (!strcmp(cmd, "mixing"))
+		{
+			if (!strcmp(arg1, "deferred"))
+				sc->deferred_mixing = true;
+			else if (!strcmp(arg1, "inline"))
+				sc->deferred_mixing = false;
+			else
+				ok = false;
+		} else if (!strcmp(cmd, "output"))
+		{
+			if (!strcmp(arg1, "normal"))
+				sc->output_mode = OutputModeNormal;
+			else if (!strcmp(arg1, "dbm"))
+				sc->output_mode = OutputModeDoubleBuffer;
+			else
+				ok = false;
+		} else if (!strcmp(cmd, "eq"))
+		{
+			static const char* types[] = { "peak", "lowshelf", "highshelf", "lowpass", "highpass" };
+			float q = 0.707f, gain = 0;
+			int type = -1;
+
+			sscanf(line, "%*s %*s %*s %*s %f %f", &q, &gain);
+			for (int i = 0; i < 5; i++)
+			{
+				if (!strcmp(arg2, types[i]))
+					type = i;
+			}
+
+			ok = type >= 0 && equalizer.setBand(atoi(arg1), (FilterType) type, atof(arg3), q, gain) &&
+				 Audio.addEffect(&equalizer);
+		} else if (!strcmp(cmd, "highpass"))
+		{
+			ok = highpass.setCutoff(atof(arg1)) && (!arg2[0] || highpass.setOrder(atoi(arg2))) &&
+				 Audio.addEffect(&highpass);
+		} else if (!strcmp(cmd, "limiter"))
+		{
+			ok = limiter.setThreshold(atof(arg1)) && (!arg2[0] || limiter.setLookahead(atoi(arg2))) &&
+				 (!arg3[0] || limiter.setRelease(atoi(arg3))) && Audio.addEffect(&limiter);
+		} else if (!strcmp(cmd, "end"))
+		{
+			sc->end_ms = atoi(arg1);
+		} else if (!strcmp(cmd, "tone") || !strcmp(cmd, "noise"))
+		{
+			char name[64];
+			char channels[16] = "mono";
+			float freq = 0;
+			float level = 0.5f;
+			uint32_t ms;
+
+			if (!strcmp(cmd, "tone"))
+				ok = sscanf(line, "%*s %63s %f %u %15s %f", name, &freq, &ms, channels, &level) >= 3;
+			else
+				ok = sscanf(line, "%*s %63s %u %15s %f", name, &ms, channels, &level) >= 2;
+
+			ok = ok && generateWav(name, freq, ms, !strcmp(channels, "stereo"), level,
+								   sc->sample_rate, sc->bits_per_sample);
+		} else if (!strcmp(cmd, "import"))
+		{
+			ok = n >= 3 && importWav(arg1, arg2);
+		} else if (!strcmp(cmd, "mkdir"))
+		{
+			ok = f_mkdir(arg1) == FR_OK;
+		} else if (!strcmp(cmd, "dummy"))
+		{
+			uint32_t bytes = atoi(arg3);
+			uint8_t* data = (uint8_t*) calloc(1, bytes + 1);
+			char name[320];
+
+			ok = n >= 4 && data;
+			for (int i = 0; ok && i < atoi(arg2); i++)
+			{
+				snprintf(name, sizeof(name), "%s%03d.bin", arg1, i);
+				ok = writeVolumeFile(name, data, bytes);
+			}
+
+			free(data);
+		} else if (!strcmp(cmd, "font"))
+		{
+			ok = font_index.begin(arg1, arg2[0] ? arg2 : FONT_INDEX_FILE);
+		} else if (!strcmp(cmd, "synth"))
+		{
+			ok = n >= 3 && synth.begin(arg1, arg2);
+		} else if (!strcmp(cmd, "cache"))
+		{
+			ok = clip_cache.begin(atoi(arg1));
+		} else if (!strcmp(cmd, "chainer"))
+		{
+			// Opened once the audio is running
+			snprintf(sc->chain_main, sizeof(sc->chain_main), "%s", arg1);
+			sc->chain_crossfade_ms = atoi(arg2);
+		} else if (!strcmp(cmd, "pool"))
+		{
+			// Opened once the audio is running too
+			sc->pool_voices = atoi(arg1);
+			sc->pool_bytes = atoi(arg2);
+		} else if (!strcmp(cmd, "group"))
+		{
+			ok = pool.setGroupLimit(atoi(arg1), atoi(arg2));
+		} else if (!strcmp(cmd, "preload"))
+		{
+			if (n >= 4)
+				ok = clip_cache.loadRandom(arg1, atoi(arg2), atoi(arg3)) == (uint32_t) abs(atoi(arg3) - atoi(arg2)) + 1;
+			else
+				ok = clip_cache.load(arg1) != NULL;
+		} else if (!strcmp(cmd, "at"))
+		{
+			SIM_EVENT* ev = &sc->events[sc->event_count];
+			char action[16];
+			char voice[16];
+
+			ev->name[0] = '\0';
+			arg3[0] = '\0';
+			ok = sc->event_count < MAX_EVENTS &&
+				 sscanf(line, "%*s %u %15s %15s %63s %63s", &ev->time_ms, action, voice, ev->name, arg3) >= 3;
+
+			if (ok && !strcmp(action, "synth"))
+			{
+				ev->voice = 0;
+				if (!strcmp(voice, "play"))
+					ev->type = EventSynthPlay;
+				else if (!strcmp(voice, "stop"))
+					ev->type = EventSynthStop;
+				else
+					ok = false;
+			} else if (ok && !strcmp(action, "motion"))
+			{
+				ev->voice = 0;
+				ev->type = EventMotion;
+				ev->value = atof(voice);
+			} else if (ok && !strcmp(action, "chain"))
+			{
+				ev->voice = 0;
+				ev->loop = !strcmp(arg3, "loop");
+				if (!strcmp(voice, "play"))
+					ev->type = EventChainPlay;
+				else if (!strcmp(voice, "stop"))
+					ev->type = EventChainStop;
+				else if (!strcmp(voice, "restart"))
+					ev->type = EventChainRestart;
+				else if (!strcmp(voice, "file"))
+					ev->type = EventChain;
+				else
+					ok = false;
+
+				ok = ok && (ev->type != EventChain || ev->name[0]);
+			} else if (ok && !strcmp(action, "pool"))
+			{
+				// The priority goes in the voice
+				ev->voice = atoi(voice);
+				ev->type = EventPool;
+				ev->range[0] = arg3[0] ? atoi(arg3) : 0;
+				ev->loop = sscanf(line, "%*s %*s %*s %*s %*s %*s %15s", action) == 1 && !strcmp(action, "loop");
+				ok = ev->name[0];
+			} else if (ok && !strcmp(action, "file"))
+			{
+				uint32_t chunk = USER_IO_MAX_CHUNK;
+
+				ev->voice = 0;
+				if (!strcmp(voice, "read"))
+				{
+					ev->type = EventFileRead;
+					if (arg3[0])
+						chunk = atoi(arg3);
+				} else if (!strcmp(voice, "write"))
+				{
+					ev->type = EventFileWrite;
+					ev->range[0] = atoi(arg3);
+					sscanf(line, "%*s %*s %*s %*s %*s %*s %u", &chunk);
+				} else if (!strcmp(voice, "log") || !strcmp(voice, "append"))
+				{
+					// Duration in range[0], record size in range[1]
+					ev->type = !strcmp(voice, "log") ? EventFileLog : EventFileAppend;
+					ev->range[0] = atoi(arg3);
+					chunk = 64;
+					sscanf(line, "%*s %*s %*s %*s %*s %*s %u", &chunk);
+					ok = ev->range[0] != 0;
+				} else
+					ok = false;
+
+				ev->range[1] = chunk;
+				ok = ok && ev->name[0] && chunk && chunk <= USER_IO_MAX_CHUNK;
+			} else if (ok && !strcmp(action, "clip"))
+			{
+				ev->voice = atoi(voice);
+				ev->type = EventClip;
+				ev->loop = sscanf(line, "%*s %*s %*s %*s %*s %u %u", &ev->range[0], &ev->range[1]) == 2;
+				ok = ev->voice < MAX_CLIP_PLAYERS && ev->name[0];
+			} else if (ok)
+			{
+				ev->voice = atoi(voice);
+				ev->loop = !strcmp(arg3, "loop");
+				ok = ev->voice < MAX_VOICES;
+
+				if (!strcmp(action, "play"))
+					ev->type = EventPlay;
+				else if (!strcmp(action, "stop"))
+					ev->type = EventStop;
+				else if (!strcmp(action, "volume"))
+				{
+					ev->type = EventVolume;
+					ev->value = atof(ev->name);
+				} else if (!strcmp(action, "ramp"))
+				{
+					ev->type = EventRamp;
+					ev->value = atof(ev->name);
+					ev->loop = !strcmp(arg3, "linear");
+				} else
+					ok = false;
+			}
+
+			if (ok)
+				sc->event_count++;
+		} else {
+			ok = false;
+		}
+
+		if (!ok)
+		{
+			fprintf(stderr, "%s:%u: invalid or failed directive '%s'\n", path, line_num, cmd);
+			fclose(file);
+			return false;
+		}
+	}
+
+	fclose(file);
+	qsort(sc->events, sc->event_count, sizeof(SIM_EVENT), compareEvents);
+	return volume_ready;
+}
+
+static void accountUserCall(uint64_t start)
+{
+	uint64_t ns = hostNow() - start;
+
+	if (ns > user_io.max_call_ns)
+		user_io.max_call_ns = ns;
+}
+
+static bool userRead(const char* name, uint32_t chunk)
+{
+	FIL file;
+	UINT read;
+
+	if (f_open(&file, name, FA_READ | FA_OPEN_EXISTING) != FR_OK)
+		return false;
+
+	do
+	{
+		uint64_t start = hostNow();
+
+		if (f_read(&file, user_io_buffer, chunk, &read) != FR_OK)
+		{
+			f_close(&file);
+			return false;
+		}
+
+		accountUserCall(start);
+		user_io.reads++;
+		user_io.bytes_read += read;
+	} while (read == chunk);
+
+	return f_close(&file) == FR_OK;
+}
+
+static bool userWrite(const char* name, uint32_t bytes, uint32_t chunk)
+{
+	FIL file;
+	UINT written;
+
+	if (f_open(&file, name, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+		return false;
+
+	for (uint32_t i = 0; i < chunk; i++)
+		user_io_buffer[i] = (uint8_t) i;
+
+	while (bytes)
+	{
+		uint32_t count = bytes < chunk ? bytes : chunk;
+		uint64_t start = hostNow();
+
+		if (f_write(&file, user_io_buffer, count, &written) != FR_OK || written != count)
+		{
+			f_close(&file);
+			return false;
+		}
+
+		accountUserCall(start);
+		user_io.writes++;
+		user_io.bytes_written += count;
+		bytes -= count;
+	}
+
+	return f_close(&file) == FR_OK;
+}
+
+static bool logStart(const char* name, uint32_t ms, uint32_t record, bool stream)
+{
+	if (log_job.active)
+		return false;
+
+	if (stream)
+	{
+		if (!logger.begin(name, ms * record))
+			return false;
+	} else if (f_open(&log_file, name, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+		return false;
+
+	log_job.active = true;
+	log_job.stream = stream;
+	log_job.record = record;
+	log_job.records_left = ms;
+	log_job.next_ns = hostNow();
+	return true;
+}
+
+static void logEnd()
+{
+	if (log_job.stream)
+		log_job.failed |= !logger.end();
+	else
+		log_job.failed |= f_close(&log_file) != FR_OK;
+
+	log_job.active = false;
+}
+
+// Logs the record that is due, from thread mode
+static void logRecord()
+{
+	uint64_t start = hostNow();
+	uint64_t ns;
+	UINT written;
+
+	for (uint32_t i = 0; i < log_job.record; i++)
+		user_io_buffer[i] = (uint8_t) (log_job.records + i);
+
+	if (log_job.stream)
+		log_job.failed |= logger.write(user_io_buffer, log_job.record) != log_job.record;
+	else
+	{
+		log_job.failed |= f_write(&log_file, user_io_buffer, log_job.record, &written) != FR_OK ||
+						  written != log_job.record;
+		if ((log_job.records + 1) % LOG_SYNC_RECORDS == 0)
+			log_job.failed |= f_sync(&log_file) != FR_OK;
+	}
+
+	ns = hostNow() - start;
+	if (ns > log_job.max_call_ns)
+		log_job.max_call_ns = ns;
+	if (hostNow() > log_job.next_ns + LOG_RECORD_NS)
+		log_job.late++;
+
+	log_job.records++;
+	log_job.next_ns += LOG_RECORD_NS;
+	if (!--log_job.records_left)
+		logEnd();
+}
+
+// Like hostAdvanceTo(), logging the records due meanwhile
+static void advanceTo(uint64_t ns)
+{
+	while (log_job.active && log_job.next_ns < ns)
+	{
+		hostAdvanceTo(log_job.next_ns);
+		logRecord();
+		hostRunPending();
+	}
+
+	hostAdvanceTo(ns);
+}
+
+static void runEvent(SIM_EVENT* ev)
+{
+	WavPlayer* voice = &voices[ev->voice];
+	bool ok = true;
+
+	switch (ev->type)
+	{
+		case EventPlay:
+			ok = voice->play(ev->name, ev->loop ? PlayModeLoop : PlayModeNormal);
+			break;
+
+		case EventStop:
+			ok = voice->stop();
+			break;
+
+		case EventVolume:
+			voice->setVolume(ev->value);
+			break;
+
+		case EventRamp:
+			voice->setVolumeRamp((uint32_t) ev->value, ev->loop ? VolumeRampLinear : VolumeRampDecibel);
+			break;
+
+		case EventSynthPlay:
+			ok = synth.play();
+			break;
+
+		case EventSynthStop:
+			ok = synth.stop();
+			break;
+
+		case EventMotion:
+			hostSetMotion(ev->value);
+			ok = synth.updateMotion();
+			break;
+
+		case EventClip:
+			if (ev->loop)
+				ok = clip_players[ev->voice].playRandom(&clip_cache, ev->name, ev->range[0], ev->range[1]);
+			else
+				ok = clip_players[ev->voice].play(&clip_cache, ev->name);
+			break;
+
+		case EventChainPlay:
+			ok = chainer.play();
+			break;
+
+		case EventChainStop:
+			ok = chainer.stop();
+			break;
+
+		case EventChainRestart:
+			ok = chainer.restart();
+			break;
+
+		case EventChain:
+			ok = chainer.chain(ev->name, ev->loop ? PlayModeLoop : PlayModeNormal);
+			break;
+
+		case EventPool:
+		{
+			VOICE_POOL_STATS before, after;
+
+			// Requests turned down for sounds with higher priority are counted, not failures
+			pool.getStats(&before);
+			ok = pool.play(ev->name, ev->voice, ev->range[0], ev->loop ? PlayModeLoop : PlayModeNormal) != VOICE_NONE;
+			pool.getStats(&after);
+			ok = ok || after.rejected != before.rejected;
+			break;
+		}
+
+		case EventFileRead:
+			ok = userRead(ev->name, ev->range[1]);
+			break;
+
+		case EventFileWrite:
+			ok = userWrite(ev->name, ev->range[0], ev->range[1]);
+			break;
+
+		case EventFileLog:
+		case EventFileAppend:
+			ok = logStart(ev->name, ev->range[0], ev->range[1], ev->type == EventFileLog);
+			break;
+	}
+
+	if (!ok && ev->type >= EventFileRead)
+		fprintf(stderr, "%u ms: failed to %s %s\n", ev->time_ms, ev->type == EventFileRead ? "read" : "write",
+				ev->name);
+	else if (!ok)
+		fprintf(stderr, "%u ms: voice %u failed to %s %s\n", ev->time_ms, ev->voice,
+				ev->type == EventPlay || ev->type == EventClip ? "play" : "stop", ev->name);
+}
+
+static void printTiming(const char* name, HOST_TIMING* timing)
+{
+	printf("%-18s %8u calls  avg %8.2f us  max %8.2f us", name, timing->count,
+		   timing->count ? timing->total_ns / 1000.0 / timing->count : 0.0,
+		   timing->max_ns / 1000.0);
+}
+
+static void printHistogram(const char* name, AUDIO_HISTOGRAM* histogram)
+{
+	printf("%-18s", name);
+	for (uint32_t i = 0; i < AUDIO_HISTOGRAM_BINS; i++)
+		printf(" %s%u:%u", i == AUDIO_HISTOGRAM_BINS - 1 ? ">=" : "<",
+			   AUDIO_HISTOGRAM_BASE_US << (i == AUDIO_HISTOGRAM_BINS - 1 ? i - 1 : i), histogram->bins[i]);
+	printf("  max %u us\n", histogram->max);
+}
+
+int main(int argc, char** argv)
+{
+	static SCENARIO sc;
+	const char* output = "audiosim.wav";
+	const char* image = "audiosim.img";
+	int opt;
+
+	while ((opt = getopt(argc, argv, "o:d:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'o': output = optarg; break;
+			case 'd': image = optarg; break;
+			default:
+				fprintf(stderr, "Usage: %s [-o output.wav] [-d disk.img] scenario.txt\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind >= argc)
+	{
+		fprintf(stderr, "Usage: %s [-o output.wav] [-d disk.img] scenario.txt\n", argv[0]);
+		return 1;
+	}
+
+	sc.sample_rate = 22050;
+	sc.bits_per_sample = 16;
+	sc.disk_mb = 64;
+	sc.end_ms = 1000;
+	sc.latency_us = TARGET_LATENCY_US;
+	sc.buffers = MIN_OUTPUT_BUFFERS;
+	sc.max_buffers = 0;
+	sc.output_mode = OutputModeNormal;
+	sc.deferred_mixing = true;
+
+	srand(1);
+
+	if (!parseScenario(argv[optind], &sc, image))
+		return 1;
+
+	output_file = fopen(output, "wb");
+	if (!output_file)
+	{
+		fprintf(stderr, "Cannot create %s\n", output);
+		return 1;
+	}
+
+	writeWavHeader(output_file, sc.sample_rate, sc.bits_per_sample, 2, 0);
+	hostSetOutput(onOutput);
+
+	Audio.setOutputMode(sc.output_mode);
+	Audio.setDeferredMixing(sc.deferred_mixing);
+
+	if (!Audio.begin(sc.sample_rate, sc.bits_per_sample, true, sc.latency_us, sc.buffers, sc.max_buffers))
+	{
+		fprintf(stderr, "Audio.begin(%u, %u) failed\n", sc.sample_rate, sc.bits_per_sample);
+		return 1;
+	}
+
+	if (sc.mixer)
+		Audio.setMixingFunction(sc.mixer);
+
+	if (sc.chain_main[0] && (!chainer.begin(sc.chain_main) || !chainer.setCrossfade(sc.chain_crossfade_ms)))
+	{
+		fprintf(stderr, "Cannot open %s on the chain player\n", sc.chain_main);
+		return 1;
+	}
+
+	if (sc.pool_voices && !pool.begin(sc.pool_voices, sc.pool_bytes))
+	{
+		fprintf(stderr, "Cannot open a pool of %u voices\n", sc.pool_voices);
+		return 1;
+	}
+
+	Audio.unmute();
+	Audio.resetStats();
+	AudioFileHelper::resetStats();
+	fs_lock_reset_stats();
+	hostResetStats();
+	hostDmaPoll();
+
+	uint64_t start = hostNow();
+
+	for (uint32_t i = 0; i < sc.event_count; i++)
+	{
+		advanceTo(start + (uint64_t) sc.events[i].time_ms * 1000000ULL);
+		runEvent(&sc.events[i]);
+		hostRunPending();
+	}
+
+	advanceTo(start + (uint64_t) sc.end_ms * 1000000ULL);
+	if (log_job.active)
+		logEnd();
+
+	for (uint32_t i = 0; i < MAX_VOICES; i++)
+		voices[i].stop();
+	synth.stop();
+	for (uint32_t i = 0; i < MAX_CLIP_PLAYERS; i++)
+		clip_players[i].stop();
+	chainer.stop();
+
+	// Patch the WAV header now that the size is known
+	rewind(output_file);
+	writeWavHeader(output_file, sc.sample_rate, sc.bits_per_sample, 2, output_bytes);
+	fclose(output_file);
+
+	HOST_STATS* stats = hostGetStats();
+	double period_us = Audio.getOutputSamples() * 1000000.0 / sc.sample_rate;
+
+	printf("Scenario:          %s\n", argv[optind]);
+	printf("Output:            %s (%u Hz, %u bits, %llu frames)\n", output, sc.sample_rate,
+		   sc.bits_per_sample, (unsigned long long) stats->frames_out);
+	printf("Mixing period:     %.1f us (%u samples)%s%s\n", period_us, Audio.getOutputSamples(),
+		   sc.mixer ? ", mixer " : "", sc.mixer_name);
+	printf("Output buffers:    %u (%u..%u), %u us latency%s\n", Audio.getOutputBuffers(), sc.buffers,
+		   sc.max_buffers > sc.buffers ? sc.max_buffers : sc.buffers, Audio.getLatency(),
+		   sc.output_mode == OutputModeDoubleBuffer ? ", double-buffer DMA" : "");
+	printTiming("DMA IRQ:", &stats->isr);
+	printf("  %u over period\n", stats->isr.over_budget);
+
+	if (sc.deferred_mixing)
+	{
+		printTiming("Mix IRQ:", &stats->mix);
+		printf("  %u over period\n", stats->mix.over_budget);
+		printf("Mix deadline:      %u misses, %u over budget, min. %d us left\n",
+			   Audio.getMixDeadlineMisses(), Audio.getMixBudgetWarnings(), Audio.getMinMixSlack());
+	}
+
+	printTiming("Update (PendSV):", &stats->pendsv);
+	printf("  %u deferred\n", stats->pendsv_deferred);
+	printf("Underruns:         %u (%u ms)\n", Audio.getMissCount(), Audio.getMissTime());
+
+	AUDIO_PERF_STATS perf;
+	Audio.getStats(&perf);
+	printHistogram("Mix time:", &perf.mix_time);
+	printHistogram("Update time:", &perf.update_time);
+	printf("Updates deferred:  %u by FatFs, %u by the SD card\n", perf.updates_deferred_fs,
+		   perf.updates_deferred_sd);
+	printHistogram("Update wait:", &perf.update_wait);
+
+	FS_LOCK_STATS lock;
+	fs_lock_stats(&lock);
+	printf("FS lock:           %u grants, %u lent to updates, %u refused, %u timeouts, max hold %u us\n",
+		   lock.grants, lock.lent, lock.refused, lock.timeouts, lock.max_hold);
+
+	if (user_io.reads || user_io.writes)
+		printf("User file I/O:     %u reads (%llu KB), %u writes (%llu KB), max call %.1f ms\n",
+			   user_io.reads, (unsigned long long) user_io.bytes_read / 1024, user_io.writes,
+			   (unsigned long long) user_io.bytes_written / 1024, user_io.max_call_ns / 1000000.0);
+	if (log_job.records)
+	{
+		printf("Log:               %u records (%u KB) %s, max call %.1f ms, %u late%s\n", log_job.records,
+			   log_job.records * log_job.record / 1024, log_job.stream ? "by SDLogger" : "by f_write",
+			   log_job.max_call_ns / 1000000.0, log_job.late, log_job.failed ? ", FAILED" : "");
+		if (log_job.stream)
+		{
+			SD_LOGGER_STATS log;
+			logger.getStats(&log);
+			printf("SDLogger:          %u chunks, avg %u us, max %u us, %u bytes dropped, %u errors\n",
+				   log.chunks, log.chunks ? log.total_write_time / log.chunks : 0, log.max_write_time,
+				   log.dropped, log.errors);
+		}
+	}
+	printf("Max. refill gap:   %u us\n", perf.max_refill_gap);
+	printf("Refill scheduler:  %u reads, %u deadline misses\n", perf.refill_chunks, perf.deadline_misses);
+
+	// Report the effects that were chained
+	AudioEffect* effects[] = { &equalizer, &highpass, &limiter };
+	const char* effect_names[] = { "Equalizer:", "High-pass:", "Limiter:" };
+	for (uint32_t i = 0; i < 3; i++)
+	{
+		if (!Audio.removeEffect(effects[i]))
+			continue;
+
+		printf("%-18s %s, max %u us, %u over budget\n", effect_names[i],
+			   effects[i]->isEnabled() ? "enabled" : "disabled", effects[i]->getMaxTime(),
+			   effects[i]->getBudgetOverruns());
+	}
+
+	for (uint32_t i = 0; i < MAX_VOICES; i++)
+	{
+		AUDIO_SOURCE_STATS voice;
+		voices[i].getStats(&voice);
+		if (!voice.refills && !voice.underruns)
+			continue;
+
+		printf("Voice %u:           %u refills, avg %u us, max %u us, %u late, %u underruns (%u samples)\n", i,
+			   voice.refills, voice.refills ? voice.total_refill_time / voice.refills : 0,
+			   voice.max_refill_time, voice.deadline_misses, voice.underruns, voice.underrun_samples);
+	}
+	AUDIO_SOURCE_STATS chain;
+	chainer.getStats(&chain);
+	if (chain.refills || chain.underruns)
+		printf("Chain player:      %u refills, avg %u us, max %u us, %u late, %u underruns (%u samples), "
+			   "crossfade %u ms\n", chain.refills, chain.refills ? chain.total_refill_time / chain.refills : 0, chain.max_refill_time,
+			   chain.deadline_misses, chain.underruns, chain.underrun_samples, chainer.getCrossfade());
+
+	BUFFER_POLICY policy;
+	RawPlayer::getDefaultBufferPolicy(&policy);
+	if (policy.adaptive)
+	{
+		REFILL_TIME_STATS refills;
+		RawPlayer::getRefillTimeStats(&refills);
+		printf("Player buffers:    %s, refill %u us at %u/1000, max %u us, %u grows, %u shrinks, voice 0 %u x %u us\n",
+			   policy.triple ? "triple" : "double", RawPlayer::getRefillTimeQuantile(policy.target), policy.target,
+			   refills.max_refill_time, refills.grows, refills.shrinks, voices[0].getBufferCount(),
+			   voices[0].getBufferTime());
+	}
+
+	if (pool.getVoiceCount())
+	{
+		VOICE_POOL_STATS voices;
+		pool.getStats(&voices);
+		printf("Voice pool:        %u voices, %u KB, %u plays, %u steals (%u in groups), %u rejected, %u errors\n",
+			   pool.getVoiceCount(), pool.getMemorySize() / 1024, voices.plays, voices.steals, voices.group_steals,
+			   voices.rejected, voices.errors);
+	}
+
+	if (font_index.getFileCount())
+	{
+		FONT_INDEX_STATS font;
+		font_index.getStats(&font);
+		printf("Font index:        %u files, %u headers read, scan %u us, %u saves, %u hits, %u misses, %u stale, %u refreshes\n",
+			   font.files, font.parsed, font.scan_time, font.saves, font.hits, font.misses, font.stale, font.refreshes);
+	}
+
+	if (clip_cache.getBudget())
+	{
+		CLIP_CACHE_STATS cache;
+		clip_cache.getStats(&cache);
+		printf("Clip cache:        %u clips, %u/%u bytes, %u loads, %u evictions, %u hits, %u misses\n",
+			   clip_cache.getClipCount(), clip_cache.getUsedBytes(), clip_cache.getBudget(), cache.loads,
+			   cache.evictions, cache.hits, cache.misses);
+	}
+
+	printf("Samples played:    %u\n", Audio.getSamplesPlayed());
+	printf("SD reads:          %u (%u sectors), writes %u (%u sectors), busy %.1f ms\n",
+		   stats->sd_reads, stats->sd_sectors_read, stats->sd_writes, stats->sd_sectors_written,
+		   stats->sd_busy_ns / 1000000.0);
+	if (stats->sd_timeouts || stats->sd_crc_errors)
+		printf("SD errors:         %u timeouts, %u CRC failures, %u transfers failed\n", stats->sd_timeouts,
+			   stats->sd_crc_errors, stats->sd_failures);
+
+	DISK_CACHE_STATS disk;
+	disk_cache_stats(&disk);
+	if (disk.hits || disk.misses)
+		printf("Disk cache:        %u hits, %u misses, %u read-aheads (%u sectors), %u bypassed, %u updated\n",
+			   disk.hits, disk.misses, disk.read_aheads, disk.read_ahead_sectors, disk.bypassed, disk.updated);
+
+	AUDIO_FILE_STATS file;
+	AudioFileHelper::getStats(&file);
+	if (file.reads)
+		printf("File reads:        %u, %u KB at %.0f KB/s, %u%% whole sectors, %u%% aligned, max %u us\n",
+			   file.reads, file.bytes / 1024, file.read_time ? file.bytes * 1000000.0 / 1024 / file.read_time : 0,
+			   (uint32_t) ((uint64_t) file.sector_bytes * 100 / file.bytes),
+			   (uint32_t) ((uint64_t) file.aligned_bytes * 100 / file.bytes), file.max_read_time);
+	if (file.decode_time)
+		printf("Decoding:          %u us\n", file.decode_time);
+	if (file.opens)
+		printf("File opens:        %u (%u by index), avg %u us, max %u us\n", file.opens, file.indexed_opens,
+			   file.open_time / file.opens, file.max_open_time);
+	if (file.seeks)
+		printf("File seeks:        %u, avg %u us, max %u us\n", file.seeks, file.seek_time / file.seeks,
+			   file.max_seek_time);
+	if (file.linkmaps || file.linkmap_fails)
+		printf("Link maps:         %u (%u allocated), %u files without\n", file.linkmaps, file.linkmap_allocs,
+			   file.linkmap_fails);
+
+	return 0;
+}
@@ -0,0 +1,94 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### audiosim.h
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+#ifndef __AUDIOSIM_H__
+#define __AUDIOSIM_H__
+
+#include <stdint.h>
+
+/*
+ * Simulated time base
+ *
+ * Time only moves forward when the simulated hardware would be waiting:
+ * SD transfers, delay() and the scenario runner itself. The I2S DMA
+ * completes whenever the clock crosses the end of the transfer programmed by
+ * PropAudio::startDMA(), and DMA1_Stream4_IRQHandler() is called from there,
+ * preempting whatever was "running" (including PendSV waiting on the card).
+ * The deferred mixing interrupt runs right after it, unless interrupts are
+ * disabled, in which case it runs when they are enabled again.
+ */
+
+typedef void (hostOutputCallback)(const uint8_t* data, uint32_t bytes, uint8_t bytes_per_sample);
+
+typedef struct _host_timing
+{
+	uint32_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint32_t over_budget;
+} HOST_TIMING;
+
+typedef struct _host_stats
+{
+	HOST_TIMING isr;			// DMA1_Stream4_IRQHandler (swap, and mix unless deferred)
+	HOST_TIMING mix;			// AUDIO_MIX_IRQHandler (deferred mix)
+	HOST_TIMING pendsv;			// PendSV_Handler (update), nested ISRs excluded
+	uint32_t pendsv_deferred;	// PendSV ran while the FS/SD lock was taken
+	uint64_t frames_out;		// Frames handed to the output callback
+	uint32_t sd_reads;
+	uint32_t sd_writes;
+	uint32_t sd_sectors_read;
+	uint32_t sd_sectors_written;
+	uint64_t sd_busy_ns;		// Simulated time spent in SD transfers
+	uint32_t sd_timeouts;		// Injected errors, see hostSdSetFaults()
+	uint32_t sd_crc_errors;
+	uint32_t sd_failures;		// Transfers that failed after all the retries
+} HOST_STATS;
+
+uint64_t hostNow();
+void hostAdvance(uint64_t ns);
+void hostAdvanceTo(uint64_t ns);
+void hostDmaPoll();
+void hostSdIrqAt(uint64_t ns);
+void hostRunPending();
+void hostSetOutput(hostOutputCallback* callback);
+void hostResetStats();
+HOST_STATS* hostGetStats();
+
+// Accelerometer stand-in: Motion.read() returns gravity plus this much on Z
+void hostSetMotion(float g);
+
+// SD card stand-in (hostsd.cpp)
+bool hostSdCreate(const char* path, uint32_t size_mb);
+bool hostSdOpen(const char* path);
+void hostSdClose();
+void hostSdSetLatency(uint32_t command_us, uint32_t sector_us);
+void hostSdSetJitter(uint32_t jitter_us);
+void hostSdSetFaults(uint32_t timeout_ppm, uint32_t crc_ppm, uint32_t timeout_us, uint32_t seed);
+void hostSdSetWriteCost(uint32_t busy_us, uint32_t erase_us, uint32_t unit_sectors);
+void hostSdAccount(bool write, uint32_t count, uint64_t ns);
+void hostSdAccountErrors(uint32_t timeouts, uint32_t crc_errors, bool failed);
+
+#endif /* __AUDIOSIM_H__ */
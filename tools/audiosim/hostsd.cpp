@@ -0,0 +1,496 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### hostsd.cpp
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+/*
+ * SD card stand-in backed by a disk image file. It replaces sdcard.cpp, so
+ * the real fatfs/diskio.cpp and FatFs run on top of it. Every transfer
+ * costs simulated time (command overhead plus a per-sector time), during
+ * which the I2S DMA keeps completing and mixing keeps running, exactly like
+ * PendSV being preempted while it waits on sdTransferBlocksWithDMA().
+ * Reads go through a copy of the request queue of sdcard.cpp, that runs the
+ * same way: once their simulated time has passed SDIO_IRQHandler() pends
+ * SD_SERVICE_IRQn, where they end. sdcard.cpp itself is only compiled for
+ * checking (CHECK_SRC in the Makefile), so keep the two queues in step.
+ *
+ * Data timeouts and CRC failures can be injected with a given probability
+ * per attempt. They cost the time the driver would lose on them, and are
+ * retried like sdTransferBlocksWithDMA() does, up to SDIO_RETRIES times.
+ *
+ * Writes can also cost the card programming time after their data (see
+ * hostSdSetWriteCost()), with erases that multi-block writes pre-erased by
+ * ACMD23 don't pay.
+ */
+
+#include "Arduino.h"
+#include "audiosim.h"
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define SECTOR_SIZE		512
+#define SDIO_RETRIES	10			// As in sdcard.cpp
+
+static int image_fd = -1;
+static uint32_t image_sectors = 0;
+static volatile uint32_t sd_busy_count = 0;
+static uint32_t latency_command_us = 200;
+static uint32_t latency_sector_us = 25;
+static uint32_t latency_jitter_us = 0;
+static uint32_t fault_timeout_ppm = 0;
+static uint32_t fault_crc_ppm = 0;
+static uint32_t fault_timeout_us = 1000000;		// SDIO->DTIMER in sdcard.cpp
+static uint32_t fault_seed = 1;
+static uint32_t write_busy_us = 0;
+static uint32_t write_erase_us = 0;
+static uint32_t write_unit_sectors = 256;
+static uint32_t write_next_sector = 0xFFFFFFFF;	// Where the last write ended
+
+typedef struct _sd_async_request
+{
+	uint32_t sector;
+	uint8_t* buffer;
+	uint32_t count;
+	sdTransferCallback* callback;
+	void* param;
+} SD_ASYNC_REQUEST;
+
+typedef struct _sd_async_wait
+{
+	volatile bool done;
+	SD_Status status;
+} SD_ASYNC_WAIT;
+
+static SD_ASYNC_REQUEST sd_async_queue[SD_ASYNC_QUEUE_SIZE];
+static uint32_t sd_async_head = 0;
+static volatile uint32_t sd_async_count = 0;
+static uint64_t sd_async_end_ns = 0;
+static SD_Status sd_async_status = SD_NO_ERROR;
+
+static void putWord(uint8_t* ptr, uint16_t value)
+{
+	ptr[0] = value;
+	ptr[1] = value >> 8;
+}
+
+static void putDword(uint8_t* ptr, uint32_t value)
+{
+	putWord(ptr, value);
+	putWord(ptr + 2, value >> 16);
+}
+
+bool hostSdCreate(const char* path, uint32_t size_mb)
+{
+	// Plain FAT16 volume without partition table (SFD), 2KB clusters
+	uint8_t sector[SECTOR_SIZE];
+	uint32_t total = size_mb * 2048;
+	uint16_t reserved = 1;
+	uint16_t root_entries = 512;
+	uint8_t cluster_size = 4;
+	uint32_t root_sectors = root_entries * 32 / SECTOR_SIZE;
+	uint32_t fat_size;
+	uint32_t clusters;
+
+	if (size_mb < 16 || size_mb > 128)
+		return false;
+
+	clusters = (total - reserved - root_sectors) / cluster_size;
+	fat_size = ((clusters + 2) * 2 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+
+	if (ftruncate(fd, (off_t) total * SECTOR_SIZE) != 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	// Boot sector
+	memset(sector, 0, sizeof(sector));
+	sector[0] = 0xEB; sector[1] = 0x3C; sector[2] = 0x90;
+	memcpy(sector + 3, "MSWIN4.1", 8);
+	putWord(sector + 11, SECTOR_SIZE);
+	sector[13] = cluster_size;
+	putWord(sector + 14, reserved);
+	sector[16] = 2;
+	putWord(sector + 17, root_entries);
+	putWord(sector + 19, total < 0x10000 ? total : 0);
+	sector[21] = 0xF8;
+	putWord(sector + 22, fat_size);
+	putWord(sector + 24, 63);
+	putWord(sector + 26, 255);
+	putDword(sector + 32, total >= 0x10000 ? total : 0);
+	sector[36] = 0x80;
+	sector[38] = 0x29;
+	putDword(sector + 39, 0x50524F50);
+	memcpy(sector + 43, "PROPBOARD  ", 11);
+	memcpy(sector + 54, "FAT16   ", 8);
+	putWord(sector + 510, 0xAA55);
+	pwrite(fd, sector, SECTOR_SIZE, 0);
+
+	// First entries of both FATs
+	memset(sector, 0, sizeof(sector));
+	putWord(sector, 0xFFF8);
+	putWord(sector + 2, 0xFFFF);
+	pwrite(fd, sector, SECTOR_SIZE, (off_t) reserved * SECTOR_SIZE);
+	pwrite(fd, sector, SECTOR_SIZE, (off_t) (reserved + fat_size) * SECTOR_SIZE);
+
+	close(fd);
+	return true;
+}
+
+bool hostSdOpen(const char* path)
+{
+	hostSdClose();
+
+	image_fd = open(path, O_RDWR);
+	if (image_fd < 0)
+		return false;
+
+	image_sectors = lseek(image_fd, 0, SEEK_END) / SECTOR_SIZE;
+	return true;
+}
+
+void hostSdClose()
+{
+	if (image_fd >= 0)
+		close(image_fd);
+
+	image_fd = -1;
+	image_sectors = 0;
+}
+
+void hostSdSetLatency(uint32_t command_us, uint32_t sector_us)
+{
+	latency_command_us = command_us;
+	latency_sector_us = sector_us;
+}
+
+static bool sdLock()
+{
+	if (sd_busy_count)
+		return false;
+
+	sd_busy_count++;
+	return true;
+}
+
+static void sdUnlock()
+{
+	__disable_irq();
+
+	if (sd_busy_count)
+		sd_busy_count--;
+
+	if (Audio.updatePending())
+		Activate_PendSV();
+
+	__enable_irq();
+}
+
+void hostSdSetJitter(uint32_t jitter_us)
+{
+	latency_jitter_us = jitter_us;
+}
+
+void hostSdSetFaults(uint32_t timeout_ppm, uint32_t crc_ppm, uint32_t timeout_us, uint32_t seed)
+{
+	fault_timeout_ppm = timeout_ppm;
+	fault_crc_ppm = crc_ppm;
+	fault_timeout_us = timeout_us;
+	fault_seed = seed ? seed : 1;
+}
+
+void hostSdSetWriteCost(uint32_t busy_us, uint32_t erase_us, uint32_t unit_sectors)
+{
+	write_busy_us = busy_us;
+	write_erase_us = erase_us;
+	write_unit_sectors = unit_sectors ? unit_sectors : 1;
+}
+
+// Time the card stays busy programming a write, after its data. Erase units are erased when
+// a write begins one, unless it was pre-erased, and when a write lands inside a unit away
+// from where the previous write ended (the sectors already in it are copied to a new one).
+static uint64_t sdProgramTime(uint32_t sector, uint32_t count, uint32_t pre_erase)
+{
+	uint64_t us = write_busy_us;
+	uint32_t first_unit = (sector + write_unit_sectors - 1) / write_unit_sectors;
+	uint32_t last_unit = (sector + count - 1) / write_unit_sectors;
+
+	if (!pre_erase && last_unit >= first_unit)
+		us += (uint64_t) (last_unit - first_unit + 1) * write_erase_us;
+
+	if ((sector % write_unit_sectors) && sector != write_next_sector)
+		us += write_erase_us;
+
+	write_next_sector = sector + count;
+	return us * 1000;
+}
+
+// Own generator (xorshift32), so rand() sequences of the scenarios don't change
+static uint32_t faultRandom()
+{
+	fault_seed ^= fault_seed << 13;
+	fault_seed ^= fault_seed >> 17;
+	fault_seed ^= fault_seed << 5;
+	return fault_seed;
+}
+
+// Time the card is busy with a transfer of 'count' sectors, with the retries done for the injected errors
+static uint64_t sdTransferTime(uint32_t count, SD_Status* status)
+{
+	uint64_t us = 0;
+	uint32_t timeouts = 0;
+	uint32_t crc_errors = 0;
+
+	*status = SD_NO_ERROR;
+
+	for (uint32_t retries = SDIO_RETRIES; retries; retries--)
+	{
+		uint32_t dice = (fault_timeout_ppm || fault_crc_ppm) ? faultRandom() % 1000000 : 1000000;
+
+		us += latency_command_us;
+		if (latency_jitter_us)
+			us += faultRandom() % (latency_jitter_us + 1);
+
+		if (dice < fault_timeout_ppm)
+		{
+			// No data until SDIO->DTIMER expires
+			us += fault_timeout_us;
+			*status = SD_DATA_TIMEOUT;
+			timeouts++;
+		} else if (dice < fault_timeout_ppm + fault_crc_ppm)
+		{
+			// The data came, then CMD12/CMD13 to abort
+			us += (uint64_t) latency_sector_us * count + latency_command_us;
+			*status = SD_DATA_CRC_FAIL;
+			crc_errors++;
+		} else {
+			us += (uint64_t) latency_sector_us * count;
+			*status = SD_NO_ERROR;
+			break;
+		}
+	}
+
+	if (timeouts || crc_errors)
+		hostSdAccountErrors(timeouts, crc_errors, *status != SD_NO_ERROR);
+
+	return us * 1000;
+}
+
+static SD_Status sdTransfer(uint32_t sector, uint8_t* buffer, uint32_t count, bool write, uint32_t pre_erase)
+{
+	ssize_t done;
+	uint64_t latency;
+	SD_Status status;
+
+	if (image_fd < 0)
+		return SD_NOT_PRESENT;
+
+	if (sector + count > image_sectors)
+		return SD_ADDR_OUT_OF_RANGE;
+
+	// The card is busy (and interrupts keep firing) for the whole transfer
+	latency = sdTransferTime(count, &status);
+	if (write && status == SD_NO_ERROR)
+		latency += sdProgramTime(sector, count, pre_erase);
+	hostAdvance(latency);
+	hostSdAccount(write, count, latency);
+
+	if (status != SD_NO_ERROR)
+		return status;
+
+	if (write)
+		done = pwrite(image_fd, buffer, count * SECTOR_SIZE, (off_t) sector * SECTOR_SIZE);
+	else
+		done = pread(image_fd, buffer, count * SECTOR_SIZE, (off_t) sector * SECTOR_SIZE);
+
+	if (done != (ssize_t) (count * SECTOR_SIZE))
+		return SD_ERROR;
+
+	return SD_NO_ERROR;
+}
+
+SD_Status sdInitialize()
+{
+	return image_fd < 0 ? SD_NOT_PRESENT : SD_NO_ERROR;
+}
+
+void sdDeinitialize()
+{
+}
+
+SD_Status sdGetStatus(bool lock)
+{
+	UNUSED(lock);
+	return image_fd < 0 ? SD_NOT_PRESENT : SD_NO_ERROR;
+}
+
+static void sdAsyncStart()
+{
+	SD_ASYNC_REQUEST* request = &sd_async_queue[sd_async_head];
+	uint64_t latency;
+
+	latency = sdTransferTime(request->count, &sd_async_status);
+	hostSdAccount(false, request->count, latency);
+
+	sd_async_end_ns = hostNow() + latency;
+	hostSdIrqAt(sd_async_end_ns);
+}
+
+extern "C" void SDIO_IRQHandler(void)
+{
+	if (sd_async_count)
+		NVIC_SetPendingIRQ(SD_SERVICE_IRQn);
+}
+
+extern "C" void SD_SERVICE_IRQHandler(void)
+{
+	SD_ASYNC_REQUEST* request = &sd_async_queue[sd_async_head];
+	SD_Status status = sd_async_status;
+
+	if (!sd_async_count)
+		return;
+
+	if (status == SD_NO_ERROR && pread(image_fd, request->buffer, request->count * SECTOR_SIZE,
+			  (off_t) request->sector * SECTOR_SIZE) != (ssize_t) (request->count * SECTOR_SIZE))
+		status = SD_ERROR;
+
+	sd_async_head = (sd_async_head + 1) % SD_ASYNC_QUEUE_SIZE;
+	sd_async_count--;
+
+	if (request->callback)
+		request->callback(status, request->param);
+
+	if (sd_async_count)
+		sdAsyncStart();
+	else
+		sdUnlock();
+}
+
+SD_Status sdReadBlocksAsync(uint32_t sector, uint8_t* buffer, uint32_t count, sdTransferCallback* callback, void* param)
+{
+	SD_ASYNC_REQUEST* request;
+	bool start;
+
+	if (image_fd < 0)
+		return SD_NOT_PRESENT;
+
+	if (!count || sector + count > image_sectors)
+		return SD_ADDR_OUT_OF_RANGE;
+
+	__disable_irq();
+
+	if (sd_async_count == SD_ASYNC_QUEUE_SIZE || (!sd_async_count && !sdLock()))
+	{
+		__enable_irq();
+		return SD_BUSY;
+	}
+
+	request = &sd_async_queue[(sd_async_head + sd_async_count) % SD_ASYNC_QUEUE_SIZE];
+	request->sector = sector;
+	request->buffer = buffer;
+	request->count = count;
+	request->callback = callback;
+	request->param = param;
+
+	start = (sd_async_count++ == 0);
+	if (start)
+		sdAsyncStart();
+
+	__enable_irq();
+
+	return SD_NO_ERROR;
+}
+
+uint32_t sdGetPendingReads()
+{
+	return sd_async_count;
+}
+
+static void sdReadDone(SD_Status status, void* param)
+{
+	SD_ASYNC_WAIT* wait = (SD_ASYNC_WAIT*) param;
+
+	wait->status = status;
+	wait->done = true;
+}
+
+SD_Status sdReadBlocks(uint32_t sector, uint8_t* buffer, uint32_t count)
+{
+	SD_ASYNC_WAIT wait;
+	SD_Status ret;
+
+	wait.done = false;
+	wait.status = SD_NO_ERROR;
+
+	ret = sdReadBlocksAsync(sector, buffer, count, sdReadDone, &wait);
+	if (ret != SD_NO_ERROR)
+		return ret;
+
+	// The card is busy (and interrupts keep firing) until the queue gets to this read
+	while (!wait.done)
+		hostAdvanceTo(sd_async_end_ns);
+
+	return wait.status;
+}
+
+SD_Status sdWriteBlocks(uint32_t sector, const uint8_t* buffer, uint32_t count, uint32_t pre_erase)
+{
+	SD_Status ret;
+
+	// ACMD23 only applies to multiple block writes. CMD55 and ACMD23 themselves are not timed.
+	if (count < 2)
+		pre_erase = 0;
+
+	if (!sdLock())
+		return SD_BUSY;
+
+	ret = sdTransfer(sector, (uint8_t*) buffer, count, true, pre_erase);
+
+	sdUnlock();
+
+	return ret;
+}
+
+uint8_t sdIsBusy()
+{
+	return (sd_busy_count > 0);
+}
+
+bool sdPresent()
+{
+	return image_fd >= 0;
+}
+
+void enableSdDebug(UARTClass* uart)
+{
+	UNUSED(uart);
+}
+
+void disableSdDebug()
+{
+}
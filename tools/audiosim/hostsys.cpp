@@ -0,0 +1,446 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### hostsys.cpp
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+#include "Arduino.h"
+#include "audiosim.h"
+#include <time.h>
+
+extern "C" void DMA1_Stream4_IRQHandler(void);
+extern "C" void PendSV_Handler(void);
+extern "C" void SDIO_IRQHandler(void);
+extern "C" void SD_SERVICE_IRQHandler(void);
+
+// Peripherals moved to RAM (see include/stm32f4xx.h and include/core_cm4.h)
+NVIC_Type host_NVIC;
+SCB_Type host_SCB;
+SysTick_Type host_SysTick;
+DMA_TypeDef host_DMA1;
+DMA_Stream_TypeDef host_DMA1_Stream4;
+SPI_TypeDef host_SPI2;
+volatile uint32_t host_primask = 0;
+
+// The PropBoard variant instantiates this in variant.cpp
+PropAudio Audio = PropAudio::instance();
+PropMotion Motion = PropMotion::instance();
+
+static uint64_t now_ns = 0;
+static uint32_t irq_depth = 0;
+static bool pendsv_active = false;
+static uint64_t isr_ns_in_pendsv = 0;
+
+static bool dma_active = false;
+static uint64_t dma_end_ns = 0;
+
+static bool sd_irq_scheduled = false;
+static uint64_t sd_irq_ns = 0;
+
+static hostOutputCallback* output_callback = NULL;
+static HOST_STATS stats;
+static float motion_g = 0;
+
+
+static uint64_t hostClock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void accountTiming(HOST_TIMING* timing, uint64_t ns, uint64_t budget)
+{
+	timing->count++;
+	timing->total_ns += ns;
+	if (ns > timing->max_ns)
+		timing->max_ns = ns;
+	if (budget && ns > budget)
+		timing->over_budget++;
+}
+
+static uint32_t dmaBytesPerItem()
+{
+	switch (DMA1_Stream4->CR & DMA_SxCR_MSIZE)
+	{
+		case DMA_SxCR_MSIZE_0: return 2;
+		case DMA_SxCR_MSIZE_1: return 4;
+		default: return 1;
+	}
+}
+
+void hostDmaPoll()
+{
+	// Pick up a transfer programmed by PropAudio::startDMA()
+	if (dma_active || !(DMA1_Stream4->CR & DMA_SxCR_EN) || !Audio.getSampleRate())
+		return;
+
+	// NDTR counts items of the memory size; two items (L/R) per frame up to 16-bit
+	uint32_t bytes = DMA1_Stream4->NDTR * dmaBytesPerItem();
+	uint32_t frame_size = Audio.getBitsPerSample() > 16 ? 8 : 4;
+	uint64_t frames = bytes / frame_size;
+
+	dma_end_ns = now_ns + (frames * 1000000000ULL) / Audio.getSampleRate();
+	dma_active = true;
+}
+
+static void serviceMixIrq()
+{
+	uint64_t period;
+
+	// Preempts PendSV and thread code, not the DMA interrupt
+	while (!host_primask && !irq_depth && NVIC_GetPendingIRQ(AUDIO_MIX_IRQn))
+	{
+		NVIC_ClearPendingIRQ(AUDIO_MIX_IRQn);
+		period = (uint64_t) Audio.getOutputSamples() * 1000000000ULL / Audio.getSampleRate();
+
+		irq_depth++;
+		uint64_t start = hostClock();
+		AUDIO_MIX_IRQHandler();
+		uint64_t elapsed = hostClock() - start;
+		irq_depth--;
+
+		accountTiming(&stats.mix, elapsed, period);
+		if (pendsv_active)
+			isr_ns_in_pendsv += elapsed;
+	}
+}
+
+static void serviceSdIrq()
+{
+	// Below the mixing: preempts PendSV and thread code only
+	while (!host_primask && !irq_depth && NVIC_GetPendingIRQ(SD_SERVICE_IRQn))
+	{
+		NVIC_ClearPendingIRQ(SD_SERVICE_IRQn);
+
+		irq_depth++;
+		uint64_t start = hostClock();
+		SD_SERVICE_IRQHandler();
+		uint64_t elapsed = hostClock() - start;
+		irq_depth--;
+
+		if (pendsv_active)
+			isr_ns_in_pendsv += elapsed;
+
+		serviceMixIrq();
+	}
+}
+
+static void dmaComplete()
+{
+	uint32_t bytes = DMA1_Stream4->NDTR * dmaBytesPerItem();
+	uint32_t frame_size = Audio.getBitsPerSample() > 16 ? 8 : 4;
+	uint64_t period = (uint64_t) (bytes / frame_size) * 1000000000ULL / Audio.getSampleRate();
+	bool double_buffer = (DMA1_Stream4->CR & DMA_SxCR_DBM) != 0;
+	uint32_t address = DMA1_Stream4->M0AR;
+
+	DMA1->HISR |= DMA_HISR_TCIF4;
+
+	if (double_buffer)
+	{
+		// Circular double-buffer mode: the stream switches targets and keeps going
+		if (DMA1_Stream4->CR & DMA_SxCR_CT)
+			address = DMA1_Stream4->M1AR;
+
+		DMA1_Stream4->CR ^= DMA_SxCR_CT;
+		dma_end_ns += period;
+	} else {
+		dma_active = false;
+		DMA1_Stream4->CR &= ~DMA_SxCR_EN;
+	}
+
+	if (output_callback)
+		output_callback((const uint8_t*)(uintptr_t) address, bytes, frame_size / 2);
+
+	stats.frames_out += bytes / frame_size;
+
+	if (!(DMA1_Stream4->CR & DMA_SxCR_TCIE))
+		return;
+
+	// The budget is the transfer that just ended
+	irq_depth++;
+	uint64_t start = hostClock();
+	DMA1_Stream4_IRQHandler();
+	uint64_t elapsed = hostClock() - start;
+	irq_depth--;
+
+	accountTiming(&stats.isr, elapsed, period);
+	if (pendsv_active)
+		isr_ns_in_pendsv += elapsed;
+
+	// A stream stopped in the handler doesn't go on
+	if (double_buffer && !(DMA1_Stream4->CR & DMA_SxCR_EN))
+		dma_active = false;
+
+	serviceMixIrq();
+
+	hostDmaPoll();
+}
+
+void hostRunPending()
+{
+	serviceMixIrq();
+	serviceSdIrq();
+
+	while (!irq_depth && !pendsv_active && !host_primask &&
+		   (SCB->ICSR & SCB_ICSR_PENDSVSET_Msk))
+	{
+		SCB->ICSR &= ~SCB_ICSR_PENDSVSET_Msk;
+
+		pendsv_active = true;
+		isr_ns_in_pendsv = 0;
+		uint64_t start = hostClock();
+		PendSV_Handler();
+		uint64_t elapsed = hostClock() - start - isr_ns_in_pendsv;
+		pendsv_active = false;
+
+		if (Audio.updatePending())
+			stats.pendsv_deferred++;
+		else
+			accountTiming(&stats.pendsv, elapsed, 0);
+	}
+}
+
+extern "C" void hostIrqEnabled(void)
+{
+	hostRunPending();
+}
+
+// Exception number of the handler running, 0 in thread mode
+extern "C" uint32_t hostGetIpsr(void)
+{
+	if (irq_depth)
+		return 16 + DMA1_Stream4_IRQn;
+
+	return pendsv_active ? 14 : 0;
+}
+
+uint64_t hostNow()
+{
+	return now_ns;
+}
+
+static void sdComplete()
+{
+	sd_irq_scheduled = false;
+
+	// Preempts everything, like VARIANT_PRIO_SDIO
+	irq_depth++;
+	uint64_t start = hostClock();
+	SDIO_IRQHandler();
+	uint64_t elapsed = hostClock() - start;
+	irq_depth--;
+
+	if (pendsv_active)
+		isr_ns_in_pendsv += elapsed;
+
+	serviceMixIrq();
+	serviceSdIrq();
+}
+
+void hostAdvanceTo(uint64_t target)
+{
+	while (true)
+	{
+		bool dma = dma_active && dma_end_ns <= target;
+		bool sd = sd_irq_scheduled && sd_irq_ns <= target;
+
+		if (!dma && !sd)
+			break;
+
+		// The I2S DMA goes first when both end at the same time
+		if (dma && (!sd || dma_end_ns <= sd_irq_ns))
+		{
+			if (dma_end_ns > now_ns)
+				now_ns = dma_end_ns;
+
+			dmaComplete();
+		} else {
+			if (sd_irq_ns > now_ns)
+				now_ns = sd_irq_ns;
+
+			sdComplete();
+		}
+
+		hostRunPending();
+	}
+
+	// A nested PendSV may have waited on the card past our target
+	if (now_ns < target)
+		now_ns = target;
+}
+
+void hostAdvance(uint64_t ns)
+{
+	hostAdvanceTo(now_ns + ns);
+}
+
+void hostSdIrqAt(uint64_t ns)
+{
+	sd_irq_ns = ns;
+	sd_irq_scheduled = true;
+}
+
+void hostSetOutput(hostOutputCallback* callback)
+{
+	output_callback = callback;
+}
+
+void hostResetStats()
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+HOST_STATS* hostGetStats()
+{
+	return &stats;
+}
+
+void hostSetMotion(float g)
+{
+	motion_g = g;
+}
+
+void hostSdAccount(bool write, uint32_t count, uint64_t ns)
+{
+	if (write)
+	{
+		stats.sd_writes++;
+		stats.sd_sectors_written += count;
+	} else {
+		stats.sd_reads++;
+		stats.sd_sectors_read += count;
+	}
+
+	stats.sd_busy_ns += ns;
+}
+
+void hostSdAccountErrors(uint32_t timeouts, uint32_t crc_errors, bool failed)
+{
+	stats.sd_timeouts += timeouts;
+	stats.sd_crc_errors += crc_errors;
+	if (failed)
+		stats.sd_failures++;
+}
+
+/*
+ * Arduino/core functions used by the audio code
+ */
+
+extern "C" uint32_t millis(void)
+{
+	return now_ns / 1000000ULL;
+}
+
+extern "C" uint32_t micros(void)
+{
+	return now_ns / 1000ULL;
+}
+
+extern "C" uint32_t GetTickCount(void)
+{
+	return millis();
+}
+
+extern "C" void delay(uint32_t ms)
+{
+	hostAdvance((uint64_t) ms * 1000000ULL);
+}
+
+extern "C" void pinMode(uint32_t pin, uint32_t mode)
+{
+	UNUSED(pin);
+	UNUSED(mode);
+}
+
+extern "C" void digitalWrite(uint32_t pin, uint32_t val)
+{
+	UNUSED(pin);
+	UNUSED(val);
+}
+
+uint32_t getRandom(uint32_t min, uint32_t max)
+{
+	uint32_t range = max - min + 1;
+	if (!range)
+		return 0;
+
+	return rand() % range + min;
+}
+
+PropMotion::PropMotion()	{ }
+PropMotion::~PropMotion()	{ }
+
+bool PropMotion::read(float* x, float* y, float* z)
+{
+	*x = 0;
+	*y = 0;
+	*z = 1.0f + motion_g;
+	return true;
+}
+
+bool wm8523Init(void)				{ return true; }
+bool wm8523SetPower(uint16_t mode)	{ UNUSED(mode); return true; }
+bool wm8523SetVolume(float db)		{ UNUSED(db); return true; }
+
+/*
+ * StdPeriph functions called by PropAudio::initI2S() and PropAudio::end().
+ * Register level accesses go to the RAM peripherals above.
+ */
+
+extern "C"
+{
+
+void RCC_AHB1PeriphClockCmd(uint32_t p, FunctionalState s)	{ UNUSED(p); UNUSED(s); }
+void RCC_APB1PeriphClockCmd(uint32_t p, FunctionalState s)	{ UNUSED(p); UNUSED(s); }
+void RCC_I2SCLKConfig(uint32_t source)						{ UNUSED(source); }
+void RCC_PLLI2SConfig(uint32_t n, uint32_t r)				{ UNUSED(n); UNUSED(r); }
+void RCC_PLLI2SCmd(FunctionalState s)						{ UNUSED(s); }
+void GPIO_Init(GPIO_TypeDef* g, GPIO_InitTypeDef* i)		{ UNUSED(g); UNUSED(i); }
+void GPIO_PinAFConfig(GPIO_TypeDef* g, uint16_t p, uint8_t a)	{ UNUSED(g); UNUSED(p); UNUSED(a); }
+void SPI_I2S_DeInit(SPI_TypeDef* spi)						{ memset((void*) spi, 0, sizeof(*spi)); }
+void I2S_Init(SPI_TypeDef* spi, I2S_InitTypeDef* i)			{ UNUSED(spi); UNUSED(i); }
+void I2S_Cmd(SPI_TypeDef* spi, FunctionalState s)			{ UNUSED(spi); UNUSED(s); }
+void SPI_I2S_DMACmd(SPI_TypeDef* spi, uint16_t r, FunctionalState s)	{ UNUSED(spi); UNUSED(r); UNUSED(s); }
+
+void DMA_Init(DMA_Stream_TypeDef* stream, DMA_InitTypeDef* init)
+{
+	stream->PAR = init->DMA_PeripheralBaseAddr;
+	stream->M0AR = init->DMA_Memory0BaseAddr;
+	stream->NDTR = init->DMA_BufferSize;
+	stream->CR = init->DMA_Channel | init->DMA_DIR | init->DMA_PeripheralInc | init->DMA_MemoryInc |
+				 init->DMA_PeripheralDataSize | init->DMA_MemoryDataSize | init->DMA_Mode |
+				 init->DMA_Priority | init->DMA_MemoryBurst | init->DMA_PeripheralBurst;
+}
+
+void DMA_ITConfig(DMA_Stream_TypeDef* stream, uint32_t it, FunctionalState s)
+{
+	if (it & DMA_IT_TC)
+	{
+		if (s == ENABLE)
+			stream->CR |= DMA_SxCR_TCIE;
+		else
+			stream->CR &= ~DMA_SxCR_TCIE;
+	}
+}
+
+} // extern "C"
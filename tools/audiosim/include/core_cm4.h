@@ -0,0 +1,247 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### core_cm4.h (host)
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+/*
+ * Host replacement for the CMSIS Cortex-M4 core header. It is found before
+ * system/CMSIS/Include/core_cm4.h when building the audio simulator, so the
+ * device header and the StdPeriph headers can be used unmodified on Linux.
+ * Core peripherals live in RAM and the DSP intrinsics are written in C with
+ * the same saturation semantics as the M4 instructions.
+ */
+
+#ifndef __CORE_CM4_H_GENERIC
+#define __CORE_CM4_H_GENERIC
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#define __CM4_CMSIS_VERSION_MAIN	(0x04)
+#define __CM4_CMSIS_VERSION_SUB		(0x00)
+#define __CM4_CMSIS_VERSION			((__CM4_CMSIS_VERSION_MAIN << 16) | __CM4_CMSIS_VERSION_SUB)
+#define __CORTEX_M					(0x04)
+
+#define __ASM						__asm
+#define __INLINE					inline
+#define __STATIC_INLINE				static inline
+
+#define __FPU_USED					0
+
+#ifdef __cplusplus
+  #define __I						volatile
+#else
+  #define __I						volatile const
+#endif
+#define __O							volatile
+#define __IO						volatile
+
+/* Core peripherals */
+typedef struct
+{
+	__IO uint32_t ISER[8];
+	     uint32_t RESERVED0[24];
+	__IO uint32_t ICER[8];
+	     uint32_t RSERVED1[24];
+	__IO uint32_t ISPR[8];
+	     uint32_t RESERVED2[24];
+	__IO uint32_t ICPR[8];
+	     uint32_t RESERVED3[24];
+	__IO uint32_t IABR[8];
+	     uint32_t RESERVED4[56];
+	__IO uint8_t  IP[240];
+	     uint32_t RESERVED5[644];
+	__O  uint32_t STIR;
+} NVIC_Type;
+
+typedef struct
+{
+	__I  uint32_t CPUID;
+	__IO uint32_t ICSR;
+	__IO uint32_t VTOR;
+	__IO uint32_t AIRCR;
+	__IO uint32_t SCR;
+	__IO uint32_t CCR;
+	__IO uint8_t  SHP[12];
+	__IO uint32_t SHCSR;
+	__IO uint32_t CFSR;
+	__IO uint32_t HFSR;
+	__IO uint32_t DFSR;
+	__IO uint32_t MMFAR;
+	__IO uint32_t BFAR;
+	__IO uint32_t AFSR;
+	__I  uint32_t PFR[2];
+	__I  uint32_t DFR;
+	__I  uint32_t ADR;
+	__I  uint32_t MMFR[4];
+	__I  uint32_t ISAR[5];
+	     uint32_t RESERVED0[5];
+	__IO uint32_t CPACR;
+} SCB_Type;
+
+typedef struct
+{
+	__IO uint32_t CTRL;
+	__IO uint32_t LOAD;
+	__IO uint32_t VAL;
+	__I  uint32_t CALIB;
+} SysTick_Type;
+
+#define SCB_ICSR_PENDSVSET_Pos		28
+#define SCB_ICSR_PENDSVSET_Msk		(1UL << SCB_ICSR_PENDSVSET_Pos)
+#define SCB_ICSR_PENDSVCLR_Pos		27
+#define SCB_ICSR_PENDSVCLR_Msk		(1UL << SCB_ICSR_PENDSVCLR_Pos)
+
+#define SysTick_CTRL_ENABLE_Msk		(1UL << 0)
+#define SysTick_CTRL_TICKINT_Msk	(1UL << 1)
+#define SysTick_CTRL_CLKSOURCE_Msk	(1UL << 2)
+#define SysTick_LOAD_RELOAD_Msk		(0xFFFFFFUL)
+
+extern NVIC_Type host_NVIC;
+extern SCB_Type host_SCB;
+extern SysTick_Type host_SysTick;
+
+#define NVIC						(&host_NVIC)
+#define SCB							(&host_SCB)
+#define SysTick						(&host_SysTick)
+
+/* Interrupt masking. The simulator only raises interrupts from well known
+ * points (see hostsys.cpp); re-enabling them is one of those points, so a
+ * PendSV requested with interrupts masked runs as soon as they are enabled,
+ * like it would on the M4. */
+extern volatile uint32_t host_primask;
+extern void hostIrqEnabled(void);
+extern uint32_t hostGetIpsr(void);
+
+__STATIC_INLINE void __disable_irq(void)				{ host_primask = 1; }
+__STATIC_INLINE void __enable_irq(void)					{ host_primask = 0; hostIrqEnabled(); }
+__STATIC_INLINE uint32_t __get_PRIMASK(void)			{ return host_primask; }
+__STATIC_INLINE void __set_PRIMASK(uint32_t mask)		{ host_primask = mask; }
+__STATIC_INLINE uint32_t __get_IPSR(void)				{ return hostGetIpsr(); }
+__STATIC_INLINE void __NOP(void)						{ }
+__STATIC_INLINE void __WFI(void)						{ }
+__STATIC_INLINE void __WFE(void)						{ }
+__STATIC_INLINE void __SEV(void)						{ }
+__STATIC_INLINE void __ISB(void)						{ __sync_synchronize(); }
+__STATIC_INLINE void __DSB(void)						{ __sync_synchronize(); }
+__STATIC_INLINE void __DMB(void)						{ __sync_synchronize(); }
+
+__STATIC_INLINE void NVIC_SetPriorityGrouping(uint32_t group)	{ (void) group; }
+__STATIC_INLINE void NVIC_EnableIRQ(IRQn_Type IRQn)				{ (void) IRQn; }
+__STATIC_INLINE void NVIC_DisableIRQ(IRQn_Type IRQn)			{ (void) IRQn; }
+__STATIC_INLINE void NVIC_ClearPendingIRQ(IRQn_Type IRQn)		{ NVIC->ISPR[(uint32_t) IRQn >> 5] &= ~(1UL << ((uint32_t) IRQn & 0x1F)); }
+__STATIC_INLINE void NVIC_SetPendingIRQ(IRQn_Type IRQn)			{ NVIC->ISPR[(uint32_t) IRQn >> 5] |= (1UL << ((uint32_t) IRQn & 0x1F)); hostIrqEnabled(); }
+__STATIC_INLINE uint32_t NVIC_GetPendingIRQ(IRQn_Type IRQn)		{ return (NVIC->ISPR[(uint32_t) IRQn >> 5] >> ((uint32_t) IRQn & 0x1F)) & 1; }
+__STATIC_INLINE void NVIC_SetPriority(IRQn_Type IRQn, uint32_t priority) { (void) IRQn; (void) priority; }
+__STATIC_INLINE uint32_t NVIC_GetPriority(IRQn_Type IRQn)		{ (void) IRQn; return 0; }
+__STATIC_INLINE void NVIC_SystemReset(void)						{ }
+__STATIC_INLINE uint32_t SysTick_Config(uint32_t ticks)			{ (void) ticks; return 0; }
+
+/* Bit manipulation */
+__STATIC_INLINE uint32_t __REV(uint32_t value)			{ return __builtin_bswap32(value); }
+__STATIC_INLINE uint32_t __REV16(uint32_t value)		{ return ((value & 0xFF00FF00) >> 8) | ((value & 0x00FF00FF) << 8); }
+__STATIC_INLINE uint32_t __ROR(uint32_t value, uint32_t n)	{ return n ? (value >> n) | (value << (32 - n)) : value; }
+__STATIC_INLINE uint8_t __CLZ(uint32_t value)			{ return value ? __builtin_clz(value) : 32; }
+
+__STATIC_INLINE uint32_t __RBIT(uint32_t value)
+{
+	uint32_t result = 0;
+	for (int i = 0; i < 32; i++)
+	{
+		result = (result << 1) | (value & 1);
+		value >>= 1;
+	}
+	return result;
+}
+
+__STATIC_INLINE int32_t __SSAT(int32_t value, uint32_t bits)
+{
+	int32_t max = (1 << (bits - 1)) - 1;
+	int32_t min = -(1 << (bits - 1));
+	return value > max ? max : (value < min ? min : value);
+}
+
+__STATIC_INLINE uint32_t __USAT(int32_t value, uint32_t bits)
+{
+	int32_t max = (1 << bits) - 1;
+	return value > max ? (uint32_t) max : (value < 0 ? 0 : (uint32_t) value);
+}
+
+/* SIMD */
+__STATIC_INLINE uint32_t __QADD16(uint32_t op1, uint32_t op2)
+{
+	int32_t lo = __SSAT((int16_t) op1 + (int16_t) op2, 16);
+	int32_t hi = __SSAT((int16_t) (op1 >> 16) + (int16_t) (op2 >> 16), 16);
+	return ((uint32_t) hi << 16) | ((uint32_t) lo & 0xFFFF);
+}
+
+__STATIC_INLINE uint32_t __QSUB16(uint32_t op1, uint32_t op2)
+{
+	int32_t lo = __SSAT((int16_t) op1 - (int16_t) op2, 16);
+	int32_t hi = __SSAT((int16_t) (op1 >> 16) - (int16_t) (op2 >> 16), 16);
+	return ((uint32_t) hi << 16) | ((uint32_t) lo & 0xFFFF);
+}
+
+__STATIC_INLINE int32_t __QADD(int32_t op1, int32_t op2)
+{
+	int64_t result = (int64_t) op1 + op2;
+	return result > INT32_MAX ? INT32_MAX : (result < INT32_MIN ? INT32_MIN : (int32_t) result);
+}
+
+__STATIC_INLINE int32_t __QSUB(int32_t op1, int32_t op2)
+{
+	int64_t result = (int64_t) op1 - op2;
+	return result > INT32_MAX ? INT32_MAX : (result < INT32_MIN ? INT32_MIN : (int32_t) result);
+}
+
+__STATIC_INLINE uint32_t __SMUAD(uint32_t op1, uint32_t op2)
+{
+	return (uint32_t) ((int16_t) op1 * (int16_t) op2 + (int16_t) (op1 >> 16) * (int16_t) (op2 >> 16));
+}
+
+__STATIC_INLINE uint32_t __SMLAD(uint32_t op1, uint32_t op2, uint32_t op3)
+{
+	return __SMUAD(op1, op2) + op3;
+}
+
+__STATIC_INLINE uint32_t __SMUADX(uint32_t op1, uint32_t op2)
+{
+	return (uint32_t) ((int16_t) op1 * (int16_t) (op2 >> 16) + (int16_t) (op1 >> 16) * (int16_t) op2);
+}
+
+__STATIC_INLINE uint64_t __SMLALD(uint32_t op1, uint32_t op2, uint64_t acc)
+{
+	return acc + (int64_t) ((int16_t) op1 * (int16_t) op2) + (int64_t) ((int16_t) (op1 >> 16) * (int16_t) (op2 >> 16));
+}
+
+#define __PKHBT(ARG1, ARG2, ARG3)	((((uint32_t) (ARG1)) & 0x0000FFFFUL) | ((((uint32_t) (ARG2)) << (ARG3)) & 0xFFFF0000UL))
+#define __PKHTB(ARG1, ARG2, ARG3)	((((uint32_t) (ARG1)) & 0xFFFF0000UL) | ((((uint32_t) (ARG2)) >> (ARG3)) & 0x0000FFFFUL))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CORE_CM4_H_GENERIC */
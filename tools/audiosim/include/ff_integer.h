@@ -0,0 +1,47 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### ff_integer.h (host)
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+/*
+ * Force-included when building the simulator. FatFs requires LONG/DWORD to
+ * be 32-bit, which 'long' is not on a 64-bit host, so the FatFs integer
+ * types are defined here and fatfs/integer.h is skipped by its guard.
+ */
+
+#ifndef _FF_INTEGER
+#define _FF_INTEGER
+
+#include <stdint.h>
+
+typedef int				INT;
+typedef unsigned int	UINT;
+typedef unsigned char	BYTE;
+typedef short			SHORT;
+typedef unsigned short	WORD;
+typedef unsigned short	WCHAR;
+typedef int32_t			LONG;
+typedef uint32_t		DWORD;
+typedef uint64_t		QWORD;
+
+#endif
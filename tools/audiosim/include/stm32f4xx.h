@@ -0,0 +1,57 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### stm32f4xx.h (host)
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+/*
+ * Wraps the real device header and moves the peripherals touched by the
+ * audio core into RAM, so register writes done by PropAudio can be observed
+ * by the simulator instead of faulting.
+ */
+
+#ifndef __STM32F4XX_HOST_H__
+#define __STM32F4XX_HOST_H__
+
+#include_next <stm32f4xx.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern DMA_TypeDef host_DMA1;
+extern DMA_Stream_TypeDef host_DMA1_Stream4;
+extern SPI_TypeDef host_SPI2;
+
+#ifdef __cplusplus
+}
+#endif
+
+#undef DMA1
+#undef DMA1_Stream4
+#undef SPI2
+
+#define DMA1				(&host_DMA1)
+#define DMA1_Stream4		(&host_DMA1_Stream4)
+#define SPI2				(&host_SPI2)
+
+#endif /* __STM32F4XX_HOST_H__ */
@@ -0,0 +1,494 @@
+/***************************************************************************
+ * Artekit PropBoard
+ * https://www.artekit.eu/products/devboards/propboard
+ *
+ * Copyright (c) 2018 Artekit Labs
+ * https://www.artekit.eu
+
+### sdbench.cpp
+
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program; if not, write to the Free Software
+#   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+***************************************************************************/
+
+/*
+ * SD/FatFs benchmark
+ *
+ * Runs the storage path of the core (FatFs, fatfs/diskio.cpp and its sector
+ * cache, AudioFileHelper, AudioFontIndex and PropConfig) against the SD card
+ * stand-in of hostsd.cpp, and reports the simulated time taken by the
+ * accesses a sketch does: sequential and random reads, opening and seeking
+ * sound font files, and parsing a configuration file. Times only advance
+ * during SD transfers, so the results depend on the card model alone and are
+ * the same from run to run.
+ *
+ * Usage: sdbench [options]
+ *
+ *   -d <file>          Disk image (default sdbench.img)
+ *   -m <mb>            Size of the FAT16 image (16..128, default 64)
+ *   -c <us>            Command overhead (default 200)
+ *   -p <us>            Time per sector (default 25)
+ *   -j <us>            Up to this much extra time per command
+ *   -t <ppm>           Data timeouts per million transfer attempts
+ *   -r <ppm>           CRC failures per million transfer attempts
+ *   -T <us>            Time lost on a data timeout (default 1000000)
+ *   -s <seed>          Seed for the jitter and the injected errors (default 1)
+ *
+ * Errors are only injected once the files are written.
+ */
+
+#include "Arduino.h"
+#include "audiosim.h"
+#include "AudioFileHelper.h"
+#include "AudioFontIndex.h"
+#include "PropConfig.h"
+#include <diskio.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define BENCH_FILE				"bench.bin"
+#define BENCH_FILE_SIZE			(1024 * 1024)
+#define BENCH_MAX_CHUNK			32768
+#define BENCH_RANDOM_READS		256
+#define BENCH_RANDOM_CHUNK		2048
+#define BENCH_FONT_DIR			"font"
+#define BENCH_FONT_FS			22050
+#define BENCH_FONT_SAMPLES		512			// Read after every open/rewind, like the first refill
+#define BENCH_SEEK_ROUNDS		8
+#define BENCH_CONFIG_FILE		"config.ini"
+#define BENCH_CONFIG_SECTIONS	16
+#define BENCH_CONFIG_KEYS		16
+
+typedef struct _bench_font_file
+{
+	const char* name;
+	uint32_t ms;
+} BENCH_FONT_FILE;
+
+static const BENCH_FONT_FILE font_files[] =
+{
+	{ "hum", 2000 }, { "poweron", 1200 }, { "poweroff", 900 }, { "lockup", 1500 },
+	{ "swingh1", 600 }, { "swingh2", 600 }, { "swingh3", 600 }, { "swingh4", 600 },
+	{ "swingl1", 600 }, { "swingl2", 600 }, { "swingl3", 600 }, { "swingl4", 600 },
+	{ "clash1", 500 }, { "clash2", 500 }, { "clash3", 500 }, { "clash4", 500 },
+	{ "blaster1", 300 }, { "blaster2", 300 }, { "blaster3", 300 }, { "blaster4", 300 },
+	{ "force1", 1000 }, { "force2", 1000 }, { "stab1", 400 }, { "stab2", 400 },
+};
+
+#define BENCH_FONT_FILES		(sizeof(font_files) / sizeof(font_files[0]))
+
+typedef struct _bench_result
+{
+	const char* name;
+	uint64_t start;
+	uint32_t ops;
+	uint32_t failed;
+	uint64_t bytes;
+	uint64_t max_ns;
+} BENCH_RESULT;
+
+static FATFS fatfs;
+static PropConfig config;				// Passes pointers to its line buffer as 32-bit tokens: keep it static
+static uint8_t buffer[BENCH_MAX_CHUNK] __attribute__((aligned(4)));
+static uint32_t random_state = 1;
+
+static uint32_t benchRandom()
+{
+	// xorshift32, independent from the fault injection of hostsd.cpp
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 17;
+	random_state ^= random_state << 5;
+	return random_state;
+}
+
+static bool writeFile(const char* name, const void* data, uint32_t size)
+{
+	FIL file;
+	UINT written;
+
+	if (f_open(&file, name, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+		return false;
+
+	bool ok = (f_write(&file, data, size, &written) == FR_OK && written == size);
+	return f_close(&file) == FR_OK && ok;
+}
+
+static bool createBenchFile()
+{
+	uint8_t* data = (uint8_t*) malloc(BENCH_FILE_SIZE);
+	if (!data)
+		return false;
+
+	for (uint32_t i = 0; i < BENCH_FILE_SIZE; i++)
+		data[i] = (uint8_t) (i * 7 + (i >> 9));
+
+	bool ok = writeFile(BENCH_FILE, data, BENCH_FILE_SIZE);
+	free(data);
+	return ok;
+}
+
+static bool createFont()
+{
+	char name[64];
+
+	if (f_mkdir(BENCH_FONT_DIR) != FR_OK)
+		return false;
+
+	for (uint32_t i = 0; i < BENCH_FONT_FILES; i++)
+	{
+		uint32_t samples = (uint64_t) BENCH_FONT_FS * font_files[i].ms / 1000;
+		uint32_t data_size = samples * 2;
+		uint8_t* data = (uint8_t*) malloc(44 + data_size);
+		uint32_t value;
+
+		if (!data)
+			return false;
+
+		// 16-bit mono PCM
+		memcpy(data, "RIFF", 4);
+		value = 36 + data_size;			memcpy(data + 4, &value, 4);
+		memcpy(data + 8, "WAVEfmt ", 8);
+		value = 16;						memcpy(data + 16, &value, 4);
+		value = 0x00010001;				memcpy(data + 20, &value, 4);	// PCM, 1 channel
+		value = BENCH_FONT_FS;			memcpy(data + 24, &value, 4);
+		value = BENCH_FONT_FS * 2;		memcpy(data + 28, &value, 4);
+		value = 0x00100002;				memcpy(data + 32, &value, 4);	// Block align 2, 16 bits
+		memcpy(data + 36, "data", 4);
+		memcpy(data + 40, &data_size, 4);
+
+		for (uint32_t s = 0; s < samples; s++)
+		{
+			int16_t sample = (int16_t) ((s * (i + 3) * 97) & 0x3FFF) - 0x2000;
+			memcpy(data + 44 + s * 2, &sample, 2);
+		}
+
+		sprintf(name, "%s/%s.wav", BENCH_FONT_DIR, font_files[i].name);
+		bool ok = writeFile(name, data, 44 + data_size);
+		free(data);
+
+		if (!ok)
+			return false;
+	}
+
+	return true;
+}
+
+static bool createConfig()
+{
+	char* text = (char*) malloc(BENCH_CONFIG_SECTIONS * (32 + BENCH_CONFIG_KEYS * 48));
+	uint32_t len = 0;
+
+	if (!text)
+		return false;
+
+	len += sprintf(text + len, "; Benchmark configuration\r\n\r\n");
+
+	for (uint32_t s = 0; s < BENCH_CONFIG_SECTIONS; s++)
+	{
+		len += sprintf(text + len, "[section%02u]\r\n", s);
+		for (uint32_t k = 0; k < BENCH_CONFIG_KEYS; k++)
+			len += sprintf(text + len, "key%02u = %u\t; value %u\r\n", k, s * 100 + k, k);
+		len += sprintf(text + len, "\r\n");
+	}
+
+	bool ok = writeFile(BENCH_CONFIG_FILE, text, len);
+	free(text);
+	return ok;
+}
+
+static void benchStart(BENCH_RESULT* result, const char* name)
+{
+	// Every benchmark starts with a cold cache
+	memset(result, 0, sizeof(BENCH_RESULT));
+	result->name = name;
+	disk_cache_invalidate();
+	disk_cache_reset_stats();
+	hostResetStats();
+	result->start = hostNow();
+}
+
+static void benchOp(BENCH_RESULT* result, uint64_t start, uint32_t bytes, bool ok)
+{
+	uint64_t ns = hostNow() - start;
+
+	result->ops++;
+	result->bytes += bytes;
+	if (!ok)
+		result->failed++;
+	if (ns > result->max_ns)
+		result->max_ns = ns;
+}
+
+static void benchEnd(BENCH_RESULT* result)
+{
+	uint64_t ns = hostNow() - result->start;
+	HOST_STATS* stats = hostGetStats();
+	DISK_CACHE_STATS cache;
+
+	disk_cache_stats(&cache);
+
+	printf("%-20s %5u ops %7.1f ms", result->name, result->ops, ns / 1000000.0);
+	if (result->bytes)
+		printf(" %6.0f KB/s", ns ? (result->bytes / 1024.0) / (ns / 1000000000.0) : 0.0);
+	else
+		printf("            ");
+	printf("  avg %6.0f us  max %6.0f us  %5u cmds %6u sectors  cache %u/%u",
+		   result->ops ? ns / 1000.0 / result->ops : 0.0, result->max_ns / 1000.0,
+		   stats->sd_reads + stats->sd_writes, stats->sd_sectors_read + stats->sd_sectors_written,
+		   cache.hits, cache.misses);
+
+	if (stats->sd_timeouts || stats->sd_crc_errors || result->failed)
+		printf("  errors %u/%u, %u failed", stats->sd_timeouts, stats->sd_crc_errors, result->failed);
+
+	printf("\n");
+}
+
+static void benchSequential(const char* name, uint32_t chunk, uint32_t offset)
+{
+	BENCH_RESULT result;
+	FIL file;
+
+	benchStart(&result, name);
+
+	if (f_open(&file, BENCH_FILE, FA_READ | FA_OPEN_EXISTING) != FR_OK || f_lseek(&file, offset) != FR_OK)
+	{
+		printf("%-20s cannot open %s\n", name, BENCH_FILE);
+		return;
+	}
+
+	for (;;)
+	{
+		uint64_t start = hostNow();
+		UINT read = 0;
+		bool ok = (f_read(&file, buffer, chunk, &read) == FR_OK);
+
+		if (ok && !read)
+			break;
+
+		benchOp(&result, start, read, ok);
+		if (!ok)
+			break;
+	}
+
+	f_close(&file);
+	benchEnd(&result);
+}
+
+static void benchRandomReads(const char* name, uint32_t chunk)
+{
+	BENCH_RESULT result;
+	FIL file;
+
+	benchStart(&result, name);
+
+	if (f_open(&file, BENCH_FILE, FA_READ | FA_OPEN_EXISTING) != FR_OK)
+	{
+		printf("%-20s cannot open %s\n", name, BENCH_FILE);
+		return;
+	}
+
+	random_state = 1;
+
+	for (uint32_t i = 0; i < BENCH_RANDOM_READS; i++)
+	{
+		// Sector aligned, like seeking to a block of samples
+		uint32_t offset = (benchRandom() % ((BENCH_FILE_SIZE - chunk) / _MAX_SS)) * _MAX_SS;
+		uint64_t start = hostNow();
+		UINT read = 0;
+		bool ok = (f_lseek(&file, offset) == FR_OK && f_read(&file, buffer, chunk, &read) == FR_OK);
+
+		benchOp(&result, start, read, ok);
+	}
+
+	f_close(&file);
+	benchEnd(&result);
+}
+
+static void benchFontOpen(const char* name)
+{
+	BENCH_RESULT result;
+	char path[64];
+
+	benchStart(&result, name);
+
+	for (uint32_t i = 0; i < BENCH_FONT_FILES; i++)
+	{
+		AudioFileHelper helper;
+		uint64_t start = hostNow();
+		uint32_t samples = 0;
+
+		sprintf(path, "%s/%s.wav", BENCH_FONT_DIR, font_files[i].name);
+		bool ok = helper.openWav(path, false);
+		if (ok)
+			samples = helper.fillBuffer(buffer, BENCH_FONT_SAMPLES);
+
+		benchOp(&result, start, samples * 2, ok && samples);
+		helper.close();
+	}
+
+	benchEnd(&result);
+}
+
+static void benchFontSeek(const char* name)
+{
+	AudioFileHelper helpers[BENCH_FONT_FILES];
+	BENCH_RESULT result;
+	char path[64];
+
+	// Open every file first, like the voices of a font that are all triggered once
+	for (uint32_t i = 0; i < BENCH_FONT_FILES; i++)
+	{
+		sprintf(path, "%s/%s.wav", BENCH_FONT_DIR, font_files[i].name);
+		helpers[i].openWav(path, false);
+	}
+
+	benchStart(&result, name);
+
+	for (uint32_t round = 0; round < BENCH_SEEK_ROUNDS; round++)
+	{
+		for (uint32_t i = 0; i < BENCH_FONT_FILES; i++)
+		{
+			uint64_t start = hostNow();
+			uint32_t samples = 0;
+			bool ok = helpers[i].isOpened() && helpers[i].rewind();
+
+			if (ok)
+				samples = helpers[i].fillBuffer(buffer, BENCH_FONT_SAMPLES);
+
+			benchOp(&result, start, samples * 2, ok && samples);
+		}
+	}
+
+	benchEnd(&result);
+
+	for (uint32_t i = 0; i < BENCH_FONT_FILES; i++)
+		helpers[i].close();
+}
+
+static void benchFontIndex(const char* name, AudioFontIndex* index)
+{
+	BENCH_RESULT result;
+
+	benchStart(&result, name);
+
+	uint64_t start = hostNow();
+	bool ok = index->begin(BENCH_FONT_DIR);
+	benchOp(&result, start, 0, ok && index->getFileCount() == BENCH_FONT_FILES);
+
+	benchEnd(&result);
+}
+
+static void benchConfig(const char* name)
+{
+	BENCH_RESULT result;
+	char section[16];
+	char key[16];
+
+	benchStart(&result, name);
+
+	uint64_t start = hostNow();
+	bool ok = config.begin(BENCH_CONFIG_FILE, false);
+	benchOp(&result, start, 0, ok);
+
+	for (uint32_t s = 0; ok && s < BENCH_CONFIG_SECTIONS; s++)
+	{
+		sprintf(section, "section%02u", s);
+
+		for (uint32_t k = 0; k < BENCH_CONFIG_KEYS; k++)
+		{
+			uint32_t value = 0;
+
+			sprintf(key, "key%02u", k);
+			start = hostNow();
+			bool found = config.readValue(section, key, &value);
+			benchOp(&result, start, 0, found && value == s * 100 + k);
+		}
+	}
+
+	benchEnd(&result);
+}
+
+int main(int argc, char** argv)
+{
+	const char* image = "sdbench.img";
+	uint32_t disk_mb = 64;
+	uint32_t command_us = 200;
+	uint32_t sector_us = 25;
+	uint32_t jitter_us = 0;
+	uint32_t timeout_ppm = 0;
+	uint32_t crc_ppm = 0;
+	uint32_t timeout_us = 1000000;
+	uint32_t seed = 1;
+	AudioFontIndex index;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:m:c:p:j:t:r:T:s:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'd': image = optarg; break;
+			case 'm': disk_mb = atoi(optarg); break;
+			case 'c': command_us = atoi(optarg); break;
+			case 'p': sector_us = atoi(optarg); break;
+			case 'j': jitter_us = atoi(optarg); break;
+			case 't': timeout_ppm = atoi(optarg); break;
+			case 'r': crc_ppm = atoi(optarg); break;
+			case 'T': timeout_us = atoi(optarg); break;
+			case 's': seed = atoi(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-d disk.img] [-m mb] [-c command_us] [-p sector_us] [-j jitter_us]\n"
+						"       [-t timeout_ppm] [-r crc_ppm] [-T timeout_us] [-s seed]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	hostSdSetLatency(command_us, sector_us);
+
+	if (!hostSdCreate(image, disk_mb) || !hostSdOpen(image) || f_mount(&fatfs, "", 1) != FR_OK)
+	{
+		fprintf(stderr, "Cannot create disk image %s\n", image);
+		return 1;
+	}
+
+	if (!createBenchFile() || !createFont() || !createConfig())
+	{
+		fprintf(stderr, "Cannot write the benchmark files in %s\n", image);
+		return 1;
+	}
+
+	hostSdSetJitter(jitter_us);
+	hostSdSetFaults(timeout_ppm, crc_ppm, timeout_us, seed);
+
+	printf("SD card:             command %u us, %u us/sector, jitter %u us, errors %u/%u ppm\n\n",
+		   command_us, sector_us, jitter_us, timeout_ppm, crc_ppm);
+
+	benchSequential("seq read 512", 512, 0);
+	benchSequential("seq read 2K", 2048, 0);
+	benchSequential("seq read 2K +100", 2048, 100);
+	benchSequential("seq read 32K", 32768, 0);
+	benchRandomReads("random read 2K", BENCH_RANDOM_CHUNK);
+
+	AudioFileHelper::setFontIndex(NULL);
+	benchFontOpen("font open");
+	benchFontIndex("font index scan", &index);
+	benchFontOpen("font open indexed");
+	benchFontSeek("font rewind");
+	index.end();
+
+	benchConfig("config parse");
+
+	hostSdClose();
+	return 0;
+}
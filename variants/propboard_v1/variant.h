@@ -88,6 +88,8 @@ static const uint8_t ONOFF_3V3 = 17;
 #define VARIANT_PRIO_SYSTICK			4
 #define VARIANT_PRIO_UART				5
 #define VARIANT_PRIO_ST					6
+#define VARIANT_PRIO_AUDIO_MIX			7
+#define VARIANT_PRIO_SD_SERVICE			8
 #define VARIANT_PRIO_USER_EXTI			10
 #define VARIANT_PRIO_PENDSV				255
 